@@ -31,7 +31,15 @@
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
+#include <arch/ops.h>
 #include <platform.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+#if WITH_LIB_BIO
+#include <lib/bio.h>
+#endif
 
 const size_t BUFSIZE = (1024*1024);
 const uint ITER = 1024;
@@ -247,6 +255,613 @@ __NO_INLINE static void bench_sincos(void)
 
 #endif // WITH_LIB_LIBM
 
+/*
+ * Memory bandwidth suite.
+ *
+ * Runs memcpy, memset and a plain read loop over a sweep of buffer sizes
+ * with aligned and misaligned source and destination, through cached and
+ * (with the vm) uncached mappings, on each cpu in turn and on all of them
+ * at once. Results are printed one per line as comma separated values with
+ * a header line, so a console log can be fed straight into a spreadsheet.
+ */
+#define MEM_BENCH_MIN_SIZE 16
+#define MEM_BENCH_MAX_SIZE (64 * 1024 * 1024)
+#define MEM_BENCH_UNCACHED_MAX_SIZE (1024 * 1024)
+#define MEM_BENCH_CPU_SIZE (8 * 1024 * 1024)
+
+/* bytes to move per measurement, small sizes are repeated to get there */
+#define MEM_BENCH_TARGET (16 * 1024 * 1024)
+#define MEM_BENCH_UNCACHED_TARGET (1024 * 1024)
+
+/* room past the end of each buffer for misaligning it */
+#define MEM_BENCH_SLACK 64
+
+enum mem_bench_op {
+    MEM_BENCH_MEMCPY,
+    MEM_BENCH_MEMSET,
+    MEM_BENCH_READ,
+    MEM_BENCH_OPS
+};
+
+static const char *mem_bench_op_name[MEM_BENCH_OPS] = {
+    [MEM_BENCH_MEMCPY] = "memcpy",
+    [MEM_BENCH_MEMSET] = "memset",
+    [MEM_BENCH_READ] = "read",
+};
+
+/* source and destination offsets from a cache line boundary */
+static const struct {
+    uint src;
+    uint dst;
+} mem_bench_align[] = {
+    { 0, 0 },
+    { 0, 3 },
+    { 5, 0 },
+    { 5, 3 },
+};
+
+struct mem_bench_buf {
+    uint8_t *ptr;
+    size_t size;
+    bool uncached;
+};
+
+struct mem_bench_result {
+    uint64_t bytes;
+    lk_bigtime_t usecs;
+    uint64_t cycles;
+};
+
+static status_t mem_bench_alloc(struct mem_bench_buf *buf, size_t size, bool uncached)
+{
+    buf->size = size;
+    buf->uncached = uncached;
+
+#if WITH_KERNEL_VM
+    size_t len = ROUNDUP(size + MEM_BENCH_SLACK, PAGE_SIZE);
+    void *ptr;
+    status_t err;
+    if (uncached) {
+        err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "mem bench", len, &ptr, 0, 0,
+                                   ARCH_MMU_FLAG_UNCACHED);
+    } else {
+        err = vmm_alloc(vmm_get_kernel_aspace(), "mem bench", len, &ptr, 0, 0,
+                        ARCH_MMU_FLAG_CACHED);
+    }
+    buf->ptr = (err < 0) ? NULL : ptr;
+#else
+    if (uncached)
+        return ERR_NOT_SUPPORTED;
+    buf->ptr = memalign(CACHE_LINE, size + MEM_BENCH_SLACK);
+#endif
+
+    if (!buf->ptr)
+        return ERR_NO_MEMORY;
+
+    memset(buf->ptr, 0x55, size + MEM_BENCH_SLACK);
+    return NO_ERROR;
+}
+
+static void mem_bench_free(struct mem_bench_buf *buf)
+{
+#if WITH_KERNEL_VM
+    vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)buf->ptr);
+#else
+    free(buf->ptr);
+#endif
+    buf->ptr = NULL;
+}
+
+__NO_INLINE static void mem_bench_read(const uint8_t *src, size_t size)
+{
+    const unsigned long *p = (const unsigned long *)ROUNDDOWN((uintptr_t)src, sizeof(long));
+    const unsigned long *end = (const unsigned long *)((uintptr_t)src + size);
+    unsigned long sum = 0;
+
+    while (p + 4 <= end) {
+        sum += p[0] + p[1] + p[2] + p[3];
+        p += 4;
+    }
+    while (p < end)
+        sum += *p++;
+
+    __asm__ volatile("" :: "r" (sum));
+}
+
+static void mem_bench_run(enum mem_bench_op op, uint8_t *dst, const uint8_t *src, size_t size,
+                          size_t target, struct mem_bench_result *res)
+{
+    uint iters = MAX(target / size, 1U);
+
+    /* once to fault things in and warm the caches */
+    for (uint pass = 0; pass < 2; pass++) {
+        uint n = pass ? iters : 1;
+
+        lk_bigtime_t t = current_time_hires();
+        uint c = arch_cycle_count();
+        switch (op) {
+            case MEM_BENCH_MEMCPY:
+                for (uint i = 0; i < n; i++)
+                    memcpy(dst, src, size);
+                break;
+            case MEM_BENCH_MEMSET:
+                for (uint i = 0; i < n; i++)
+                    memset(dst, i, size);
+                break;
+            case MEM_BENCH_READ:
+                for (uint i = 0; i < n; i++)
+                    mem_bench_read(src, size);
+                break;
+            default:
+                break;
+        }
+        c = arch_cycle_count() - c;
+        t = current_time_hires() - t;
+
+        res->bytes = (uint64_t)n * size;
+        res->usecs = t;
+        res->cycles = c;
+    }
+}
+
+static void mem_bench_header(void)
+{
+    printf("mem_bench,op,mapping,cpu,cpus,size,src_off,dst_off,bytes,usecs,cycles,MB/s,cycles/byte\n");
+}
+
+static void mem_bench_report(enum mem_bench_op op, bool uncached, int cpu, uint ncpus, size_t size,
+                             uint src_off, uint dst_off, const struct mem_bench_result *res)
+{
+    uint64_t mbps = res->usecs ? res->bytes * 1000000 / res->usecs / (1024 * 1024) : 0;
+    uint64_t mcpb = res->bytes ? res->cycles * 1000 / res->bytes : 0;
+
+    printf("mem_bench,%s,%s,", mem_bench_op_name[op], uncached ? "uncached" : "cached");
+    if (cpu < 0)
+        printf("all,");
+    else
+        printf("%d,", cpu);
+    printf("%u,%zu,%u,%u,%llu,%llu,%llu,%llu,%llu.%03llu\n", ncpus, size, src_off, dst_off,
+           res->bytes, res->usecs, res->cycles, mbps, mcpb / 1000, mcpb % 1000);
+}
+
+/* every size from MEM_BENCH_MIN_SIZE to max_size on the current cpu */
+static void mem_bench_sweep(size_t max_size, bool uncached)
+{
+    struct mem_bench_buf src, dst;
+    size_t target = uncached ? MEM_BENCH_UNCACHED_TARGET : MEM_BENCH_TARGET;
+
+    if (uncached)
+        max_size = MIN(max_size, MEM_BENCH_UNCACHED_MAX_SIZE);
+
+    /* settle for smaller buffers if there isn't room for two of the largest */
+    for (;;) {
+        if (max_size < MEM_BENCH_MIN_SIZE) {
+            printf("failed to allocate %s buffers\n", uncached ? "uncached" : "cached");
+            return;
+        }
+        if (mem_bench_alloc(&src, max_size, uncached) == NO_ERROR) {
+            if (mem_bench_alloc(&dst, max_size, uncached) == NO_ERROR)
+                break;
+            mem_bench_free(&src);
+        }
+        max_size /= 2;
+    }
+
+    int cpu = arch_curr_cpu_num();
+    for (size_t size = MEM_BENCH_MIN_SIZE; size <= max_size; size *= 2) {
+        for (uint a = 0; a < countof(mem_bench_align); a++) {
+            uint src_off = mem_bench_align[a].src;
+            uint dst_off = mem_bench_align[a].dst;
+            struct mem_bench_result res;
+
+            /* misaligned accesses can fault on uncached memory */
+            if (uncached && (src_off || dst_off))
+                continue;
+
+            mem_bench_run(MEM_BENCH_MEMCPY, dst.ptr + dst_off, src.ptr + src_off, size, target, &res);
+            mem_bench_report(MEM_BENCH_MEMCPY, uncached, cpu, 1, size, src_off, dst_off, &res);
+
+            if (src_off == 0) {
+                mem_bench_run(MEM_BENCH_MEMSET, dst.ptr + dst_off, NULL, size, target, &res);
+                mem_bench_report(MEM_BENCH_MEMSET, uncached, cpu, 1, size, 0, dst_off, &res);
+            }
+            if (a == 0) {
+                mem_bench_run(MEM_BENCH_READ, NULL, src.ptr, size, target, &res);
+                mem_bench_report(MEM_BENCH_READ, uncached, cpu, 1, size, 0, 0, &res);
+            }
+        }
+    }
+
+    mem_bench_free(&dst);
+    mem_bench_free(&src);
+}
+
+struct mem_bench_cpu_args {
+    uint cpu;
+    size_t size;
+    event_t *start;
+    status_t err;
+    struct mem_bench_result res[MEM_BENCH_OPS];
+};
+
+static int mem_bench_cpu_thread(void *arg)
+{
+    struct mem_bench_cpu_args *args = arg;
+    struct mem_bench_buf src, dst;
+
+    args->err = mem_bench_alloc(&src, args->size, false);
+    if (args->err == NO_ERROR) {
+        args->err = mem_bench_alloc(&dst, args->size, false);
+        if (args->err < 0)
+            mem_bench_free(&src);
+    }
+
+    /* everyone waits for the start even if they couldn't allocate */
+    if (args->start)
+        event_wait(args->start);
+
+    if (args->err < 0)
+        return args->err;
+
+    for (uint op = 0; op < MEM_BENCH_OPS; op++)
+        mem_bench_run(op, dst.ptr, src.ptr, args->size, MEM_BENCH_TARGET * 4, &args->res[op]);
+
+    mem_bench_free(&dst);
+    mem_bench_free(&src);
+    return 0;
+}
+
+/* one buffer size on each cpu alone, then on all of them at once */
+static void mem_bench_cpus(size_t size)
+{
+    uint ncpus = 1;
+#if WITH_SMP
+    while (ncpus < SMP_MAX_CPUS && mp_is_cpu_active(ncpus))
+        ncpus++;
+#endif
+
+    struct mem_bench_cpu_args *args = calloc(ncpus, sizeof(*args));
+    thread_t **threads = calloc(ncpus, sizeof(*threads));
+    if (!args || !threads) {
+        printf("failed to allocate thread state\n");
+        goto out;
+    }
+
+    for (uint cpu = 0; cpu < ncpus; cpu++) {
+        args[cpu].cpu = cpu;
+        args[cpu].size = size;
+
+        thread_t *t = thread_create("mem bench", &mem_bench_cpu_thread, &args[cpu],
+                                    HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!t)
+            goto out;
+        thread_set_pinned_cpu(t, cpu);
+        thread_resume(t);
+        thread_join(t, NULL, INFINITE_TIME);
+
+        for (uint op = 0; op < MEM_BENCH_OPS && args[cpu].err == NO_ERROR; op++)
+            mem_bench_report(op, false, cpu, 1, size, 0, 0, &args[cpu].res[op]);
+    }
+
+    if (ncpus < 2)
+        goto out;
+
+    event_t start;
+    event_init(&start, false, 0);
+
+    for (uint cpu = 0; cpu < ncpus; cpu++) {
+        memset(args[cpu].res, 0, sizeof(args[cpu].res));
+        args[cpu].start = &start;
+
+        threads[cpu] = thread_create("mem bench", &mem_bench_cpu_thread, &args[cpu],
+                                     HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+        if (threads[cpu]) {
+            thread_set_pinned_cpu(threads[cpu], cpu);
+            thread_resume(threads[cpu]);
+        }
+    }
+
+    /* give them a chance to allocate before starting them together */
+    thread_sleep(100);
+    event_signal(&start, true);
+
+    struct mem_bench_result total[MEM_BENCH_OPS] = {};
+    for (uint cpu = 0; cpu < ncpus; cpu++) {
+        if (!threads[cpu])
+            continue;
+        thread_join(threads[cpu], NULL, INFINITE_TIME);
+
+        for (uint op = 0; op < MEM_BENCH_OPS && args[cpu].err == NO_ERROR; op++) {
+            mem_bench_report(op, false, cpu, ncpus, size, 0, 0, &args[cpu].res[op]);
+
+            /* the aggregate is everything moved over the longest run */
+            total[op].bytes += args[cpu].res[op].bytes;
+            total[op].usecs = MAX(total[op].usecs, args[cpu].res[op].usecs);
+            total[op].cycles = MAX(total[op].cycles, args[cpu].res[op].cycles);
+        }
+    }
+
+    for (uint op = 0; op < MEM_BENCH_OPS; op++)
+        mem_bench_report(op, false, -1, ncpus, size, 0, 0, &total[op]);
+
+    event_destroy(&start);
+
+out:
+    free(threads);
+    free(args);
+}
+
+int mem_bench(int argc, const cmd_args *argv)
+{
+    bool sweep = true, cpus = true;
+
+    if (argc >= 2) {
+        if (!strcmp(argv[1].str, "sweep")) {
+            cpus = false;
+        } else if (!strcmp(argv[1].str, "cpus")) {
+            sweep = false;
+        } else if (strcmp(argv[1].str, "all")) {
+            printf("usage: %s [sweep|cpus|all] [size]\n", argv[0].str);
+            printf("\tsweep: sizes up to <size> (default 64MB), aligned and misaligned, cached and uncached\n");
+            printf("\tcpus: a <size> buffer (default 8MB) on each cpu alone and all together\n");
+            return ERR_INVALID_ARGS;
+        }
+    }
+
+    mem_bench_header();
+
+    if (sweep) {
+        size_t max_size = (argc >= 3) ? argv[2].u : MEM_BENCH_MAX_SIZE;
+
+        mem_bench_sweep(max_size, false);
+#if WITH_KERNEL_VM
+        mem_bench_sweep(max_size, true);
+#endif
+    }
+
+    if (cpus)
+        mem_bench_cpus((argc >= 3) ? MAX(argv[2].u, (ulong)MEM_BENCH_MIN_SIZE) : MEM_BENCH_CPU_SIZE);
+
+    return 0;
+}
+
+#if WITH_LIB_BIO
+
+#define BIO_IOPS_MAX_DEPTH 32
+#define BIO_IOPS_MAX_THREADS 8
+
+struct bio_iops_slot {
+    bio_request_t req;
+    bio_iovec_t iov;
+    lk_bigtime_t start;
+    lk_bigtime_t end;
+    bool busy;
+};
+
+struct bio_iops_args {
+    bdev_t *dev;
+    uint depth;
+    size_t size;
+    lk_time_t duration;
+    event_t *start;
+    uint32_t seed;
+
+    event_t done;
+    struct bio_iops_slot slots[BIO_IOPS_MAX_DEPTH];
+    uint8_t *buf;
+
+    status_t err;
+    uint64_t ios;
+    uint64_t latency;
+};
+
+static void bio_iops_callback(bio_request_t *req)
+{
+    struct bio_iops_slot *slot = containerof(req, struct bio_iops_slot, req);
+    struct bio_iops_args *args = req->callback_arg;
+
+    slot->end = current_time_hires();
+    if (req->result < 0)
+        args->err = req->result;
+    __atomic_store_n(&slot->busy, false, __ATOMIC_RELEASE);
+    event_signal(&args->done, false);
+}
+
+/* one reader, keeping depth random reads outstanding until time runs out */
+static int bio_iops_thread(void *arg)
+{
+    struct bio_iops_args *args = arg;
+    uint blocks = args->size >> args->dev->block_shift;
+    uint range = (args->dev->block_count - blocks) / blocks + 1;
+    uint outstanding = 0;
+
+    event_wait(args->start);
+
+    lk_time_t deadline = current_time() + args->duration;
+    for (;;) {
+        bool running = TIME_LT(current_time(), deadline) && args->err == NO_ERROR;
+
+        for (uint i = 0; i < args->depth; i++) {
+            struct bio_iops_slot *slot = &args->slots[i];
+
+            if (__atomic_load_n(&slot->busy, __ATOMIC_ACQUIRE))
+                continue;
+
+            /* account for the last request in this slot */
+            if (slot->start) {
+                args->ios++;
+                args->latency += slot->end - slot->start;
+                slot->start = 0;
+                outstanding--;
+            }
+
+            if (!running)
+                continue;
+
+            args->seed = args->seed * 1664525 + 1013904223;
+            slot->iov.base = args->buf + i * args->size;
+            slot->iov.len = args->size;
+            slot->req.op = BIO_OP_READ;
+            slot->req.block = ((args->seed >> 8) % range) * blocks;
+            slot->req.count = blocks;
+            slot->req.iov = &slot->iov;
+            slot->req.iov_count = 1;
+            slot->req.callback = &bio_iops_callback;
+            slot->req.callback_arg = args;
+            slot->busy = true;
+            slot->start = current_time_hires();
+
+            status_t err = bio_submit(args->dev, &slot->req);
+            if (err < 0) {
+                slot->busy = false;
+                slot->start = 0;
+                args->err = err;
+                continue;
+            }
+            outstanding++;
+        }
+
+        if (!running && outstanding == 0)
+            break;
+
+        event_wait_timeout(&args->done, 10);
+    }
+
+    return 0;
+}
+
+/* random reads of one size from a number of threads at once, like fio's randread */
+static void bio_iops_run(bdev_t *dev, struct bio_iops_args *args, uint nthreads, uint depth,
+                         size_t size, lk_time_t duration)
+{
+    thread_t *threads[BIO_IOPS_MAX_THREADS];
+    event_t start;
+
+#if WITH_SMP
+    uint ncpus = 1;
+    while (ncpus < SMP_MAX_CPUS && mp_is_cpu_active(ncpus))
+        ncpus++;
+#endif
+
+    event_init(&start, false, 0);
+
+    for (uint i = 0; i < nthreads; i++) {
+        args[i].depth = depth;
+        args[i].start = &start;
+        args[i].err = NO_ERROR;
+        args[i].ios = 0;
+        args[i].latency = 0;
+
+        threads[i] = thread_create("bio iops", &bio_iops_thread, &args[i],
+                                   HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+        if (threads[i]) {
+#if WITH_SMP
+            thread_set_pinned_cpu(threads[i], i % ncpus);
+#endif
+            thread_resume(threads[i]);
+        }
+    }
+
+    lk_bigtime_t t = current_time_hires();
+    event_signal(&start, true);
+
+    uint64_t ios = 0, latency = 0;
+    status_t err = NO_ERROR;
+    for (uint i = 0; i < nthreads; i++) {
+        if (!threads[i]) {
+            err = ERR_NO_MEMORY;
+            continue;
+        }
+        thread_join(threads[i], NULL, INFINITE_TIME);
+
+        ios += args[i].ios;
+        latency += args[i].latency;
+        if (args[i].err < 0)
+            err = args[i].err;
+    }
+    t = current_time_hires() - t;
+
+    event_destroy(&start);
+
+    if (err < 0) {
+        printf("bio_iops: error %d\n", err);
+        return;
+    }
+
+    /* bio_iops,device,threads,depth,size,ios,usecs,IOPS,MB/s,avg latency us */
+    printf("bio_iops,%s,%u,%u,%zu,%llu,%llu,%llu,%llu,%llu\n", dev->name, nthreads, depth, size,
+           ios, t, ios * 1000000 / t, ios * size / t, ios ? latency / ios : 0);
+}
+
+int bio_iops(int argc, const cmd_args *argv)
+{
+    if (argc < 2) {
+        printf("usage: %s <device> [request size] [ms]\n", argv[0].str);
+        printf("\trandom reads from 1 to %u threads, each with 1 to %u requests outstanding\n",
+               BIO_IOPS_MAX_THREADS, BIO_IOPS_MAX_DEPTH);
+        return ERR_INVALID_ARGS;
+    }
+
+    bdev_t *dev = bio_open(argv[1].str);
+    if (!dev) {
+        printf("error opening block device\n");
+        return ERR_NOT_FOUND;
+    }
+
+    size_t size = (argc >= 3) ? argv[2].u : 4096;
+    lk_time_t duration = (argc >= 4) ? argv[3].u : 1000;
+    size = ROUNDUP(MAX(size, dev->block_size), dev->block_size);
+
+    status_t err = NO_ERROR;
+    struct bio_iops_args *args = calloc(BIO_IOPS_MAX_THREADS, sizeof(*args));
+    if (!args) {
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+
+    if ((size >> dev->block_shift) > dev->block_count) {
+        printf("request bigger than the device\n");
+        err = ERR_INVALID_ARGS;
+        goto out;
+    }
+
+    for (uint i = 0; i < BIO_IOPS_MAX_THREADS; i++) {
+        args[i].dev = dev;
+        args[i].size = size;
+        args[i].duration = duration;
+        args[i].seed = i + 1;
+        event_init(&args[i].done, false, EVENT_FLAG_AUTOUNSIGNAL);
+        args[i].buf = memalign(CACHE_LINE, BIO_IOPS_MAX_DEPTH * size);
+        if (!args[i].buf) {
+            err = ERR_NO_MEMORY;
+            goto out;
+        }
+    }
+
+    printf("bio_iops,device,threads,depth,size,ios,usecs,IOPS,MB/s,avg latency us\n");
+    for (uint nthreads = 1; nthreads <= BIO_IOPS_MAX_THREADS; nthreads *= 2) {
+        for (uint depth = 1; depth <= BIO_IOPS_MAX_DEPTH; depth *= 2)
+            bio_iops_run(dev, args, nthreads, depth, size, duration);
+    }
+
+out:
+    if (args) {
+        for (uint i = 0; i < BIO_IOPS_MAX_THREADS; i++) {
+            if (args[i].dev)
+                event_destroy(&args[i].done);
+            free(args[i].buf);
+        }
+    }
+    free(args);
+    bio_close(dev);
+
+    if (err < 0)
+        printf("bio_iops: error %d\n", err);
+    return err;
+}
+
+#endif
+
 void benchmarks(void)
 {
     bench_set_overhead();
@@ -113,4 +113,27 @@ void clock_tests(void)
         cycles = arch_cycle_count() - cycles;
         printf("%u cycles per second\n", cycles);
     }
+
+    printf("measuring thread_sleep_hires() overshoot\n");
+    static const lk_bigtime_t hires_delays[] = { 100, 250, 1000, 2667 };
+    for (uint i = 0; i < countof(hires_delays); i++) {
+        lk_bigtime_t max_late = 0;
+        lk_bigtime_t total_late = 0;
+        const int iter = 100;
+
+        for (int j = 0; j < iter; j++) {
+            lk_bigtime_t start = current_time_hires();
+            thread_sleep_hires(hires_delays[i]);
+            lk_bigtime_t late = current_time_hires() - start - hires_delays[i];
+            if ((int64_t)late < 0) {
+                printf("WARNING: woke up %lld us early\n", -(int64_t)late);
+                continue;
+            }
+            total_late += late;
+            if (late > max_late)
+                max_late = late;
+        }
+        printf("%llu us sleep: avg late %llu us, max late %llu us\n",
+               hires_delays[i], total_late / iter, max_late);
+    }
 }
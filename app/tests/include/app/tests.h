@@ -25,8 +25,16 @@
 
 #include <lib/console.h>
 
+#if WITH_LIB_BIO
+int bio_iops(int argc, const cmd_args *argv);
+#endif
 int cbuf_tests(int argc, const cmd_args *argv);
+#if WITH_SMP
+int context_switch_smp_bench(int argc, const cmd_args *argv);
+#endif
 int fibo(int argc, const cmd_args *argv);
+int mem_bench(int argc, const cmd_args *argv);
+int mutex_bench(int argc, const cmd_args *argv);
 int port_tests(void);
 int spinner(int argc, const cmd_args *argv);
 int thread_tests(void);
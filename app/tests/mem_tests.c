@@ -21,6 +21,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <stdio.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <err.h>
@@ -30,6 +31,12 @@
 #include <platform.h>
 #include <debug.h>
 
+#include <rand.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <lib/heap.h>
+#include <lib/slab.h>
+
 #if WITH_KERNEL_VM
 #include <kernel/vm.h>
 #endif
@@ -237,6 +244,810 @@ usage:
     return 0;
 }
 
+#define MEM_BENCH_MAX_THREADS 16
+
+/* what one benchmark thread counts, it runs until the deadline */
+struct mem_bench_thread {
+    lk_time_t deadline;
+    uint index;
+    uint64_t ops;
+    uint64_t cycles;
+    uint max_cycles;
+    uint failures;
+};
+
+struct mem_bench {
+    const char *name;
+    int (*routine)(void *arg); /* passed its struct mem_bench_thread */
+
+    /* filled in by mem_bench_run(), the counts summed over the threads */
+    uint thread_count;
+    lk_time_t duration;
+    unsigned long long ops;
+    unsigned long long cycles;
+    uint max_cycles;
+    uint failures;
+};
+
+/* run a benchmark on "[threads] [milliseconds]" threads from the command line */
+static int mem_bench_run(int argc, const cmd_args *argv, struct mem_bench *bench)
+{
+    static struct mem_bench_thread threads[MEM_BENCH_MAX_THREADS];
+    thread_t *t[MEM_BENCH_MAX_THREADS];
+
+    bench->thread_count = (argc >= 2) ? argv[1].u : SMP_MAX_CPUS;
+    bench->duration = (argc >= 3) ? argv[2].u : 1000;
+
+    if (bench->thread_count == 0 || bench->thread_count > MEM_BENCH_MAX_THREADS || bench->duration == 0) {
+        printf("usage: %s [threads (1-%d)] [milliseconds]\n", argv[0].str, MEM_BENCH_MAX_THREADS);
+        return ERR_INVALID_ARGS;
+    }
+
+    lk_time_t deadline = current_time() + bench->duration;
+    for (uint i = 0; i < bench->thread_count; i++) {
+        memset(&threads[i], 0, sizeof(threads[i]));
+        threads[i].deadline = deadline;
+        threads[i].index = i;
+        t[i] = thread_create(bench->name, bench->routine, &threads[i],
+                             DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(t[i]);
+    }
+
+    bench->ops = 0;
+    bench->cycles = 0;
+    bench->max_cycles = 0;
+    bench->failures = 0;
+    for (uint i = 0; i < bench->thread_count; i++) {
+        thread_join(t[i], NULL, INFINITE_TIME);
+        bench->ops += threads[i].ops;
+        bench->cycles += threads[i].cycles;
+        bench->max_cycles = MAX(bench->max_cycles, threads[i].max_cycles);
+        bench->failures += threads[i].failures;
+    }
+
+    return 0;
+}
+
+#if WITH_KERNEL_VM
+#define PMM_TEST_RUNS 64
+
+/* check a run handed out by pmm_alloc_contiguous() */
+static bool pmm_test_check_run(struct list_node *list, paddr_t pa, uint count, uint align_log2)
+{
+    if (pa & ((1UL << align_log2) - 1)) {
+        printf("run at 0x%lx not aligned to %u bits\n", pa, align_log2);
+        return false;
+    }
+
+    vm_page_t *p;
+    uint i = 0;
+    list_for_every_entry(list, p, vm_page_t, node) {
+        if (vm_page_to_paddr(p) != pa + i * PAGE_SIZE || !(p->flags & VM_PAGE_FLAG_NONFREE)) {
+            printf("page %u of run at 0x%lx is at 0x%lx flags 0x%x\n", i, pa, vm_page_to_paddr(p), p->flags);
+            return false;
+        }
+        i++;
+    }
+
+    if (i != count) {
+        printf("run at 0x%lx has %u pages, wanted %u\n", pa, i, count);
+        return false;
+    }
+
+    return true;
+}
+
+/* With every other page allocated, free the middle four pages of an aligned
+ * eight page run. They sit in two separate two page blocks, and a four page
+ * run has to be found across them. */
+static bool pmm_test_straddle(void)
+{
+    struct list_node run = LIST_INITIAL_VALUE(run);
+    struct list_node hog = LIST_INITIAL_VALUE(hog);
+    struct list_node hole = LIST_INITIAL_VALUE(hole);
+    struct list_node got = LIST_INITIAL_VALUE(got);
+    paddr_t pa, got_pa = 0;
+
+    if (pmm_alloc_contiguous(8, PAGE_SIZE_SHIFT + 3, &pa, &run) != 8) {
+        printf("couldn't allocate a run to punch a hole in\n");
+        return false;
+    }
+
+    /* take everything else. An impossible contiguous allocation sends the
+     * per cpu page caches back to the arenas, so take those pages too. */
+    while (pmm_alloc_pages(64, &hog) > 0)
+        ;
+    pmm_alloc_contiguous(UINT_MAX, PAGE_SIZE_SHIFT, NULL, &hog);
+    while (pmm_alloc_pages(64, &hog) > 0)
+        ;
+
+    vm_page_t *p, *temp;
+    list_for_every_entry_safe(&run, p, temp, vm_page_t, node) {
+        paddr_t page_pa = vm_page_to_paddr(p);
+        if (page_pa >= pa + 2 * PAGE_SIZE && page_pa < pa + 6 * PAGE_SIZE) {
+            list_delete(&p->node);
+            list_add_tail(&hole, &p->node);
+        }
+    }
+    pmm_free(&hole);
+
+    size_t ret = pmm_alloc_contiguous(4, PAGE_SIZE_SHIFT, &got_pa, &got);
+
+    pmm_free(&got);
+    pmm_free(&hog);
+    pmm_free(&run);
+
+    if (ret != 4 || got_pa != pa + 2 * PAGE_SIZE) {
+        printf("run across free blocks at 0x%lx not found, got %zu pages at 0x%lx\n",
+               pa + 2 * PAGE_SIZE, ret, got_pa);
+        return false;
+    }
+
+    return true;
+}
+
+/* allocate and free a mix of aligned contiguous runs and loose pages */
+static int pmm_test(int argc, const cmd_args *argv)
+{
+    static struct list_node runs[PMM_TEST_RUNS];
+    struct list_node pages = LIST_INITIAL_VALUE(pages);
+    uint iterations = (argc >= 2) ? argv[1].u : 16;
+    lk_bigtime_t alloc_time = 0;
+    uint allocs = 0, failures = 0;
+
+    for (uint iter = 0; iter < iterations; iter++) {
+        for (uint i = 0; i < PMM_TEST_RUNS; i++) {
+            uint count = 1 + rand() % 64;
+            uint align_log2 = PAGE_SIZE_SHIFT + rand() % 7;
+            paddr_t pa;
+
+            list_initialize(&runs[i]);
+
+            lk_bigtime_t t = current_time_hires();
+            size_t ret = pmm_alloc_contiguous(count, align_log2, &pa, &runs[i]);
+            alloc_time += current_time_hires() - t;
+            allocs++;
+
+            if (ret == 0) {
+                failures++;
+                continue;
+            }
+            if (ret != count || !pmm_test_check_run(&runs[i], pa, count, align_log2)) {
+                printf("pmm test FAILED\n");
+                return ERR_GENERIC;
+            }
+        }
+
+        /* punch holes, then fill some of them back in with loose pages */
+        for (uint i = 0; i < PMM_TEST_RUNS; i += 2)
+            pmm_free(&runs[i]);
+
+        size_t count = pmm_alloc_pages(PMM_TEST_RUNS * 8, &pages);
+        if (count != PMM_TEST_RUNS * 8)
+            printf("pmm_alloc_pages returned %zu pages\n", count);
+
+        for (uint i = 1; i < PMM_TEST_RUNS; i += 2)
+            pmm_free(&runs[i]);
+        pmm_free(&pages);
+    }
+
+    printf("%u contiguous allocations, %u failed, %llu us average\n",
+           allocs, failures, allocs ? alloc_time / allocs : 0);
+
+    if (!pmm_test_straddle()) {
+        printf("pmm test FAILED\n");
+        return ERR_GENERIC;
+    }
+
+    return 0;
+}
+
+#define PMM_BENCH_BURST 8
+
+/* allocate and free single pages in small bursts until the deadline */
+static int pmm_bench_thread(void *arg)
+{
+    struct mem_bench_thread *b = arg;
+    void *pages[PMM_BENCH_BURST];
+
+    while (TIME_LT(current_time(), b->deadline)) {
+        for (uint i = 0; i < PMM_BENCH_BURST; i++) {
+            pages[i] = pmm_alloc_kpages(1, NULL);
+            if (!pages[i])
+                b->failures++;
+            else
+                *(volatile uint32_t *)pages[i] = i;
+        }
+        for (uint i = 0; i < PMM_BENCH_BURST; i++) {
+            if (pages[i])
+                pmm_free_kpages(pages[i], 1);
+        }
+        b->ops += PMM_BENCH_BURST;
+    }
+
+    return 0;
+}
+
+static int pmm_bench(int argc, const cmd_args *argv)
+{
+    struct mem_bench bench = {
+        .name = "pmm bench",
+        .routine = &pmm_bench_thread,
+    };
+
+    int err = mem_bench_run(argc, argv, &bench);
+    if (err < 0)
+        return err;
+
+    printf("%u threads: %llu page alloc/free pairs in %u ms, %llu per second, %u failed\n",
+           bench.thread_count, bench.ops, bench.duration, bench.ops * 1000 / bench.duration,
+           bench.failures);
+
+    return 0;
+}
+#endif
+
+#if WITH_KERNEL_VM
+/* chase a pointer through every page of the buffer in random order, one
+ * cache line per page, so nearly every access needs a fresh translation */
+static void tlb_bench_run(void *buf, size_t size, uint *order)
+{
+    size_t pages = size / PAGE_SIZE;
+
+    for (size_t i = 0; i < pages; i++)
+        order[i] = i;
+    for (size_t i = pages - 1; i > 0; i--) {
+        size_t j = rand() % (i + 1);
+        uint tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    /* stagger the line used in each page so the chain doesn't all land in
+     * one cache set */
+    for (size_t i = 0; i < pages; i++) {
+        uint8_t *from = (uint8_t *)buf + order[i] * PAGE_SIZE + (order[i] % (PAGE_SIZE / CACHE_LINE)) * CACHE_LINE;
+        size_t next = order[(i + 1) % pages];
+        uint8_t *to = (uint8_t *)buf + next * PAGE_SIZE + (next % (PAGE_SIZE / CACHE_LINE)) * CACHE_LINE;
+        *(void **)from = to;
+    }
+
+    uint steps = MAX(pages * 4, 1024 * 1024);
+    void **p = (void **)((uint8_t *)buf + order[0] * PAGE_SIZE + (order[0] % (PAGE_SIZE / CACHE_LINE)) * CACHE_LINE);
+
+    lk_bigtime_t t = current_time_hires();
+    for (uint i = 0; i < steps; i++)
+        p = *p;
+    t = current_time_hires() - t;
+
+    printf("\trandom page walk: %llu ns per access (%p)\n", t * 1000 / steps, p);
+
+    /* plain sequential read bandwidth over the same buffer */
+    uint64_t sum = 0;
+    t = current_time_hires();
+    for (uint pass = 0; pass < 4; pass++) {
+        for (uint64_t *q = buf; q < (uint64_t *)((uint8_t *)buf + size); q++)
+            sum += *q;
+    }
+    t = current_time_hires() - t;
+
+    printf("\tsequential read: %llu MB/s (sum 0x%llx)\n",
+           t ? (4ULL * size * 1000000 / t) >> 20 : 0, sum);
+}
+
+static int tlb_bench(int argc, const cmd_args *argv)
+{
+    size_t size = ((argc >= 2) ? argv[1].u : 16) * 1024 * 1024;
+
+    uint *order = malloc(size / PAGE_SIZE * sizeof(uint));
+    if (!order)
+        return ERR_NO_MEMORY;
+
+    for (uint large = 0; large < 2; large++) {
+        void *buf;
+        status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "tlb bench", size, &buf, 0,
+                                            large ? VMM_FLAG_LARGE_PAGES : 0, ARCH_MMU_FLAG_CACHED);
+        if (err < 0) {
+            printf("failed to allocate %zu bytes, err %d\n", size, err);
+            free(order);
+            return err;
+        }
+
+        printf("%s mapping at %p, paddr 0x%lx:\n", large ? "large page" : "default",
+               buf, vaddr_to_paddr(buf));
+        tlb_bench_run(buf, size, order);
+
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)buf);
+    }
+
+    free(order);
+    return 0;
+}
+
+static status_t unmap_bench_map(paddr_t pa, size_t size, vaddr_t *vaddrs, uint count)
+{
+    for (uint i = 0; i < count; i++) {
+        void *ptr;
+        status_t err = vmm_alloc_physical(vmm_get_kernel_aspace(), "unmap bench", size, &ptr, 0,
+                                          pa, 0, ARCH_MMU_FLAG_CACHED);
+        if (err < 0) {
+            printf("failed to map region %u, err %d\n", i, err);
+            vmm_free_regions(vmm_get_kernel_aspace(), vaddrs, i);
+            return err;
+        }
+        vaddrs[i] = (vaddr_t)ptr;
+
+        /* touch it so there's something in the tlb to get rid of */
+        for (size_t off = 0; off < size; off += PAGE_SIZE)
+            *(volatile uint32_t *)((uint8_t *)ptr + off);
+    }
+
+    return NO_ERROR;
+}
+
+static int unmap_bench(int argc, const cmd_args *argv)
+{
+    uint count = (argc >= 2) ? argv[1].u : 64;
+    uint pages = (argc >= 3) ? argv[2].u : 16;
+    size_t size = pages * PAGE_SIZE;
+    int ret = 0;
+
+    if (count == 0 || pages == 0)
+        return ERR_INVALID_ARGS;
+
+    /* every region maps the same run of physical pages */
+    struct list_node page_list = LIST_INITIAL_VALUE(page_list);
+    paddr_t pa;
+    if (pmm_alloc_contiguous(pages, PAGE_SIZE_SHIFT, &pa, &page_list) != pages) {
+        printf("failed to allocate %u pages\n", pages);
+        return ERR_NO_MEMORY;
+    }
+
+    vaddr_t *vaddrs = malloc(count * sizeof(vaddr_t));
+    if (!vaddrs) {
+        pmm_free(&page_list);
+        return ERR_NO_MEMORY;
+    }
+
+    printf("unmapping %u regions of %u pages:\n", count, pages);
+
+    for (uint batched = 0; batched < 2; batched++) {
+        lk_bigtime_t worst = 0, total = 0;
+
+        for (uint iter = 0; iter < 8; iter++) {
+            ret = unmap_bench_map(pa, size, vaddrs, count);
+            if (ret < 0)
+                goto out;
+
+            lk_bigtime_t t = current_time_hires();
+            if (batched) {
+                vmm_free_regions(vmm_get_kernel_aspace(), vaddrs, count);
+            } else {
+                for (uint i = 0; i < count; i++)
+                    vmm_free_region(vmm_get_kernel_aspace(), vaddrs[i]);
+            }
+            t = current_time_hires() - t;
+
+            total += t;
+            worst = MAX(worst, t);
+        }
+
+        printf("\t%s: %llu us average, %llu us worst, %llu ns per page\n",
+               batched ? "vmm_free_regions" : "vmm_free_region", total / 8, worst,
+               total * 1000 / (8ULL * count * pages));
+    }
+
+out:
+    free(vaddrs);
+    pmm_free(&page_list);
+    return ret;
+}
+
+#define VMM_STRESS_MAX_PAGES 16
+
+struct vmm_stress_region {
+    vaddr_t base;
+    size_t size;
+};
+
+static status_t vmm_stress_alloc(vmm_aspace_t *aspace, paddr_t pa, struct vmm_stress_region *r,
+                                 lk_bigtime_t *time)
+{
+    size_t size = (1 + rand() % VMM_STRESS_MAX_PAGES) * PAGE_SIZE;
+    void *ptr;
+
+    lk_bigtime_t t = current_time_hires();
+    status_t err = vmm_alloc_physical(aspace, "vmm stress", size, &ptr, 0, pa, 0, ARCH_MMU_FLAG_CACHED);
+    *time += current_time_hires() - t;
+
+    r->base = err < 0 ? 0 : (vaddr_t)ptr;
+    r->size = err < 0 ? 0 : size;
+    return err;
+}
+
+static int vmm_stress(int argc, const cmd_args *argv)
+{
+    uint count = (argc >= 2) ? argv[1].u : 4096;
+    lk_bigtime_t alloc_time = 0, free_time = 0;
+    uint allocs = 0, frees = 0;
+    int ret = -1;
+
+    if (count == 0)
+        return ERR_INVALID_ARGS;
+
+    /* every region maps the same run of physical pages */
+    struct list_node pages = LIST_INITIAL_VALUE(pages);
+    paddr_t pa;
+    if (pmm_alloc_contiguous(VMM_STRESS_MAX_PAGES, PAGE_SIZE_SHIFT, &pa, &pages) != VMM_STRESS_MAX_PAGES) {
+        printf("failed to allocate pages\n");
+        return ERR_NO_MEMORY;
+    }
+
+    struct vmm_stress_region *regions = calloc(count, sizeof(*regions));
+    if (!regions) {
+        pmm_free(&pages);
+        return ERR_NO_MEMORY;
+    }
+
+    /* use a private aspace if the arch supports them */
+    vmm_aspace_t *user_aspace = NULL;
+    vmm_aspace_t *aspace = vmm_get_kernel_aspace();
+    if (vmm_create_aspace(&user_aspace, "vmm stress", 0) == NO_ERROR)
+        aspace = user_aspace;
+
+    for (uint i = 0; i < count; i++) {
+        status_t err = vmm_stress_alloc(aspace, pa, &regions[i], &alloc_time);
+        allocs++;
+        if (err < 0) {
+            printf("failed to allocate region %u, err %d\n", i, err);
+            goto out;
+        }
+    }
+
+    for (uint i = 0; i < count; i++) {
+        for (uint j = i + 1; j < count; j++) {
+            if (regions[i].base < regions[j].base + regions[j].size &&
+                    regions[j].base < regions[i].base + regions[i].size) {
+                printf("regions %u and %u overlap: 0x%lx+0x%zx 0x%lx+0x%zx\n", i, j,
+                       regions[i].base, regions[i].size, regions[j].base, regions[j].size);
+                goto out;
+            }
+        }
+    }
+
+    /* free a random half by an address somewhere inside each, and refill */
+    for (uint iter = 0; iter < 4; iter++) {
+        for (uint i = 0; i < count; i++) {
+            if (rand() & 1)
+                continue;
+
+            vaddr_t va = regions[i].base + (rand() % (regions[i].size / PAGE_SIZE)) * PAGE_SIZE;
+            lk_bigtime_t t = current_time_hires();
+            status_t err = vmm_free_region(aspace, va);
+            free_time += current_time_hires() - t;
+            frees++;
+            if (err < 0) {
+                printf("failed to free region at 0x%lx, err %d\n", va, err);
+                goto out;
+            }
+            regions[i].base = 0;
+        }
+
+        for (uint i = 0; i < count; i++) {
+            if (regions[i].base)
+                continue;
+
+            status_t err = vmm_stress_alloc(aspace, pa, &regions[i], &alloc_time);
+            allocs++;
+            if (err < 0) {
+                printf("failed to reallocate region %u, err %d\n", i, err);
+                goto out;
+            }
+
+            paddr_t check = 0;
+            arch_mmu_query(&aspace->arch_aspace, regions[i].base, &check, NULL);
+            if (check != pa) {
+                printf("region at 0x%lx maps 0x%lx, expected 0x%lx\n", regions[i].base, check, pa);
+                goto out;
+            }
+        }
+    }
+
+    ret = 0;
+
+out:
+    for (uint i = 0; i < count; i++) {
+        if (!regions[i].base)
+            continue;
+
+        lk_bigtime_t t = current_time_hires();
+        vmm_free_region(aspace, regions[i].base);
+        free_time += current_time_hires() - t;
+        frees++;
+    }
+
+    if (user_aspace)
+        vmm_free_aspace(user_aspace);
+    free(regions);
+    pmm_free(&pages);
+
+    printf("vmm stress %s: %u regions, %llu ns per alloc, %llu ns per free\n",
+           ret ? "FAILED" : "passed", count, alloc_time * 1000 / allocs, frees ? free_time * 1000 / frees : 0);
+    return ret;
+}
+#endif
+
+#if WITH_LIB_HEAP_CMPCTMALLOC
+#define MALLOC_BENCH_HEAP "cmpctmalloc"
+#elif WITH_LIB_HEAP_MINIHEAP
+#define MALLOC_BENCH_HEAP "miniheap"
+#elif WITH_LIB_HEAP_DLMALLOC
+#define MALLOC_BENCH_HEAP "dlmalloc"
+#else
+#define MALLOC_BENCH_HEAP "unknown"
+#endif
+#if LK_HEAP_CACHE
+#define MALLOC_BENCH_CACHE " with small object cache"
+#else
+#define MALLOC_BENCH_CACHE ""
+#endif
+
+#define MALLOC_BENCH_SLOTS 64
+
+/* keep a window of live objects, mostly small, replacing a random one each
+ * round so allocations and frees interleave like transient buffers do */
+static int malloc_bench_thread(void *arg)
+{
+    struct mem_bench_thread *b = arg;
+    void *slots[MALLOC_BENCH_SLOTS] = { 0 };
+    uint32_t x = 0x9e3779b9 * (b->index + 1);
+
+    while (TIME_LT(current_time(), b->deadline)) {
+        for (uint i = 0; i < 256; i++) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+
+            uint slot = x % MALLOC_BENCH_SLOTS;
+            /* one in sixteen allocations is larger than the small size classes */
+            size_t size = ((x >> 8) & 0xf) ? 8 + (x >> 12) % 248 : 256 + (x >> 12) % 3840;
+
+            uint t = arch_cycle_count();
+            free(slots[slot]);
+            slots[slot] = malloc(size);
+            t = arch_cycle_count() - t;
+
+            if (!slots[slot])
+                b->failures++;
+            else
+                *(volatile uint8_t *)slots[slot] = 0;
+
+            b->cycles += t;
+            if (t > b->max_cycles)
+                b->max_cycles = t;
+        }
+        b->ops += 256;
+    }
+
+    for (uint i = 0; i < MALLOC_BENCH_SLOTS; i++)
+        free(slots[i]);
+
+    return 0;
+}
+
+static int malloc_bench(int argc, const cmd_args *argv)
+{
+    struct mem_bench bench = {
+        .name = "malloc bench",
+        .routine = &malloc_bench_thread,
+    };
+
+    int err = mem_bench_run(argc, argv, &bench);
+    if (err < 0)
+        return err;
+
+    printf("%s, %u threads: %llu free/malloc pairs in %u ms, %llu per second\n",
+           MALLOC_BENCH_HEAP MALLOC_BENCH_CACHE, bench.thread_count, bench.ops, bench.duration,
+           bench.ops * 1000 / bench.duration);
+    printf("latency: %llu cycles average, %u max, %u failed\n",
+           bench.ops ? bench.cycles / bench.ops : 0, bench.max_cycles, bench.failures);
+
+    return 0;
+}
+
+#define SLAB_TEST_OBJS 512
+#define SLAB_TEST_MAGIC 0x51ab51ab
+
+#define HEAP_IRQ_TEST_SLOTS 16
+
+struct heap_irq_test_state {
+    uint32_t seed;
+    uint8_t *objs[HEAP_IRQ_TEST_SLOTS];
+    size_t sizes[HEAP_IRQ_TEST_SLOTS];
+    uint allocs;
+    uint misses;
+    uint frees;
+    uint corrupt;
+};
+
+/* churn objects from the irq reserves out of a timer callback */
+static enum handler_return heap_irq_test_tick(timer_t *t, lk_time_t now, void *arg)
+{
+    struct heap_irq_test_state *s = arg;
+
+    for (uint i = 0; i < HEAP_IRQ_TEST_SLOTS; i++) {
+        s->seed = s->seed * 1664525 + 1013904223;
+
+        if (s->objs[i]) {
+            if (s->objs[i][0] != i || s->objs[i][s->sizes[i] - 1] != i)
+                s->corrupt++;
+
+            if (s->seed & 0x80000000)
+                heap_free_irq(s->objs[i]);
+            else
+                heap_delayed_free(s->objs[i]);
+            s->objs[i] = NULL;
+            s->frees++;
+        } else {
+            size_t size = 1 + (s->seed >> 8) % 256;
+
+            s->objs[i] = heap_alloc_irq(size);
+            if (s->objs[i]) {
+                memset(s->objs[i], i, size);
+                s->sizes[i] = size;
+                s->allocs++;
+            } else {
+                s->misses++;
+            }
+        }
+    }
+
+    return INT_NO_RESCHEDULE;
+}
+
+static int heap_irq_test(int argc, const cmd_args *argv)
+{
+    lk_time_t duration = (argc >= 2) ? argv[1].u : 1000;
+    static struct heap_irq_test_state s;
+    timer_t timer;
+
+    memset(&s, 0, sizeof(s));
+    s.seed = rand();
+
+    timer_initialize(&timer);
+    timer_set_periodic(&timer, 1, heap_irq_test_tick, &s);
+
+    /* keep calling into the heap from a thread so the reserves get refilled
+     * and the delayed frees get processed */
+    lk_time_t start = current_time();
+    while (current_time() - start < duration) {
+        free(malloc(16));
+        thread_sleep(1);
+    }
+
+    timer_cancel(&timer);
+
+    for (uint i = 0; i < HEAP_IRQ_TEST_SLOTS; i++)
+        free(s.objs[i]);
+
+    printf("heap irq test %s: %u allocs, %u frees, %u misses, %u corrupted\n",
+           s.corrupt ? "FAILED" : "passed", s.allocs, s.frees, s.misses, s.corrupt);
+    return s.corrupt ? -1 : 0;
+}
+
+static void slab_test_ctor(void *obj, void *arg)
+{
+    *(uint32_t *)obj = SLAB_TEST_MAGIC;
+    (*(uint *)arg)++;
+}
+
+/* fill a cache, check the objects are distinct, aligned and constructed,
+ * then give everything back */
+static int slab_test_cache(size_t size, size_t align)
+{
+    static void *objs[SLAB_TEST_OBJS];
+    uint ctor_count = 0;
+    uint live = 0;
+    int err = 0;
+
+    slab_cache_t *cache = slab_cache_create("slab test", size, align, &slab_test_ctor, &ctor_count);
+    if (!cache) {
+        printf("failed to create cache of size %zu\n", size);
+        return ERR_NO_MEMORY;
+    }
+
+    for (uint pass = 0; pass < 2; pass++) {
+        for (uint i = 0; i < SLAB_TEST_OBJS; i++) {
+            objs[i] = slab_alloc(cache);
+            if (!objs[i]) {
+                printf("size %zu: allocation %u failed\n", size, i);
+                err = ERR_NO_MEMORY;
+                goto out;
+            }
+            live = i + 1;
+            if (align && ((uintptr_t)objs[i] & (align - 1))) {
+                printf("size %zu: object %p misaligned\n", size, objs[i]);
+                err = ERR_GENERIC;
+                goto out;
+            }
+            if (*(uint32_t *)objs[i] != SLAB_TEST_MAGIC) {
+                printf("size %zu: object %p not constructed\n", size, objs[i]);
+                err = ERR_GENERIC;
+                goto out;
+            }
+            /* stamp the tail so overlapping objects show up below */
+            ((uint8_t *)objs[i])[size - 1] = i;
+        }
+
+        for (uint i = 0; i < SLAB_TEST_OBJS; i++) {
+            if (((uint8_t *)objs[i])[size - 1] != (uint8_t)i) {
+                printf("size %zu: object %p overlaps another\n", size, objs[i]);
+                err = ERR_GENERIC;
+                goto out;
+            }
+        }
+
+        /* free in a scrambled order */
+        for (uint i = 0; i < SLAB_TEST_OBJS; i++) {
+            uint j = i + rand() % (SLAB_TEST_OBJS - i);
+            void *tmp = objs[i];
+            objs[i] = objs[j];
+            objs[j] = tmp;
+            slab_free(cache, objs[i]);
+        }
+        live = 0;
+    }
+
+out:
+    /* everything has to be back before the cache can go */
+    for (uint i = 0; i < live; i++)
+        slab_free(cache, objs[i]);
+
+    uint ctors = ctor_count;
+    slab_cache_reap(cache);
+    slab_cache_destroy(cache);
+
+    if (err == 0)
+        printf("size %zu, align %zu: ok, %u objects constructed\n", size, align, ctors);
+    return err;
+}
+
+static int slab_test(int argc, const cmd_args *argv)
+{
+    static const struct {
+        size_t size;
+        size_t align;
+    } tests[] = {
+        { 8, 0 },
+        { 24, 0 },
+        { 200, 64 },
+        { 700, 0 },
+        { 1536, CACHE_LINE },
+        { 5000, 0 },
+    };
+
+    for (uint i = 0; i < countof(tests); i++) {
+        int err = slab_test_cache(tests[i].size, tests[i].align);
+        if (err < 0) {
+            printf("slab test FAILED\n");
+            return err;
+        }
+    }
+
+    printf("slab test passed\n");
+    return 0;
+}
+
 STATIC_COMMAND_START
 STATIC_COMMAND("mem_test", "test memory", &mem_test)
+STATIC_COMMAND("malloc_bench", "benchmark the heap from several threads", &malloc_bench)
+STATIC_COMMAND("heap_irq_test", "allocate and free from the irq reserves in a timer", &heap_irq_test)
+STATIC_COMMAND("slab_test", "test the slab allocator", &slab_test)
+#if WITH_KERNEL_VM
+STATIC_COMMAND("pmm_test", "test the physical memory allocator", &pmm_test)
+STATIC_COMMAND("pmm_bench", "benchmark single page allocations from several threads", &pmm_bench)
+STATIC_COMMAND("tlb_bench", "compare memory access through default and large page mappings", &tlb_bench)
+STATIC_COMMAND("unmap_bench", "compare freeing vmm regions one at a time and batched", &unmap_bench)
+STATIC_COMMAND("vmm_stress", "allocate and free thousands of vmm regions", &vmm_stress)
+#endif
 STATIC_COMMAND_END(mem_tests);
@@ -21,7 +21,8 @@ MODULE_SRCS += \
 MODULE_ARM_OVERRIDE_SRCS := \
 
 MODULE_DEPS += \
-    lib/cbuf
+    lib/cbuf \
+    lib/slab
 
 MODULE_COMPILEFLAGS += -Wno-format -fno-builtin
 
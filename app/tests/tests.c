@@ -33,11 +33,19 @@ STATIC_COMMAND("printf_tests", "test printf", (console_cmd)&printf_tests)
 STATIC_COMMAND("printf_tests_float", "test printf with floating point", (console_cmd)&printf_tests_float)
 STATIC_COMMAND("thread_tests", "test the scheduler", (console_cmd)&thread_tests)
 STATIC_COMMAND("port_tests", "test the ports", (console_cmd)&port_tests)
+STATIC_COMMAND("mutex_bench", "mutex lock/unlock benchmark", &mutex_bench)
 STATIC_COMMAND("clock_tests", "test clocks", (console_cmd)&clock_tests)
 STATIC_COMMAND("bench", "miscellaneous benchmarks", (console_cmd)&benchmarks)
+STATIC_COMMAND("mem_bench", "memory bandwidth and copy benchmarks", &mem_bench)
 STATIC_COMMAND("fibo", "threaded fibonacci", (console_cmd)&fibo)
 STATIC_COMMAND("spinner", "create a spinning thread", (console_cmd)&spinner)
 STATIC_COMMAND("cbuf_tests", "test lib/cbuf", &cbuf_tests)
+#if WITH_LIB_BIO
+STATIC_COMMAND("bio_iops", "parallel block device request benchmark", &bio_iops)
+#endif
+#if WITH_SMP
+STATIC_COMMAND("cs_smp_bench", "smp context switch scaling benchmark", &context_switch_smp_bench)
+#endif
 STATIC_COMMAND_END(tests);
 
 #endif
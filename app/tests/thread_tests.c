@@ -25,13 +25,21 @@
 #include <rand.h>
 #include <err.h>
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <app/tests.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
+#include <kernel/rwlock.h>
+#include <kernel/seqlock.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
 #include <platform.h>
+#if WITH_LIB_DPC
+#include <lib/dpc.h>
+#endif
 
 static int sleep_thread(void *arg)
 {
@@ -240,6 +248,272 @@ int mutex_test(void)
     return 0;
 }
 
+struct rwlock_test_state {
+    rwlock_t lock;
+    volatile int a, b;
+    volatile int readers;
+    volatile int max_readers;
+    volatile bool writer_active;
+};
+
+static int rwlock_reader_thread(void *arg)
+{
+    struct rwlock_test_state *st = (struct rwlock_test_state *)arg;
+
+    for (int i = 0; i < 10000; i++) {
+        rwlock_read_acquire(&st->lock);
+
+        int r = atomic_add(&st->readers, 1) + 1;
+        if (r > st->max_readers)
+            st->max_readers = r;
+
+        if (st->writer_active)
+            panic("rwlock reader running alongside a writer\n");
+        if (st->a != st->b)
+            panic("rwlock reader saw a torn update %d %d\n", st->a, st->b);
+        thread_yield();
+        if (st->a != st->b)
+            panic("rwlock reader saw a torn update %d %d\n", st->a, st->b);
+
+        atomic_add(&st->readers, -1);
+        rwlock_read_release(&st->lock);
+    }
+
+    return 0;
+}
+
+static int rwlock_writer_thread(void *arg)
+{
+    struct rwlock_test_state *st = (struct rwlock_test_state *)arg;
+
+    for (int i = 0; i < 1000; i++) {
+        rwlock_write_acquire(&st->lock);
+
+        if (st->writer_active || st->readers != 0)
+            panic("rwlock writer not exclusive, readers %d\n", st->readers);
+        st->writer_active = true;
+        st->a++;
+        thread_yield();
+        st->b++;
+        st->writer_active = false;
+
+        rwlock_write_release(&st->lock);
+        thread_yield();
+    }
+
+    return 0;
+}
+
+static int rwlock_timeout_thread(void *arg)
+{
+    rwlock_t *rw = (rwlock_t *)arg;
+    status_t err;
+
+    err = rwlock_write_acquire_timeout(rw, 100);
+    if (err == NO_ERROR)
+        rwlock_write_release(rw);
+
+    return err;
+}
+
+static int rwlock_blocked_writer_thread(void *arg)
+{
+    rwlock_t *rw = (rwlock_t *)arg;
+
+    rwlock_write_acquire(rw);
+    rwlock_write_release(rw);
+
+    return 0;
+}
+
+static void rwlock_test(void)
+{
+    static struct rwlock_test_state st;
+    thread_t *threads[6];
+    status_t err;
+    int ret;
+
+    printf("testing rwlock:\n");
+    rwlock_init(&st.lock);
+
+    for (uint i = 0; i < countof(threads); i++) {
+        threads[i] = thread_create(i < 4 ? "rwlock reader" : "rwlock writer",
+                                   i < 4 ? &rwlock_reader_thread : &rwlock_writer_thread,
+                                   &st, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(threads[i]);
+    }
+
+    for (uint i = 0; i < countof(threads); i++)
+        thread_join(threads[i], NULL, INFINITE_TIME);
+
+    printf("rwlock readers/writers done, %d updates, up to %d concurrent readers\n",
+           st.a, st.max_readers);
+
+    /* a writer gives up when readers hold on past its timeout */
+    rwlock_read_acquire(&st.lock);
+    threads[0] = thread_create("rwlock timeout", &rwlock_timeout_thread, &st.lock, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(threads[0]);
+    thread_join(threads[0], &ret, INFINITE_TIME);
+    printf("write acquire with readers returns %d (should be %d)\n", ret, ERR_TIMED_OUT);
+
+    /* once that writer is gone, readers are not held back any more */
+    err = rwlock_read_acquire_timeout(&st.lock, 0);
+    printf("second read acquire returns %d (should be %d)\n", err, NO_ERROR);
+    if (err == NO_ERROR)
+        rwlock_read_release(&st.lock);
+
+    /* a waiting writer blocks new readers */
+    threads[0] = thread_create("rwlock writer", &rwlock_blocked_writer_thread, &st.lock, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(threads[0]);
+    thread_sleep(50);
+    err = rwlock_read_acquire_timeout(&st.lock, 0);
+    printf("read acquire behind a waiting writer returns %d (should be %d)\n", err, ERR_TIMED_OUT);
+    if (err == NO_ERROR)
+        rwlock_read_release(&st.lock);
+    rwlock_read_release(&st.lock);
+    thread_join(threads[0], NULL, INFINITE_TIME);
+
+    rwlock_destroy(&st.lock);
+
+    printf("done with rwlock tests\n");
+}
+
+struct seqlock_test_state {
+    seqlock_t lock;
+    volatile uint32_t a, b;
+    volatile bool done;
+};
+
+static int seqlock_writer_thread(void *arg)
+{
+    struct seqlock_test_state *st = (struct seqlock_test_state *)arg;
+    spin_lock_saved_state_t state;
+
+    while (!st->done) {
+        seqlock_write_begin(&st->lock, &state);
+        st->a++;
+        st->b = ~st->a;
+        seqlock_write_end(&st->lock, state);
+    }
+
+    return 0;
+}
+
+static void seqlock_test(void)
+{
+    static struct seqlock_test_state st;
+    thread_t *writer;
+    uint reads = 0, retries = 0;
+
+    printf("testing seqlock:\n");
+    seqlock_init(&st.lock);
+    st.a = 0;
+    st.b = ~0u;
+    st.done = false;
+
+    writer = thread_create("seqlock writer", &seqlock_writer_thread, &st, LOW_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(writer);
+
+    lk_time_t start = current_time();
+    while (current_time() - start < 500) {
+        uint32_t seq, a, b;
+
+        do {
+            seq = seqlock_read_begin(&st.lock);
+            a = st.a;
+            b = st.b;
+            retries++;
+        } while (seqlock_read_retry(&st.lock, seq));
+        retries--;
+        reads++;
+
+        if (a != ~b)
+            panic("seqlock reader saw a torn update %#x %#x\n", a, b);
+
+        /* let the lower priority writer run on single cpu systems */
+        if ((reads % 1024) == 0)
+            thread_sleep(1);
+    }
+
+    st.done = true;
+    thread_join(writer, NULL, INFINITE_TIME);
+
+    printf("%u consistent seqlock reads, %u retries, %u writes\n", reads, retries, st.a);
+    printf("done with seqlock tests\n");
+}
+
+struct mutex_bench_args {
+    mutex_t *m;
+    uint iterations;
+    lk_bigtime_t elapsed;
+};
+
+static int mutex_bench_thread(void *arg)
+{
+    struct mutex_bench_args *args = (struct mutex_bench_args *)arg;
+
+    lk_bigtime_t start = current_time_hires();
+    for (uint i = 0; i < args->iterations; i++) {
+        mutex_acquire(args->m);
+        mutex_release(args->m);
+    }
+    args->elapsed = current_time_hires() - start;
+
+    return 0;
+}
+
+/* run nthreads lock/unlock loops in parallel, one per cpu where possible,
+ * either each on its own mutex or all on a shared one, and return the
+ * average cost of a lock/unlock pair in ns */
+static uint mutex_bench_run(uint nthreads, bool shared, uint iterations)
+{
+    mutex_t mutexes[SMP_MAX_CPUS];
+    struct mutex_bench_args args[SMP_MAX_CPUS];
+    thread_t *threads[SMP_MAX_CPUS];
+
+    for (uint i = 0; i < nthreads; i++) {
+        mutex_init(&mutexes[i]);
+        args[i].m = shared ? &mutexes[0] : &mutexes[i];
+        args[i].iterations = iterations;
+        args[i].elapsed = 0;
+        threads[i] = thread_create("mutex bench", &mutex_bench_thread, &args[i], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_set_pinned_cpu(threads[i], i);
+    }
+
+    for (uint i = 0; i < nthreads; i++)
+        thread_resume(threads[i]);
+
+    lk_bigtime_t total = 0;
+    for (uint i = 0; i < nthreads; i++) {
+        thread_join(threads[i], NULL, INFINITE_TIME);
+        total += args[i].elapsed;
+    }
+
+    for (uint i = 0; i < nthreads; i++)
+        mutex_destroy(&mutexes[i]);
+
+    return (uint)(total * 1000 / ((lk_bigtime_t)iterations * nthreads));
+}
+
+int mutex_bench(int argc, const cmd_args *argv)
+{
+    const uint iterations = (argc >= 2) ? argv[1].u : 1000000;
+
+    printf("mutex lock/unlock benchmark, %u iterations per thread\n", iterations);
+
+    for (uint n = 1; n <= SMP_MAX_CPUS; n++) {
+        if (!mp_is_cpu_active(n - 1))
+            break;
+
+        uint private_ns = mutex_bench_run(n, false, iterations);
+        uint shared_ns = mutex_bench_run(n, true, iterations);
+        printf("%u thread(s): %u ns per lock/unlock uncontended, %u ns contended\n",
+               n, private_ns, shared_ns);
+    }
+
+    return 0;
+}
+
 static event_t e;
 
 static int event_signaler(void *arg)
@@ -399,6 +673,258 @@ void context_switch_test(void)
     thread_sleep(100);
 }
 
+#if WITH_SMP
+struct cs_pingpong {
+    event_t ping;
+    event_t pong;
+    volatile bool stop;
+    uint round_trips;
+};
+
+static int cs_pinger(void *arg)
+{
+    struct cs_pingpong *pp = (struct cs_pingpong *)arg;
+
+    while (!pp->stop) {
+        event_signal(&pp->ping, false);
+        event_wait(&pp->pong);
+        pp->round_trips++;
+    }
+
+    /* release the ponger if it is still waiting */
+    event_signal(&pp->ping, false);
+
+    return 0;
+}
+
+static int cs_ponger(void *arg)
+{
+    struct cs_pingpong *pp = (struct cs_pingpong *)arg;
+
+    for (;;) {
+        event_wait(&pp->ping);
+        event_signal(&pp->pong, false);
+        if (pp->stop)
+            break;
+    }
+
+    return 0;
+}
+
+/* run one ping-pong pair of threads pinned to each of the first ncpus cpus and
+ * report the aggregate context switch rate, which should scale with ncpus */
+static void context_switch_smp_run(uint ncpus, lk_time_t duration)
+{
+    struct cs_pingpong pp[SMP_MAX_CPUS];
+    thread_t *threads[SMP_MAX_CPUS * 2];
+
+    for (uint i = 0; i < ncpus; i++) {
+        event_init(&pp[i].ping, false, EVENT_FLAG_AUTOUNSIGNAL);
+        event_init(&pp[i].pong, false, EVENT_FLAG_AUTOUNSIGNAL);
+        pp[i].stop = false;
+        pp[i].round_trips = 0;
+
+        threads[i * 2] = thread_create("cs pinger", &cs_pinger, &pp[i], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        threads[i * 2 + 1] = thread_create("cs ponger", &cs_ponger, &pp[i], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_set_pinned_cpu(threads[i * 2], i);
+        thread_set_pinned_cpu(threads[i * 2 + 1], i);
+    }
+
+    for (uint i = 0; i < ncpus * 2; i++)
+        thread_resume(threads[i]);
+
+    thread_sleep(duration);
+
+    for (uint i = 0; i < ncpus; i++)
+        pp[i].stop = true;
+
+    uint total = 0;
+    for (uint i = 0; i < ncpus; i++) {
+        thread_join(threads[i * 2], NULL, INFINITE_TIME);
+        thread_join(threads[i * 2 + 1], NULL, INFINITE_TIME);
+        total += pp[i].round_trips;
+        event_destroy(&pp[i].ping);
+        event_destroy(&pp[i].pong);
+    }
+
+    /* every round trip is two context switches on the pair's cpu */
+    uint per_sec = (uint)((uint64_t)total * 2 * 1000 / duration);
+    printf("%u cpu(s): %u context switches/sec, %u per cpu\n", ncpus, per_sec, per_sec / ncpus);
+}
+
+int context_switch_smp_bench(int argc, const cmd_args *argv)
+{
+    lk_time_t duration = (argc >= 2) ? argv[1].u : 1000;
+
+    printf("smp context switch scaling, %u ms per run\n", duration);
+
+    for (uint ncpus = 1; ncpus <= SMP_MAX_CPUS; ncpus++) {
+        if (!mp_is_cpu_active(ncpus - 1))
+            break;
+        context_switch_smp_run(ncpus, duration);
+    }
+
+    return 0;
+}
+
+struct affinity_test_args {
+    cpu_mask_t mask;
+    volatile bool stop;
+    uint strays; /* times it was seen outside of its mask */
+};
+
+static int affinity_tester(void *arg)
+{
+    struct affinity_test_args *args = (struct affinity_test_args *)arg;
+
+    while (!args->stop) {
+        if (!(args->mask & cpu_num_to_mask(arch_curr_cpu_num())))
+            args->strays++;
+        thread_yield();
+    }
+
+    return 0;
+}
+
+static void affinity_test(void)
+{
+    struct affinity_test_args args[4];
+    thread_t *threads[countof(args)];
+    cpu_mask_t active = mp.active_cpus;
+
+    if ((active & (active - 1)) == 0)
+        return;
+
+    printf("testing thread affinity\n");
+
+    for (uint i = 0; i < countof(args); i++) {
+        /* alternate between the lowest and the highest active cpu, then both */
+        args[i].mask = (i & 1) ? cpu_num_to_mask(highest_cpu_set(active)) : cpu_num_to_mask(lowest_cpu_set(active));
+        args[i].stop = false;
+        args[i].strays = 0;
+        threads[i] = thread_create("affinity tester", &affinity_tester, &args[i], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_set_affinity(threads[i], args[i].mask);
+        thread_resume(threads[i]);
+    }
+
+    thread_sleep(100);
+
+    /* move them around while they run */
+    for (uint i = 0; i < countof(args); i++) {
+        args[i].mask = cpu_num_to_mask(lowest_cpu_set(active)) | cpu_num_to_mask(highest_cpu_set(active));
+        thread_set_affinity(threads[i], args[i].mask);
+    }
+
+    thread_sleep(100);
+
+    uint strays = 0;
+    for (uint i = 0; i < countof(args); i++) {
+        args[i].stop = true;
+        thread_join(threads[i], NULL, INFINITE_TIME);
+        strays += args[i].strays;
+    }
+
+    printf("affinity test done, %u strays (should be 0)\n", strays);
+}
+
+#if WITH_LIB_DPC
+/* an isolated cpu should run no housekeeping: no thread with the default
+ * affinity, none of the timers such a thread arms and no dpc, even one
+ * queued from the isolated cpu itself */
+struct isolation_test_args {
+    cpu_mask_t isolated;
+    volatile bool stop;
+    uint strays; /* times it was seen on an isolated cpu */
+    timer_t timer;
+    volatile int timer_cpu;
+};
+
+static volatile int isolation_dpc_cpu;
+
+static enum handler_return isolation_timer(timer_t *timer, lk_time_t now, void *arg)
+{
+    struct isolation_test_args *args = (struct isolation_test_args *)arg;
+
+    args->timer_cpu = arch_curr_cpu_num();
+
+    return INT_NO_RESCHEDULE;
+}
+
+static void isolation_dpc(void *arg)
+{
+    isolation_dpc_cpu = arch_curr_cpu_num();
+}
+
+static int isolation_tester(void *arg)
+{
+    struct isolation_test_args *args = (struct isolation_test_args *)arg;
+
+    timer_set_oneshot(&args->timer, 10, &isolation_timer, args);
+
+    while (!args->stop) {
+        if (args->isolated & cpu_num_to_mask(arch_curr_cpu_num()))
+            args->strays++;
+        thread_yield();
+    }
+
+    return 0;
+}
+
+static void isolation_test(void)
+{
+    struct isolation_test_args args[4];
+    thread_t *threads[countof(args)];
+    thread_t *current_thread = get_current_thread();
+    cpu_mask_t active = mp.active_cpus;
+
+    if ((active & (active - 1)) == 0)
+        return;
+
+    printf("testing cpu isolation\n");
+
+    uint cpu = highest_cpu_set(active);
+    mp_cpu_mask_t old_isolated = mp_get_isolated_mask();
+    mp_set_isolated_cpus(old_isolated | cpu_num_to_mask(cpu));
+
+    /* created after the cpu was isolated, so they get the housekeeping affinity */
+    for (uint i = 0; i < countof(args); i++) {
+        args[i].isolated = cpu_num_to_mask(cpu);
+        args[i].stop = false;
+        args[i].strays = 0;
+        args[i].timer_cpu = -1;
+        timer_initialize(&args[i].timer);
+        threads[i] = thread_create("isolation tester", &isolation_tester, &args[i], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(threads[i]);
+    }
+
+    /* queue a dpc from the isolated cpu */
+    int old_pinned = thread_pinned_cpu(current_thread);
+    thread_set_pinned_cpu(current_thread, cpu);
+    thread_yield();
+    isolation_dpc_cpu = -1;
+    dpc_queue(&isolation_dpc, NULL, 0);
+    thread_set_pinned_cpu(current_thread, old_pinned);
+
+    thread_sleep(100);
+
+    uint strays = 0, stray_timers = 0;
+    for (uint i = 0; i < countof(args); i++) {
+        args[i].stop = true;
+        thread_join(threads[i], NULL, INFINITE_TIME);
+        timer_cancel(&args[i].timer);
+        strays += args[i].strays;
+        if (args[i].timer_cpu < 0 || args[i].timer_cpu == (int)cpu)
+            stray_timers++;
+    }
+
+    mp_set_isolated_cpus(old_isolated);
+
+    printf("isolation test done, %u strays, %u timers not run off cpu %u, dpc ran on cpu %d (should be 0, 0 and not %u)\n",
+           strays, stray_timers, cpu, isolation_dpc_cpu, cpu);
+}
+#endif
+#endif
+
 static volatile int atomic;
 static volatile int atomic_count;
 
@@ -502,6 +1028,33 @@ static void preempt_test(void)
     printf("done with real-time preempt test, above time stamps should be 1 second apart\n");
 }
 
+#if THREAD_STATS && PLATFORM_HAS_DYNAMIC_TIMER
+/* a thread that has its cpu to itself should not be taking scheduler ticks */
+static void tickless_test(void)
+{
+    thread_t *current_thread = get_current_thread();
+    int old_pinned = thread_pinned_cpu(current_thread);
+
+    printf("testing tickless operation\n");
+
+    /* stay on this cpu so its counters are the ones we look at */
+    thread_set_pinned_cpu(current_thread, arch_curr_cpu_num());
+    thread_yield();
+
+    uint cpu = arch_curr_cpu_num();
+    ulong timer_ints = thread_stats[cpu].timer_ints;
+    lk_time_t start = current_time();
+    while (current_time() - start < 200)
+        ;
+    timer_ints = thread_stats[cpu].timer_ints - timer_ints;
+
+    thread_set_pinned_cpu(current_thread, old_pinned);
+
+    printf("%lu timer interrupts on cpu %u in 200ms with no other ready thread (a 10ms tick would be 20)\n",
+           timer_ints, cpu);
+}
+#endif
+
 static int join_tester(void *arg)
 {
     long val = (long)arg;
@@ -576,6 +1129,96 @@ static void join_test(void)
     printf("thread_join returns err %d, retval %d (should be 0 and 55)\n", err, ret);
 }
 
+#if KERNEL_EDF
+struct edf_test_args {
+    lk_bigtime_t runtime;
+    lk_bigtime_t period;
+    lk_bigtime_t work; /* time spent spinning each period */
+    uint periods;
+
+    /* filled in by the thread before it exits */
+    ulong jobs;
+    ulong deadline_misses;
+    ulong budget_overruns;
+};
+
+static int edf_tester(void *arg)
+{
+    struct edf_test_args *args = (struct edf_test_args *)arg;
+
+    for (uint i = 0; i < args->periods; i++) {
+        lk_bigtime_t start = current_time_hires();
+        while (current_time_hires() - start < args->work)
+            ;
+        thread_wait_next_period();
+    }
+
+    thread_t *t = get_current_thread();
+    args->jobs = t->edf.jobs;
+    args->deadline_misses = t->edf.deadline_misses;
+    args->budget_overruns = t->edf.budget_overruns;
+
+    return 0;
+}
+
+static thread_t *edf_test_start(struct edf_test_args *args)
+{
+    thread_t *t = thread_create("edf tester", &edf_tester, args, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!t)
+        return NULL;
+
+    status_t err = thread_set_deadline(t, args->runtime, args->period, args->period);
+    if (err < 0) {
+        printf("thread_set_deadline returned %d\n", err);
+        thread_detach_and_resume(t);
+        return NULL;
+    }
+
+    thread_resume(t);
+    return t;
+}
+
+static void edf_test(void)
+{
+    struct edf_test_args args[] = {
+        { .runtime = 1000, .period = 5000, .work = 500, .periods = 200 },
+        { .runtime = 2000, .period = 10000, .work = 1000, .periods = 100 },
+        /* overruns its budget every period */
+        { .runtime = 500, .period = 10000, .work = 2000, .periods = 20 },
+    };
+    struct edf_test_args overload_args = { .runtime = 9500, .period = 10000 };
+    thread_t *threads[countof(args)];
+
+    printf("testing edf scheduling\n");
+
+    for (uint i = 0; i < countof(args); i++) {
+        threads[i] = edf_test_start(&args[i]);
+        if (!threads[i]) {
+            while (i--)
+                thread_join(threads[i], NULL, INFINITE_TIME);
+            return;
+        }
+    }
+
+    /* no cpu can fit another 95% */
+    thread_t *t = thread_create("edf overload", &edf_tester, &overload_args, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    status_t err = thread_set_deadline(t, overload_args.runtime, overload_args.period, overload_args.period);
+    printf("overloaded admission returns %d (should be %d)\n", err, ERR_NO_RESOURCES);
+    thread_detach_and_resume(t);
+
+    for (uint i = 0; i < countof(args); i++)
+        thread_join(threads[i], NULL, INFINITE_TIME);
+
+    for (uint i = 0; i < countof(args); i++) {
+        printf("edf thread %u: runtime %llu period %llu, %lu jobs, %lu deadline misses, %lu budget overruns\n",
+               i, args[i].runtime, args[i].period, args[i].jobs,
+               args[i].deadline_misses, args[i].budget_overruns);
+    }
+
+    printf("edf tests done\n");
+}
+#endif
+
 static void spinlock_test(void)
 {
     spin_lock_saved_state_t state;
@@ -593,6 +1236,16 @@ static void spinlock_test(void)
     spin_unlock_irqrestore(&lock, state);
     ASSERT(!spin_lock_held(&lock));
     ASSERT(!arch_ints_disabled());
+
+    arch_disable_ints();
+    ASSERT(spin_trylock(&lock) == 0);
+    ASSERT(spin_lock_held(&lock));
+#if WITH_SMP
+    ASSERT(spin_trylock(&lock) != 0);
+#endif
+    spin_unlock(&lock);
+    ASSERT(!spin_lock_held(&lock));
+    arch_enable_ints();
     printf("seems to work\n");
 
 #define COUNT (1024*1024)
@@ -616,22 +1269,112 @@ static void spinlock_test(void)
 #undef COUNT
 }
 
+#if WITH_SMP
+struct spinlock_contention_args {
+    spin_lock_t *lock;
+    volatile uint *counter;
+    volatile bool *done;
+    uint acquisitions;
+};
+
+static int spinlock_contender(void *arg)
+{
+    struct spinlock_contention_args *args = (struct spinlock_contention_args *)arg;
+    spin_lock_saved_state_t state;
+
+    while (!*args->done) {
+        spin_lock_irqsave(args->lock, state);
+        (*args->counter)++;
+        spin_unlock_irqrestore(args->lock, state);
+        args->acquisitions++;
+    }
+
+    return 0;
+}
+
+/* hammer one lock from every cpu and report how evenly it was handed out */
+static void spinlock_contention_test(void)
+{
+    struct spinlock_contention_args args[SMP_MAX_CPUS];
+    thread_t *threads[SMP_MAX_CPUS];
+    spin_lock_t lock;
+    volatile uint counter = 0;
+    volatile bool done = false;
+    uint ncpus = 0;
+
+    spin_lock_init(&lock);
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!mp_is_cpu_active(i))
+            continue;
+
+        args[ncpus].lock = &lock;
+        args[ncpus].counter = &counter;
+        args[ncpus].done = &done;
+        args[ncpus].acquisitions = 0;
+        threads[ncpus] = thread_create("spin contender", &spinlock_contender, &args[ncpus],
+                                       LOW_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_set_pinned_cpu(threads[ncpus], i);
+        ncpus++;
+    }
+
+    printf("testing spinlock contention on %u cpus\n", ncpus);
+
+    for (uint i = 0; i < ncpus; i++)
+        thread_resume(threads[i]);
+
+    thread_sleep(500);
+    done = true;
+
+    uint total = 0, min = UINT_MAX, max = 0;
+    for (uint i = 0; i < ncpus; i++) {
+        thread_join(threads[i], NULL, INFINITE_TIME);
+        total += args[i].acquisitions;
+        min = MIN(min, args[i].acquisitions);
+        max = MAX(max, args[i].acquisitions);
+    }
+
+    printf("%u acquisitions, counter %u, per cpu min %u max %u\n", total, counter, min, max);
+    if (counter != total)
+        printf("spinlock contention test FAILED, lost %u updates\n", total - counter);
+}
+#endif
+
 int thread_tests(void)
 {
     mutex_test();
+    rwlock_test();
+    seqlock_test();
     semaphore_test();
     event_test();
 
     spinlock_test();
+#if WITH_SMP
+    spinlock_contention_test();
+#endif
     atomic_test();
 
     thread_sleep(200);
     context_switch_test();
+#if WITH_SMP
+    context_switch_smp_bench(0, NULL);
+    affinity_test();
+#if WITH_LIB_DPC
+    isolation_test();
+#endif
+#endif
 
     preempt_test();
+#if THREAD_STATS && PLATFORM_HAS_DYNAMIC_TIMER
+    tickless_test();
+#endif
 
     join_test();
 
+#if KERNEL_EDF
+    edf_test();
+#endif
+
     return 0;
 }
 
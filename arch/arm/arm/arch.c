@@ -63,7 +63,7 @@ static void spinlock_test_secondary(void);
 
 #if WITH_SMP
 /* smp boot lock */
-spin_lock_t arm_boot_cpu_lock = 1;
+spin_lock_t arm_boot_cpu_lock = SPIN_LOCK_INITIAL_LOCKED_VALUE;
 volatile int secondaries_to_init = 0;
 #endif
 
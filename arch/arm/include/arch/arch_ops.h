@@ -39,6 +39,9 @@ __BEGIN_CDECLS;
 #define USE_GCC_ATOMICS 0
 #define ENABLE_CYCLE_COUNTER 1
 
+/* atomic_cmpxchg() is a real ldrex/strex sequence */
+#define ARCH_HAS_ATOMIC_CMPXCHG 1
+
 // override of some routines
 static inline void arch_enable_ints(void)
 {
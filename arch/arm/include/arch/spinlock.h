@@ -35,6 +35,17 @@ typedef unsigned long spin_lock_t;
 typedef unsigned long spin_lock_saved_state_t;
 typedef unsigned long spin_lock_save_flags_t;
 
+#if WITH_SMP
+/* armv7 smp cores wait for the lock in wfe, unlock wakes them with sev */
+#define ARCH_TICKET_SPIN_WAIT() __asm__ volatile("wfe" ::: "memory")
+#define ARCH_TICKET_SPIN_WAKE() __asm__ volatile("dsb; sev" ::: "memory")
+#endif
+
+#include <arch/ticket_spinlock.h>
+
+/* initial value of a lock that is held until its first unlock */
+#define SPIN_LOCK_INITIAL_LOCKED_VALUE TICKET_SPIN_LOCK_LOCKED
+
 static inline void arch_spin_lock_init(spin_lock_t *lock)
 {
     *lock = SPIN_LOCK_INITIAL_VALUE;
@@ -42,20 +53,31 @@ static inline void arch_spin_lock_init(spin_lock_t *lock)
 
 static inline bool arch_spin_lock_held(spin_lock_t *lock)
 {
-    return *lock != 0;
+    return ticket_spin_lock_held(lock);
 }
 
 #if WITH_SMP
 
-void arch_spin_lock(spin_lock_t *lock);
-int arch_spin_trylock(spin_lock_t *lock);
-void arch_spin_unlock(spin_lock_t *lock);
+static inline void arch_spin_lock(spin_lock_t *lock)
+{
+    ticket_spin_lock(lock);
+}
+
+static inline int arch_spin_trylock(spin_lock_t *lock)
+{
+    return ticket_spin_trylock(lock);
+}
+
+static inline void arch_spin_unlock(spin_lock_t *lock)
+{
+    ticket_spin_unlock(lock);
+}
 
 #else
 
 static inline void arch_spin_lock(spin_lock_t *lock)
 {
-    *lock = 1;
+    *lock = SPIN_LOCK_INITIAL_LOCKED_VALUE;
 }
 
 static inline int arch_spin_trylock(spin_lock_t *lock)
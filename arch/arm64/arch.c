@@ -46,9 +46,9 @@
 #if WITH_SMP
 /* smp boot lock */
 #ifdef SPINLOCK_STATS
-static spin_lock_t arm_boot_cpu_lock = { .lock = 1, };
+static spin_lock_t arm_boot_cpu_lock = { .lock = SPIN_LOCK_INITIAL_LOCKED_VALUE, };
 #else
-static spin_lock_t arm_boot_cpu_lock = 1;
+static spin_lock_t arm_boot_cpu_lock = SPIN_LOCK_INITIAL_LOCKED_VALUE;
 #endif
 static volatile int secondaries_to_init = 0;
 #endif
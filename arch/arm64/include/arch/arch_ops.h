@@ -257,6 +257,8 @@ static inline int atomic_swap(volatile int *ptr, int val)
 #endif
 }
 
+#define ARCH_HAS_ATOMIC_CMPXCHG 1
+
 static inline int atomic_cmpxchg(volatile int *ptr, int oldval, int newval)
 {
 #if USE_GCC_ATOMICS
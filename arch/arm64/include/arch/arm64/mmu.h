@@ -334,6 +334,12 @@ __BEGIN_CDECLS
     ISB; \
 })
 
+/* no barrier, for issuing a run of invalidates followed by a single DSB */
+#define ARM64_TLBI_NOSYNC(op, val) \
+({ \
+    __asm__ volatile("tlbi " #op ", %0" :: "r" (val)); \
+})
+
 #define MMU_ARM64_GLOBAL_ASID (~0U)
 #define MMU_ARM64_USER_ASID (0U)
 int arm64_mmu_map(vaddr_t vaddr, paddr_t paddr, size_t size, pte_t attrs,
@@ -28,6 +28,24 @@
 
 __BEGIN_CDECLS
 
+/* past this many entries it's cheaper to drop every entry for the asid */
+#ifndef ARM64_TLB_BATCH_MAX
+#define ARM64_TLB_BATCH_MAX 32
+#endif
+
+/* TLB maintenance and page table frees held back by unmaps so they can be
+ * issued together once the page tables are updated */
+struct arm64_tlb_batch {
+    uint asid;
+
+    /* addresses to invalidate, more than ARM64_TLB_BATCH_MAX means all of them */
+    uint count;
+    vaddr_t vaddrs[ARM64_TLB_BATCH_MAX];
+
+    /* page tables to free once no walker can be using them */
+    struct list_node page_tables;
+};
+
 struct arch_aspace {
     /* pointer to the translation table */
     paddr_t tt_phys;
@@ -38,6 +56,10 @@ struct arch_aspace {
     /* range of address space */
     vaddr_t base;
     size_t size;
+
+    /* unmaps between arch_mmu_unmap_begin() and arch_mmu_unmap_end() */
+    uint unmap_batch_count;
+    struct arm64_tlb_batch unmap_batch;
 };
 
 __END_CDECLS
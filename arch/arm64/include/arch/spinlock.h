@@ -25,6 +25,17 @@
 #include <arch/ops.h>
 #include <stdbool.h>
 
+/*
+ * Spin locks are ticket locks, see spinlock.S. The low halfword of the lock
+ * word is the ticket being served and the high halfword the next ticket,
+ * the lock is free when they match.
+ */
+#define SPIN_LOCK_TICKET_SHIFT 16
+#define SPIN_LOCK_TICKET_MASK 0xffffUL
+
+/* initial lock word of a lock that is held until its first unlock */
+#define SPIN_LOCK_INITIAL_LOCKED_VALUE (1UL << SPIN_LOCK_TICKET_SHIFT)
+
 #ifndef SPINLOCK_STATS
 #define SPIN_LOCK_INITIAL_VALUE (0)
 
@@ -40,12 +51,16 @@ typedef struct spin_lock {
 
 typedef struct spin_lock_elem {
     spin_lock_t *lock;
-    uint64_t ts;
-    uint64_t max;
-    uint64_t mean;
-    uint32_t num;
+    uint64_t ts;            /* acquisition time of the current holder */
+    uint64_t max;           /* longest hold time */
+    uint64_t mean;          /* total hold time, divided by num on dump */
+    uint64_t wait;          /* total time spent spinning for the lock */
+    uint64_t wait_max;      /* longest time spent spinning for the lock */
+    uint32_t num;           /* acquisitions */
+    uint32_t contended;     /* acquisitions that had to spin */
     uint32_t magic;
-    void *caller;
+    void *caller;           /* site that registered the lock */
+    void *max_caller;       /* site that held the lock the longest */
 } spin_lock_elem_t;
 
 #define SPIN_LOCK_MAGIC 0x4e695053 /* SPiN */
@@ -67,7 +82,7 @@ void arch_spin_unlock(spin_lock_t *lock);
 #else
 static inline void arch_spin_lock(spin_lock_t *lock)
 {
-    *lock = 1;
+    *(unsigned long *)lock = SPIN_LOCK_INITIAL_LOCKED_VALUE;
 }
 
 static inline int arch_spin_trylock(spin_lock_t *lock)
@@ -77,10 +92,16 @@ static inline int arch_spin_trylock(spin_lock_t *lock)
 
 static inline void arch_spin_unlock(spin_lock_t *lock)
 {
-    *lock = 0;
+    *(unsigned long *)lock = 0;
 }
 #endif
 
+static inline bool arch_spin_lock_word_held(unsigned long val)
+{
+    return (val & SPIN_LOCK_TICKET_MASK) !=
+           ((val >> SPIN_LOCK_TICKET_SHIFT) & SPIN_LOCK_TICKET_MASK);
+}
+
 #ifndef SPINLOCK_STATS
 static inline void arch_spin_lock_init(spin_lock_t *lock)
 {
@@ -89,7 +110,7 @@ static inline void arch_spin_lock_init(spin_lock_t *lock)
 
 static inline bool arch_spin_lock_held(spin_lock_t *lock)
 {
-    return *lock != 0;
+    return arch_spin_lock_word_held(*lock);
 }
 
 #else
@@ -99,26 +120,62 @@ static inline bool arch_spin_lock_held(spin_lock_t *lock)
 
 void spin_lock_register(spin_lock_t *lock);
 
+/* Hands out a statistics slot to a lock that was statically initialized.
+ * Must be called with the lock held, returns NULL once the table is full. */
+spin_lock_elem_t *spin_lock_stats_attach(spin_lock_t *lock, void *caller);
+
 static inline void arch_spin_lock_init(spin_lock_t *lock)
 {
     memset(lock, 0, sizeof(spin_lock_t));
     spin_lock_register(lock);
 }
 
-static inline void arch_spin_lock_and_ts(spin_lock_t *lock)
+static inline void arch_spin_lock_acquired(spin_lock_t *lock, bool contended,
+                                           uint64_t wait)
 {
-    arch_spin_lock(lock);
     spin_lock_elem_t *elem = lock->elem;
 
-    if (!elem)
-        return;
+    if (!elem) {
+        elem = spin_lock_stats_attach(lock, __GET_CALLER());
+        if (!elem)
+            return;
+    }
+
+    if (contended) {
+        elem->contended++;
+        elem->wait += wait;
+        if (wait > elem->wait_max)
+            elem->wait_max = wait;
+    }
 
     elem->ts = current_time_hires();
 }
 
+static inline void arch_spin_lock_and_ts(spin_lock_t *lock)
+{
+    uint64_t wait = 0;
+    bool contended = false;
+
+    /* only time the slow path, an uncontended lock costs one extra probe */
+    if (arch_spin_trylock(lock)) {
+        uint64_t start = current_time_hires();
+
+        arch_spin_lock(lock);
+        wait = current_time_hires() - start;
+        contended = true;
+    }
+
+    arch_spin_lock_acquired(lock, contended, wait);
+}
+
 static inline int arch_spin_trylock_and_ts(spin_lock_t *lock)
 {
-    return arch_spin_trylock(lock);
+    int ret = arch_spin_trylock(lock);
+
+    if (ret == 0)
+        arch_spin_lock_acquired(lock, false, 0);
+
+    return ret;
 }
 
 static inline void arch_spin_unlock_and_ts(spin_lock_t *lock)
@@ -133,7 +190,7 @@ static inline void arch_spin_unlock_and_ts(spin_lock_t *lock)
 
     if (delta > elem->max) {
         elem->max = delta;
-        elem->caller = __GET_CALLER();
+        elem->max_caller = __GET_CALLER();
     }
 
     elem->num++;
@@ -145,7 +202,7 @@ skip:
 
 static inline bool arch_spin_lock_held(spin_lock_t *lock)
 {
-    return lock->lock != 0;
+    return arch_spin_lock_word_held(lock->lock);
 }
 #endif
 
@@ -308,10 +308,153 @@ static bool page_table_is_clear(pte_t *page_table, uint page_size_shift)
     return true;
 }
 
+static void arm64_mmu_invalidate_va(vaddr_t vaddr, uint asid)
+{
+    if (asid == MMU_ARM64_GLOBAL_ASID)
+        ARM64_TLBI(vaae1is, vaddr >> 12);
+    else
+        ARM64_TLBI(vae1is, vaddr >> 12 | (vaddr_t)asid << 48);
+}
+
+static void arm64_tlb_batch_init(struct arm64_tlb_batch *batch, uint asid)
+{
+    batch->asid = asid;
+    batch->count = 0;
+    list_initialize(&batch->page_tables);
+}
+
+/* Queue an invalidate for the entry mapping vaddr, or for the walks through
+ * a table if it's one being freed.
+ */
+static void arm64_tlb_batch_add(struct arm64_tlb_batch *batch, vaddr_t vaddr)
+{
+    if (batch->count < ARM64_TLB_BATCH_MAX)
+        batch->vaddrs[batch->count] = vaddr;
+    if (batch->count <= ARM64_TLB_BATCH_MAX)
+        batch->count++;
+}
+
+/* Issue everything gathered in the batch with a single barrier, then free
+ * the page tables that were unhooked.
+ */
+static void arm64_tlb_batch_flush(struct arm64_tlb_batch *batch)
+{
+    if (batch->count) {
+        LTRACEF("count %u, asid 0x%x\n", batch->count, batch->asid);
+
+        /* the cleared entries have to be visible to the walkers first */
+        DSB;
+        if (batch->count > ARM64_TLB_BATCH_MAX) {
+            if (batch->asid == MMU_ARM64_GLOBAL_ASID)
+                ARM64_TLBI_NOADDR(vmalle1is);
+            else
+                ARM64_TLBI(aside1is, (vaddr_t)batch->asid << 48);
+        } else {
+            for (uint i = 0; i < batch->count; i++) {
+                if (batch->asid == MMU_ARM64_GLOBAL_ASID)
+                    ARM64_TLBI_NOSYNC(vaae1is, batch->vaddrs[i] >> 12);
+                else
+                    ARM64_TLBI_NOSYNC(vae1is, batch->vaddrs[i] >> 12 | (vaddr_t)batch->asid << 48);
+            }
+        }
+        DSB;
+        ISB;
+
+        batch->count = 0;
+    }
+
+    if (!list_is_empty(&batch->page_tables))
+        pmm_free(&batch->page_tables);
+}
+
+/* Free a page table that has been unhooked from its parent once the batch
+ * has been flushed, walkers may still have it cached until then.
+ */
+static void arm64_tlb_batch_free_table(struct arm64_tlb_batch *batch, void *vaddr, paddr_t paddr,
+                                       uint page_size_shift)
+{
+    size_t size = 1U << page_size_shift;
+
+    if (size >= PAGE_SIZE) {
+        vm_page_t *page = paddr_to_vm_page(paddr);
+        if (!page)
+            panic("bad page table paddr 0x%lx\n", paddr);
+        list_add_tail(&batch->page_tables, &page->node);
+    } else {
+        /* tables smaller than a page come from the heap, just flush now */
+        arm64_tlb_batch_flush(batch);
+        free_page_table(vaddr, paddr, page_size_shift);
+    }
+}
+
+/* log2 of the number of entries at a level that can be marked with the
+ * contiguous hint to share a single TLB entry, or 0 if the level can't */
+static uint arm64_mmu_contiguous_shift(uint index_shift, uint page_size_shift)
+{
+    if (index_shift == page_size_shift) {
+        /* level 3: 16 x 4K, 128 x 16K or 32 x 64K pages */
+        return (page_size_shift == 12) ? 4 : (page_size_shift == 14) ? 7 : 5;
+    } else if (index_shift == page_size_shift + (page_size_shift - 3) &&
+               index_shift <= MMU_PTE_DESCRIPTOR_BLOCK_MAX_SHIFT) {
+        /* level 2 blocks: 16 x 2M, 32 x 32M or 32 x 512M */
+        return (page_size_shift == 12) ? 4 : 5;
+    }
+    return 0;
+}
+
+static bool arm64_mmu_pte_is_leaf(pte_t pte, uint index_shift, uint page_size_shift)
+{
+    uint descriptor_type = pte & MMU_PTE_DESCRIPTOR_MASK;
+
+    if (index_shift > page_size_shift)
+        return descriptor_type == MMU_PTE_L012_DESCRIPTOR_BLOCK;
+    else
+        return descriptor_type == MMU_PTE_L3_DESCRIPTOR_PAGE;
+}
+
+/* Would unmapping [start, last] take out only part of the block or run of
+ * contiguous hinted entries that maps addr? Those can't be rewritten in place
+ * while other cpus may be using them, so such an unmap has to be refused.
+ */
+static bool arm64_mmu_unmap_cuts_leaf(vaddr_t addr, vaddr_t start, vaddr_t last,
+                                      uint index_shift, uint page_size_shift,
+                                      pte_t *page_table)
+{
+    vaddr_t base = 0;
+
+    for (;;) {
+        vaddr_t rel = addr - base;
+        vaddr_t index = rel >> index_shift;
+        pte_t pte = page_table[index];
+
+        if (index_shift > page_size_shift &&
+                (pte & MMU_PTE_DESCRIPTOR_MASK) == MMU_PTE_L012_DESCRIPTOR_TABLE) {
+            base += index << index_shift;
+            page_table = paddr_to_kvaddr(pte & MMU_PTE_OUTPUT_ADDR_MASK);
+            index_shift -= page_size_shift - 3;
+            continue;
+        }
+
+        if (!arm64_mmu_pte_is_leaf(pte, index_shift, page_size_shift))
+            return false;
+
+        uint span_shift = index_shift;
+        if (pte & MMU_PTE_ATTR_CONTIGUOUS)
+            span_shift += arm64_mmu_contiguous_shift(index_shift, page_size_shift);
+        if (span_shift == page_size_shift)
+            return false;
+
+        vaddr_t leaf_start = base + (rel & ~((1UL << span_shift) - 1));
+        vaddr_t leaf_last = leaf_start + ((1UL << span_shift) - 1);
+
+        return leaf_start < start || leaf_last > last;
+    }
+}
+
 static void arm64_mmu_unmap_pt(vaddr_t vaddr, vaddr_t vaddr_rel,
                                size_t size,
                                uint index_shift, uint page_size_shift,
-                               pte_t *page_table, uint asid)
+                               pte_t *page_table, struct arm64_tlb_batch *batch)
 {
     pte_t *next_page_table;
     vaddr_t index;
@@ -341,22 +484,21 @@ static void arm64_mmu_unmap_pt(vaddr_t vaddr, vaddr_t vaddr_rel,
             arm64_mmu_unmap_pt(vaddr, vaddr_rem, chunk_size,
                                index_shift - (page_size_shift - 3),
                                page_size_shift,
-                               next_page_table, asid);
+                               next_page_table, batch);
             if (chunk_size == block_size ||
                     page_table_is_clear(next_page_table, page_size_shift)) {
                 LTRACEF("pte %p[0x%lx] = 0 (was page table)\n", page_table, index);
                 page_table[index] = MMU_PTE_DESCRIPTOR_INVALID;
                 __asm__ volatile("dmb ishst" ::: "memory");
-                free_page_table(next_page_table, page_table_paddr, page_size_shift);
+
+                arm64_tlb_batch_add(batch, vaddr);
+                arm64_tlb_batch_free_table(batch, next_page_table, page_table_paddr, page_size_shift);
             }
         } else if (pte) {
             LTRACEF("pte %p[0x%lx] = 0\n", page_table, index);
             page_table[index] = MMU_PTE_DESCRIPTOR_INVALID;
             CF;
-            if (asid == MMU_ARM64_GLOBAL_ASID)
-                ARM64_TLBI(vaae1is, vaddr >> 12);
-            else
-                ARM64_TLBI(vae1is, vaddr >> 12 | (vaddr_t)asid << 48);
+            arm64_tlb_batch_add(batch, vaddr);
         } else {
             LTRACEF("pte %p[0x%lx] already clear\n", page_table, index);
         }
@@ -366,6 +508,20 @@ static void arm64_mmu_unmap_pt(vaddr_t vaddr, vaddr_t vaddr_rel,
     }
 }
 
+/* unmap and flush right away, kept out of line so the batch doesn't end up
+ * in the stack frame of every level of arm64_mmu_map_pt() */
+__NO_INLINE static void arm64_mmu_unmap_pt_sync(vaddr_t vaddr, vaddr_t vaddr_rel,
+                                                size_t size,
+                                                uint index_shift, uint page_size_shift,
+                                                pte_t *page_table, uint asid)
+{
+    struct arm64_tlb_batch batch;
+
+    arm64_tlb_batch_init(&batch, asid);
+    arm64_mmu_unmap_pt(vaddr, vaddr_rel, size, index_shift, page_size_shift, page_table, &batch);
+    arm64_tlb_batch_flush(&batch);
+}
+
 static int arm64_mmu_map_pt(vaddr_t vaddr_in, vaddr_t vaddr_rel_in,
                             paddr_t paddr_in,
                             size_t size_in, pte_t attrs,
@@ -384,6 +540,7 @@ static int arm64_mmu_map_pt(vaddr_t vaddr_in, vaddr_t vaddr_rel_in,
     vaddr_t block_size;
     vaddr_t block_mask;
     pte_t pte;
+    uint cont_left = 0;
 
     LTRACEF("vaddr 0x%lx, vaddr_rel 0x%lx, paddr 0x%lx, size 0x%lx, attrs 0x%llx, index shift %d, page_size_shift %d, page_table %p\n",
             vaddr, vaddr_rel, paddr, size, attrs,
@@ -428,6 +585,20 @@ static int arm64_mmu_map_pt(vaddr_t vaddr_in, vaddr_t vaddr_rel_in,
             else
                 pte |= MMU_PTE_L3_DESCRIPTOR_PAGE;
 
+            /* mark aligned runs of entries mapped together so the tlb can
+             * cache the whole run in one entry */
+            if (cont_left == 0) {
+                uint cont_shift = arm64_mmu_contiguous_shift(index_shift, page_size_shift);
+                vaddr_t cont_size = block_size << cont_shift;
+
+                if (cont_shift && !((vaddr_rel | paddr) & (cont_size - 1)) && size >= cont_size)
+                    cont_left = 1U << cont_shift;
+            }
+            if (cont_left) {
+                pte |= MMU_PTE_ATTR_CONTIGUOUS;
+                cont_left--;
+            }
+
             LTRACEF("pte %p[0x%lx] = 0x%llx\n", page_table, index, pte);
             page_table[index] = pte;
         }
@@ -440,9 +611,8 @@ static int arm64_mmu_map_pt(vaddr_t vaddr_in, vaddr_t vaddr_rel_in,
     return 0;
 
 err:
-    arm64_mmu_unmap_pt(vaddr_in, vaddr_rel_in, size_in - size,
-                       index_shift, page_size_shift, page_table, asid);
-    DSB;
+    arm64_mmu_unmap_pt_sync(vaddr_in, vaddr_rel_in, size_in - size,
+                            index_shift, page_size_shift, page_table, asid);
     return ERR_GENERIC;
 }
 
@@ -475,15 +645,15 @@ int arm64_mmu_map(vaddr_t vaddr, paddr_t paddr, size_t size, pte_t attrs,
     return ret;
 }
 
-int arm64_mmu_unmap(vaddr_t vaddr, size_t size,
-                    vaddr_t vaddr_base, uint top_size_shift,
-                    uint top_index_shift, uint page_size_shift,
-                    pte_t *top_page_table, uint asid)
+static int arm64_mmu_unmap_batch(vaddr_t vaddr, size_t size,
+                                 vaddr_t vaddr_base, uint top_size_shift,
+                                 uint top_index_shift, uint page_size_shift,
+                                 pte_t *top_page_table, struct arm64_tlb_batch *batch)
 {
     vaddr_t vaddr_rel = vaddr - vaddr_base;
     vaddr_t vaddr_rel_max = 1UL << top_size_shift;
 
-    LTRACEF("vaddr 0x%lx, size 0x%lx, asid 0x%x\n", vaddr, size, asid);
+    LTRACEF("vaddr 0x%lx, size 0x%lx, asid 0x%x\n", vaddr, size, batch->asid);
 
     if (vaddr_rel > vaddr_rel_max - size || size > vaddr_rel_max) {
         TRACEF("vaddr 0x%lx, size 0x%lx out of range vaddr 0x%lx, size 0x%lx\n",
@@ -496,12 +666,35 @@ int arm64_mmu_unmap(vaddr_t vaddr, size_t size,
         return ERR_INVALID_ARGS;
     }
 
+    if (size && (arm64_mmu_unmap_cuts_leaf(vaddr_rel, vaddr_rel, vaddr_rel + size - 1,
+                                           top_index_shift, page_size_shift, top_page_table) ||
+                 arm64_mmu_unmap_cuts_leaf(vaddr_rel + size - 1, vaddr_rel, vaddr_rel + size - 1,
+                                           top_index_shift, page_size_shift, top_page_table))) {
+        TRACEF("vaddr 0x%lx, size 0x%lx only covers part of a block or contiguous run\n",
+               vaddr, size);
+        return ERR_NOT_SUPPORTED;
+    }
+
     arm64_mmu_unmap_pt(vaddr, vaddr_rel, size,
-                       top_index_shift, page_size_shift, top_page_table, asid);
-    DSB;
+                       top_index_shift, page_size_shift, top_page_table, batch);
     return 0;
 }
 
+int arm64_mmu_unmap(vaddr_t vaddr, size_t size,
+                    vaddr_t vaddr_base, uint top_size_shift,
+                    uint top_index_shift, uint page_size_shift,
+                    pte_t *top_page_table, uint asid)
+{
+    struct arm64_tlb_batch batch;
+    int ret;
+
+    arm64_tlb_batch_init(&batch, asid);
+    ret = arm64_mmu_unmap_batch(vaddr, size, vaddr_base, top_size_shift,
+                                top_index_shift, page_size_shift, top_page_table, &batch);
+    arm64_tlb_batch_flush(&batch);
+    return ret;
+}
+
 int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
 {
     LTRACEF("vaddr 0x%lx paddr 0x%lx count %u flags 0x%x\n", vaddr, paddr, count, flags);
@@ -522,6 +715,10 @@ int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count
     if (count == 0)
         return NO_ERROR;
 
+    /* don't let stale entries for a batched unmap shadow the new mapping */
+    if (aspace->unmap_batch_count)
+        arm64_tlb_batch_flush(&aspace->unmap_batch);
+
     int ret;
     if (aspace->flags & ARCH_ASPACE_FLAG_KERNEL) {
         ret = arm64_mmu_map(vaddr, paddr, count * PAGE_SIZE,
@@ -540,6 +737,14 @@ int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count
     return ret;
 }
 
+static void arm64_aspace_tlb_batch_init(arch_aspace_t *aspace, struct arm64_tlb_batch *batch)
+{
+    if (aspace->flags & ARCH_ASPACE_FLAG_KERNEL)
+        arm64_tlb_batch_init(batch, MMU_ARM64_GLOBAL_ASID);
+    else
+        arm64_tlb_batch_init(batch, MMU_ARM64_USER_ASID);
+}
+
 int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
 {
     LTRACEF("vaddr 0x%lx count %u\n", vaddr, count);
@@ -556,24 +761,49 @@ int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
     if (!IS_PAGE_ALIGNED(vaddr))
         return ERR_INVALID_ARGS;
 
+    struct arm64_tlb_batch local_batch;
+    struct arm64_tlb_batch *batch = &aspace->unmap_batch;
+    if (!aspace->unmap_batch_count) {
+        batch = &local_batch;
+        arm64_aspace_tlb_batch_init(aspace, batch);
+    }
+
     int ret;
     if (aspace->flags & ARCH_ASPACE_FLAG_KERNEL) {
-        ret = arm64_mmu_unmap(vaddr, count * PAGE_SIZE,
-                           ~0UL << MMU_KERNEL_SIZE_SHIFT, MMU_KERNEL_SIZE_SHIFT,
-                           MMU_KERNEL_TOP_SHIFT, MMU_KERNEL_PAGE_SIZE_SHIFT,
-                           aspace->tt_virt,
-                           MMU_ARM64_GLOBAL_ASID);
+        ret = arm64_mmu_unmap_batch(vaddr, count * PAGE_SIZE,
+                                    ~0UL << MMU_KERNEL_SIZE_SHIFT, MMU_KERNEL_SIZE_SHIFT,
+                                    MMU_KERNEL_TOP_SHIFT, MMU_KERNEL_PAGE_SIZE_SHIFT,
+                                    aspace->tt_virt, batch);
     } else {
-        ret = arm64_mmu_unmap(vaddr, count * PAGE_SIZE,
-                           0, MMU_USER_SIZE_SHIFT,
-                           MMU_USER_TOP_SHIFT, MMU_USER_PAGE_SIZE_SHIFT,
-                           aspace->tt_virt,
-                           MMU_ARM64_USER_ASID);
+        ret = arm64_mmu_unmap_batch(vaddr, count * PAGE_SIZE,
+                                    0, MMU_USER_SIZE_SHIFT,
+                                    MMU_USER_TOP_SHIFT, MMU_USER_PAGE_SIZE_SHIFT,
+                                    aspace->tt_virt, batch);
     }
 
+    if (batch == &local_batch)
+        arm64_tlb_batch_flush(batch);
+
     return ret;
 }
 
+void arch_mmu_unmap_begin(arch_aspace_t *aspace)
+{
+    DEBUG_ASSERT(aspace);
+
+    if (aspace->unmap_batch_count++ == 0)
+        arm64_aspace_tlb_batch_init(aspace, &aspace->unmap_batch);
+}
+
+void arch_mmu_unmap_end(arch_aspace_t *aspace)
+{
+    DEBUG_ASSERT(aspace);
+    DEBUG_ASSERT(aspace->unmap_batch_count > 0);
+
+    if (--aspace->unmap_batch_count == 0)
+        arm64_tlb_batch_flush(&aspace->unmap_batch);
+}
+
 status_t arch_mmu_init_aspace(arch_aspace_t *aspace, vaddr_t base, size_t size, uint flags)
 {
     LTRACEF("aspace %p, base 0x%lx, size 0x%zx, flags 0x%x\n", aspace, base, size, flags);
@@ -585,6 +815,7 @@ status_t arch_mmu_init_aspace(arch_aspace_t *aspace, vaddr_t base, size_t size,
     DEBUG_ASSERT(base + size - 1 > base);
 
     aspace->flags = flags;
+    aspace->unmap_batch_count = 0;
     if (flags & ARCH_ASPACE_FLAG_KERNEL) {
         /* at the moment we can only deal with address spaces as globally defined */
         DEBUG_ASSERT(base == ~0UL << MMU_KERNEL_SIZE_SHIFT);
@@ -624,6 +855,7 @@ status_t arch_mmu_destroy_aspace(arch_aspace_t *aspace)
 
     DEBUG_ASSERT(aspace);
     DEBUG_ASSERT((aspace->flags & ARCH_ASPACE_FLAG_KERNEL) == 0);
+    DEBUG_ASSERT(aspace->unmap_batch_count == 0);
 
     // XXX make sure it's not mapped
 
@@ -42,6 +42,11 @@ GLOBAL_DEFINES += \
 
 MODULE_SRCS += \
     $(LOCAL_DIR)/mp.c
+
+# per lock acquisition, contention and hold time statistics, see 'lockstats'
+ifeq ($(WITH_SPINLOCK_STATS),1)
+GLOBAL_DEFINES += SPINLOCK_STATS=1
+endif
 else
 GLOBAL_DEFINES += \
     SMP_MAX_CPUS=1
@@ -127,6 +127,7 @@ static platform_timer_callback t_callback;
 static int timer_irq;
 
 struct fp_32_64 cntpct_per_ms;
+struct fp_32_64 cntpct_per_us;
 struct fp_32_64 ms_per_cntpct;
 struct fp_32_64 us_per_cntpct;
 
@@ -135,6 +136,11 @@ static uint64_t lk_time_to_cntpct(lk_time_t lk_time)
     return u64_mul_u32_fp32_64(lk_time, cntpct_per_ms);
 }
 
+static uint64_t lk_bigtime_to_cntpct(lk_bigtime_t lk_bigtime)
+{
+    return u64_mul_u64_fp32_64(lk_bigtime, cntpct_per_us);
+}
+
 static lk_time_t cntpct_to_lk_time(uint64_t cntpct)
 {
     return u32_mul_u64_fp32_64(cntpct, ms_per_cntpct);
@@ -215,6 +221,22 @@ status_t platform_set_oneshot_timer(platform_timer_callback callback, void *arg,
     return 0;
 }
 
+status_t platform_set_oneshot_timer_hires(platform_timer_callback callback, void *arg, lk_bigtime_t interval)
+{
+    uint64_t cntpct_interval = lk_bigtime_to_cntpct(interval);
+
+    ASSERT(arg == NULL);
+
+    t_callback = callback;
+    if (cntpct_interval <= INT_MAX)
+        write_cntp_tval(cntpct_interval);
+    else
+        write_cntp_cval(read_cntpct() + cntpct_interval);
+    write_cntp_ctl(1);
+
+    return 0;
+}
+
 void platform_stop_timer(void)
 {
     write_cntp_ctl(0);
@@ -312,6 +334,7 @@ static void test_time_conversions(uint32_t cntfrq)
 static void arm_generic_timer_init_conversion_factors(uint32_t cntfrq)
 {
     fp_32_64_div_32_32(&cntpct_per_ms, cntfrq, 1000);
+    fp_32_64_div_32_32(&cntpct_per_us, cntfrq, 1000 * 1000);
     fp_32_64_div_32_32(&ms_per_cntpct, 1000, cntfrq);
     fp_32_64_div_32_32(&us_per_cntpct, 1000 * 1000, cntfrq);
     LTRACEF("cntpct_per_ms: %08x.%08x%08x\n", cntpct_per_ms.l0, cntpct_per_ms.l32, cntpct_per_ms.l64);
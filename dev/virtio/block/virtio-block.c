@@ -28,9 +28,12 @@
 #include <compiler.h>
 #include <list.h>
 #include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arch/ops.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
-#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
 #include <lib/bio.h>
 
@@ -46,6 +49,18 @@ struct virtio_blk_config {
         uint8_t sectors;
     } geometry;
     uint32_t blk_size;
+    struct virtio_blk_topology {
+        uint8_t physical_block_exp;
+        uint8_t alignment_offset;
+        uint16_t min_io_size;
+        uint32_t opt_io_size;
+    } topology;
+    uint8_t writeback;
+    uint8_t unused0;
+    uint16_t num_queues;
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_seg;
+    uint32_t discard_sector_alignment;
 } __PACKED;
 
 struct virtio_blk_req {
@@ -54,6 +69,12 @@ struct virtio_blk_req {
     uint64_t sector;
 } __PACKED;
 
+struct virtio_blk_discard_write_zeroes {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+} __PACKED;
+
 #define VIRTIO_BLK_F_BARRIER  (1<<0)
 #define VIRTIO_BLK_F_SIZE_MAX (1<<1)
 #define VIRTIO_BLK_F_SEG_MAX  (1<<2)
@@ -64,66 +85,134 @@ struct virtio_blk_req {
 #define VIRTIO_BLK_F_FLUSH    (1<<9)
 #define VIRTIO_BLK_F_TOPOLOGY (1<<10)
 #define VIRTIO_BLK_F_CONFIG_WCE (1<<11)
+#define VIRTIO_BLK_F_MQ       (1<<12)
+#define VIRTIO_BLK_F_DISCARD  (1<<13)
 
 #define VIRTIO_BLK_T_IN         0
 #define VIRTIO_BLK_T_OUT        1
 #define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_T_DISCARD    11
 
 #define VIRTIO_BLK_S_OK         0
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
 
+/* features we know how to use */
+#define VIRTIO_BLK_FEATURES (VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_FLUSH | \
+                             VIRTIO_BLK_F_MQ | VIRTIO_BLK_F_DISCARD | (1U << VIRTIO_RING_F_INDIRECT_DESC))
+
+#define VIRTIO_BLK_SECTOR_SIZE 512
+
+/* descriptors in each ring */
+#define VIRTIO_BLK_RING_SIZE 128
+
+/* requests in flight on each ring */
+#define VIRTIO_BLK_QUEUE_DEPTH 32
+
+/* data buffers that fit in a request's indirect table, more take descriptors from the ring */
+#define VIRTIO_BLK_MAX_SEGS 32
+
+/*
+ * The parts of a request the device reads and writes. Each one is allocated
+ * on its own power of two boundary no bigger than a page, so it's physically
+ * contiguous.
+ */
+struct virtio_blk_slot_dma {
+    struct vring_desc indirect[VIRTIO_BLK_MAX_SEGS + 2];
+    struct virtio_blk_req hdr;
+    struct virtio_blk_discard_write_zeroes discard;
+    uint8_t status;
+};
+
+#define VIRTIO_BLK_SLOT_DMA_SIZE 1024
+STATIC_ASSERT(sizeof(struct virtio_blk_slot_dma) <= VIRTIO_BLK_SLOT_DMA_SIZE);
+
+/* a request in flight */
+struct virtio_blk_slot {
+    struct list_node node;
+    bio_request_t *req;
+    struct virtio_blk_slot_dma *dma;
+    paddr_t dma_phys;
+};
+
+/* one virtqueue, with its own lock and set of slots */
+struct virtio_blk_queue {
+    uint ring;
+    spin_lock_t lock;
+
+    struct list_node free_slots;
+
+    /* requests waiting for enough free descriptors, oldest first */
+    struct list_node pending;
+
+    /* the slot that went out with each descriptor chain */
+    struct virtio_blk_slot *head_slot[VIRTIO_BLK_RING_SIZE];
+
+    /* scratch space for the data buffers of the request being started */
+    struct vring_desc segs[VIRTIO_BLK_RING_SIZE];
+};
+
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
 static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count);
 static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count);
+static void virtio_bdev_submit(struct bdev *bdev, bio_request_t *req);
 
 struct virtio_block_dev {
     struct virtio_device *dev;
 
-    mutex_t lock;
-    event_t io_event;
-
     /* bio block device */
     bdev_t bdev;
 
-    /* one blk_req structure for io, not crossing a page boundary */
-    struct virtio_blk_req *blk_req;
-    paddr_t blk_req_phys;
+    uint32_t features;
+    uint sectors_per_block;
+    uint max_segs;
+    uint32_t max_discard_sectors;
 
-    /* one uint8_t response word */
-    uint8_t blk_response;
-    paddr_t blk_response_phys;
+    uint num_queues;
+    struct virtio_blk_queue *queues;
+    struct virtio_blk_slot *slots;
 };
 
+static paddr_t virtio_blk_paddr(const void *ptr)
+{
+#if WITH_KERNEL_VM
+    return vaddr_to_paddr((void *)ptr);
+#else
+    return (paddr_t)(uintptr_t)ptr;
+#endif
+}
+
+static void dump_feature_bits(uint32_t feature)
+{
+    printf("virtio-block host features (0x%x):", feature);
+    if (feature & VIRTIO_BLK_F_BARRIER) printf(" BARRIER");
+    if (feature & VIRTIO_BLK_F_SIZE_MAX) printf(" SIZE_MAX");
+    if (feature & VIRTIO_BLK_F_SEG_MAX) printf(" SEG_MAX");
+    if (feature & VIRTIO_BLK_F_GEOMETRY) printf(" GEOMETRY");
+    if (feature & VIRTIO_BLK_F_RO) printf(" RO");
+    if (feature & VIRTIO_BLK_F_BLK_SIZE) printf(" BLK_SIZE");
+    if (feature & VIRTIO_BLK_F_SCSI) printf(" SCSI");
+    if (feature & VIRTIO_BLK_F_FLUSH) printf(" FLUSH");
+    if (feature & VIRTIO_BLK_F_TOPOLOGY) printf(" TOPOLOGY");
+    if (feature & VIRTIO_BLK_F_CONFIG_WCE) printf(" CONFIG_WCE");
+    if (feature & VIRTIO_BLK_F_MQ) printf(" MQ");
+    if (feature & VIRTIO_BLK_F_DISCARD) printf(" DISCARD");
+    if (feature & (1U << VIRTIO_RING_F_INDIRECT_DESC)) printf(" INDIRECT_DESC");
+    printf("\n");
+}
+
 status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
 {
     LTRACEF("dev %p, host_features 0x%x\n", dev, host_features);
 
     /* allocate a new block device */
-    struct virtio_block_dev *bdev = malloc(sizeof(struct virtio_block_dev));
+    struct virtio_block_dev *bdev = calloc(1, sizeof(struct virtio_block_dev));
     if (!bdev)
         return ERR_NO_MEMORY;
 
-    mutex_init(&bdev->lock);
-    event_init(&bdev->io_event, false, EVENT_FLAG_AUTOUNSIGNAL);
-
     bdev->dev = dev;
     dev->priv = bdev;
 
-    bdev->blk_req = memalign(sizeof(struct virtio_blk_req), sizeof(struct virtio_blk_req));
-#if WITH_KERNEL_VM
-    bdev->blk_req_phys = vaddr_to_paddr(bdev->blk_req);
-#else
-    bdev->blk_freq_phys = (uint64_t)(uintptr_t)bdev->blk_req;
-#endif
-    LTRACEF("blk_req structure at %p (0x%lx phys)\n", bdev->blk_req, bdev->blk_req_phys);
-
-#if WITH_KERNEL_VM
-    bdev->blk_response_phys = vaddr_to_paddr(&bdev->blk_response);
-#else
-    bdev->blk_response_phys = (uint64_t)(uintptr_t)&bdev->blk_response;
-#endif
-
     /* make sure the device is reset */
     virtio_reset_device(dev);
 
@@ -137,10 +226,57 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     /* ack and set the driver status bit */
     virtio_status_acknowledge_driver(dev);
 
-    // XXX check features bits and ack/nak them
+    /* take the features we can use */
+    bdev->features = host_features & VIRTIO_BLK_FEATURES;
+#if LOCAL_TRACE
+    dump_feature_bits(host_features);
+#endif
+    virtio_set_guest_features(dev, bdev->features);
+
+    size_t block_size = VIRTIO_BLK_SECTOR_SIZE;
+    if (bdev->features & VIRTIO_BLK_F_BLK_SIZE)
+        block_size = config->blk_size;
+    bdev->sectors_per_block = block_size / VIRTIO_BLK_SECTOR_SIZE;
+
+    bdev->max_segs = VIRTIO_BLK_RING_SIZE - 2;
+    if ((bdev->features & VIRTIO_BLK_F_SEG_MAX) && config->seg_max)
+        bdev->max_segs = MIN(bdev->max_segs, config->seg_max);
+
+    if (bdev->features & VIRTIO_BLK_F_DISCARD)
+        bdev->max_discard_sectors = config->max_discard_sectors;
+
+    bdev->num_queues = 1;
+    if (bdev->features & VIRTIO_BLK_F_MQ)
+        bdev->num_queues = MAX(MIN(MIN(config->num_queues, MAX_VIRTIO_RINGS), SMP_MAX_CPUS), 1);
+
+    /* a ring and a set of requests for each queue */
+    uint slot_count = bdev->num_queues * VIRTIO_BLK_QUEUE_DEPTH;
+    bdev->queues = calloc(bdev->num_queues, sizeof(struct virtio_blk_queue));
+    bdev->slots = calloc(slot_count, sizeof(struct virtio_blk_slot));
+    if (!bdev->queues || !bdev->slots)
+        goto nomem;
+
+    for (uint i = 0; i < bdev->num_queues; i++) {
+        struct virtio_blk_queue *q = &bdev->queues[i];
+
+        q->ring = i;
+        spin_lock_init(&q->lock);
+        list_initialize(&q->free_slots);
+        list_initialize(&q->pending);
+
+        for (uint j = 0; j < VIRTIO_BLK_QUEUE_DEPTH; j++) {
+            struct virtio_blk_slot *slot = &bdev->slots[i * VIRTIO_BLK_QUEUE_DEPTH + j];
+
+            slot->dma = memalign(VIRTIO_BLK_SLOT_DMA_SIZE, VIRTIO_BLK_SLOT_DMA_SIZE);
+            if (!slot->dma)
+                goto nomem;
+            slot->dma_phys = virtio_blk_paddr(slot->dma);
+            list_add_tail(&q->free_slots, &slot->node);
+        }
 
-    /* allocate a virtio ring */
-    virtio_alloc_ring(dev, 0, 256);
+        if (virtio_alloc_ring(dev, i, VIRTIO_BLK_RING_SIZE) < 0)
+            goto nomem;
+    }
 
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_block_irq_driver_callback;
@@ -153,26 +289,235 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     char buf[16];
     snprintf(buf, sizeof(buf), "virtio%u", found_index++);
     bio_initialize_bdev(&bdev->bdev, buf,
-                        config->blk_size, config->capacity,
+                        block_size, config->capacity / bdev->sectors_per_block,
                         0, NULL, BIO_FLAGS_NONE);
 
     /* override our block device hooks */
     bdev->bdev.read_block = &virtio_bdev_read_block;
     bdev->bdev.write_block = &virtio_bdev_write_block;
+    bdev->bdev.submit = &virtio_bdev_submit;
+    bdev->bdev.queue_depth = slot_count;
+    bdev->bdev.max_segments = bdev->max_segs;
 
     bio_register_device(&bdev->bdev);
 
-    printf("found virtio block device of size %lld\n", config->capacity * config->blk_size);
+    printf("found virtio block device of size %lld, %u queue%s%s\n",
+           config->capacity * VIRTIO_BLK_SECTOR_SIZE, bdev->num_queues,
+           (bdev->num_queues > 1) ? "s" : "",
+           (bdev->features & (1U << VIRTIO_RING_F_INDIRECT_DESC)) ? ", indirect descriptors" : "");
+
+    return NO_ERROR;
+
+nomem:
+    /* the device may already know about some of the rings, so leave everything allocated */
+    dev->priv = NULL;
+    return ERR_NO_MEMORY;
+}
+
+/* fill in descriptors for the buffers of a chain of requests, merging ones that
+ * are physically contiguous. returns how many were needed or -1 if more than max */
+static int virtio_blk_build_segs(struct vring_desc *segs, uint max, const bio_request_t *req)
+{
+    uint16_t flags = (req->op == BIO_OP_READ) ? VRING_DESC_F_WRITE : 0;
+    uint n = 0;
+
+    for (const bio_request_t *r = req; r; r = r->next) {
+        for (uint i = 0; i < r->iov_count; i++) {
+            vaddr_t va = (vaddr_t)r->iov[i].base;
+            size_t len = r->iov[i].len;
+
+            while (len > 0) {
+#if WITH_KERNEL_VM
+                /* a page at a time */
+                size_t chunk = MIN(len, PAGE_SIZE - (va & (PAGE_SIZE - 1)));
+#else
+                size_t chunk = len;
+#endif
+                paddr_t pa = virtio_blk_paddr((void *)va);
+
+                if (n > 0 && segs[n - 1].addr + segs[n - 1].len == pa) {
+                    segs[n - 1].len += chunk;
+                } else {
+                    if (n == max)
+                        return -1;
+                    segs[n].addr = pa;
+                    segs[n].len = chunk;
+                    segs[n].flags = flags;
+                    n++;
+                }
+
+                va += chunk;
+                len -= chunk;
+            }
+        }
+    }
+
+    return n;
+}
+
+/* put a request on the ring, called with the queue lock held. returns
+ * ERR_NO_RESOURCES if it has to wait for descriptors to come free */
+static status_t virtio_blk_start(struct virtio_block_dev *bdev, struct virtio_blk_queue *q,
+                                 struct virtio_blk_slot *slot)
+{
+    bio_request_t *req = slot->req;
+    struct virtio_blk_slot_dma *dma = slot->dma;
+    struct vring_desc *segs = q->segs;
+    int nsegs = 0;
+
+    dma->hdr.ioprio = 0;
+    dma->hdr.sector = (uint64_t)req->block * bdev->sectors_per_block;
+    dma->status = VIRTIO_BLK_S_IOERR;
+
+    switch (req->op) {
+        case BIO_OP_READ:
+        case BIO_OP_WRITE:
+            dma->hdr.type = (req->op == BIO_OP_WRITE) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+            nsegs = virtio_blk_build_segs(segs, bdev->max_segs, req);
+            if (nsegs < 0)
+                return ERR_TOO_BIG;
+            break;
+        case BIO_OP_FLUSH:
+            dma->hdr.type = VIRTIO_BLK_T_FLUSH;
+            dma->hdr.sector = 0;
+            break;
+        case BIO_OP_DISCARD:
+            /* it's only a hint, so don't bother splitting up big ones */
+            dma->hdr.type = VIRTIO_BLK_T_DISCARD;
+            dma->hdr.sector = 0;
+            dma->discard.sector = (uint64_t)req->block * bdev->sectors_per_block;
+            dma->discard.num_sectors = MIN((uint64_t)req->total * bdev->sectors_per_block,
+                                           bdev->max_discard_sectors);
+            dma->discard.flags = 0;
+            segs[0].addr = slot->dma_phys + offsetof(struct virtio_blk_slot_dma, discard);
+            segs[0].len = sizeof(dma->discard);
+            segs[0].flags = 0;
+            nsegs = 1;
+            break;
+    }
+
+    uint16_t head;
+    struct vring_desc *desc;
+    if ((bdev->features & (1U << VIRTIO_RING_F_INDIRECT_DESC)) && nsegs <= VIRTIO_BLK_MAX_SEGS) {
+        /* a single descriptor on the ring pointing at the slot's table */
+        head = virtio_alloc_desc(bdev->dev, q->ring);
+        if (head == 0xffff)
+            return ERR_NO_RESOURCES;
+
+        struct vring_desc *table = dma->indirect;
+        table[0].addr = slot->dma_phys + offsetof(struct virtio_blk_slot_dma, hdr);
+        table[0].len = sizeof(struct virtio_blk_req);
+        table[0].flags = VRING_DESC_F_NEXT;
+        table[0].next = 1;
+        for (int i = 0; i < nsegs; i++) {
+            table[i + 1] = segs[i];
+            table[i + 1].flags |= VRING_DESC_F_NEXT;
+            table[i + 1].next = i + 2;
+        }
+        table[nsegs + 1].addr = slot->dma_phys + offsetof(struct virtio_blk_slot_dma, status);
+        table[nsegs + 1].len = 1;
+        table[nsegs + 1].flags = VRING_DESC_F_WRITE;
+        table[nsegs + 1].next = 0;
+
+        desc = virtio_desc_index_to_desc(bdev->dev, q->ring, head);
+        desc->addr = slot->dma_phys + offsetof(struct virtio_blk_slot_dma, indirect);
+        desc->len = (nsegs + 2) * sizeof(struct vring_desc);
+        desc->flags = VRING_DESC_F_INDIRECT;
+    } else {
+        /* header, buffers and status straight on the ring */
+        desc = virtio_alloc_desc_chain(bdev->dev, q->ring, nsegs + 2, &head);
+        if (!desc)
+            return ERR_NO_RESOURCES;
+
+        desc->addr = slot->dma_phys + offsetof(struct virtio_blk_slot_dma, hdr);
+        desc->len = sizeof(struct virtio_blk_req);
+        for (int i = 0; i < nsegs; i++) {
+            desc = virtio_desc_index_to_desc(bdev->dev, q->ring, desc->next);
+            desc->addr = segs[i].addr;
+            desc->len = segs[i].len;
+            desc->flags = segs[i].flags | VRING_DESC_F_NEXT;
+        }
+        desc = virtio_desc_index_to_desc(bdev->dev, q->ring, desc->next);
+        desc->addr = slot->dma_phys + offsetof(struct virtio_blk_slot_dma, status);
+        desc->len = 1;
+        desc->flags = VRING_DESC_F_WRITE;
+    }
+
+    LTRACEF("req %p, type %u, sector %llu, segs %d, head %u\n", req, dma->hdr.type, dma->hdr.sector, nsegs, head);
+
+    // XXX not cache safe.
+    // At the moment only tested on arm qemu, which doesn't emulate cache.
+
+    q->head_slot[head] = slot;
+    virtio_submit_chain(bdev->dev, q->ring, head);
 
     return NO_ERROR;
 }
 
+static void virtio_bdev_submit(struct bdev *_bdev, bio_request_t *req)
+{
+    struct virtio_block_dev *bdev = containerof(_bdev, struct virtio_block_dev, bdev);
+    struct virtio_blk_queue *q = NULL;
+    struct virtio_blk_slot *slot = NULL;
+    spin_lock_saved_state_t state;
+    status_t err;
+
+    /* without a write cache there's nothing to flush, and discards are only a hint */
+    if ((req->op == BIO_OP_FLUSH && !(bdev->features & VIRTIO_BLK_F_FLUSH)) ||
+            (req->op == BIO_OP_DISCARD && !(bdev->features & VIRTIO_BLK_F_DISCARD))) {
+        bio_request_complete(&bdev->bdev, req, NO_ERROR);
+        return;
+    }
+
+    /* start on this cpu's queue, but take a free slot anywhere */
+    uint first = arch_curr_cpu_num() % bdev->num_queues;
+    for (uint i = 0; i < bdev->num_queues; i++) {
+        q = &bdev->queues[(first + i) % bdev->num_queues];
+
+        spin_lock_irqsave(&q->lock, state);
+        slot = list_remove_head_type(&q->free_slots, struct virtio_blk_slot, node);
+        if (slot)
+            break;
+        spin_unlock_irqrestore(&q->lock, state);
+    }
+
+    /* lib/bio never hands us more requests than there are slots */
+    DEBUG_ASSERT(slot);
+
+    slot->req = req;
+
+    /* don't overtake requests already waiting for descriptors */
+    err = list_is_empty(&q->pending) ? virtio_blk_start(bdev, q, slot) : ERR_NO_RESOURCES;
+    if (err == NO_ERROR) {
+        virtio_kick(bdev->dev, q->ring);
+    } else if (err == ERR_NO_RESOURCES) {
+        list_add_tail(&q->pending, &slot->node);
+        err = NO_ERROR;
+    } else {
+        slot->req = NULL;
+        list_add_head(&q->free_slots, &slot->node);
+    }
+
+    spin_unlock_irqrestore(&q->lock, state);
+
+    if (err < 0)
+        bio_request_complete(&bdev->bdev, req, err);
+}
+
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e)
 {
     struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+    struct virtio_blk_queue *q = &bdev->queues[ring];
+    spin_lock_saved_state_t state;
 
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
+    spin_lock_irqsave(&q->lock, state);
+
+    struct virtio_blk_slot *slot = q->head_slot[e->id];
+    DEBUG_ASSERT(slot);
+    q->head_slot[e->id] = NULL;
+
     /* parse our descriptor chain, add back to the free queue */
     uint16_t i = e->id;
     for (;;) {
@@ -195,119 +540,115 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
         i = next;
     }
 
-    /* signal our event */
-    event_signal(&bdev->io_event, false);
+    bio_request_t *req = slot->req;
+    uint8_t status = slot->dma->status;
+    slot->req = NULL;
+    list_add_head(&q->free_slots, &slot->node);
 
-    return INT_RESCHEDULE;
-}
+    /* descriptors came free, start whatever was waiting on them */
+    bool kick = false;
+    while ((slot = list_peek_head_type(&q->pending, struct virtio_blk_slot, node))) {
+        status_t err = virtio_blk_start(bdev, q, slot);
+        if (err == ERR_NO_RESOURCES)
+            break;
 
-ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write)
-{
-    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+        /* anything else wrong with it would have been caught when it was submitted */
+        DEBUG_ASSERT(err == NO_ERROR);
+        list_delete(&slot->node);
+        kick = true;
+    }
+    if (kick)
+        virtio_kick(dev, ring);
 
-    uint16_t i;
-    struct vring_desc *desc;
-    paddr_t pa;
-    vaddr_t va = (vaddr_t)buf;
+    spin_unlock_irqrestore(&q->lock, state);
 
-    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+    LTRACEF("req %p, status 0x%hhx\n", req, status);
 
-    mutex_acquire(&bdev->lock);
+    status_t err;
+    switch (status) {
+        case VIRTIO_BLK_S_OK:
+            err = NO_ERROR;
+            break;
+        case VIRTIO_BLK_S_UNSUPP:
+            err = ERR_NOT_SUPPORTED;
+            break;
+        default:
+            err = ERR_IO;
+            break;
+    }
+    bio_request_complete(&bdev->bdev, req, err);
 
-    /* set up the request */
-    bdev->blk_req->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    bdev->blk_req->ioprio = 0;
-    bdev->blk_req->sector = offset / 512;
-    LTRACEF("blk_req type %u ioprio %u sector %llu\n",
-            bdev->blk_req->type, bdev->blk_req->ioprio, bdev->blk_req->sector);
+    return INT_RESCHEDULE;
+}
 
-    /* put together a transfer */
-    desc = virtio_alloc_desc_chain(dev, 0, 3, &i);
-    LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
+/* do a transfer through the request queue and wait for it */
+static ssize_t virtio_block_transfer_one(struct virtio_block_dev *bdev, void *buf, bnum_t block, uint count, bool write)
+{
+    event_t event;
+    bio_iovec_t iov = {
+        .base = buf,
+        .len = (size_t)count * bdev->bdev.block_size,
+    };
+    bio_request_t req = {
+        .op = write ? BIO_OP_WRITE : BIO_OP_READ,
+        .block = block,
+        .count = count,
+        .iov = &iov,
+        .iov_count = 1,
+        .event = &event,
+    };
+
+    event_init(&event, false, 0);
+
+    ssize_t err = bio_submit(&bdev->bdev, &req);
+    if (err == NO_ERROR) {
+        event_wait(&event);
+        err = req.result;
+    }
 
-    // XXX not cache safe.
-    // At the moment only tested on arm qemu, which doesn't emulate cache.
+    event_destroy(&event);
 
-    /* set up the descriptor pointing to the head */
-    desc->addr = bdev->blk_req_phys;
-    desc->len = sizeof(struct virtio_blk_req);
-    desc->flags |= VRING_DESC_F_NEXT;
+    return err;
+}
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
+/* split a transfer into pieces that fit in max_segs segments, wherever the buffer's pages are */
+static ssize_t virtio_block_transfer(struct virtio_block_dev *bdev, void *buf, bnum_t block, uint count, bool write)
+{
 #if WITH_KERNEL_VM
-    /* translate the first buffer */
-    pa = vaddr_to_paddr((void *)va);
-    desc->addr = (uint64_t)pa;
-    /* desc->len is filled in below */
+    size_t max_len = (bdev->max_segs > 1) ? (bdev->max_segs - 1) * PAGE_SIZE : 0;
+    uint max_count = MAX(max_len >> bdev->bdev.block_shift, 1U);
 #else
-    desc->addr = (uint64_t)(uintptr_t)buf;
-    desc->len = len;
+    uint max_count = count;
 #endif
-    desc->flags |= write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-    desc->flags |= VRING_DESC_F_NEXT;
-
-#if WITH_KERNEL_VM
-    /* see if we need to add more descriptors due to scatter gather */
-    paddr_t next_pa = PAGE_ALIGN(pa + 1);
-    desc->len = MIN(next_pa - pa, len);
-    LTRACEF("first descriptor va 0x%lx desc->addr 0x%llx desc->len %u\n", va, desc->addr, desc->len);
-    len -= desc->len;
-    while (len > 0) {
-        /* amount of source buffer handled by this iteration of the loop */
-        size_t len_tohandle = MIN(len, PAGE_SIZE);
-
-        /* translate the next page in the buffer */
-        va = PAGE_ALIGN(va + 1);
-        pa = vaddr_to_paddr((void *)va);
-        LTRACEF("va now 0x%lx, pa 0x%lx, next_pa 0x%lx, remaining len %zu\n", va, pa, next_pa, len);
-
-        /* is the new translated physical address contiguous to the last one? */
-        if (next_pa == pa) {
-            LTRACEF("extending last one by %zu bytes\n", len_tohandle);
-            desc->len += len_tohandle;
-        } else {
-            uint16_t next_i = virtio_alloc_desc(dev, 0);
-            struct vring_desc *next_desc = virtio_desc_index_to_desc(dev, 0, next_i);
-            DEBUG_ASSERT(next_desc);
+    ssize_t total = 0;
 
-            LTRACEF("doesn't extend, need new desc, allocated desc %i (%p)\n", next_i, next_desc);
+    while (count > 0) {
+        uint n = MIN(count, max_count);
 
-            /* fill this descriptor in and put it after the last one but before the response descriptor */
-            next_desc->addr = (uint64_t)pa;
-            next_desc->len = len_tohandle;
-            next_desc->flags = write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-            next_desc->flags |= VRING_DESC_F_NEXT;
-            next_desc->next = desc->next;
-            desc->next = next_i;
+        ssize_t err = virtio_block_transfer_one(bdev, buf, block, n, write);
+        if (err < 0)
+            return err;
 
-            desc = next_desc;
-        }
-        len -= len_tohandle;
-        next_pa += PAGE_SIZE;
+        total += err;
+        buf = (uint8_t *)buf + err;
+        block += n;
+        count -= n;
     }
-#endif
 
-    /* set up the descriptor pointing to the response */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-    desc->addr = bdev->blk_response_phys;
-    desc->len = 1;
-    desc->flags = VRING_DESC_F_WRITE;
-
-    /* submit the transfer */
-    virtio_submit_chain(dev, 0, i);
-
-    /* kick it off */
-    virtio_kick(dev, 0);
+    return total;
+}
 
-    /* wait for the transfer to complete */
-    event_wait(&bdev->io_event);
+ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write)
+{
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
 
-    LTRACEF("status 0x%hhx\n", bdev->blk_response);
+    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
 
-    mutex_release(&bdev->lock);
+    if ((offset | len) & (bdev->bdev.block_size - 1))
+        return ERR_INVALID_ARGS;
 
-    return len;
+    return virtio_block_transfer(bdev, buf, offset >> bdev->bdev.block_shift,
+                                 len >> bdev->bdev.block_shift, write);
 }
 
 static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
@@ -316,12 +657,7 @@ static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block
 
     LTRACEF("dev %p, buf %p, block 0x%x, count %u\n", bdev, buf, block, count);
 
-    if (virtio_block_read_write(dev->dev, buf, (off_t)block * dev->bdev.block_size,
-                                count * dev->bdev.block_size, false) == 0) {
-        return count * dev->bdev.block_size;
-    } else {
-        return ERR_IO;
-    }
+    return virtio_block_transfer(dev, buf, block, count, false);
 }
 
 static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count)
@@ -330,11 +666,5 @@ static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_
 
     LTRACEF("dev %p, buf %p, block 0x%x, count %u\n", bdev, buf, block, count);
 
-    if (virtio_block_read_write(dev->dev, (void *)buf, (off_t)block * dev->bdev.block_size,
-                                count * dev->bdev.block_size, true) == 0) {
-        return count * dev->bdev.block_size;
-    } else {
-        return ERR_IO;
-    }
+    return virtio_block_transfer(dev, (void *)buf, block, count, true);
 }
-
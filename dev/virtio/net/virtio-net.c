@@ -151,7 +151,7 @@ status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features)
     dev->priv = ndev;
     ndev->started = false;
 
-    ndev->lock = SPIN_LOCK_INITIAL_VALUE;
+    spin_lock_init(&ndev->lock);
     event_init(&ndev->rx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
     list_initialize(&ndev->completed_rx_queue);
 
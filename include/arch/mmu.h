@@ -56,6 +56,13 @@ int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count
 int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count) __NONNULL((1));
 status_t arch_mmu_query(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t *paddr, uint *flags) __NONNULL((1));
 
+/* Unmaps of the aspace between these two calls may hold back their TLB
+ * maintenance and page table frees until arch_mmu_unmap_end(). Calls nest.
+ * Default implementations do nothing.
+ */
+void arch_mmu_unmap_begin(arch_aspace_t *aspace) __NONNULL((1));
+void arch_mmu_unmap_end(arch_aspace_t *aspace) __NONNULL((1));
+
 vaddr_t arch_mmu_pick_spot(arch_aspace_t *aspace,
                            vaddr_t base, uint prev_region_arch_mmu_flags,
                            vaddr_t end,  uint next_region_arch_mmu_flags,
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2026 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+
+/*
+ * Portable ticket spinlock for architectures without a hand written one.
+ *
+ * The lock word holds two 16 bit counters: the low half is the ticket
+ * currently being served, the high half the next ticket to hand out.
+ * A locker atomically takes the next ticket and spins until it is served,
+ * so contending cpus acquire the lock in FIFO order. The lock is free when
+ * both halves are equal, which makes 0 the unlocked initial value.
+ *
+ * An architecture may define ARCH_TICKET_SPIN_WAIT() to a low power wait
+ * (e.g. wfe) and ARCH_TICKET_SPIN_WAKE() to the matching wake up before
+ * including this file.
+ */
+
+#define TICKET_SPIN_LOCK_SHIFT      16
+#define TICKET_SPIN_LOCK_MASK       0xffffUL
+
+/* lock word value for a lock that starts out held by the first owner */
+#define TICKET_SPIN_LOCK_LOCKED     (1UL << TICKET_SPIN_LOCK_SHIFT)
+
+#ifndef ARCH_TICKET_SPIN_WAIT
+#define ARCH_TICKET_SPIN_WAIT()     do { } while (0)
+#endif
+#ifndef ARCH_TICKET_SPIN_WAKE
+#define ARCH_TICKET_SPIN_WAKE()     do { } while (0)
+#endif
+
+static inline unsigned long ticket_spin_owner(unsigned long val)
+{
+    return val & TICKET_SPIN_LOCK_MASK;
+}
+
+static inline unsigned long ticket_spin_next(unsigned long val)
+{
+    return (val >> TICKET_SPIN_LOCK_SHIFT) & TICKET_SPIN_LOCK_MASK;
+}
+
+static inline bool ticket_spin_lock_held(unsigned long *lock)
+{
+    unsigned long val = __atomic_load_n(lock, __ATOMIC_RELAXED);
+
+    return ticket_spin_owner(val) != ticket_spin_next(val);
+}
+
+static inline void ticket_spin_lock(unsigned long *lock)
+{
+    unsigned long val = __atomic_fetch_add(lock, 1UL << TICKET_SPIN_LOCK_SHIFT,
+                                           __ATOMIC_ACQUIRE);
+    unsigned long ticket = ticket_spin_next(val);
+
+    while (ticket_spin_owner(val) != ticket) {
+        ARCH_TICKET_SPIN_WAIT();
+        val = __atomic_load_n(lock, __ATOMIC_ACQUIRE);
+    }
+}
+
+/* Returns 0 on success, non-0 if the lock is held */
+static inline int ticket_spin_trylock(unsigned long *lock)
+{
+    unsigned long val = __atomic_load_n(lock, __ATOMIC_RELAXED);
+
+    if (ticket_spin_owner(val) != ticket_spin_next(val))
+        return 1;
+
+    if (!__atomic_compare_exchange_n(lock, &val, val + (1UL << TICKET_SPIN_LOCK_SHIFT),
+                                     false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 1;
+
+    return 0;
+}
+
+static inline void ticket_spin_unlock(unsigned long *lock)
+{
+    unsigned long val = __atomic_load_n(lock, __ATOMIC_RELAXED);
+    unsigned long newval;
+
+    /* only the owner half is ours, lockers may be bumping the next half
+     * concurrently, so serve the next ticket without carrying into it */
+    do {
+        newval = (val & ~TICKET_SPIN_LOCK_MASK) |
+                 ((val + 1) & TICKET_SPIN_LOCK_MASK);
+    } while (!__atomic_compare_exchange_n(lock, &val, newval,
+                                          true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    ARCH_TICKET_SPIN_WAKE();
+}
@@ -38,8 +38,28 @@ enum {
     KERNEL_EVLOG_TIMER_CALL,
     KERNEL_EVLOG_IRQ_ENTER,
     KERNEL_EVLOG_IRQ_EXIT,
+    KERNEL_EVLOG_SCHED_LATENCY,
 };
 
+enum {
+    KEVLOG_LATENCY_WAKEUP = 0,
+    KEVLOG_LATENCY_QUEUE,
+};
+
+#if THREAD_LATENCY_STATS
+struct latency_histogram;
+
+/* a scheduling latency histogram exported with KEVLOG_SCHED_LATENCY() */
+struct kevlog_sched_latency {
+    const char *name; /* thread name, or "cpu" for the per-cpu histograms */
+    uintptr_t id; /* thread pointer or cpu number */
+    uint8_t kind; /* KEVLOG_LATENCY_* */
+    const struct latency_histogram *hist;
+};
+
+void latency_histogram_dump(const struct latency_histogram *h, const char *title);
+#endif
+
 #if WITH_KERNEL_TRACEPOINT
 
 void kernel_evlog_init(void);
@@ -50,6 +70,7 @@ void kernel_evlog_init(void);
 #define KEVLOG_TIMER_CALL(ptr, arg)
 #define KEVLOG_IRQ_ENTER(irqn) lk_trace_subsys_kernel_ev(KERNEL_EVLOG_IRQ_ENTER, (uintptr_t)irqn, 0)
 #define KEVLOG_IRQ_EXIT(irqn) lk_trace_subsys_kernel_ev(KERNEL_EVLOG_IRQ_EXIT, (uintptr_t)irqn, 0)
+#define KEVLOG_SCHED_LATENCY(src) lk_trace_subsys_kernel_ev(KERNEL_EVLOG_SCHED_LATENCY, (uintptr_t)src, 0)
 
 # else
 
@@ -82,6 +103,8 @@ static inline void kernel_evlog_dump(void) {}
 #define KEVLOG_TIMER_CALL(ptr, arg) kernel_evlog_add(KERNEL_EVLOG_TIMER_CALL, (uintptr_t)ptr, (uintptr_t)arg)
 #define KEVLOG_IRQ_ENTER(irqn) kernel_evlog_add(KERNEL_EVLOG_IRQ_ENTER, (uintptr_t)irqn, 0)
 #define KEVLOG_IRQ_EXIT(irqn) kernel_evlog_add(KERNEL_EVLOG_IRQ_EXIT, (uintptr_t)irqn, 0)
+/* histograms do not fit the event log, only exported to the tracelog */
+#define KEVLOG_SCHED_LATENCY(src) ((void)(src))
 
 __END_CDECLS;
 
@@ -35,6 +35,14 @@ typedef uint32_t mp_cpu_mask_t;
 
 #define MP_CPU_ALL_BUT_LOCAL (UINT32_MAX)
 
+/* every cpu the kernel was built for */
+#define MP_CPU_ALL ((mp_cpu_mask_t)((1ULL << SMP_MAX_CPUS) - 1))
+
+/* cpus kept out of general scheduling from boot, see mp_set_isolated_cpus() */
+#ifndef SMP_ISOLATED_CPUS
+#define SMP_ISOLATED_CPUS 0
+#endif
+
 /* by default, mp_mbx_reschedule does not signal to cpus that are running realtime
  * threads. Override this behavior.
  */
@@ -64,6 +72,9 @@ struct mp_state {
     /* only safely accessible with thread lock held */
     mp_cpu_mask_t idle_cpus;
     mp_cpu_mask_t realtime_cpus;
+
+    /* only run threads whose affinity explicitly includes them */
+    mp_cpu_mask_t isolated_cpus;
 };
 
 extern struct mp_state mp;
@@ -108,6 +119,35 @@ static inline mp_cpu_mask_t mp_get_realtime_mask(void)
 {
     return mp.realtime_cpus;
 }
+
+static inline int mp_is_cpu_isolated(uint cpu)
+{
+    return mp.isolated_cpus & (1U << cpu);
+}
+
+static inline mp_cpu_mask_t mp_get_isolated_mask(void)
+{
+    return mp.isolated_cpus;
+}
+
+/* affinity of new threads: every cpu but the isolated ones */
+static inline mp_cpu_mask_t mp_get_default_affinity(void)
+{
+    mp_cpu_mask_t mask = MP_CPU_ALL & ~mp.isolated_cpus;
+
+    return mask ? mask : MP_CPU_ALL;
+}
+
+/* Isolate cpus from general scheduling: threads created afterwards get an
+ * affinity without them, and so do the timers those threads arm since a timer
+ * fires on the cpu that set it. Dpcs queued on an isolated cpu run on a
+ * housekeeping cpu. Meant to be called at boot, from platform or target early
+ * init, before the housekeeping threads are created. Defaults to
+ * SMP_ISOLATED_CPUS. */
+static inline void mp_set_isolated_cpus(mp_cpu_mask_t mask)
+{
+    mp.isolated_cpus = mask & MP_CPU_ALL;
+}
 #else
 static inline void mp_init(void) {}
 static inline void mp_reschedule(mp_cpu_mask_t target, uint flags) {}
@@ -129,6 +169,11 @@ static inline void mp_set_cpu_realtime(uint cpu) {}
 static inline void mp_set_cpu_non_realtime(uint cpu) {}
 
 static inline mp_cpu_mask_t mp_get_realtime_mask(void) { return 0; }
+
+static inline int mp_is_cpu_isolated(uint cpu) { return 0; }
+static inline mp_cpu_mask_t mp_get_isolated_mask(void) { return 0; }
+static inline mp_cpu_mask_t mp_get_default_affinity(void) { return 1; }
+static inline void mp_set_isolated_cpus(mp_cpu_mask_t mask) {}
 #endif
 
 __END_CDECLS;
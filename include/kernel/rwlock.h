@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2026 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __KERNEL_RWLOCK_H
+#define __KERNEL_RWLOCK_H
+
+#include <compiler.h>
+#include <kernel/thread.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS;
+
+#define RWLOCK_MAGIC (0x72776c6b)  // "rwlk"
+
+/* Blocking reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, a writer holds it alone.
+ * The lock is writer-preferring: once a writer is waiting, new readers block
+ * behind it, so a steady stream of readers cannot starve writers.
+ */
+typedef struct rwlock {
+    uint32_t magic;
+    int readers;            /* number of readers holding the lock */
+    int writers_waiting;    /* number of writers blocked in write_wait */
+    thread_t *writer;       /* writer holding the lock, if any */
+    wait_queue_t read_wait;
+    wait_queue_t write_wait;
+} rwlock_t;
+
+#define RWLOCK_INITIAL_VALUE(rw) \
+{ \
+    .magic = RWLOCK_MAGIC, \
+    .readers = 0, \
+    .writers_waiting = 0, \
+    .writer = NULL, \
+    .read_wait = WAIT_QUEUE_INITIAL_VALUE((rw).read_wait), \
+    .write_wait = WAIT_QUEUE_INITIAL_VALUE((rw).write_wait), \
+}
+
+/* Rules for rwlocks:
+ * - rwlocks are only safe to use from thread context.
+ * - rwlocks are non-recursive, a reader may not upgrade to a writer.
+ */
+
+void rwlock_init(rwlock_t *rw);
+void rwlock_destroy(rwlock_t *rw);
+status_t rwlock_read_acquire_timeout(rwlock_t *rw, lk_time_t timeout);
+status_t rwlock_read_release(rwlock_t *rw);
+status_t rwlock_write_acquire_timeout(rwlock_t *rw, lk_time_t timeout);
+status_t rwlock_write_release(rwlock_t *rw);
+
+static inline status_t rwlock_read_acquire(rwlock_t *rw)
+{
+    return rwlock_read_acquire_timeout(rw, INFINITE_TIME);
+}
+
+static inline status_t rwlock_write_acquire(rwlock_t *rw)
+{
+    return rwlock_write_acquire_timeout(rw, INFINITE_TIME);
+}
+
+/* does the current thread hold the lock for writing? */
+static inline bool is_rwlock_write_held(rwlock_t *rw)
+{
+    return rw->writer == get_current_thread();
+}
+
+__END_CDECLS;
+
+#endif
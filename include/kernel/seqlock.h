@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2026 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __KERNEL_SEQLOCK_H
+#define __KERNEL_SEQLOCK_H
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <kernel/spinlock.h>
+
+__BEGIN_CDECLS;
+
+/* Sequence lock.
+ *
+ * For small, frequently read data (time bases, counter snapshots) that
+ * readers must not block on. Writers serialize on a spinlock with interrupts
+ * disabled and bump the sequence count before and after the update, so it is
+ * odd while a write is in progress. Readers never write shared state, they
+ * copy the data and retry if the sequence changed underneath them:
+ *
+ *     uint32_t seq;
+ *     do {
+ *         seq = seqlock_read_begin(&sl);
+ *         copy = data;
+ *     } while (seqlock_read_retry(&sl, seq));
+ *
+ * Readers may run in interrupt context. The protected data must not contain
+ * pointers the reader dereferences, since it may observe a torn copy before
+ * retrying.
+ */
+typedef struct seqlock {
+    uint32_t seq;
+    spin_lock_t lock;
+} seqlock_t;
+
+#define SEQLOCK_INITIAL_VALUE(sl) \
+{ \
+    .seq = 0, \
+    .lock = SPIN_LOCK_INITIAL_VALUE, \
+}
+
+static inline void seqlock_init(seqlock_t *sl)
+{
+    sl->seq = 0;
+    spin_lock_init(&sl->lock);
+}
+
+static inline uint32_t seqlock_read_begin(const seqlock_t *sl)
+{
+    uint32_t seq;
+
+    /* wait out a writer in progress */
+    while ((seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE)) & 1)
+        ;
+
+    return seq;
+}
+
+/* returns true if the data read since seqlock_read_begin() may be torn */
+static inline bool seqlock_read_retry(const seqlock_t *sl, uint32_t seq)
+{
+    /* order the data loads before the sequence recheck */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&sl->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void seqlock_write_begin(seqlock_t *sl, spin_lock_saved_state_t *statep)
+{
+    spin_lock_irqsave(&sl->lock, *statep);
+
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELAXED);
+    /* the odd count must be visible before any of the data stores */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqlock_write_end(seqlock_t *sl, spin_lock_saved_state_t state)
+{
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELEASE);
+
+    spin_unlock_irqrestore(&sl->lock, state);
+}
+
+__END_CDECLS;
+
+#endif
@@ -31,6 +31,8 @@
 #include <arch/thread.h>
 #include <kernel/wait.h>
 #include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <kernel/cpu.h>
 #include <debug.h>
 
 #if WITH_KERNEL_VM
@@ -85,6 +87,45 @@ enum thread_tls_list {
 
 #define THREAD_LINEBUFFER_LENGTH 128
 
+#if THREAD_LATENCY_STATS
+/* log2 histogram of scheduling latencies in us. Bucket 0 counts latencies
+ * under 1us, bucket n those in [2^(n-1), 2^n) us and the last bucket
+ * everything above. */
+#define LATENCY_HIST_BUCKETS 24
+
+struct latency_histogram {
+    uint32_t buckets[LATENCY_HIST_BUCKETS];
+    uint32_t count;
+    lk_bigtime_t total;
+    lk_bigtime_t max;
+};
+#endif
+
+#if KERNEL_EDF
+/* earliest deadline first scheduling state, see thread_set_deadline() */
+struct thread_edf {
+    /* parameters, all in us. period is 0 if the thread is not in the edf class */
+    lk_bigtime_t runtime;
+    lk_bigtime_t deadline;
+    lk_bigtime_t period;
+    uint32_t utilization; /* runtime / period in parts per million */
+    bool auto_pinned; /* pinned by admission control, unpinned on exit from the class */
+
+    /* current job */
+    lk_bigtime_t release;
+    lk_bigtime_t abs_deadline;
+    lk_bigtime_t job_runtime_base; /* thread runtime when the job started */
+    bool throttled; /* budget exhausted, runs at its base priority until the next period */
+    bool waiting; /* sleeping in thread_wait_next_period() */
+    timer_t period_timer;
+
+    /* statistics */
+    ulong jobs;
+    ulong deadline_misses;
+    ulong budget_overruns;
+};
+#endif
+
 typedef struct thread {
     int magic;
     struct list_node thread_list_node;
@@ -98,6 +139,10 @@ typedef struct thread {
 #if WITH_SMP
     int curr_cpu;
     int pinned_cpu; /* only run on pinned_cpu if >= 0 */
+    int last_cpu; /* cpu it last ran on, used as a placement hint */
+    cpu_mask_t affinity; /* cpus it may run on unless pinned, see thread_set_affinity() */
+    int rq_cpu; /* run queue it sits on while ready */
+    cpu_mask_t rq_mask; /* other cpus allowed to steal it from there */
 #endif
 #if WITH_KERNEL_VM
     vmm_aspace_t *aspace;
@@ -110,6 +155,19 @@ typedef struct thread {
      * left the scheduler. */
     lk_bigtime_t runtime_us;
 
+#if KERNEL_EDF
+    /* earliest deadline first class */
+    struct thread_edf edf;
+#endif
+
+#if THREAD_LATENCY_STATS
+    /* scheduling latency accounting */
+    lk_bigtime_t ready_time; /* when the thread last became ready, 0 once running */
+    bool woken; /* became ready through a wakeup rather than a preemption */
+    struct latency_histogram wakeup_latency; /* wakeup to running */
+    struct latency_histogram queue_latency; /* ready to running, for any reason */
+#endif
+
     /* if blocked, a pointer to the wait queue */
     struct wait_queue *blocking_wait_queue;
     status_t wait_queue_block_ret;
@@ -145,12 +203,20 @@ typedef struct thread {
 #define thread_curr_cpu(t) ((t)->curr_cpu)
 #define thread_pinned_cpu(t) ((t)->pinned_cpu)
 #define thread_set_curr_cpu(t,c) ((t)->curr_cpu = (c))
-#define thread_set_pinned_cpu(t, c) ((t)->pinned_cpu = (c))
+void thread_set_pinned_cpu(thread_t *t, int cpu);
+#define thread_last_cpu(t) ((t)->last_cpu)
+#define thread_set_last_cpu(t, c) ((t)->last_cpu = (c))
+#define thread_affinity(t) ((t)->affinity)
+#define thread_set_affinity_mask(t, m) ((t)->affinity = (m))
 #else
 #define thread_curr_cpu(t) (0)
 #define thread_pinned_cpu(t) (-1)
 #define thread_set_curr_cpu(t,c) do {} while(0)
 #define thread_set_pinned_cpu(t, c) do {} while(0)
+#define thread_last_cpu(t) (0)
+#define thread_set_last_cpu(t, c) do {} while(0)
+#define thread_affinity(t) ((cpu_mask_t)1)
+#define thread_set_affinity_mask(t, m) do {} while(0)
 #endif
 
 /* thread priority */
@@ -183,13 +249,22 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 status_t thread_resume(thread_t *);
 void thread_exit(int retcode) __NO_RETURN;
 void thread_sleep(lk_time_t delay);
+void thread_sleep_hires(lk_bigtime_t delay);
 status_t thread_detach(thread_t *t);
 status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout);
 status_t thread_detach_and_resume(thread_t *t);
 status_t thread_set_real_time(thread_t *t);
+status_t thread_set_affinity(thread_t *t, cpu_mask_t mask);
+#if KERNEL_EDF
+status_t thread_set_deadline(thread_t *t, lk_bigtime_t runtime, lk_bigtime_t deadline, lk_bigtime_t period);
+status_t thread_wait_next_period(void);
+#endif
 
 void dump_thread(thread_t *t);
 void arch_dump_thread(thread_t *t);
+#if THREAD_LATENCY_STATS
+void dump_all_thread_latencies(bool trace, bool reset);
+#endif
 void dump_all_threads(void);
 
 /* scheduler routines */
@@ -251,14 +326,28 @@ struct thread_stats {
     ulong interrupts; /* platform code increment this */
     ulong timer_ints; /* timer code increment this */
     ulong timers; /* timer code increment this */
+    ulong tick_stops; /* times the preemption tick went quiet, see thread_resched */
 
 #if WITH_SMP
     ulong reschedule_ipis;
+    ulong steals; /* threads pulled from another cpu's run queue */
+#endif
+#if KERNEL_EDF
+    ulong deadline_misses; /* edf jobs completed past their deadline */
+    ulong budget_overruns; /* edf jobs throttled for exceeding their runtime */
+#endif
+
+#if THREAD_LATENCY_STATS
+    struct latency_histogram wakeup_latency; /* of the threads woken up on this cpu */
+    struct latency_histogram queue_latency;
 #endif
 };
 
 extern struct thread_stats thread_stats[SMP_MAX_CPUS];
 
+/* idle time of a cpu including the idle period in progress, in us */
+lk_bigtime_t thread_stats_idle_time(uint cpu);
+
 #define THREAD_STATS_INC(name) do { thread_stats[arch_curr_cpu_num()].name++; } while(0)
 
 #else
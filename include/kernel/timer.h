@@ -25,6 +25,7 @@
 
 #include <compiler.h>
 #include <list.h>
+#include <stdbool.h>
 #include <sys/types.h>
 
 __BEGIN_CDECLS;
@@ -38,10 +39,17 @@ typedef enum handler_return (*timer_callback)(struct timer *, lk_time_t now, voi
 
 typedef struct timer {
     int magic;
-    struct list_node node;
 
-    lk_time_t scheduled_time;
-    lk_time_t periodic_time;
+    /* per cpu timer heap linkage, only valid while queued */
+    struct timer *heap_child;
+    struct timer *heap_next;
+    struct timer *heap_prev; /* parent if first child, else previous sibling */
+    bool queued;
+    uint queued_cpu;
+
+    /* absolute deadline and period, in microseconds */
+    lk_bigtime_t scheduled_time;
+    lk_bigtime_t periodic_time;
 
     timer_callback callback;
     void *arg;
@@ -50,7 +58,11 @@ typedef struct timer {
 #define TIMER_INITIAL_VALUE(t) \
 { \
     .magic = TIMER_MAGIC, \
-    .node = LIST_INITIAL_CLEARED_VALUE, \
+    .heap_child = NULL, \
+    .heap_next = NULL, \
+    .heap_prev = NULL, \
+    .queued = false, \
+    .queued_cpu = 0, \
     .scheduled_time = 0, \
     .periodic_time = 0, \
     .callback = NULL, \
@@ -61,13 +73,23 @@ typedef struct timer {
  * - Timer callbacks occur from interrupt context
  * - Timers may be programmed or canceled from interrupt or thread context
  * - Timers may be canceled or reprogrammed from within their callback
- * - Timers currently are dispatched from a 10ms periodic tick
+ * - Timers are dispatched from a oneshot hardware timer programmed for the
+ *   earliest deadline on platforms with PLATFORM_HAS_DYNAMIC_TIMER, from a 10ms
+ *   periodic tick otherwise
+ * - The _hires variants take microseconds, the others milliseconds
 */
 void timer_initialize(timer_t *);
 void timer_set_oneshot(timer_t *, lk_time_t delay, timer_callback, void *arg);
 void timer_set_periodic(timer_t *, lk_time_t period, timer_callback, void *arg);
+void timer_set_oneshot_hires(timer_t *, lk_bigtime_t delay, timer_callback, void *arg);
+void timer_set_periodic_hires(timer_t *, lk_bigtime_t period, timer_callback, void *arg);
 void timer_cancel(timer_t *);
 
+static inline bool timer_is_queued(const timer_t *timer)
+{
+    return timer->queued;
+}
+
 __END_CDECLS;
 
 #endif
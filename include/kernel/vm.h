@@ -83,10 +83,12 @@ typedef struct vm_page {
     struct list_node node;
 
     uint flags : 8;
-    uint ref : 24;
+    uint order : 8; /* of the free block this page heads, see VM_PAGE_FLAG_FREE_HEAD */
+    uint ref : 16;
 } vm_page_t;
 
 #define VM_PAGE_FLAG_NONFREE  (0x1)
+#define VM_PAGE_FLAG_FREE_HEAD (0x2) /* first page of a free pmm buddy block */
 
 /* kernel address space */
 #ifndef KERNEL_ASPACE_BASE
@@ -119,6 +121,13 @@ static inline bool is_user_address(vaddr_t va)
 }
 
 /* physical allocator */
+
+/* free pages are kept in power of two sized blocks of up to
+ * 1 << (PMM_MAX_ORDER - 1) pages */
+#ifndef PMM_MAX_ORDER
+#define PMM_MAX_ORDER 20
+#endif
+
 typedef struct pmm_arena {
     struct list_node node;
     const char *name;
@@ -132,7 +141,7 @@ typedef struct pmm_arena {
     size_t free_count;
 
     struct vm_page *page_array;
-    struct list_node free_list;
+    struct list_node free_lists[PMM_MAX_ORDER]; /* free blocks, by order */
 } pmm_arena_t;
 
 #define PMM_ARENA_FLAG_KMAP (0x1) /* this arena is already mapped and useful for kallocs */
@@ -202,6 +211,7 @@ typedef struct vmm_aspace {
     size_t  size;
 
     struct list_node region_list;
+    struct vmm_region *region_tree;
 
     arch_aspace_t arch_aspace;
 } vmm_aspace_t;
@@ -219,6 +229,14 @@ typedef struct vmm_region {
     size_t  size;
 
     struct list_node page_list;
+
+    /* AVL tree of the aspace's regions keyed on base, augmented with the
+       free gap in front of each region and the largest gap in each subtree */
+    struct vmm_region *left;
+    struct vmm_region *right;
+    uint height;
+    size_t gap;
+    size_t max_gap;
 } vmm_region_t;
 
 #define VMM_REGION_FLAG_RESERVED 0x1
@@ -254,8 +272,18 @@ __NONNULL((1));
 /* Unmap previously allocated region and free physical memory pages backing it (if any) */
 status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t va);
 
+/* Free several regions, each found by an address inside it, with a single round
+   of TLB maintenance. Returns ERR_NOT_FOUND if any of them weren't there. */
+status_t vmm_free_regions(vmm_aspace_t *aspace, const vaddr_t *vaddrs, uint count)
+__NONNULL((1));
+
 /* For the above region creation routines. Allocate virtual space at the passed in pointer. */
 #define VMM_FLAG_VALLOC_SPECIFIC 0x1
+/* For vmm_alloc_physical and vmm_alloc_contiguous. Align the region, and the physical
+   run for contiguous allocations, as far as the size allows so the arch can map it
+   with large pages or blocks. Falls back to the requested alignment if that fails.
+   The arch may refuse to unmap only part of a large page, so free the region whole. */
+#define VMM_FLAG_LARGE_PAGES 0x2
 
 /* allocate a new address space */
 status_t vmm_create_aspace(vmm_aspace_t **aspace, const char *name, uint flags)
@@ -67,6 +67,9 @@ void wait_queue_destroy(wait_queue_t *, bool reschedule);
  */
 status_t wait_queue_block(wait_queue_t *, lk_time_t timeout);
 
+/* same as wait_queue_block(), timeout in microseconds, INFINITE_TIME_HIRES to wait forever */
+status_t wait_queue_block_hires(wait_queue_t *, lk_bigtime_t timeout);
+
 /*
  * release one or more threads from the wait queue.
  * reschedule = should the system reschedule if any is released.
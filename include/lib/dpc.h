@@ -30,7 +30,13 @@ typedef void (*dpc_callback)(void *arg);
 
 #define DPC_FLAG_NORESCHED 0x1
 
+/* queue a callback on the current cpu's dpc worker, or a housekeeping cpu's
+ * if the current cpu is isolated. Safe from interrupt context with
+ * DPC_FLAG_NORESCHED. Fails with ERR_NO_MEMORY if the queue is full. */
 status_t dpc_queue(dpc_callback, void *arg, uint flags);
 
+/* change the priority of a cpu's dpc worker, DPC_PRIORITY by default */
+status_t dpc_set_priority(uint cpu, int priority);
+
 #endif
 
@@ -33,6 +33,8 @@
 
 #include <debug.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
@@ -43,6 +45,67 @@
 #include <kernel/trace/tp_debug.h>
 #include <kernel/trace/tracelog.h>
 
+#ifdef SPINLOCK_STATS
+#include <kernel/spinlock.h>
+
+#define SPINLOCK_LIST_MAX      512
+
+static uint32_t spinlock_list_cnt = 0;
+static spin_lock_elem_t spin_lock_table[SPINLOCK_LIST_MAX];
+
+static spin_lock_elem_t *spin_lock_alloc_elem(spin_lock_t *lock, void *caller)
+{
+    uint32_t i;
+
+    if (__atomic_load_n(&spinlock_list_cnt, __ATOMIC_RELAXED) >= SPINLOCK_LIST_MAX)
+        return NULL;
+
+    i = __atomic_fetch_add(&spinlock_list_cnt, 1, __ATOMIC_RELAXED);
+    if (i >= SPINLOCK_LIST_MAX)
+        return NULL;
+
+    spin_lock_elem_t *elem = &spin_lock_table[i];
+
+    elem->lock = lock;
+    elem->caller = caller;
+    __atomic_store_n(&elem->magic, SPIN_LOCK_MAGIC, __ATOMIC_RELEASE);
+    lock->elem = elem;
+
+    return elem;
+}
+
+static uint32_t spin_lock_table_count(void)
+{
+    uint32_t cnt = __atomic_load_n(&spinlock_list_cnt, __ATOMIC_RELAXED);
+
+    return MIN(cnt, SPINLOCK_LIST_MAX);
+}
+
+void spin_lock_register(spin_lock_t *lock)
+{
+    uint32_t i, cnt = spin_lock_table_count();
+
+    for (i = 0; i < cnt; i++) {
+        spin_lock_elem_t *elem = &spin_lock_table[i];
+
+        if (elem->lock == lock) {
+            printf("%p lock already registered. Caller %p\n",
+                   lock, __GET_CALLER());
+            return;
+        }
+    }
+
+    if (!spin_lock_alloc_elem(lock, __GET_CALLER()))
+        printf("Too many spinlocks !\n");
+}
+
+/* called with the lock held, so no other cpu can attach the same lock */
+spin_lock_elem_t *spin_lock_stats_attach(spin_lock_t *lock, void *caller)
+{
+    return spin_lock_alloc_elem(lock, caller);
+}
+#endif /* SPINLOCK_STATS */
+
 #if WITH_LIB_CONSOLE
 #include <lib/console.h>
 
@@ -50,9 +113,11 @@ static int cmd_threads(int argc, const cmd_args *argv);
 static int cmd_threadstats(int argc, const cmd_args *argv);
 static int cmd_threadload(int argc, const cmd_args *argv);
 static int cmd_kevlog(int argc, const cmd_args *argv);
+#if THREAD_LATENCY_STATS
+static int cmd_threadlat(int argc, const cmd_args *argv);
+#endif
 
 #ifdef SPINLOCK_STATS
-#include <kernel/spinlock.h>
 static int cmd_spinlockstats(int argc, const cmd_args *argv);
 #endif
 
@@ -64,14 +129,17 @@ STATIC_COMMAND_MASKED("threads", "list kernel threads", &cmd_threads, CMD_AVAIL_
 STATIC_COMMAND("threadstats", "thread level statistics", &cmd_threadstats)
 STATIC_COMMAND("threadload", "toggle thread load display", &cmd_threadload)
 #endif
+#if THREAD_LATENCY_STATS
+STATIC_COMMAND("threadlat", "scheduling latency histograms", &cmd_threadlat)
+#endif
 #if WITH_KERNEL_EVLOG
 #if !WITH_KERNEL_TRACEPOINT
 STATIC_COMMAND_MASKED("kevlog", "dump kernel event log", &cmd_kevlog, CMD_AVAIL_ALWAYS)
 #endif
+#endif
 #ifdef SPINLOCK_STATS
 STATIC_COMMAND_MASKED("lockstats", "spin lock statistics", &cmd_spinlockstats, CMD_AVAIL_ALWAYS)
 #endif
-#endif
 STATIC_COMMAND_END(kernel);
 
 #if LK_DEBUGLEVEL > 1
@@ -82,74 +150,50 @@ static int cmd_threads(int argc, const cmd_args *argv)
 
     return 0;
 }
+#endif
 
 #ifdef SPINLOCK_STATS
-static uint32_t spinlock_list_cnt = 0;
-#define SPINLOCK_LIST_MAX      512
-
-static spin_lock_elem_t spin_lock_table[SPINLOCK_LIST_MAX];
-
-inline void spin_lock_register(spin_lock_t *lock)
-{
-    uint32_t i;
-
-    if (spinlock_list_cnt >= SPINLOCK_LIST_MAX) {
-        printf("Too many spinlocks !\n");
-        return;
-    }
-
-    for (i = 0; i < spinlock_list_cnt; i++) {
-        spin_lock_elem_t *elem = &spin_lock_table[i];
-
-        if (elem->lock == lock) {
-            printf("%p lock already registered. Caller %p\n",
-                   lock, __GET_CALLER());
-            return;
-        }
-    }
-
-    /* Add into list */
-    spin_lock_elem_t *elem = &spin_lock_table[spinlock_list_cnt++];
-
-    lock->elem = elem;
-    elem->lock = lock;
-    elem->caller = __GET_CALLER();
-    elem->magic = SPIN_LOCK_MAGIC;
-}
-
 static int cmd_spinlockstats(int argc, const cmd_args *argv)
 {
-    uint32_t i, limit = 10;
+    uint32_t i, cnt = spin_lock_table_count();
+    uint64_t limit = 10;
 
     if (argc > 1 && !strcmp(argv[1].str, "reset")) {
-        for (i = 0; i < spinlock_list_cnt; i++) {
+        for (i = 0; i < cnt; i++) {
             spin_lock_elem_t *elem = &spin_lock_table[i];
 
-            elem->caller = NULL;
-            elem->num = elem->mean = elem->max = 0;
-
+            elem->max_caller = NULL;
+            elem->num = elem->contended = 0;
+            elem->mean = elem->max = 0;
+            elem->wait = elem->wait_max = 0;
         }
         return 0;
-    } else if (argc > 1 ) {
+    } else if (argc > 1) {
         limit = argv[1].u;
     }
 
-    printf("spin lock list - limit is %uus\n", limit);
-    printf(" total %u spin lock\n", spinlock_list_cnt);
+    printf("spin lock list - limit is %lluus\n", limit);
+    printf(" total %u spin lock\n", cnt);
 
-    for (i = 0; i < spinlock_list_cnt; i++) {
+    for (i = 0; i < cnt; i++) {
         spin_lock_elem_t *elem = &spin_lock_table[i];
 
-        if (elem->magic == SPIN_LOCK_MAGIC && elem->max >= limit) {
-            printf(" lock %p - caller %p - num %u - mean %llu - max %llu\n",
-               elem->lock, elem->caller, elem->num, elem->mean / elem->num, elem->max);
-        }
+        if (elem->magic != SPIN_LOCK_MAGIC || elem->num == 0)
+            continue;
+        if (elem->max < limit && elem->wait_max < limit)
+            continue;
+
+        printf(" lock %p - site %p - num %u - hold mean %llu max %llu (%p)"
+               " - contended %u - wait mean %llu max %llu\n",
+               elem->lock, elem->caller, elem->num,
+               elem->mean / elem->num, elem->max, elem->max_caller,
+               elem->contended,
+               elem->contended ? elem->wait / elem->contended : 0,
+               elem->wait_max);
     }
 
     return 0;
 }
-#endif /* SPINLOCK_STATS */
-
 #endif
 
 #if THREAD_STATS
@@ -159,12 +203,15 @@ static int cmd_threadstats(int argc, const cmd_args *argv)
         if (!mp_is_cpu_active(i))
             continue;
 
+        lk_bigtime_t idle_time = thread_stats_idle_time(i);
+
         printf("thread stats (cpu %d):\n", i);
-        printf("\ttotal idle time: %lld\n", thread_stats[i].idle_time);
-        printf("\ttotal busy time: %lld\n", current_time_hires() - thread_stats[i].idle_time);
+        printf("\ttotal idle time: %lld\n", idle_time);
+        printf("\ttotal busy time: %lld\n", current_time_hires() - idle_time);
         printf("\treschedules: %lu\n", thread_stats[i].reschedules);
 #if WITH_SMP
         printf("\treschedule_ipis: %lu\n", thread_stats[i].reschedule_ipis);
+        printf("\tsteals: %lu\n", thread_stats[i].steals);
 #endif
         printf("\tcontext_switches: %lu\n", thread_stats[i].context_switches);
         printf("\tpreempts: %lu\n", thread_stats[i].preempts);
@@ -172,6 +219,11 @@ static int cmd_threadstats(int argc, const cmd_args *argv)
         printf("\tinterrupts: %lu\n", thread_stats[i].interrupts);
         printf("\ttimer interrupts: %lu\n", thread_stats[i].timer_ints);
         printf("\ttimers: %lu\n", thread_stats[i].timers);
+        printf("\tpreempt tick stops: %lu\n", thread_stats[i].tick_stops);
+#if KERNEL_EDF
+        printf("\tedf deadline misses: %lu\n", thread_stats[i].deadline_misses);
+        printf("\tedf budget overruns: %lu\n", thread_stats[i].budget_overruns);
+#endif
     }
 
     return 0;
@@ -187,13 +239,7 @@ static enum handler_return threadload(struct timer *t, lk_time_t now, void *arg)
         if (!mp_is_cpu_active(i))
             continue;
 
-        lk_bigtime_t idle_time = thread_stats[i].idle_time;
-
-        /* if the cpu is currently idle, add the time since it went idle up until now to the idle counter */
-        bool is_idle = !!mp_is_cpu_idle(i);
-        if (is_idle) {
-            idle_time += current_time_hires() - thread_stats[i].last_idle_timestamp;
-        }
+        lk_bigtime_t idle_time = thread_stats_idle_time(i);
 
         lk_bigtime_t delta_time = idle_time - last_idle_time[i];
         lk_bigtime_t busy_time = 1000000ULL - (delta_time > 1000000ULL ? 1000000ULL : delta_time);
@@ -247,8 +293,81 @@ static int cmd_threadload(int argc, const cmd_args *argv)
 
 #endif // THREAD_STATS
 
+#if THREAD_LATENCY_STATS
+static int cmd_threadlat(int argc, const cmd_args *argv)
+{
+    bool trace = false, reset = false;
+    uint i;
+
+    for (int a = 1; a < argc; a++) {
+        if (!strcmp(argv[a].str, "trace")) {
+            trace = true;
+        } else if (!strcmp(argv[a].str, "reset")) {
+            reset = true;
+        } else {
+            printf("usage: %s [trace] [reset]\n", argv[0].str);
+            return ERR_INVALID_ARGS;
+        }
+    }
+
+    for (i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!mp_is_cpu_active(i))
+            continue;
+
+        printf("cpu %u:\n", i);
+        latency_histogram_dump(&thread_stats[i].wakeup_latency, "wakeup to run");
+        latency_histogram_dump(&thread_stats[i].queue_latency, "ready to run");
+
+        if (trace) {
+            struct kevlog_sched_latency src = {
+                .name = "cpu",
+                .id = i,
+                .kind = KEVLOG_LATENCY_WAKEUP,
+                .hist = &thread_stats[i].wakeup_latency,
+            };
+            KEVLOG_SCHED_LATENCY(&src);
+            src.kind = KEVLOG_LATENCY_QUEUE;
+            src.hist = &thread_stats[i].queue_latency;
+            KEVLOG_SCHED_LATENCY(&src);
+        }
+
+        if (reset) {
+            memset(&thread_stats[i].wakeup_latency, 0, sizeof(thread_stats[i].wakeup_latency));
+            memset(&thread_stats[i].queue_latency, 0, sizeof(thread_stats[i].queue_latency));
+        }
+    }
+
+    dump_all_thread_latencies(trace, reset);
+
+    return 0;
+}
+#endif // THREAD_LATENCY_STATS
+
 #endif // WITH_LIB_CONSOLE
 
+#if THREAD_LATENCY_STATS
+/**
+ * @brief  Print a scheduling latency histogram, skipping empty buckets
+ */
+void latency_histogram_dump(const struct latency_histogram *h, const char *title)
+{
+    printf("\t%s: %u samples, avg %llu us, max %llu us\n", title, h->count,
+           h->count ? h->total / h->count : 0, h->max);
+
+    for (uint i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+        if (!h->buckets[i])
+            continue;
+
+        if (i == 0)
+            printf("\t\t      < 1 us: %u\n", h->buckets[i]);
+        else if (i == LATENCY_HIST_BUCKETS - 1)
+            printf("\t\t>= %8lu us: %u\n", 1UL << (i - 1), h->buckets[i]);
+        else
+            printf("\t\t< %9lu us: %u\n", 1UL << i, h->buckets[i]);
+    }
+}
+#endif
+
 #if WITH_KERNEL_TRACEPOINT
 
 void probe_subsys_kernel_ev(uintptr_t id, uintptr_t arg0, uintptr_t arg1)
@@ -34,7 +34,9 @@
 
 #if WITH_SMP
 /* a global state structure, aligned on cpu cache line to minimize aliasing */
-struct mp_state mp __CPU_ALIGN;
+struct mp_state mp __CPU_ALIGN = {
+    .isolated_cpus = SMP_ISOLATED_CPUS & MP_CPU_ALL,
+};
 
 void mp_init(void)
 {
@@ -20,6 +20,7 @@
 #include <assert.h>
 #include <err.h>
 #include <kernel/thread.h>
+#include <arch/ops.h>
 
 /**
  * @brief  Initialize a mutex_t
@@ -52,9 +53,66 @@ void mutex_destroy(mutex_t *m)
     THREAD_UNLOCK(state);
 }
 
+/* architectures with a native atomic_cmpxchg() take and release uncontended
+ * mutexes without touching the thread lock. The count is then always updated
+ * atomically, the thread lock only serializes the wait queue.
+ */
+#if ARCH_HAS_ATOMIC_CMPXCHG
+#define MUTEX_FAST_PATH 1
+#endif
+
+#if MUTEX_FAST_PATH
+static inline int mutex_count_inc(mutex_t *m)
+{
+    return atomic_add(&m->count, 1) + 1;
+}
+
+static inline int mutex_count_dec(mutex_t *m)
+{
+    return atomic_add(&m->count, -1) - 1;
+}
+
+/* 0 -> 1 transition, succeeds only if nobody holds or waits on the mutex */
+static inline bool mutex_try_fast_acquire(mutex_t *m)
+{
+    if (atomic_cmpxchg(&m->count, 0, 1) == 0) {
+        smp_mb();
+        return true;
+    }
+    return false;
+}
+
+/* 1 -> 0 transition, succeeds only if nobody is waiting */
+static inline bool mutex_try_fast_release(mutex_t *m)
+{
+    smp_mb();
+    return atomic_cmpxchg(&m->count, 1, 0) == 1;
+}
+#else
+static inline int mutex_count_inc(mutex_t *m)
+{
+    return ++m->count;
+}
+
+static inline int mutex_count_dec(mutex_t *m)
+{
+    return --m->count;
+}
+
+static inline bool mutex_try_fast_acquire(mutex_t *m)
+{
+    return false;
+}
+
+static inline bool mutex_try_fast_release(mutex_t *m)
+{
+    return false;
+}
+#endif
+
 status_t mutex_acquire_timeout_internal(mutex_t *m, lk_time_t timeout)
 {
-    if (unlikely(++m->count > 1)) {
+    if (unlikely(mutex_count_inc(m) > 1)) {
         status_t ret = wait_queue_block(&m->wait, timeout);
         if (unlikely(ret < NO_ERROR)) {
             /* if the acquisition timed out, back out the acquire and exit */
@@ -64,7 +122,7 @@ status_t mutex_acquire_timeout_internal(mutex_t *m, lk_time_t timeout)
                  * but before we got scheduled again which makes messing with the
                  * count variable dangerous.
                  */
-                m->count--;
+                mutex_count_dec(m);
             }
             /* if there was a general error, it may have been destroyed out from
              * underneath us, so just exit (which is really an invalid state anyway)
@@ -98,6 +156,11 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout)
               get_current_thread(), get_current_thread()->name, m);
 #endif
 
+    if (likely(mutex_try_fast_acquire(m))) {
+        m->holder = get_current_thread();
+        return NO_ERROR;
+    }
+
     THREAD_LOCK(state);
     status_t ret = mutex_acquire_timeout_internal(m, timeout);
     THREAD_UNLOCK(state);
@@ -108,7 +171,7 @@ void mutex_release_internal(mutex_t *m, bool reschedule)
 {
     m->holder = 0;
 
-    if (unlikely(--m->count >= 1)) {
+    if (unlikely(mutex_count_dec(m) >= 1)) {
         /* release a thread */
         wait_queue_wake_one(&m->wait, reschedule, NO_ERROR);
     }
@@ -128,6 +191,10 @@ status_t mutex_release(mutex_t *m)
     }
 #endif
 
+    m->holder = 0;
+    if (likely(mutex_try_fast_release(m)))
+        return NO_ERROR;
+
     THREAD_LOCK(state);
     mutex_release_internal(m, true);
     THREAD_UNLOCK(state);
@@ -18,6 +18,7 @@ MODULE_SRCS := \
 	$(LOCAL_DIR)/semaphore.c \
 	$(LOCAL_DIR)/mp.c \
 	$(LOCAL_DIR)/port.c \
+	$(LOCAL_DIR)/rwlock.c \
 
 
 ifeq ($(WITH_KERNEL_VM),1)
@@ -31,6 +32,21 @@ MODULE_DEPS += lib/cbuf
 MODULE_DEPS += kernel/trace
 endif
 
+# scheduling latency histograms, costs a timestamp per wakeup and context switch
+ifeq ($(WITH_THREAD_LATENCY_STATS),1)
+GLOBAL_DEFINES += THREAD_LATENCY_STATS=1
+endif
+
+# earliest deadline first scheduling class, see thread_set_deadline()
+ifeq ($(WITH_KERNEL_EDF),1)
+GLOBAL_DEFINES += KERNEL_EDF=1
+endif
+
+# require tickless operation, fails the build on a platform with only a periodic timer
+ifeq ($(WITH_TICKLESS),1)
+GLOBAL_DEFINES += KERNEL_TICKLESS=1
+endif
+
 ifeq ($(WITH_DYNAMIC_DEBUG),1)
 MODULE_DEPS += kernel/dyndbg
 endif
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2026 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <kernel/rwlock.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <platform.h>
+#include <kernel/thread.h>
+
+void rwlock_init(rwlock_t *rw)
+{
+    *rw = (rwlock_t)RWLOCK_INITIAL_VALUE(*rw);
+}
+
+void rwlock_destroy(rwlock_t *rw)
+{
+    DEBUG_ASSERT(rw->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+    if (unlikely(rw->writer || rw->readers))
+        panic("rwlock_destroy: thread %p (%s) tried to destroy locked rwlock %p, writer %p readers %d\n",
+              get_current_thread(), get_current_thread()->name, rw, rw->writer, rw->readers);
+#endif
+
+    THREAD_LOCK(state);
+
+    rw->magic = 0;
+    wait_queue_destroy(&rw->read_wait, false);
+    wait_queue_destroy(&rw->write_wait, true);
+
+    THREAD_UNLOCK(state);
+}
+
+/* time left until deadline, for waits that block more than once */
+static lk_time_t rwlock_remaining(lk_time_t deadline, lk_time_t timeout)
+{
+    if (timeout == INFINITE_TIME)
+        return INFINITE_TIME;
+
+    lk_time_t now = current_time();
+    if (TIME_GTE(now, deadline))
+        return 0;
+
+    return deadline - now;
+}
+
+/* pass the lock on once it becomes free, writers first. thread lock held. */
+static void rwlock_wake_waiters(rwlock_t *rw, bool reschedule)
+{
+    if (rw->writer || rw->readers)
+        return;
+
+    if (rw->writers_waiting > 0) {
+        wait_queue_wake_one(&rw->write_wait, reschedule, NO_ERROR);
+    } else {
+        wait_queue_wake_all(&rw->read_wait, reschedule, NO_ERROR);
+    }
+}
+
+status_t rwlock_read_acquire_timeout(rwlock_t *rw, lk_time_t timeout)
+{
+    DEBUG_ASSERT(rw->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+    if (unlikely(rw->writer == get_current_thread()))
+        panic("rwlock_read_acquire_timeout: thread %p (%s) tried to read acquire rwlock %p it write holds\n",
+              get_current_thread(), get_current_thread()->name, rw);
+#endif
+
+    status_t ret = NO_ERROR;
+    lk_time_t deadline = current_time() + timeout;
+
+    THREAD_LOCK(state);
+
+    /* queue behind an active or waiting writer */
+    while (rw->writer || rw->writers_waiting > 0) {
+        ret = wait_queue_block(&rw->read_wait, rwlock_remaining(deadline, timeout));
+        if (ret < NO_ERROR)
+            goto out;
+    }
+
+    rw->readers++;
+
+out:
+    THREAD_UNLOCK(state);
+    return ret;
+}
+
+status_t rwlock_read_release(rwlock_t *rw)
+{
+    DEBUG_ASSERT(rw->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+    if (unlikely(rw->readers <= 0))
+        panic("rwlock_read_release: thread %p (%s) tried to read release rwlock %p with no readers\n",
+              get_current_thread(), get_current_thread()->name, rw);
+#endif
+
+    THREAD_LOCK(state);
+
+    if (--rw->readers == 0)
+        rwlock_wake_waiters(rw, true);
+
+    THREAD_UNLOCK(state);
+    return NO_ERROR;
+}
+
+status_t rwlock_write_acquire_timeout(rwlock_t *rw, lk_time_t timeout)
+{
+    DEBUG_ASSERT(rw->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+    if (unlikely(rw->writer == get_current_thread()))
+        panic("rwlock_write_acquire_timeout: thread %p (%s) tried to acquire rwlock %p it already owns\n",
+              get_current_thread(), get_current_thread()->name, rw);
+#endif
+
+    status_t ret = NO_ERROR;
+    lk_time_t deadline = current_time() + timeout;
+
+    THREAD_LOCK(state);
+
+    while (rw->writer || rw->readers > 0) {
+        rw->writers_waiting++;
+        ret = wait_queue_block(&rw->write_wait, rwlock_remaining(deadline, timeout));
+        rw->writers_waiting--;
+
+        if (ret < NO_ERROR) {
+            /* readers held back only by us may go now */
+            if (rw->writers_waiting == 0 && !rw->writer)
+                wait_queue_wake_all(&rw->read_wait, false, NO_ERROR);
+            goto out;
+        }
+    }
+
+    rw->writer = get_current_thread();
+
+out:
+    THREAD_UNLOCK(state);
+    return ret;
+}
+
+status_t rwlock_write_release(rwlock_t *rw)
+{
+    DEBUG_ASSERT(rw->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+    if (unlikely(rw->writer != get_current_thread()))
+        panic("rwlock_write_release: thread %p (%s) tried to release rwlock %p it doesn't own. owned by %p (%s)\n",
+              get_current_thread(), get_current_thread()->name, rw, rw->writer, rw->writer ? rw->writer->name : "none");
+#endif
+
+    THREAD_LOCK(state);
+
+    rw->writer = NULL;
+    rwlock_wake_waiters(rw, true);
+
+    THREAD_UNLOCK(state);
+    return NO_ERROR;
+}
@@ -34,6 +34,7 @@
 #include <assert.h>
 #include <list.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
 #include <printf.h>
 #include <err.h>
@@ -64,12 +65,29 @@ static struct list_node thread_list;
 /* master thread spinlock */
 spin_lock_t thread_lock = SPIN_LOCK_INITIAL_VALUE;
 
-/* the run queue */
-static struct list_node run_queue[NUM_PRIORITIES];
-static uint32_t run_queue_bitmap;
+/* the run queues, one per cpu, protected by thread_lock like the rest of the
+ * scheduler state */
+struct run_queue {
+    struct list_node list[NUM_PRIORITIES];
+    uint32_t bitmap;
+#if KERNEL_EDF
+    struct list_node edf_list; /* ready edf threads, sorted by absolute deadline */
+    uint32_t edf_utilization; /* admitted edf bandwidth, parts per million */
+#endif
+    uint count;
+    int curr_priority; /* priority of the thread running on this cpu, -1 if idle */
+#if WITH_SMP
+    /* for every other cpu, the priority levels holding at least one thread
+     * it is allowed to steal, and how many there are at each level */
+    uint32_t steal_bitmap[SMP_MAX_CPUS];
+    uint16_t steal_count[SMP_MAX_CPUS][NUM_PRIORITIES];
+#endif
+} __CPU_ALIGN;
+
+static struct run_queue run_queue[SMP_MAX_CPUS];
 
 /* make sure the bitmap is large enough to cover our number of priorities */
-STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue_bitmap) * 8);
+STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue[0].bitmap) * 8);
 
 /* the idle thread(s) (statically allocated) */
 #if WITH_SMP
@@ -84,41 +102,521 @@ static thread_t _idle_thread;
 static void thread_resched(void);
 static void idle_thread_routine(void) __NO_RETURN;
 
+/* the preemption tick and idle only stop on a platform with a oneshot timer,
+ * a periodic one keeps ticking. Projects that need tickless operation set
+ * WITH_TICKLESS=1 to have that checked at build time. */
+#if KERNEL_TICKLESS && !PLATFORM_HAS_DYNAMIC_TIMER
+#error "KERNEL_TICKLESS needs a platform timer with oneshot support (PLATFORM_HAS_DYNAMIC_TIMER)"
+#endif
+
 #if PLATFORM_HAS_DYNAMIC_TIMER
-/* preemption timer */
+/* preemption timer, only armed while the running thread shares its cpu */
 static timer_t preempt_timer[SMP_MAX_CPUS];
+static bool preempt_tick_running[SMP_MAX_CPUS];
+
+static void thread_update_preempt_tick(thread_t *t, uint cpu);
+#else
+static inline void thread_update_preempt_tick(thread_t *t, uint cpu) { }
 #endif
 
+#if KERNEL_EDF
+/* edf runtime budget enforcement timer */
+static timer_t edf_budget_timer[SMP_MAX_CPUS];
+
+/* maximum edf bandwidth admitted on a cpu, in parts per million, the rest
+ * is left to the fixed priority threads */
+#ifndef EDF_MAX_UTILIZATION
+#define EDF_MAX_UTILIZATION 900000
+#endif
+
+/* running edf threads outrank every fixed priority */
+#define EDF_CURR_PRIORITY NUM_PRIORITIES
+
+static inline bool thread_is_edf(thread_t *t)
+{
+    return t->edf.period != 0;
+}
+
+/* edf threads that exhausted their budget run at their base priority */
+static inline bool thread_is_edf_active(thread_t *t)
+{
+    return thread_is_edf(t) && !t->edf.throttled;
+}
+#else
+static inline bool thread_is_edf(thread_t *t) { return false; }
+static inline bool thread_is_edf_active(thread_t *t) { return false; }
+#endif
+
+/* mp_reschedule() flags for readying t. An active edf thread outranks the
+ * real time thread a cpu may be running, so that cpu has to hear about it. */
+static inline uint thread_ready_ipi_flags(thread_t *t)
+{
+    return thread_is_edf_active(t) ? MP_RESCHEDULE_FLAG_REALTIME : 0;
+}
+
+static inline int run_queue_top_priority(const struct run_queue *rq)
+{
+    if (rq->bitmap == 0)
+        return -1;
+
+    return sizeof(rq->bitmap) * 8 - 1 - __builtin_clz(rq->bitmap);
+}
+
 /* run queue manipulation */
-static void insert_in_run_queue_head(thread_t *t)
+#if KERNEL_EDF
+static void insert_in_edf_queue(struct run_queue *rq, thread_t *t, bool head)
+{
+    thread_t *entry;
+
+    /* keep the list sorted by deadline, head inserts go in front of equal deadlines */
+    list_for_every_entry(&rq->edf_list, entry, thread_t, queue_node) {
+        if (entry->edf.abs_deadline > t->edf.abs_deadline ||
+                (head && entry->edf.abs_deadline == t->edf.abs_deadline)) {
+            list_add_before(&entry->queue_node, &t->queue_node);
+            rq->count++;
+            return;
+        }
+    }
+
+    list_add_tail(&rq->edf_list, &t->queue_node);
+    rq->count++;
+}
+#else
+static inline void insert_in_edf_queue(struct run_queue *rq, thread_t *t, bool head) { }
+#endif
+
+#if WITH_SMP
+static uint select_cpu_for_thread(thread_t *t);
+
+/* set the pin of a thread that isn't queued, or with the thread lock held
+ * while the caller takes care of requeueing it */
+#define thread_pin(t, c) ((t)->pinned_cpu = (c))
+
+/* cpus t may run on right now: its pinned cpu, else its affinity */
+static inline cpu_mask_t thread_cpu_mask(thread_t *t)
+{
+    return (t->pinned_cpu >= 0) ? cpu_num_to_mask(t->pinned_cpu) : t->affinity;
+}
+
+static void run_queue_add_stealable(struct run_queue *rq, thread_t *t)
+{
+    for (cpu_mask_t mask = t->rq_mask; mask; mask &= mask - 1) {
+        uint c = lowest_cpu_set(mask);
+
+        rq->steal_count[c][t->priority]++;
+        rq->steal_bitmap[c] |= 1U << t->priority;
+    }
+}
+
+static void run_queue_remove_stealable(struct run_queue *rq, thread_t *t)
+{
+    for (cpu_mask_t mask = t->rq_mask; mask; mask &= mask - 1) {
+        uint c = lowest_cpu_set(mask);
+
+        if (--rq->steal_count[c][t->priority] == 0)
+            rq->steal_bitmap[c] &= ~(1U << t->priority);
+    }
+}
+#else
+#define thread_pin(t, c) do {} while (0)
+
+static inline cpu_mask_t thread_cpu_mask(thread_t *t)
+{
+    return 1U;
+}
+#endif
+
+static void insert_in_run_queue(uint cpu, thread_t *t, bool head)
 {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_READY);
     DEBUG_ASSERT(!list_in_list(&t->queue_node));
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
+
+#if WITH_SMP
+    /* never queue a thread on a cpu it may not run on. This happens to a
+     * running thread whose affinity just changed when it gets preempted. */
+    if (!(thread_cpu_mask(t) & cpu_num_to_mask(cpu))) {
+        cpu = select_cpu_for_thread(t);
+        mp_reschedule(cpu_num_to_mask(cpu), thread_ready_ipi_flags(t));
+    }
+    t->rq_cpu = cpu;
+#endif
+
+    struct run_queue *rq = &run_queue[cpu];
+
+    if (thread_is_edf_active(t)) {
+#if WITH_SMP
+        t->rq_mask = 0;
+#endif
+        insert_in_edf_queue(rq, t, head);
+    } else {
+        if (head)
+            list_add_head(&rq->list[t->priority], &t->queue_node);
+        else
+            list_add_tail(&rq->list[t->priority], &t->queue_node);
+        rq->bitmap |= (1<<t->priority);
+        rq->count++;
 
-    list_add_head(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+#if WITH_SMP
+        t->rq_mask = thread_cpu_mask(t) & ~cpu_num_to_mask(cpu);
+        run_queue_add_stealable(rq, t);
+#endif
+    }
+
+    /* the running thread may have to take turns now. Remote cpus are
+     * kicked by the caller and sort out their tick when they reschedule. */
+    if (cpu == arch_curr_cpu_num()) {
+        thread_t *current_thread = get_current_thread();
+
+        if (current_thread->state == THREAD_RUNNING)
+            thread_update_preempt_tick(current_thread, cpu);
+    }
 }
 
-static void insert_in_run_queue_tail(thread_t *t)
+static void insert_in_run_queue_head(uint cpu, thread_t *t)
 {
-    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
-    DEBUG_ASSERT(t->state == THREAD_READY);
-    DEBUG_ASSERT(!list_in_list(&t->queue_node));
-    DEBUG_ASSERT(arch_ints_disabled());
+    insert_in_run_queue(cpu, t, true);
+}
+
+static void insert_in_run_queue_tail(uint cpu, thread_t *t)
+{
+    insert_in_run_queue(cpu, t, false);
+}
+
+static void run_queue_remove(struct run_queue *rq, thread_t *t)
+{
+    DEBUG_ASSERT(list_in_list(&t->queue_node));
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    list_add_tail(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+#if WITH_SMP
+    DEBUG_ASSERT(&run_queue[t->rq_cpu] == rq);
+    run_queue_remove_stealable(rq, t);
+    t->rq_mask = 0;
+#endif
+
+    list_delete(&t->queue_node);
+    if (!thread_is_edf_active(t) && list_is_empty(&rq->list[t->priority]))
+        rq->bitmap &= ~(1<<t->priority);
+    rq->count--;
+}
+
+static void remove_from_run_queue(uint cpu, thread_t *t)
+{
+    run_queue_remove(&run_queue[cpu], t);
+}
+
+#if THREAD_LATENCY_STATS
+static void latency_histogram_add(struct latency_histogram *h, lk_bigtime_t latency)
+{
+    uint bucket = latency ? 64 - __builtin_clzll(latency) : 0;
+
+    h->buckets[MIN(bucket, LATENCY_HIST_BUCKETS - 1)]++;
+    h->count++;
+    h->total += latency;
+    if (latency > h->max)
+        h->max = latency;
+}
+
+static inline void thread_latency_mark_ready(thread_t *t, bool woken)
+{
+    t->ready_time = current_time_hires();
+    t->woken = woken;
+}
+
+/* account the time newthread spent ready before getting this cpu, and start
+ * the clock on oldthread if it was preempted */
+static void thread_latency_switch(thread_t *oldthread, thread_t *newthread, uint cpu, lk_bigtime_t now)
+{
+    if (newthread->ready_time && !(newthread->flags & THREAD_FLAG_IDLE)) {
+        lk_bigtime_t latency = now - newthread->ready_time;
+
+        latency_histogram_add(&newthread->queue_latency, latency);
+        latency_histogram_add(&thread_stats[cpu].queue_latency, latency);
+        if (newthread->woken) {
+            latency_histogram_add(&newthread->wakeup_latency, latency);
+            latency_histogram_add(&thread_stats[cpu].wakeup_latency, latency);
+        }
+    }
+    newthread->ready_time = 0;
+
+    if (oldthread->state == THREAD_READY) {
+        oldthread->ready_time = now;
+        oldthread->woken = false;
+    }
+}
+#else
+static inline void thread_latency_mark_ready(thread_t *t, bool woken) { }
+static inline void thread_latency_switch(thread_t *oldthread, thread_t *newthread, uint cpu, lk_bigtime_t now) { }
+#endif
+
+#if WITH_SMP
+/* pick the cpu a thread that just became ready should be queued on, among
+ * the ones it is allowed on. Preference order: the only one it is allowed on,
+ * the cpu it last ran on if that one is idle or running something less
+ * important, any idle cpu, the active cpu running the lowest priority
+ * thread, and finally the local cpu.
+ */
+static uint select_cpu_for_thread(thread_t *t)
+{
+    uint local_cpu = arch_curr_cpu_num();
+    cpu_mask_t allowed = thread_cpu_mask(t);
+    mp_cpu_mask_t active = mp.active_cpus & allowed;
+    mp_cpu_mask_t idle = mp_get_idle_mask() & active;
+    mp_cpu_mask_t realtime = mp_get_realtime_mask();
+
+    /* pinned, or none of its cpus is up yet: it will run once one is */
+    if ((allowed & (allowed - 1)) == 0 || active == 0)
+        return (allowed & cpu_num_to_mask(local_cpu)) ? local_cpu : lowest_cpu_set(allowed);
+
+    /* nothing but this cpu is up yet */
+    if (active == cpu_num_to_mask(local_cpu))
+        return local_cpu;
+
+    int last = t->last_cpu;
+    if (last >= 0 && (active & cpu_num_to_mask(last))) {
+        if (idle & cpu_num_to_mask(last))
+            return last;
+        if (!(realtime & cpu_num_to_mask(last)) && run_queue[last].curr_priority < t->priority)
+            return last;
+    }
+
+    if (idle)
+        return lowest_cpu_set(idle);
+
+    int best = -1;
+    int best_priority = INT_MAX;
+    for (mp_cpu_mask_t mask = active & ~realtime; mask; mask &= mask - 1) {
+        uint i = lowest_cpu_set(mask);
+
+        if (run_queue[i].curr_priority < best_priority) {
+            best = i;
+            best_priority = run_queue[i].curr_priority;
+        }
+    }
+    if (best >= 0)
+        return best;
+
+    return (active & cpu_num_to_mask(local_cpu)) ? local_cpu : lowest_cpu_set(active);
+}
+#else
+static inline uint select_cpu_for_thread(thread_t *t)
+{
+    return 0;
+}
+#endif
+
+/* queue a thread that just became ready on its chosen cpu, at the head of the
+ * priority list. If prefer_local is set and the thread is not pinned elsewhere,
+ * keep it on this cpu so the caller can switch to it directly.
+ * Returns the mask of cpus that should be kicked to pick it up.
+ */
+static mp_cpu_mask_t insert_in_run_queue_wakeup(thread_t *t, bool prefer_local)
+{
+    uint cpu;
+
+    if (prefer_local && (thread_cpu_mask(t) & cpu_num_to_mask(arch_curr_cpu_num())))
+        cpu = arch_curr_cpu_num();
+    else
+        cpu = select_cpu_for_thread(t);
+
+    insert_in_run_queue_head(cpu, t);
+    thread_latency_mark_ready(t, true);
+
+    return 1U << cpu;
+}
+
+/* total time the thread has spent running, including the current stint */
+static lk_bigtime_t thread_runtime(thread_t *t, lk_bigtime_t now)
+{
+    lk_bigtime_t runtime = t->runtime_us;
+
+    if (t->state == THREAD_RUNNING)
+        runtime += now - t->last_started_running_us;
+
+    return runtime;
+}
+
+#if KERNEL_EDF
+/* the cpu an edf thread was admitted on, admission pins it */
+static inline uint thread_edf_cpu(thread_t *t)
+{
+    return thread_pinned_cpu(t) >= 0 ? (uint)thread_pinned_cpu(t) : 0;
+}
+
+static enum handler_return thread_edf_budget_handler(timer_t *timer, lk_time_t now, void *arg);
+static enum handler_return thread_edf_release_handler(timer_t *timer, lk_time_t now, void *arg);
+
+static void thread_edf_start_job(thread_t *t, lk_bigtime_t release, lk_bigtime_t now)
+{
+    t->edf.release = release;
+    t->edf.abs_deadline = release + t->edf.deadline;
+    t->edf.job_runtime_base = thread_runtime(t, now);
+    t->edf.throttled = false;
+    t->edf.jobs++;
+}
+
+/* arm the budget timer of the local cpu for the remaining runtime of t's job */
+static void thread_edf_arm_budget_timer(thread_t *t, uint cpu, lk_bigtime_t now)
+{
+    lk_bigtime_t used = thread_runtime(t, now) - t->edf.job_runtime_base;
+    lk_bigtime_t remaining = (used < t->edf.runtime) ? t->edf.runtime - used : 0;
+
+    timer_cancel(&edf_budget_timer[cpu]);
+    timer_set_oneshot_hires(&edf_budget_timer[cpu], remaining, thread_edf_budget_handler, NULL);
+}
+
+/* arm t's period timer for the start of its next period */
+static void thread_edf_arm_period_timer(thread_t *t, lk_bigtime_t now)
+{
+    lk_bigtime_t next = t->edf.release + t->edf.period;
+
+    timer_cancel(&t->edf.period_timer);
+    timer_set_oneshot_hires(&t->edf.period_timer, (next > now) ? next - now : 0,
+                            thread_edf_release_handler, t);
+}
+
+/* give back the bandwidth reserved by admission control */
+static void thread_edf_release_bandwidth(thread_t *t)
+{
+    timer_cancel(&t->edf.period_timer);
+
+    run_queue[thread_edf_cpu(t)].edf_utilization -= t->edf.utilization;
+    t->edf.utilization = 0;
+
+    if (t->edf.auto_pinned) {
+        thread_pin(t, -1);
+        t->edf.auto_pinned = false;
+    }
+}
+
+/* pick a cpu with room for the requested bandwidth, the least loaded one
+ * the thread is allowed on. Returns -1 if none fits. */
+static int thread_edf_admit(thread_t *t, uint32_t utilization)
+{
+    int best = -1;
+    uint32_t best_free = 0;
+
+    /* a previous admission pin does not restrict the new choice */
+    cpu_mask_t allowed = t->edf.auto_pinned ? thread_affinity(t) : thread_cpu_mask(t);
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!mp_is_cpu_active(i) && i != arch_curr_cpu_num())
+            continue;
+        if (!(allowed & (1U << i)))
+            continue;
+
+        uint32_t used = run_queue[i].edf_utilization;
+        if (thread_is_edf(t) && thread_edf_cpu(t) == i)
+            used -= t->edf.utilization;
+
+        uint32_t free = EDF_MAX_UTILIZATION - MIN(used, EDF_MAX_UTILIZATION);
+        if (utilization <= free && (best < 0 || free > best_free)) {
+            best = i;
+            best_free = free;
+        }
+    }
+
+    return best;
+}
+
+/* budget timer callback, the running edf thread used up its runtime */
+static enum handler_return thread_edf_budget_handler(timer_t *timer, lk_time_t now, void *arg)
+{
+    thread_t *t = get_current_thread();
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    spin_lock(&thread_lock);
+
+    if (thread_is_edf_active(t)) {
+        t->edf.throttled = true;
+        t->edf.budget_overruns++;
+        THREAD_STATS_INC(budget_overruns);
+
+        /* run at base priority until the budget is replenished next period */
+        thread_edf_arm_period_timer(t, current_time_hires());
+        ret = INT_RESCHEDULE;
+    }
+
+    spin_unlock(&thread_lock);
+
+    return ret;
+}
+
+/* period timer callback: release the next job of a thread waiting in
+ * thread_wait_next_period(), or replenish a throttled one */
+static enum handler_return thread_edf_release_handler(timer_t *timer, lk_time_t now, void *arg)
+{
+    thread_t *t = (thread_t *)arg;
+    enum handler_return ret = INT_NO_RESCHEDULE;
+    lk_bigtime_t now_hires = current_time_hires();
+    uint cpu = arch_curr_cpu_num();
+
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+
+    spin_lock(&thread_lock);
+
+    if (!thread_is_edf(t) || t->state == THREAD_DEATH)
+        goto out;
+
+    lk_bigtime_t release = t->edf.release + t->edf.period;
+
+    if (t->edf.waiting) {
+        DEBUG_ASSERT(t->state == THREAD_SLEEPING);
+
+        t->edf.waiting = false;
+        thread_edf_start_job(t, release, now_hires);
+
+        t->state = THREAD_READY;
+        mp_cpu_mask_t target = insert_in_run_queue_wakeup(t, false);
+        mp_reschedule(target, thread_ready_ipi_flags(t));
+        if (target & (1U << cpu))
+            ret = INT_RESCHEDULE;
+    } else if (t->edf.throttled) {
+        /* the job ran past its budget and is still not done at the next
+         * release, so it missed its deadline. Replenish and move the
+         * deadline out by a period, skipping periods we are far behind on. */
+        t->edf.deadline_misses++;
+        THREAD_STATS_INC(deadline_misses);
+
+        while (release + t->edf.period <= now_hires)
+            release += t->edf.period;
+
+        bool queued = (t->state == THREAD_READY);
+        if (queued)
+            remove_from_run_queue(thread_edf_cpu(t), t);
+
+        thread_edf_start_job(t, release, now_hires);
+
+        if (queued) {
+            insert_in_run_queue_head(thread_edf_cpu(t), t);
+            mp_reschedule(1U << thread_edf_cpu(t), thread_ready_ipi_flags(t));
+            ret = INT_RESCHEDULE;
+        } else if (t == get_current_thread()) {
+            thread_edf_arm_budget_timer(t, cpu, now_hires);
+            run_queue[cpu].curr_priority = EDF_CURR_PRIORITY;
+        }
+    }
+
+out:
+    spin_unlock(&thread_lock);
+
+    return ret;
 }
+#endif
 
 static void init_thread_struct(thread_t *t, const char *name)
 {
     memset(t, 0, sizeof(thread_t));
     t->magic = THREAD_MAGIC;
-    thread_set_pinned_cpu(t, -1);
+    thread_pin(t, -1);
+    thread_set_last_cpu(t, -1);
+    thread_set_affinity_mask(t, mp_get_default_affinity());
+#if KERNEL_EDF
+    timer_initialize(&t->edf.period_timer);
+#endif
     strlcpy(t->name, name, sizeof(t->name));
 }
 
@@ -247,14 +745,90 @@ status_t thread_set_real_time(thread_t *t)
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
 
     THREAD_LOCK(state);
-#if PLATFORM_HAS_DYNAMIC_TIMER
+    t->flags |= THREAD_FLAG_REAL_TIME;
     if (t == get_current_thread()) {
-        /* if we're currently running, cancel the preemption timer. */
-        timer_cancel(&preempt_timer[arch_curr_cpu_num()]);
+        /* if we're currently running, stop the preemption tick */
+        thread_update_preempt_tick(t, arch_curr_cpu_num());
     }
+    THREAD_UNLOCK(state);
+
+    return NO_ERROR;
+}
+
+#if WITH_SMP
+/* the cpus t may run on changed, move it off a queue or cpu it may no
+ * longer use, and let the run queues know who may steal it now. thread lock
+ * held. */
+static void thread_cpu_mask_changed(thread_t *t)
+{
+    if (t->state == THREAD_READY) {
+        /* its queue, or who may steal it from there, may have changed */
+        remove_from_run_queue(t->rq_cpu, t);
+        mp_reschedule(insert_in_run_queue_wakeup(t, false), thread_ready_ipi_flags(t));
+    } else if (t->state == THREAD_RUNNING && !(thread_cpu_mask(t) & cpu_num_to_mask(t->curr_cpu))) {
+        if (t == get_current_thread()) {
+            /* insert_in_run_queue() moves us to an allowed cpu */
+            t->state = THREAD_READY;
+            insert_in_run_queue_head(arch_curr_cpu_num(), t);
+            thread_resched();
+        } else {
+            /* same thing, on its cpu, once preempted */
+            mp_reschedule(cpu_num_to_mask(t->curr_cpu), MP_RESCHEDULE_FLAG_REALTIME);
+        }
+    }
+}
+
+/**
+ * @brief Pin a thread to a cpu, or unpin it with -1
+ *
+ * Takes effect right away, like thread_set_affinity().
+ */
+void thread_set_pinned_cpu(thread_t *t, int cpu)
+{
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
+
+    THREAD_LOCK(state);
+
+    t->pinned_cpu = cpu;
+    thread_cpu_mask_changed(t);
+
+    THREAD_UNLOCK(state);
+}
 #endif
-    t->flags |= THREAD_FLAG_REAL_TIME;
+
+/**
+ * @brief Set the cpus a thread may run on
+ *
+ * Takes effect right away: a ready thread is requeued on an allowed cpu and a
+ * running one is preempted if its cpu is no longer allowed. A pinned cpu, set
+ * with thread_set_pinned_cpu() or by edf admission, takes precedence. Unlike
+ * the default affinity, the mask may include isolated cpus.
+ *
+ * @param t Thread to change
+ * @param mask Allowed cpus
+ *
+ * @return NO_ERROR on success, ERR_INVALID_ARGS if mask holds no valid cpu
+ */
+status_t thread_set_affinity(thread_t *t, cpu_mask_t mask)
+{
+    if (!t)
+        return ERR_INVALID_ARGS;
+
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+
+    mask &= MP_CPU_ALL;
+    if (!mask)
+        return ERR_INVALID_ARGS;
+
+#if WITH_SMP
+    THREAD_LOCK(state);
+
+    t->affinity = mask;
+    thread_cpu_mask_changed(t);
+
     THREAD_UNLOCK(state);
+#endif
 
     return NO_ERROR;
 }
@@ -274,6 +848,205 @@ static bool thread_is_real_time_or_idle(thread_t *t)
     return !!(t->flags & (THREAD_FLAG_REAL_TIME | THREAD_FLAG_IDLE));
 }
 
+#if PLATFORM_HAS_DYNAMIC_TIMER
+static enum handler_return thread_preempt_tick(timer_t *timer, lk_time_t now, void *arg)
+{
+    uint cpu = arch_curr_cpu_num();
+
+    /* the threads we were taking turns with may have blocked or been
+     * stolen by other cpus, stop ticking if we are alone again */
+    if (run_queue[cpu].count == 0) {
+        THREAD_LOCK(state);
+        thread_update_preempt_tick(get_current_thread(), cpu);
+        THREAD_UNLOCK(state);
+    }
+
+    return thread_timer_tick();
+}
+
+/* Run the preemption tick only while it has something to do: the running
+ * thread uses up quanta and other threads are ready on this cpu. An idle
+ * cpu, or one running a real time thread or its only ready thread, takes
+ * no periodic interrupts, the hardware timer is programmed for its next
+ * timer deadline only. thread lock held.
+ */
+static void thread_update_preempt_tick(thread_t *t, uint cpu)
+{
+    bool needed = !thread_is_real_time_or_idle(t) && run_queue[cpu].count > 0;
+
+    if (needed == preempt_tick_running[cpu])
+        return;
+
+    preempt_tick_running[cpu] = needed;
+    if (needed) {
+#if DEBUG_THREAD_CONTEXT_SWITCH
+        dprintf(ALWAYS, "start preempt, cpu %u, thread %p (%s)\n", cpu, t, t->name);
+#endif
+        timer_set_periodic(&preempt_timer[cpu], 10, thread_preempt_tick, NULL);
+    } else {
+#if DEBUG_THREAD_CONTEXT_SWITCH
+        dprintf(ALWAYS, "stop preempt, cpu %u, thread %p (%s)\n", cpu, t, t->name);
+#endif
+        timer_cancel(&preempt_timer[cpu]);
+        THREAD_STATS_INC(tick_stops);
+    }
+}
+#endif
+
+#if KERNEL_EDF
+/**
+ * @brief Move a thread in or out of the earliest deadline first class
+ *
+ * An edf thread runs a job of at most @a runtime every @a period, each of
+ * which must complete within @a deadline of its release. Jobs end with
+ * thread_wait_next_period(). Ready edf threads run before any fixed priority
+ * thread, earliest absolute deadline first. A job that exhausts its runtime is
+ * throttled to the thread's base priority until the next period, where its
+ * budget is replenished and the miss is counted.
+ *
+ * Admission control places the thread on the cpu with the most spare edf
+ * bandwidth (or its pinned cpu) and pins it there, and fails if no cpu can
+ * fit runtime / period under EDF_MAX_UTILIZATION.
+ *
+ * Only valid on the current thread or a suspended one. A period of 0 moves
+ * the thread back to fixed priority scheduling.
+ *
+ * @param t Thread to change
+ * @param runtime Execution budget per period, in us
+ * @param deadline Relative deadline, in us, runtime <= deadline <= period
+ * @param period Period, in us
+ *
+ * @return NO_ERROR on success, ERR_NO_RESOURCES if admission failed
+ */
+status_t thread_set_deadline(thread_t *t, lk_bigtime_t runtime, lk_bigtime_t deadline, lk_bigtime_t period)
+{
+    if (!t)
+        return ERR_INVALID_ARGS;
+    if (period != 0 && (runtime == 0 || runtime > deadline || deadline > period))
+        return ERR_INVALID_ARGS;
+
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+
+    uint32_t utilization = period ? (uint32_t)(runtime * 1000000 / period) : 0;
+    thread_t *current_thread = get_current_thread();
+
+    THREAD_LOCK(state);
+
+    if (t != current_thread && t->state != THREAD_SUSPENDED) {
+        THREAD_UNLOCK(state);
+        return ERR_BAD_STATE;
+    }
+
+    int cpu = -1;
+    if (period) {
+        cpu = thread_edf_admit(t, utilization);
+        if (cpu < 0) {
+            THREAD_UNLOCK(state);
+            return ERR_NO_RESOURCES;
+        }
+    }
+
+    if (thread_is_edf(t))
+        thread_edf_release_bandwidth(t);
+
+    t->edf.runtime = runtime;
+    t->edf.deadline = deadline;
+    t->edf.period = period;
+    t->edf.utilization = utilization;
+    t->edf.throttled = false;
+    t->edf.waiting = false;
+
+    if (period) {
+        run_queue[cpu].edf_utilization += utilization;
+        if (thread_pinned_cpu(t) < 0) {
+            thread_pin(t, cpu);
+            t->edf.auto_pinned = true;
+        }
+    }
+
+    if (t == current_thread) {
+        uint curr_cpu = arch_curr_cpu_num();
+        lk_bigtime_t now = current_time_hires();
+
+        /* the scheduling class of the running thread changed under the
+         * preemption and budget timers, set them up for the new one */
+        thread_update_preempt_tick(t, curr_cpu);
+        timer_cancel(&edf_budget_timer[curr_cpu]);
+        if (period) {
+            thread_edf_start_job(t, now, now);
+            thread_edf_arm_budget_timer(t, curr_cpu, now);
+        }
+
+        /* requeue, possibly on the cpu we were admitted on */
+        uint target = (thread_pinned_cpu(t) >= 0) ? (uint)thread_pinned_cpu(t) : curr_cpu;
+        t->state = THREAD_READY;
+        insert_in_run_queue_head(target, t);
+        mp_reschedule(1U << target, thread_ready_ipi_flags(t));
+        thread_resched();
+    }
+
+    THREAD_UNLOCK(state);
+
+    return NO_ERROR;
+}
+
+/**
+ * @brief Complete the current edf job and wait for the next period
+ *
+ * Counts a deadline miss if the job completed after its deadline. If the next
+ * period has already started, the next job is released immediately and the
+ * period is re-synchronized on the current time.
+ *
+ * @return NO_ERROR, or ERR_BAD_STATE if the current thread is not an edf thread
+ */
+status_t thread_wait_next_period(void)
+{
+    thread_t *current_thread = get_current_thread();
+
+    DEBUG_ASSERT(current_thread->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(current_thread->state == THREAD_RUNNING);
+
+    if (!thread_is_edf(current_thread))
+        return ERR_BAD_STATE;
+
+    THREAD_LOCK(state);
+
+    lk_bigtime_t now = current_time_hires();
+    uint cpu = arch_curr_cpu_num();
+
+    if (now > current_thread->edf.abs_deadline) {
+        current_thread->edf.deadline_misses++;
+        THREAD_STATS_INC(deadline_misses);
+    }
+
+    /* may be armed to replenish a throttled job */
+    timer_cancel(&current_thread->edf.period_timer);
+
+    lk_bigtime_t next = current_thread->edf.release + current_thread->edf.period;
+    if (next <= now) {
+        /* already late for the next period, start it right away */
+        thread_edf_start_job(current_thread, now, now);
+        thread_edf_arm_budget_timer(current_thread, cpu, now);
+        run_queue[cpu].curr_priority = EDF_CURR_PRIORITY;
+
+        /* let an edf thread with an earlier deadline go first */
+        current_thread->state = THREAD_READY;
+        insert_in_run_queue_head(cpu, current_thread);
+        thread_resched();
+    } else {
+        current_thread->edf.waiting = true;
+        current_thread->state = THREAD_SLEEPING;
+        timer_set_oneshot_hires(&current_thread->edf.period_timer, next - now,
+                                thread_edf_release_handler, current_thread);
+        thread_resched();
+    }
+
+    THREAD_UNLOCK(state);
+
+    return NO_ERROR;
+}
+#endif
+
 /**
  * @brief  Make a suspended thread executable.
  *
@@ -293,13 +1066,21 @@ status_t thread_resume(thread_t *t)
     bool ints_disabled = arch_ints_disabled();
     THREAD_LOCK(state);
     if (t->state == THREAD_SUSPENDED) {
+#if KERNEL_EDF
+        /* the first edf job is released when the thread starts */
+        if (thread_is_edf(t)) {
+            lk_bigtime_t now = current_time_hires();
+            thread_edf_start_job(t, now, now);
+        }
+#endif
+
         t->state = THREAD_READY;
-        insert_in_run_queue_head(t);
+        mp_cpu_mask_t target = insert_in_run_queue_wakeup(t, false);
         if (!ints_disabled) /* HACK, don't resced into bootstrap thread before idle thread is set up */
             resched = true;
-    }
 
-    mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+        mp_reschedule(target, thread_ready_ipi_flags(t));
+    }
 
     THREAD_UNLOCK(state);
 
@@ -411,6 +1192,11 @@ void thread_exit(int retcode)
     current_thread->state = THREAD_DEATH;
     current_thread->retcode = retcode;
 
+#if KERNEL_EDF
+    if (thread_is_edf(current_thread))
+        thread_edf_release_bandwidth(current_thread);
+#endif
+
     /* if we're detached, then do our teardown here */
     if (current_thread->flags & THREAD_FLAG_DETACHED) {
         /* remove it from the master thread list */
@@ -446,33 +1232,92 @@ static void idle_thread_routine(void)
         arch_idle();
 }
 
-static thread_t *get_top_thread(int cpu)
+#if WITH_SMP
+/* look for a thread on another cpu's run queue that is allowed to run on this
+ * cpu and is more important than anything queued locally. Only unpinned threads
+ * are candidates.
+ *
+ * The per cpu steal bitmaps pick the victim queue and level without walking
+ * any of the remote lists.
+ */
+static thread_t *steal_thread(uint cpu, int local_priority)
 {
-    thread_t *newthread;
-    uint32_t local_run_queue_bitmap = run_queue_bitmap;
+    thread_t *t;
+    int best_priority = local_priority;
+    int best_cpu = -1;
 
-    while (local_run_queue_bitmap) {
-        /* find the first (remaining) queue with a thread in it */
-        uint next_queue = sizeof(run_queue_bitmap) * 8 - 1 - __builtin_clz(local_run_queue_bitmap);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (i == cpu)
+            continue;
 
-        list_for_every_entry(&run_queue[next_queue], newthread, thread_t, queue_node) {
-#if WITH_SMP
-            if (newthread->pinned_cpu < 0 || newthread->pinned_cpu == cpu)
-#endif
-            {
-                list_delete(&newthread->queue_node);
+        /* only look at levels holding a thread we may take, and that would
+         * beat what we already found */
+        uint32_t bitmap = run_queue[i].steal_bitmap[cpu];
+        if (best_priority >= 0)
+            bitmap &= ~((2U << best_priority) - 1);
+        if (!bitmap)
+            continue;
 
-                if (list_is_empty(&run_queue[next_queue]))
-                    run_queue_bitmap &= ~(1<<next_queue);
+        best_cpu = i;
+        best_priority = sizeof(bitmap) * 8 - 1 - __builtin_clz(bitmap);
+    }
 
-                return newthread;
-            }
+    if (best_cpu < 0)
+        return NULL;
+
+    struct run_queue *rq = &run_queue[best_cpu];
+    thread_t *best = NULL;
+
+    /* take the first one in line we are allowed to run */
+    list_for_every_entry(&rq->list[best_priority], t, thread_t, queue_node) {
+        if (t->rq_mask & cpu_num_to_mask(cpu)) {
+            best = t;
+            break;
         }
+    }
+    DEBUG_ASSERT(best);
+
+    run_queue_remove(rq, best);
+    THREAD_STATS_INC(steals);
+
+    return best;
+}
+#endif
+
+static thread_t *get_top_thread(uint cpu)
+{
+    thread_t *newthread;
+    struct run_queue *rq = &run_queue[cpu];
+
+#if KERNEL_EDF
+    /* edf threads are pinned and run first, earliest deadline at the head */
+    newthread = list_peek_head_type(&rq->edf_list, thread_t, queue_node);
+    if (newthread) {
+        run_queue_remove(rq, newthread);
+        return newthread;
+    }
+#endif
+
+    int top = run_queue_top_priority(rq);
 
-        local_run_queue_bitmap &= ~(1<<next_queue);
+#if WITH_SMP
+    /* pull in an unpinned thread from another cpu if we would otherwise idle
+     * or it outranks everything queued here */
+    newthread = steal_thread(cpu, top);
+    if (newthread)
+        return newthread;
+#endif
+
+    if (top >= 0) {
+        /* everything on the local queue may run here, take the first one */
+        newthread = list_peek_head_type(&rq->list[top], thread_t, queue_node);
+        run_queue_remove(rq, newthread);
+    } else {
+        /* no threads to run, select the idle thread for this cpu */
+        newthread = idle_thread(cpu);
     }
-    /* no threads to run, select the idle thread for this cpu */
-    return idle_thread(cpu);
+
+    return newthread;
 }
 
 /**
@@ -507,6 +1352,18 @@ void thread_resched(void)
 
     oldthread = current_thread;
 
+    if (thread_is_idle(newthread))
+        run_queue[cpu].curr_priority = -1;
+#if KERNEL_EDF
+    else if (thread_is_edf_active(newthread))
+        run_queue[cpu].curr_priority = EDF_CURR_PRIORITY;
+#endif
+    else
+        run_queue[cpu].curr_priority = newthread->priority;
+
+    /* the run queue may have changed even if we keep running */
+    thread_update_preempt_tick(newthread, cpu);
+
     if (newthread == oldthread)
         return;
 
@@ -514,6 +1371,16 @@ void thread_resched(void)
     oldthread->runtime_us += now - oldthread->last_started_running_us;
     newthread->last_started_running_us = now;
 
+    thread_latency_switch(oldthread, newthread, cpu, now);
+
+#if KERNEL_EDF
+    /* edf budget enforcement follows the running thread */
+    if (thread_is_edf_active(oldthread))
+        timer_cancel(&edf_budget_timer[cpu]);
+    if (thread_is_edf_active(newthread))
+        thread_edf_arm_budget_timer(newthread, cpu, now);
+#endif
+
     /* set up quantum for the new thread if it was consumed */
     if (newthread->remaining_quantum <= 0) {
         newthread->remaining_quantum = 5; // XXX make this smarter
@@ -521,6 +1388,7 @@ void thread_resched(void)
 
     /* mark the cpu ownership of the threads */
     thread_set_curr_cpu(oldthread, -1);
+    thread_set_last_cpu(oldthread, cpu);
     thread_set_curr_cpu(newthread, cpu);
 
 #if WITH_SMP
@@ -550,27 +1418,6 @@ void thread_resched(void)
 
     KEVLOG_THREAD_SWITCH(oldthread, newthread);
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-    if (thread_is_real_time_or_idle(newthread)) {
-        if (!thread_is_real_time_or_idle(oldthread)) {
-            /* if we're switching from a non real time to a real time, cancel
-             * the preemption timer. */
-#if DEBUG_THREAD_CONTEXT_SWITCH
-            dprintf(ALWAYS, "arch_context_switch: stop preempt, cpu %d, old %p (%s), new %p (%s)\n",
-                    cpu, oldthread, oldthread->name, newthread, newthread->name);
-#endif
-            timer_cancel(&preempt_timer[cpu]);
-        }
-    } else if (thread_is_real_time_or_idle(oldthread)) {
-        /* if we're switching from a real time (or idle thread) to a regular one,
-         * set up a periodic timer to run our preemption tick. */
-#if DEBUG_THREAD_CONTEXT_SWITCH
-        dprintf(ALWAYS, "arch_context_switch: start preempt, cpu %d, old %p (%s), new %p (%s)\n",
-                cpu, oldthread, oldthread->name, newthread, newthread->name);
-#endif
-        timer_set_periodic(&preempt_timer[cpu], 10, (timer_callback)thread_timer_tick, NULL);
-    }
-#endif
 
     /* set some optional target debug leds */
     target_set_debug_led(0, !thread_is_idle(newthread));
@@ -641,7 +1488,7 @@ void thread_yield(void)
     current_thread->state = THREAD_READY;
     current_thread->remaining_quantum = 0;
     if (likely(!thread_is_idle(current_thread))) { /* idle thread doesn't go in the run queue */
-        insert_in_run_queue_tail(current_thread);
+        insert_in_run_queue_tail(arch_curr_cpu_num(), current_thread);
     }
     thread_resched();
 
@@ -683,9 +1530,9 @@ void thread_preempt(void)
     current_thread->state = THREAD_READY;
     if (likely(!thread_is_idle(current_thread))) { /* idle thread doesn't go in the run queue */
         if (current_thread->remaining_quantum > 0)
-            insert_in_run_queue_head(current_thread);
+            insert_in_run_queue_head(arch_curr_cpu_num(), current_thread);
         else
-            insert_in_run_queue_tail(current_thread); /* if we're out of quantum, go to the tail of the queue */
+            insert_in_run_queue_tail(arch_curr_cpu_num(), current_thread); /* if we're out of quantum, go to the tail of the queue */
     }
     thread_resched();
 
@@ -723,8 +1570,7 @@ void thread_unblock(thread_t *t, bool resched)
     DEBUG_ASSERT(!thread_is_idle(t));
 
     t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
-    mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+    mp_reschedule(insert_in_run_queue_wakeup(t, resched), thread_ready_ipi_flags(t));
     if (resched)
         thread_resched();
 }
@@ -755,11 +1601,12 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
     THREAD_LOCK(state);
 
     t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
+    mp_cpu_mask_t target = insert_in_run_queue_wakeup(t, false);
+    mp_reschedule(target, thread_ready_ipi_flags(t));
 
     THREAD_UNLOCK(state);
 
-    return INT_RESCHEDULE;
+    return (target & (1U << arch_curr_cpu_num())) ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
 }
 
 /**
@@ -773,6 +1620,16 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
  * be placed at the head of the run queue.
  */
 void thread_sleep(lk_time_t delay)
+{
+    thread_sleep_hires(delay ? delay * 1000ULL : 1000);
+}
+
+/**
+ * @brief  Put thread to sleep; delay specified in us
+ *
+ * Same as thread_sleep(), for delays that need sub-millisecond resolution.
+ */
+void thread_sleep_hires(lk_bigtime_t delay)
 {
     timer_t timer;
 
@@ -785,7 +1642,7 @@ void thread_sleep(lk_time_t delay)
     timer_initialize(&timer);
 
     THREAD_LOCK(state);
-    timer_set_oneshot(&timer, delay, thread_sleep_handler, (void *)current_thread);
+    timer_set_oneshot_hires(&timer, delay, thread_sleep_handler, (void *)current_thread);
     current_thread->state = THREAD_SLEEPING;
     thread_resched();
     THREAD_UNLOCK(state);
@@ -803,8 +1660,14 @@ void thread_init_early(void)
     DEBUG_ASSERT(arch_curr_cpu_num() == 0);
 
     /* initialize the run queues */
-    for (i=0; i < NUM_PRIORITIES; i++)
-        list_initialize(&run_queue[i]);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        for (i=0; i < NUM_PRIORITIES; i++)
+            list_initialize(&run_queue[cpu].list[i]);
+#if KERNEL_EDF
+        list_initialize(&run_queue[cpu].edf_list);
+#endif
+        run_queue[cpu].curr_priority = -1;
+    }
 
     /* initialize the thread list */
     list_initialize(&thread_list);
@@ -818,12 +1681,30 @@ void thread_init_early(void)
     t->state = THREAD_RUNNING;
     t->flags = THREAD_FLAG_DETACHED;
     thread_set_curr_cpu(t, 0);
-    thread_set_pinned_cpu(t, 0);
+    thread_pin(t, 0);
     wait_queue_init(&t->retcode_wait_queue);
     list_add_head(&thread_list, &t->thread_list_node);
     set_current_thread(t);
 }
 
+#if THREAD_STATS
+lk_bigtime_t thread_stats_idle_time(uint cpu)
+{
+    spin_lock_saved_state_t state;
+    lk_bigtime_t idle_time;
+
+    /* idle periods are only accounted when the cpu switches away from its
+     * idle thread, which may take arbitrarily long without a tick */
+    spin_lock_irqsave(&thread_lock, state);
+    idle_time = thread_stats[cpu].idle_time;
+    if (mp_is_cpu_idle(cpu))
+        idle_time += current_time_hires() - thread_stats[cpu].last_idle_timestamp;
+    spin_unlock_irqrestore(&thread_lock, state);
+
+    return idle_time;
+}
+#endif
+
 /**
  * @brief Complete thread initialization
  *
@@ -831,11 +1712,14 @@ void thread_init_early(void)
  */
 void thread_init(void)
 {
-#if PLATFORM_HAS_DYNAMIC_TIMER
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+#if PLATFORM_HAS_DYNAMIC_TIMER
         timer_initialize(&preempt_timer[i]);
-    }
 #endif
+#if KERNEL_EDF
+        timer_initialize(&edf_budget_timer[i]);
+#endif
+    }
 }
 
 /**
@@ -865,7 +1749,7 @@ void thread_set_priority(int priority)
     current_thread->priority = priority;
 
     current_thread->state = THREAD_READY;
-    insert_in_run_queue_head(current_thread);
+    insert_in_run_queue_head(arch_curr_cpu_num(), current_thread);
     thread_resched();
 
     THREAD_UNLOCK(state);
@@ -895,7 +1779,7 @@ void thread_become_idle(void)
     /* mark ourself as idle */
     t->priority = IDLE_PRIORITY;
     t->flags |= THREAD_FLAG_IDLE;
-    thread_set_pinned_cpu(t, arch_curr_cpu_num());
+    thread_pin(t, arch_curr_cpu_num());
 
     mp_set_curr_cpu_active(true);
     mp_set_cpu_idle(arch_curr_cpu_num());
@@ -920,14 +1804,14 @@ void thread_secondary_cpu_init_early(void)
     char name[16];
     snprintf(name, sizeof(name), "idle %u", cpu);
     init_thread_struct(t, name);
-    thread_set_pinned_cpu(t, cpu);
+    thread_pin(t, cpu);
 
     /* half construct this thread, since we're already running */
     t->priority = HIGHEST_PRIORITY;
     t->state = THREAD_RUNNING;
     t->flags = THREAD_FLAG_DETACHED | THREAD_FLAG_IDLE;
     thread_set_curr_cpu(t, cpu);
-    thread_set_pinned_cpu(t, cpu);
+    thread_pin(t, cpu);
     wait_queue_init(&t->retcode_wait_queue);
 
     THREAD_LOCK(state);
@@ -1004,14 +1888,22 @@ void dump_thread(thread_t *t)
 
     dprintf(INFO, "dump_thread: t %p (%s)\n", t, t->name);
 #if WITH_SMP
-    dprintf(INFO, "\tstate %s, curr_cpu %d, pinned_cpu %d, priority %d, remaining quantum %d %s\n",
-            thread_state_to_str(t->state), t->curr_cpu, t->pinned_cpu, t->priority, t->remaining_quantum, t->flags & THREAD_FLAG_REAL_TIME? "realtime":"");
+    dprintf(INFO, "\tstate %s, curr_cpu %d, pinned_cpu %d, affinity 0x%x, priority %d, remaining quantum %d %s\n",
+            thread_state_to_str(t->state), t->curr_cpu, t->pinned_cpu, t->affinity, t->priority, t->remaining_quantum, t->flags & THREAD_FLAG_REAL_TIME? "realtime":"");
 #else
     dprintf(INFO, "\tstate %s, priority %d, remaining quantum %d\n",
             thread_state_to_str(t->state), t->priority, t->remaining_quantum);
 #endif
 
     dprintf(INFO, "\truntime_us %lld, runtime_s %lld\n", runtime, runtime / 1000000);
+#if KERNEL_EDF
+    if (thread_is_edf(t)) {
+        dprintf(INFO, "\tedf runtime %llu, deadline %llu, period %llu us%s\n",
+                t->edf.runtime, t->edf.deadline, t->edf.period, t->edf.throttled ? ", throttled" : "");
+        dprintf(INFO, "\tedf jobs %lu, deadline misses %lu, budget overruns %lu\n",
+                t->edf.jobs, t->edf.deadline_misses, t->edf.budget_overruns);
+    }
+#endif
 #ifdef THREAD_STACK_HIGHWATER
     dprintf(INFO, "\tstack %p, stack_size %zd, stack_used %zd\n",
             t->stack, t->stack_size, thread_stack_used(t));
@@ -1088,6 +1980,92 @@ void dump_all_threads(void)
         printf("All threads were not printed. Increase number of threads (nr_threads).\n");
 }
 
+#if THREAD_LATENCY_STATS
+struct thread_latency_snapshot {
+    char name[32];
+    thread_t *t;
+    lk_bigtime_t runtime;
+    struct latency_histogram wakeup_latency;
+    struct latency_histogram queue_latency;
+};
+
+/**
+ * @brief  Dump the cpu time and scheduling latencies of all threads
+ *
+ * @param trace Also export the histograms to the tracelog
+ * @param reset Clear the histograms once dumped
+ */
+void dump_all_thread_latencies(bool trace, bool reset)
+{
+    spin_lock_saved_state_t state;
+    struct thread_latency_snapshot *snap, *s;
+    thread_t *t;
+    uint nr_threads = 0, n = 0;
+
+    spin_lock_irqsave(&thread_lock, state);
+    list_for_every_entry(&thread_list, t, thread_t, thread_list_node)
+        nr_threads++;
+    spin_unlock_irqrestore(&thread_lock, state);
+
+    /* room for threads created in the meantime */
+    nr_threads += 16;
+    snap = malloc(nr_threads * sizeof(*snap));
+    if (!snap)
+        return;
+
+    lk_bigtime_t now = current_time_hires();
+
+    spin_lock_irqsave(&thread_lock, state);
+    list_for_every_entry(&thread_list, t, thread_t, thread_list_node) {
+        if (t->magic != THREAD_MAGIC)
+            continue;
+        if (n == nr_threads)
+            break;
+
+        s = &snap[n++];
+        strlcpy(s->name, t->name, sizeof(s->name));
+        s->t = t;
+        s->runtime = thread_runtime(t, now);
+        s->wakeup_latency = t->wakeup_latency;
+        s->queue_latency = t->queue_latency;
+        if (reset) {
+            memset(&t->wakeup_latency, 0, sizeof(t->wakeup_latency));
+            memset(&t->queue_latency, 0, sizeof(t->queue_latency));
+        }
+    }
+    spin_unlock_irqrestore(&thread_lock, state);
+
+    printf("%-32s %12s %8s %8s %8s %8s %8s %8s\n", "thread", "cpu time us",
+           "wakeups", "avg us", "max us", "queued", "avg us", "max us");
+    for (uint i = 0; i < n; i++) {
+        s = &snap[i];
+
+        printf("%-32s %12llu %8u %8llu %8llu %8u %8llu %8llu\n", s->name, s->runtime,
+               s->wakeup_latency.count,
+               s->wakeup_latency.count ? s->wakeup_latency.total / s->wakeup_latency.count : 0,
+               s->wakeup_latency.max,
+               s->queue_latency.count,
+               s->queue_latency.count ? s->queue_latency.total / s->queue_latency.count : 0,
+               s->queue_latency.max);
+
+        if (trace) {
+            struct kevlog_sched_latency src = {
+                .name = s->name,
+                .id = (uintptr_t)s->t,
+                .kind = KEVLOG_LATENCY_WAKEUP,
+                .hist = &s->wakeup_latency,
+            };
+            KEVLOG_SCHED_LATENCY(&src);
+            src.kind = KEVLOG_LATENCY_QUEUE;
+            src.hist = &s->queue_latency;
+            KEVLOG_SCHED_LATENCY(&src);
+        }
+    }
+
+    free(snap);
+}
+#endif
+
 /** @} */
 
 
@@ -1137,6 +2115,17 @@ static enum handler_return wait_queue_timeout_handler(timer_t *timer, lk_time_t
  * value specified when the queue was woken by wait_queue_wake_one().
  */
 status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
+{
+    return wait_queue_block_hires(wait, timeout == INFINITE_TIME ? INFINITE_TIME_HIRES : timeout * 1000ULL);
+}
+
+/**
+ * @brief  Block until a wait queue is notified, timeout in us.
+ *
+ * Same as wait_queue_block(), with a timeout in microseconds.
+ * INFINITE_TIME_HIRES waits indefinitely.
+ */
+status_t wait_queue_block_hires(wait_queue_t *wait, lk_bigtime_t timeout)
 {
     timer_t timer;
 
@@ -1157,15 +2146,15 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
     current_thread->wait_queue_block_ret = NO_ERROR;
 
     /* if the timeout is nonzero or noninfinite, set a callback to yank us out of the queue */
-    if (timeout != INFINITE_TIME) {
+    if (timeout != INFINITE_TIME_HIRES) {
         timer_initialize(&timer);
-        timer_set_oneshot(&timer, timeout, wait_queue_timeout_handler, (void *)current_thread);
+        timer_set_oneshot_hires(&timer, timeout, wait_queue_timeout_handler, (void *)current_thread);
     }
 
     thread_resched();
 
     /* we don't really know if the timer fired or not, so it's better safe to try to cancel it */
-    if (timeout != INFINITE_TIME) {
+    if (timeout != INFINITE_TIME_HIRES) {
         timer_cancel(&timer);
     }
 
@@ -1211,10 +2200,9 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
          */
         if (reschedule) {
             current_thread->state = THREAD_READY;
-            insert_in_run_queue_head(current_thread);
+            insert_in_run_queue_head(arch_curr_cpu_num(), current_thread);
         }
-        insert_in_run_queue_head(t);
-        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+        mp_reschedule(insert_in_run_queue_wakeup(t, reschedule), thread_ready_ipi_flags(t));
         if (reschedule) {
             thread_resched();
         }
@@ -1244,6 +2232,8 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
 {
     thread_t *t;
     int ret = 0;
+    mp_cpu_mask_t target = 0;
+    uint ipi_flags = 0;
 
     thread_t *current_thread = get_current_thread();
 
@@ -1257,7 +2247,7 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
          * before the current one, but the current one doesn't get unnecessarilly punished.
          */
         current_thread->state = THREAD_READY;
-        insert_in_run_queue_head(current_thread);
+        insert_in_run_queue_head(arch_curr_cpu_num(), current_thread);
     }
 
     /* pop all the threads off the wait queue into the run queue */
@@ -1268,14 +2258,15 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
         t->wait_queue_block_ret = wait_queue_error;
         t->blocking_wait_queue = NULL;
 
-        insert_in_run_queue_head(t);
+        target |= insert_in_run_queue_wakeup(t, false);
+        ipi_flags |= thread_ready_ipi_flags(t);
         ret++;
     }
 
     DEBUG_ASSERT(wait->count == 0);
 
     if (ret > 0) {
-        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+        mp_reschedule(target, ipi_flags);
         if (reschedule) {
             thread_resched();
         }
@@ -1329,8 +2320,7 @@ status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
     t->blocking_wait_queue = NULL;
     t->state = THREAD_READY;
     t->wait_queue_block_ret = wait_queue_error;
-    insert_in_run_queue_head(t);
-    mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+    mp_reschedule(insert_in_run_queue_wakeup(t, false), thread_ready_ipi_flags(t));
 
     return NO_ERROR;
 }
@@ -49,8 +49,12 @@
 
 spin_lock_t timer_lock;
 
+/* pending timers of each cpu are kept in a pairing heap ordered by deadline:
+ * O(1) insert and peek, O(log n) amortized removal of the earliest timer
+ * or of an arbitrary one.
+ */
 struct timer_state {
-    struct list_node timer_queue;
+    timer_t *heap;
 } __CPU_ALIGN;
 
 static struct timer_state timers[SMP_MAX_CPUS];
@@ -65,44 +69,130 @@ void timer_initialize(timer_t *timer)
     *timer = (timer_t)TIMER_INITIAL_VALUE(*timer);
 }
 
+/* meld two heap roots, returns the new root */
+static timer_t *timer_heap_meld(timer_t *a, timer_t *b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+
+    if (b->scheduled_time < a->scheduled_time) {
+        timer_t *tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    /* b becomes the first child of a */
+    b->heap_prev = a;
+    b->heap_next = a->heap_child;
+    if (a->heap_child)
+        a->heap_child->heap_prev = b;
+    a->heap_child = b;
+
+    return a;
+}
+
+/* two pass pairing of a sibling list, returns the new root */
+static timer_t *timer_heap_merge_pairs(timer_t *first)
+{
+    timer_t *pairs = NULL;
+    timer_t *root = NULL;
+
+    /* left to right, meld siblings two by two and stack the results */
+    while (first) {
+        timer_t *a = first;
+        timer_t *b = a->heap_next;
+
+        first = b ? b->heap_next : NULL;
+        a->heap_next = a->heap_prev = NULL;
+        if (b)
+            b->heap_next = b->heap_prev = NULL;
+
+        a = timer_heap_meld(a, b);
+        a->heap_next = pairs;
+        pairs = a;
+    }
+
+    /* right to left, meld the stacked pairs into a single root */
+    while (pairs) {
+        timer_t *next = pairs->heap_next;
+
+        pairs->heap_next = NULL;
+        root = timer_heap_meld(root, pairs);
+        pairs = next;
+    }
+
+    return root;
+}
+
 static void insert_timer_in_queue(uint cpu, timer_t *timer)
 {
-    timer_t *entry;
+    DEBUG_ASSERT(arch_ints_disabled());
+    DEBUG_ASSERT(!timer_is_queued(timer));
+
+    LTRACEF("timer %p, cpu %u, scheduled %llu, periodic %llu\n", timer, cpu, timer->scheduled_time, timer->periodic_time);
+
+    timer->heap_child = timer->heap_next = timer->heap_prev = NULL;
+    timer->queued = true;
+    timer->queued_cpu = cpu;
+    timers[cpu].heap = timer_heap_meld(timers[cpu].heap, timer);
+}
 
+static void remove_timer_from_queue(timer_t *timer)
+{
     DEBUG_ASSERT(arch_ints_disabled());
+    DEBUG_ASSERT(timer_is_queued(timer));
 
-    LTRACEF("timer %p, cpu %u, scheduled %u, periodic %u\n", timer, cpu, timer->scheduled_time, timer->periodic_time);
+    struct timer_state *ts = &timers[timer->queued_cpu];
+    timer_t *children = timer_heap_merge_pairs(timer->heap_child);
 
-    list_for_every_entry(&timers[cpu].timer_queue, entry, timer_t, node) {
-        if (TIME_GT(entry->scheduled_time, timer->scheduled_time)) {
-            list_add_before(&entry->node, &timer->node);
-            return;
-        }
+    if (ts->heap == timer) {
+        ts->heap = children;
+    } else {
+        /* unlink from the parent or sibling list, then meld the children back in */
+        if (timer->heap_prev->heap_child == timer)
+            timer->heap_prev->heap_child = timer->heap_next;
+        else
+            timer->heap_prev->heap_next = timer->heap_next;
+        if (timer->heap_next)
+            timer->heap_next->heap_prev = timer->heap_prev;
+
+        ts->heap = timer_heap_meld(ts->heap, children);
     }
 
-    /* walked off the end of the list */
-    list_add_tail(&timers[cpu].timer_queue, &timer->node);
+    timer->heap_child = timer->heap_next = timer->heap_prev = NULL;
+    timer->queued = false;
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+__WEAK status_t platform_set_oneshot_timer_hires(platform_timer_callback callback, void *arg, lk_bigtime_t interval)
+{
+    lk_bigtime_t interval_ms = (interval + 999) / 1000;
+
+    return platform_set_oneshot_timer(callback, arg, interval_ms > UINT32_MAX ? UINT32_MAX : (lk_time_t)interval_ms);
 }
+#endif
 
-static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_callback callback, void *arg)
+static void timer_set(timer_t *timer, lk_bigtime_t delay, lk_bigtime_t period, timer_callback callback, void *arg)
 {
-    lk_time_t now;
+    lk_bigtime_t now;
 
-    LTRACEF("timer %p, delay %u, period %u, callback %p, arg %p\n", timer, delay, period, callback, arg);
+    LTRACEF("timer %p, delay %llu, period %llu, callback %p, arg %p\n", timer, delay, period, callback, arg);
 
     DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
 
-    if (list_in_list(&timer->node)) {
+    if (timer_is_queued(timer)) {
         panic("timer %p already in list\n", timer);
     }
 
-    now = current_time();
+    now = current_time_hires();
     timer->scheduled_time = now + delay;
     timer->periodic_time = period;
     timer->callback = callback;
     timer->arg = arg;
 
-    LTRACEF("scheduled time %u\n", timer->scheduled_time);
+    LTRACEF("scheduled time %llu\n", timer->scheduled_time);
 
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&timer_lock, state);
@@ -111,10 +201,10 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
     insert_timer_in_queue(cpu, timer);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    if (list_peek_head_type(&timers[cpu].timer_queue, timer_t, node) == timer) {
+    if (timers[cpu].heap == timer) {
         /* we just modified the head of the timer queue */
-        LTRACEF("setting new timer for %u msecs\n", delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
+        LTRACEF("setting new timer for %llu usecs\n", delay);
+        platform_set_oneshot_timer_hires(timer_tick, NULL, delay);
     }
 #endif
 
@@ -139,7 +229,7 @@ void timer_set_oneshot(timer_t *timer, lk_time_t delay, timer_callback callback,
 {
     if (delay == 0)
         delay = 1;
-    timer_set(timer, delay, 0, callback, arg);
+    timer_set(timer, delay * 1000ULL, 0, callback, arg);
 }
 
 /**
@@ -157,6 +247,33 @@ void timer_set_oneshot(timer_t *timer, lk_time_t delay, timer_callback callback,
  *   enum handler_return callback(struct timer *, lk_time_t now, void *arg) { ... }
  */
 void timer_set_periodic(timer_t *timer, lk_time_t period, timer_callback callback, void *arg)
+{
+    if (period == 0)
+        period = 1;
+    timer_set(timer, period * 1000ULL, period * 1000ULL, callback, arg);
+}
+
+/**
+ * @brief  Set up a timer that executes once, with a delay in us
+ *
+ * Same as timer_set_oneshot(), for deadlines that need sub-millisecond
+ * resolution. Resolution is bounded by the platform timer.
+ */
+void timer_set_oneshot_hires(timer_t *timer, lk_bigtime_t delay, timer_callback callback, void *arg)
+{
+    if (delay == 0)
+        delay = 1;
+    timer_set(timer, delay, 0, callback, arg);
+}
+
+/**
+ * @brief  Set up a timer that executes repeatedly, with a period in us
+ *
+ * Same as timer_set_periodic(), for periods that need sub-millisecond
+ * resolution. Deadlines are advanced by exactly one period on every
+ * expiration so they do not drift with interrupt latency.
+ */
+void timer_set_periodic_hires(timer_t *timer, lk_bigtime_t period, timer_callback callback, void *arg)
 {
     if (period == 0)
         period = 1;
@@ -174,13 +291,18 @@ void timer_cancel(timer_t *timer)
     spin_lock_irqsave(&timer_lock, state);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
+    /* only the local hardware timer can be reprogrammed from here. When
+     * cancelling the head timer of another cpu, its hardware timer is left
+     * armed for the old deadline and timer_tick() there rearms it for the
+     * new head, see below. */
     uint cpu = arch_curr_cpu_num();
+    bool local = !timer_is_queued(timer) || timer->queued_cpu == cpu;
 
-    timer_t *oldhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+    timer_t *oldhead = timers[cpu].heap;
 #endif
 
-    if (list_in_list(&timer->node))
-        list_delete(&timer->node);
+    if (timer_is_queued(timer))
+        remove_timer_from_queue(timer);
 
     /* to keep it from being reinserted into the queue if called from
      * periodic timer callback.
@@ -191,21 +313,23 @@ void timer_cancel(timer_t *timer)
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
     /* see if we've just modified the head of the timer queue */
-    timer_t *newhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (newhead == NULL) {
-        LTRACEF("clearing old hw timer, nothing in the queue\n");
-        platform_stop_timer();
-    } else if (newhead != oldhead) {
-        lk_time_t delay;
-        lk_time_t now = current_time();
-
-        if (TIME_LT(newhead->scheduled_time, now))
-            delay = 0;
-        else
-            delay = newhead->scheduled_time - now;
-
-        LTRACEF("setting new timer to %u\n", (uint) delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
+    timer_t *newhead = timers[cpu].heap;
+    if (local && newhead != oldhead) {
+        if (newhead == NULL) {
+            LTRACEF("clearing old hw timer, nothing in the queue\n");
+            platform_stop_timer();
+        } else {
+            lk_bigtime_t delay;
+            lk_bigtime_t now = current_time_hires();
+
+            if (newhead->scheduled_time < now)
+                delay = 0;
+            else
+                delay = newhead->scheduled_time - now;
+
+            LTRACEF("setting new timer to %llu\n", delay);
+            platform_set_oneshot_timer_hires(timer_tick, NULL, delay);
+        }
     }
 #endif
 
@@ -217,6 +341,7 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 {
     timer_t *timer;
     enum handler_return ret = INT_NO_RESCHEDULE;
+    lk_bigtime_t now_hires = current_time_hires();
 
     DEBUG_ASSERT(arch_ints_disabled());
 
@@ -225,28 +350,28 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 
     uint cpu = arch_curr_cpu_num();
 
-    LTRACEF("cpu %u now %u, sp %p\n", cpu, now, __GET_FRAME());
+    LTRACEF("cpu %u now %llu, sp %p\n", cpu, now_hires, __GET_FRAME());
 
     spin_lock(&timer_lock);
 
     for (;;) {
         /* see if there's an event to process */
-        timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+        timer = timers[cpu].heap;
         if (likely(timer == 0))
             break;
-        LTRACEF("next item on timer queue %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
-        if (likely(TIME_LT(now, timer->scheduled_time)))
+        LTRACEF("next item on timer queue %p at %llu now %llu (%p, arg %p)\n", timer, timer->scheduled_time, now_hires, timer->callback, timer->arg);
+        if (likely(now_hires < timer->scheduled_time))
             break;
 
         /* process it */
         LTRACEF("timer %p\n", timer);
         DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
-        list_delete(&timer->node);
+        remove_timer_from_queue(timer);
 
         /* we pulled it off the list, release the list lock to handle it */
         spin_unlock(&timer_lock);
 
-        LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
+        LTRACEF("dequeued timer %p, scheduled %llu periodic %llu\n", timer, timer->scheduled_time, timer->periodic_time);
 
         THREAD_STATS_INC(timers);
 
@@ -263,24 +388,30 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
         /* if it was a periodic timer and it hasn't been requeued
          * by the callback put it back in the list
          */
-        if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
-            LTRACEF("periodic timer, period %u\n", timer->periodic_time);
-            timer->scheduled_time = now + timer->periodic_time;
+        if (periodic && !timer_is_queued(timer) && timer->periodic_time > 0) {
+            LTRACEF("periodic timer, period %llu\n", timer->periodic_time);
+            timer->scheduled_time += timer->periodic_time;
+            /* if we fell more than a period behind, skip the missed expirations */
+            if (timer->scheduled_time <= now_hires)
+                timer->scheduled_time = now_hires + timer->periodic_time;
             insert_timer_in_queue(cpu, timer);
         }
     }
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    /* reset the timer to the next event */
-    timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+    /* reset the timer to the next event. This may be an early interrupt for
+     * a head timer another cpu cancelled, in which case nothing was due and
+     * the hardware is simply rearmed for the new head, or left idle if the
+     * queue is now empty. */
+    timer = timers[cpu].heap;
     if (timer) {
         /* has to be the case or it would have fired already */
-        DEBUG_ASSERT(TIME_GT(timer->scheduled_time, now));
+        DEBUG_ASSERT(timer->scheduled_time > now_hires);
 
-        lk_time_t delay = timer->scheduled_time - now;
+        lk_bigtime_t delay = timer->scheduled_time - now_hires;
 
-        LTRACEF("setting new timer for %u msecs for event %p\n", (uint)delay, timer);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
+        LTRACEF("setting new timer for %llu usecs for event %p\n", delay, timer);
+        platform_set_oneshot_timer_hires(timer_tick, NULL, delay);
     }
 
     /* we're done manipulating the timer queue */
@@ -303,7 +434,7 @@ void timer_init(void)
     arch_spin_lock_init(&timer_lock);
 
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-        list_initialize(&timers[i].timer_queue);
+        timers[i].heap = NULL;
     }
 #if !PLATFORM_HAS_DYNAMIC_TIMER
     /* register for a periodic timer tick */
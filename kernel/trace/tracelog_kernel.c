@@ -49,11 +49,59 @@ struct tracelog_kernel_preempt {
     uint32_t prio;
 } __PACKED;
 
+#if THREAD_LATENCY_STATS
+struct tracelog_kernel_sched_latency {
+    uint8_t comm[32];
+    uint64_t id;
+    uint8_t kind;
+    uint32_t count;
+    uint64_t total;
+    uint64_t max;
+    uint32_t buckets[LATENCY_HIST_BUCKETS];
+} __PACKED;
+#endif
+
 struct tracelog_kernel_timer_call {
     uintptr_t callback;
     uintptr_t arg;
 } __PACKED;
 
+#if THREAD_LATENCY_STATS
+static void sched_latency_print(struct tracelog_entry_header *header, void *buf)
+{
+    struct tracelog_kernel_sched_latency *t_lat;
+
+    t_lat = (struct tracelog_kernel_sched_latency *) buf;
+
+    printf("Sched latency \"%s\" [ID: %#llx] %s: %u samples, avg %llu us, max %llu us, log2 buckets:",
+            t_lat->comm, (unsigned long long)t_lat->id, t_lat->kind == KEVLOG_LATENCY_WAKEUP ? "wakeup" : "queue",
+            t_lat->count, t_lat->count ? t_lat->total / t_lat->count : 0, t_lat->max);
+    for (int i = 0; i < LATENCY_HIST_BUCKETS; i++)
+        printf(" %u", t_lat->buckets[i]);
+    printf("\n");
+}
+
+static void sched_latency_store(struct tracelog_entry_header *header, void *arg0, void *arg1)
+{
+    struct tracelog_kernel_sched_latency *t_lat;
+    struct kevlog_sched_latency *src;
+
+    t_lat = (struct tracelog_kernel_sched_latency *) &header->data[0];
+
+    src = (struct kevlog_sched_latency *) arg0;
+
+    strlcpy((char *) t_lat->comm, src->name, sizeof(t_lat->comm));
+    t_lat->id = src->id;
+    t_lat->kind = src->kind;
+    t_lat->count = src->hist->count;
+    t_lat->total = src->hist->total;
+    t_lat->max = src->hist->max;
+    memcpy(t_lat->buckets, src->hist->buckets, sizeof(t_lat->buckets));
+
+    header->len = sizeof(struct tracelog_kernel_sched_latency);
+}
+#endif
+
 static void timer_call_print(struct tracelog_entry_header *header, void *buf)
 {
     struct tracelog_kernel_timer_call *t_call;
@@ -188,6 +236,9 @@ static struct tracelog_hooks hooks[] = {
     [KERNEL_EVLOG_TIMER_CALL]       = { timer_call_print, timer_call_store, NULL },
     [KERNEL_EVLOG_IRQ_ENTER]        = { irq_print, irq_store, NULL },
     [KERNEL_EVLOG_IRQ_EXIT]         = { irq_print, irq_store, NULL },
+#if THREAD_LATENCY_STATS
+    [KERNEL_EVLOG_SCHED_LATENCY]    = { sched_latency_print, sched_latency_store, NULL },
+#endif
 };
 
 bool tracelog_kernel_no_ipc_trace(struct tracelog_entry_header *header, void *arg0, void *arg1)
@@ -195,7 +246,7 @@ bool tracelog_kernel_no_ipc_trace(struct tracelog_entry_header *header, void *ar
     int t = TRACELOG_SUBTYPE(header->type);
     bool filter_out = false;
 
-    if (t > KERNEL_EVLOG_IRQ_EXIT)
+    if (t >= (int)countof(hooks) || !hooks[t].print)
         return false;
 
     if (hooks[t].no_trace)
@@ -208,7 +259,7 @@ void tracelog_kernel_print(struct tracelog_entry_header *header, void *buf)
 {
     int t = TRACELOG_SUBTYPE(header->type);
 
-    if (t > KERNEL_EVLOG_IRQ_EXIT)
+    if (t >= (int)countof(hooks) || !hooks[t].print)
         return;
 
     hooks[t].print(header, buf);
@@ -218,7 +269,7 @@ void tracelog_kernel_store(struct tracelog_entry_header *header, void *arg0, voi
 {
     int t = TRACELOG_SUBTYPE(header->type);
 
-    if (t > KERNEL_EVLOG_IRQ_EXIT)
+    if (t >= (int)countof(hooks) || !hooks[t].print)
         return;
 
     hooks[t].store(header, arg0, arg1);
@@ -32,12 +32,39 @@
 #include <pow2.h>
 #include <lib/console.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <arch/ops.h>
 
 #define LOCAL_TRACE 0
 
 static struct list_node arena_list = LIST_INITIAL_VALUE(arena_list);
 static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
 
+/* Per cpu caches of free pages in front of the arenas, so the common single
+ * page allocation and free only take the local cpu's cache lock instead of
+ * the pmm lock. They are refilled from and drained to the arenas a batch at
+ * a time. Cached pages come from KMAP arenas and are marked allocated, so
+ * they do not count as free in their arena. Other cpus only take a cache's
+ * lock to drain it when a contiguous allocation comes up short.
+ */
+#ifndef PMM_PCPU_CACHE_SIZE
+#define PMM_PCPU_CACHE_SIZE 32
+#endif
+#define PMM_PCPU_CACHE_BATCH (PMM_PCPU_CACHE_SIZE / 2)
+
+struct pmm_pcpu_cache {
+    spin_lock_t lock;
+    uint count;
+    vm_page_t *pages[PMM_PCPU_CACHE_SIZE];
+
+    /* statistics */
+    ulong hits;
+    ulong refills;
+    ulong drains;
+} __CPU_ALIGN;
+
+static struct pmm_pcpu_cache pcpu_cache[SMP_MAX_CPUS];
+
 #define PAGE_BELONGS_TO_ARENA(page, arena) \
     (((uintptr_t)(page) >= (uintptr_t)(arena)->page_array) && \
      ((uintptr_t)(page) < ((uintptr_t)(arena)->page_array + (arena)->size / PAGE_SIZE * sizeof(vm_page_t))))
@@ -53,6 +80,151 @@ static inline bool page_is_free(const vm_page_t *page)
     return !(page->flags & VM_PAGE_FLAG_NONFREE);
 }
 
+static inline size_t arena_page_count(const pmm_arena_t *arena)
+{
+    return arena->size / PAGE_SIZE;
+}
+
+/*
+ * Free pages are kept in buddy blocks: naturally aligned (relative to the
+ * start of the arena) runs of 1 << order pages, on one free list per order.
+ * The first page of a free block carries VM_PAGE_FLAG_FREE_HEAD and the
+ * block's order, the buddy of the block at page index i is at i ^ (1 << order).
+ * Every page of a free block has VM_PAGE_FLAG_NONFREE clear.
+ */
+static void buddy_add_block(pmm_arena_t *a, size_t index, uint order)
+{
+    vm_page_t *page = &a->page_array[index];
+
+    page->flags |= VM_PAGE_FLAG_FREE_HEAD;
+    page->order = order;
+    list_add_head(&a->free_lists[order], &page->node);
+}
+
+static void buddy_remove_block(pmm_arena_t *a, size_t index)
+{
+    vm_page_t *page = &a->page_array[index];
+
+    DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_FREE_HEAD);
+
+    list_delete(&page->node);
+    page->flags &= ~VM_PAGE_FLAG_FREE_HEAD;
+}
+
+/* put a block of free pages on the free lists, merging it with its buddies */
+static void buddy_free_block(pmm_arena_t *a, size_t index, uint order)
+{
+    size_t page_count = arena_page_count(a);
+
+    while (order < PMM_MAX_ORDER - 1) {
+        size_t buddy = index ^ (1UL << order);
+        if (buddy >= page_count)
+            break;
+
+        vm_page_t *page = &a->page_array[buddy];
+        if (!(page->flags & VM_PAGE_FLAG_FREE_HEAD) || page->order != order)
+            break;
+
+        buddy_remove_block(a, buddy);
+        index &= ~(1UL << order);
+        order++;
+    }
+
+    buddy_add_block(a, index, order);
+}
+
+/* put the free pages [start, end) on the free lists as the largest aligned
+ * blocks that fit */
+static void buddy_free_range(pmm_arena_t *a, size_t start, size_t end)
+{
+    while (start < end) {
+        uint order = start ? MIN((uint)__builtin_ctzl(start), PMM_MAX_ORDER - 1) : PMM_MAX_ORDER - 1;
+
+        while ((1UL << order) > end - start)
+            order--;
+
+        buddy_free_block(a, start, order);
+        start += 1UL << order;
+    }
+}
+
+/* take a free block of at least 1 << order pages off the free lists and
+ * split it down to that size. returns its first page index, or -1 */
+static ssize_t buddy_alloc_block(pmm_arena_t *a, uint order)
+{
+    for (uint o = order; o < PMM_MAX_ORDER; o++) {
+        vm_page_t *page = list_peek_head_type(&a->free_lists[o], vm_page_t, node);
+        if (!page)
+            continue;
+
+        size_t index = page - a->page_array;
+        buddy_remove_block(a, index);
+
+        /* hand back the upper halves we don't need */
+        while (o > order) {
+            o--;
+            buddy_add_block(a, index + (1UL << o), o);
+        }
+
+        return index;
+    }
+
+    return -1;
+}
+
+/* the head of the free block holding the free page at index */
+static size_t buddy_find_block(pmm_arena_t *a, size_t index, uint *order)
+{
+    for (uint o = 0; o < PMM_MAX_ORDER; o++) {
+        size_t head = index & ~((1UL << o) - 1);
+        vm_page_t *page = &a->page_array[head];
+
+        if ((page->flags & VM_PAGE_FLAG_FREE_HEAD) && page->order == o) {
+            *order = o;
+            return head;
+        }
+    }
+
+    panic("pmm: free page %zu of arena %p is in no free block\n", index, a);
+}
+
+/* take the free pages [index, index + count) out of the blocks holding
+ * them, giving back whatever is left of those blocks */
+static void buddy_take_range(pmm_arena_t *a, size_t index, size_t count)
+{
+    size_t end = index + count;
+
+    while (index < end) {
+        uint order;
+        size_t head = buddy_find_block(a, index, &order);
+        size_t block_end = head + (1UL << order);
+        size_t run_end = MIN(end, block_end);
+
+        buddy_remove_block(a, head);
+        buddy_free_range(a, head, index);
+        buddy_free_range(a, run_end, block_end);
+
+        index = run_end;
+    }
+}
+
+/* mark the pages [index, index + count), already off the free lists, allocated */
+static void buddy_claim_pages(pmm_arena_t *a, size_t index, size_t count, struct list_node *list)
+{
+    for (size_t i = index; i < index + count; i++) {
+        vm_page_t *page = &a->page_array[i];
+
+        DEBUG_ASSERT(page_is_free(page));
+        DEBUG_ASSERT(!(page->flags & VM_PAGE_FLAG_FREE_HEAD));
+
+        page->flags |= VM_PAGE_FLAG_NONFREE;
+        if (list)
+            list_add_tail(list, &page->node);
+    }
+
+    a->free_count -= count;
+}
+
 paddr_t vm_page_to_paddr(const vm_page_t *page)
 {
     pmm_arena_t *a;
@@ -100,25 +272,208 @@ done_add:
 
     /* zero out some of the structure */
     arena->free_count = 0;
-    list_initialize(&arena->free_list);
+    for (uint i = 0; i < PMM_MAX_ORDER; i++)
+        list_initialize(&arena->free_lists[i]);
 
     /* allocate an array of pages to back this one */
-    size_t page_count = arena->size / PAGE_SIZE;
+    size_t page_count = arena_page_count(arena);
     arena->page_array = boot_alloc_mem(page_count * sizeof(vm_page_t));
 
     /* initialize all of the pages */
     memset(arena->page_array, 0, page_count * sizeof(vm_page_t));
 
-    /* add them to the free list */
-    for (size_t i = 0; i < page_count; i++) {
-        vm_page_t *p = &arena->page_array[i];
+    /* add them to the free lists */
+    buddy_free_range(arena, 0, page_count);
+    arena->free_count = page_count;
 
-        list_add_tail(&arena->free_list, &p->node);
+    return NO_ERROR;
+}
 
-        arena->free_count++;
+static pmm_arena_t *page_to_arena(const vm_page_t *page)
+{
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        if (PAGE_BELONGS_TO_ARENA(page, a))
+            return a;
     }
+    return NULL;
+}
 
-    return NO_ERROR;
+/* return a list of allocated pages to their arenas. lock held. */
+static size_t pmm_free_locked(struct list_node *list)
+{
+    uint count = 0;
+    while (!list_is_empty(list)) {
+        vm_page_t *page = list_remove_head_type(list, vm_page_t, node);
+
+        DEBUG_ASSERT(!list_in_list(&page->node));
+        DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
+
+        /* see which arena this page belongs to and add it */
+        pmm_arena_t *a = page_to_arena(page);
+        if (a) {
+            page->flags &= ~VM_PAGE_FLAG_NONFREE;
+
+            buddy_free_block(a, page - a->page_array, 0);
+            a->free_count++;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/* lock the local cpu's cache, staying on this cpu until it is unlocked */
+static struct pmm_pcpu_cache *pmm_pcpu_cache_lock(spin_lock_saved_state_t *state)
+{
+    arch_interrupt_save(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct pmm_pcpu_cache *c = &pcpu_cache[arch_curr_cpu_num()];
+    spin_lock(&c->lock);
+
+    return c;
+}
+
+static void pmm_pcpu_cache_unlock(struct pmm_pcpu_cache *c, spin_lock_saved_state_t state)
+{
+    spin_unlock(&c->lock);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/* take up to a batch of pages from the KMAP arenas for the local cache,
+ * handing the first one to the caller */
+static vm_page_t *pmm_pcpu_cache_refill(void)
+{
+    struct list_node batch = LIST_INITIAL_VALUE(batch);
+    uint n = 0;
+
+    mutex_acquire(&lock);
+
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        if (!(a->flags & PMM_ARENA_FLAG_KMAP))
+            continue;
+
+        while (n < PMM_PCPU_CACHE_BATCH && a->free_count > 0) {
+            uint order = log2_uint(PMM_PCPU_CACHE_BATCH - n);
+            ssize_t index;
+
+            while ((index = buddy_alloc_block(a, order)) < 0)
+                order--;
+
+            buddy_claim_pages(a, index, 1UL << order, &batch);
+            n += 1U << order;
+        }
+
+        if (n == PMM_PCPU_CACHE_BATCH)
+            break;
+    }
+
+    mutex_release(&lock);
+
+    vm_page_t *page = list_remove_head_type(&batch, vm_page_t, node);
+    if (!page)
+        return NULL;
+
+    /* we may have moved cpus while refilling, stash the rest on this one */
+    spin_lock_saved_state_t state;
+    struct pmm_pcpu_cache *c = pmm_pcpu_cache_lock(&state);
+
+    c->refills++;
+    while (c->count < PMM_PCPU_CACHE_SIZE && !list_is_empty(&batch))
+        c->pages[c->count++] = list_remove_head_type(&batch, vm_page_t, node);
+
+    pmm_pcpu_cache_unlock(c, state);
+
+    /* someone else filled it up meanwhile */
+    if (!list_is_empty(&batch)) {
+        mutex_acquire(&lock);
+        pmm_free_locked(&batch);
+        mutex_release(&lock);
+    }
+
+    return page;
+}
+
+static vm_page_t *pmm_pcpu_cache_alloc(void)
+{
+    vm_page_t *page = NULL;
+    spin_lock_saved_state_t state;
+
+    struct pmm_pcpu_cache *c = pmm_pcpu_cache_lock(&state);
+    if (c->count > 0) {
+        page = c->pages[--c->count];
+        c->hits++;
+    }
+    pmm_pcpu_cache_unlock(c, state);
+
+    if (!page)
+        page = pmm_pcpu_cache_refill();
+
+    return page;
+}
+
+static void pmm_pcpu_cache_free(vm_page_t *page)
+{
+    struct list_node drain = LIST_INITIAL_VALUE(drain);
+    spin_lock_saved_state_t state;
+
+    DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
+
+    struct pmm_pcpu_cache *c = pmm_pcpu_cache_lock(&state);
+    if (c->count == PMM_PCPU_CACHE_SIZE) {
+        /* full, send the least recently freed half back to the arenas */
+        for (uint i = 0; i < PMM_PCPU_CACHE_BATCH; i++)
+            list_add_tail(&drain, &c->pages[i]->node);
+        memmove(c->pages, c->pages + PMM_PCPU_CACHE_BATCH,
+                (PMM_PCPU_CACHE_SIZE - PMM_PCPU_CACHE_BATCH) * sizeof(c->pages[0]));
+        c->count -= PMM_PCPU_CACHE_BATCH;
+        c->drains++;
+    }
+    c->pages[c->count++] = page;
+
+    pmm_pcpu_cache_unlock(c, state);
+
+    if (!list_is_empty(&drain)) {
+        mutex_acquire(&lock);
+        pmm_free_locked(&drain);
+        mutex_release(&lock);
+    }
+}
+
+/* give every cpu's cached pages back to the arenas. returns how many there were */
+static size_t pmm_pcpu_cache_drain_all(void)
+{
+    struct list_node drain = LIST_INITIAL_VALUE(drain);
+    spin_lock_saved_state_t state;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct pmm_pcpu_cache *c = &pcpu_cache[i];
+
+        spin_lock_irqsave(&c->lock, state);
+        while (c->count > 0)
+            list_add_tail(&drain, &c->pages[--c->count]->node);
+        spin_unlock_irqrestore(&c->lock, state);
+    }
+
+    mutex_acquire(&lock);
+    size_t count = pmm_free_locked(&drain);
+    mutex_release(&lock);
+
+    return count;
+}
+
+/* single page allocations only come from the caches while a KMAP arena is
+ * the first with free pages, so they still follow arena priority */
+static bool pmm_pcpu_cache_preferred(void)
+{
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        if (a->free_count > 0)
+            return a->flags & PMM_ARENA_FLAG_KMAP;
+    }
+
+    return true;
 }
 
 size_t pmm_alloc_pages(uint count, struct list_node *list)
@@ -132,26 +487,35 @@ size_t pmm_alloc_pages(uint count, struct list_node *list)
     if (count == 0)
         return 0;
 
+    if (count == 1 && pmm_pcpu_cache_preferred()) {
+        vm_page_t *page = pmm_pcpu_cache_alloc();
+        if (page) {
+            list_add_tail(list, &page->node);
+            return 1;
+        }
+    }
+
     mutex_acquire(&lock);
 
-    /* walk the arenas in order, allocating as many pages as we can from each */
+    /* walk the arenas in order, allocating as many pages as we can from each,
+     * in the largest blocks that are available and still needed */
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-        while (allocated < count) {
-            vm_page_t *page = list_remove_head_type(&a->free_list, vm_page_t, node);
-            if (!page)
-                goto done;
+        while (allocated < count && a->free_count > 0) {
+            uint order = MIN(log2_uint(count - allocated), PMM_MAX_ORDER - 1);
+            ssize_t index;
 
-            a->free_count--;
+            while ((index = buddy_alloc_block(a, order)) < 0)
+                order--;
 
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
-
-            allocated++;
+            buddy_claim_pages(a, index, 1UL << order, list);
+            allocated += 1U << order;
         }
+
+        if (allocated == count)
+            break;
     }
 
-done:
     mutex_release(&lock);
     return allocated;
 }
@@ -173,29 +537,24 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
     /* walk through the arenas, looking to see if the physical page belongs to it */
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-        while (allocated < count && ADDRESS_IN_ARENA(address, a)) {
-            size_t index = (address - a->base) / PAGE_SIZE;
-
-            DEBUG_ASSERT(index < a->size / PAGE_SIZE);
-
-            vm_page_t *page = &a->page_array[index];
-            if (page->flags & VM_PAGE_FLAG_NONFREE) {
-                /* we hit an allocated page */
-                break;
-            }
+        if (!ADDRESS_IN_ARENA(address, a))
+            continue;
 
-            DEBUG_ASSERT(list_in_list(&page->node));
+        /* find the free run starting at address, up to the end of the arena */
+        size_t index = (address - a->base) / PAGE_SIZE;
+        size_t run = 0;
+        while (allocated + run < count && index + run < arena_page_count(a) &&
+                page_is_free(&a->page_array[index + run]))
+            run++;
 
-            list_delete(&page->node);
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+        buddy_take_range(a, index, run);
+        buddy_claim_pages(a, index, run, list);
 
-            a->free_count--;
-            allocated++;
-            address += PAGE_SIZE;
-        }
+        allocated += run;
+        address += run * PAGE_SIZE;
 
-        if (allocated == count)
+        /* we hit an allocated page */
+        if (index + run < arena_page_count(a))
             break;
     }
 
@@ -209,30 +568,22 @@ size_t pmm_free(struct list_node *list)
 
     DEBUG_ASSERT(list);
 
-    mutex_acquire(&lock);
-
-    uint count = 0;
-    while (!list_is_empty(list)) {
-        vm_page_t *page = list_remove_head_type(list, vm_page_t, node);
-
-        DEBUG_ASSERT(!list_in_list(&page->node));
-        DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
-
-        /* see which arena this page belongs to and add it */
-        pmm_arena_t *a;
-        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-            if (PAGE_BELONGS_TO_ARENA(page, a)) {
-                page->flags &= ~VM_PAGE_FLAG_NONFREE;
+    /* a single page from a KMAP arena goes to the local page cache */
+    if (!list_is_empty(list) && list->next->next == list) {
+        vm_page_t *page = list_peek_head_type(list, vm_page_t, node);
+        pmm_arena_t *a = page_to_arena(page);
 
-                list_add_head(&a->free_list, &page->node);
-                a->free_count++;
-                count++;
-                break;
-            }
+        if (a && (a->flags & PMM_ARENA_FLAG_KMAP)) {
+            list_delete(&page->node);
+            pmm_pcpu_cache_free(page);
+            return 1;
         }
     }
 
+    mutex_acquire(&lock);
+    size_t count = pmm_free_locked(list);
     mutex_release(&lock);
+
     return count;
 }
 
@@ -251,8 +602,17 @@ void *pmm_alloc_kpages(uint count, struct list_node *list)
 {
     LTRACEF("count %u\n", count);
 
-    // XXX do fast path for single page
+    /* single pages come from the local page cache */
+    if (count == 1) {
+        vm_page_t *page = pmm_pcpu_cache_alloc();
+        if (!page)
+            return NULL;
+
+        if (list)
+            list_add_tail(list, &page->node);
 
+        return paddr_to_kvaddr(vm_page_to_paddr(page));
+    }
 
     paddr_t pa;
     size_t alloc_count = pmm_alloc_contiguous(count, PAGE_SIZE_SHIFT, &pa, list);
@@ -284,6 +644,80 @@ size_t pmm_free_kpages(void *_ptr, uint count)
     return pmm_free(&list);
 }
 
+/* find a free run of count pages starting on a 1 << alignment_log2 physical
+ * boundary by walking the page array, for runs larger than any block or
+ * spread over several. returns its first page index, or -1 */
+static ssize_t pmm_scan_contiguous(pmm_arena_t *a, uint count, uint8_t alignment_log2)
+{
+    /* walk the list starting at alignment boundaries.
+     * calculate the starting offset into this arena, based on the
+     * base address of the arena to handle the case where the arena
+     * is not aligned on the same boundary requested.
+     */
+    paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
+    if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
+        return -1;
+
+    uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
+    uint start = aligned_offset;
+    LTRACEF("starting search at aligned offset %u\n", start);
+    LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
+
+retry:
+    /* search while we're still within the arena and have a chance of finding a slot
+       (start + count < end of arena) */
+    while ((start < a->size / PAGE_SIZE) &&
+            ((start + count) <= a->size / PAGE_SIZE)) {
+        vm_page_t *p = &a->page_array[start];
+        for (uint i = 0; i < count; i++) {
+            if (p->flags & VM_PAGE_FLAG_NONFREE) {
+                /* this run is broken, break out of the inner loop.
+                 * start over at the next alignment boundary
+                 */
+                start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
+                goto retry;
+            }
+            p++;
+        }
+
+        return start;
+    }
+
+    return -1;
+}
+
+/* find a free run of count pages starting on a 1 << alignment_log2 physical
+ * boundary. Looking within a single free block is cheap, but a run may also
+ * straddle several smaller blocks, so fall back to walking the page array.
+ * returns its first page index, or -1 */
+static ssize_t pmm_find_contiguous(pmm_arena_t *a, uint count, uint8_t alignment_log2)
+{
+    uint order = log2_uint(round_up_pow2_u32(count));
+
+    if (order >= PMM_MAX_ORDER)
+        return pmm_scan_contiguous(a, count, alignment_log2);
+
+    /* the smallest blocks that can hold the run first. arenas are usually
+     * aligned well enough that the head of the first block fits. */
+    for (uint o = order; o < PMM_MAX_ORDER; o++) {
+        vm_page_t *page;
+        list_for_every_entry(&a->free_lists[o], page, vm_page_t, node) {
+            size_t index = page - a->page_array;
+            paddr_t block_pa = a->base + index * PAGE_SIZE;
+            paddr_t run_pa = ROUNDUP(block_pa, 1UL << alignment_log2);
+
+            if (run_pa < block_pa)
+                continue;
+
+            size_t start = (run_pa - a->base) / PAGE_SIZE;
+            if (start + count <= index + (1UL << o))
+                return start;
+        }
+    }
+
+    return pmm_scan_contiguous(a, count, alignment_log2);
+}
+
 size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list)
 {
     LTRACEF("count %u, align %u\n", count, alignment_log2);
@@ -293,72 +727,43 @@ size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, str
     if (alignment_log2 < PAGE_SIZE_SHIFT)
         alignment_log2 = PAGE_SIZE_SHIFT;
 
+    bool drained = false;
+retry:
     mutex_acquire(&lock);
 
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
         // XXX make this a flag to only search kmap?
-        if (a->flags & PMM_ARENA_FLAG_KMAP) {
-            /* walk the list starting at alignment boundaries.
-             * calculate the starting offset into this arena, based on the
-             * base address of the arena to handle the case where the arena
-             * is not aligned on the same boundary requested.
-             */
-            paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
-            if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
-                continue;
+        if (!(a->flags & PMM_ARENA_FLAG_KMAP) || a->free_count < count)
+            continue;
 
-            uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
-            uint start = aligned_offset;
-            LTRACEF("starting search at aligned offset %u\n", start);
-            LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
+        ssize_t start = pmm_find_contiguous(a, count, alignment_log2);
+        if (start < 0)
+            continue;
 
-retry:
-            /* search while we're still within the arena and have a chance of finding a slot
-               (start + count < end of arena) */
-            while ((start < a->size / PAGE_SIZE) &&
-                    ((start + count) <= a->size / PAGE_SIZE)) {
-                vm_page_t *p = &a->page_array[start];
-                for (uint i = 0; i < count; i++) {
-                    if (p->flags & VM_PAGE_FLAG_NONFREE) {
-                        /* this run is broken, break out of the inner loop.
-                         * start over at the next alignment boundary
-                         */
-                        start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
-                        goto retry;
-                    }
-                    p++;
-                }
-
-                /* we found a run */
-                LTRACEF("found run from pn %u to %u\n", start, start + count);
-
-                /* remove the pages from the run out of the free list */
-                for (uint i = start; i < start + count; i++) {
-                    p = &a->page_array[i];
-                    DEBUG_ASSERT(!(p->flags & VM_PAGE_FLAG_NONFREE));
-                    DEBUG_ASSERT(list_in_list(&p->node));
-
-                    list_delete(&p->node);
-                    p->flags |= VM_PAGE_FLAG_NONFREE;
-                    a->free_count--;
-
-                    if (list)
-                        list_add_tail(list, &p->node);
-                }
-
-                if (pa)
-                    *pa = a->base + start * PAGE_SIZE;
-
-                mutex_release(&lock);
-
-                return count;
-            }
-        }
+        /* we found a run */
+        LTRACEF("found run from pn %zd to %zd\n", start, start + count);
+
+        buddy_take_range(a, start, count);
+        buddy_claim_pages(a, start, count, list);
+
+        if (pa)
+            *pa = a->base + start * PAGE_SIZE;
+
+        mutex_release(&lock);
+
+        return count;
     }
 
     mutex_release(&lock);
 
+    /* the run may be held up by pages sitting in the page caches */
+    if (!drained) {
+        drained = true;
+        if (pmm_pcpu_cache_drain_all() > 0)
+            goto retry;
+    }
+
     LTRACEF("couldn't find run\n");
     return 0;
 }
@@ -403,6 +808,41 @@ static void dump_arena(const pmm_arena_t *arena, bool dump_pages)
     }
 }
 
+/* free blocks per order, and for each order the share of the free pages
+ * that sit in smaller blocks and so cannot serve an allocation that large */
+static void dump_arena_fragmentation(pmm_arena_t *arena)
+{
+    size_t blocks[PMM_MAX_ORDER];
+    size_t free_count;
+    int largest = -1;
+
+    mutex_acquire(&lock);
+    for (uint o = 0; o < PMM_MAX_ORDER; o++) {
+        blocks[o] = list_length(&arena->free_lists[o]);
+        if (blocks[o])
+            largest = o;
+    }
+    free_count = arena->free_count;
+    mutex_release(&lock);
+
+    printf("arena %p: name '%s' free pages %zu\n", arena, arena->name, free_count);
+    if (largest < 0)
+        return;
+
+    printf("\torder %10s %8s %9s\n", "block size", "blocks", "unusable");
+
+    size_t smaller = 0;
+    for (int o = 0; o <= largest; o++) {
+        uint unusable = smaller * 100 / free_count;
+
+        printf("\t%5d %8zuKB %8zu %8u%%\n", o, ((size_t)PAGE_SIZE << o) / 1024, blocks[o], unusable);
+        smaller += blocks[o] << o;
+    }
+
+    printf("\tlargest free block %zu pages, %zu%% of free pages\n",
+           (size_t)1 << largest, (((size_t)1 << largest) * 100) / free_count);
+}
+
 static int cmd_pmm(int argc, const cmd_args *argv)
 {
     if (argc < 2) {
@@ -411,6 +851,8 @@ notenoughargs:
 usage:
         printf("usage:\n");
         printf("%s arenas\n", argv[0].str);
+        printf("%s frag\n", argv[0].str);
+        printf("%s caches\n", argv[0].str);
         printf("%s alloc <count>\n", argv[0].str);
         printf("%s alloc_range <address> <count>\n", argv[0].str);
         printf("%s alloc_kpages <count>\n", argv[0].str);
@@ -427,6 +869,18 @@ usage:
         list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
             dump_arena(a, false);
         }
+    } else if (!strcmp(argv[1].str, "frag")) {
+        pmm_arena_t *a;
+        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+            dump_arena_fragmentation(a);
+        }
+    } else if (!strcmp(argv[1].str, "caches")) {
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            struct pmm_pcpu_cache *c = &pcpu_cache[i];
+
+            printf("cpu %u: %u pages cached, %lu hits, %lu refills, %lu drains\n",
+                   i, c->count, c->hits, c->refills, c->drains);
+        }
     } else if (!strcmp(argv[1].str, "alloc")) {
         if (argc < 3) goto notenoughargs;
 
@@ -126,6 +126,173 @@ static vmm_region_t *alloc_region_struct(const char *name, vaddr_t base, size_t
     return r;
 }
 
+/*
+ * Regions live both in a list sorted by address, for walking them in order,
+ * and in an AVL tree keyed on base address for lookups. Every tree node also
+ * tracks the free gap between its region and the previous one (or the start
+ * of the aspace) and the largest such gap in its subtree, so alloc_spot()
+ * can skip over subtrees with no room in them.
+ */
+static inline uint region_height(const vmm_region_t *r)
+{
+    return r ? r->height : 0;
+}
+
+static inline size_t region_max_gap(const vmm_region_t *r)
+{
+    return r ? r->max_gap : 0;
+}
+
+static void region_tree_fix(vmm_region_t *r)
+{
+    r->height = 1 + MAX(region_height(r->left), region_height(r->right));
+    r->max_gap = MAX(r->gap, MAX(region_max_gap(r->left), region_max_gap(r->right)));
+}
+
+static vmm_region_t *region_tree_rotate_right(vmm_region_t *r)
+{
+    vmm_region_t *l = r->left;
+
+    r->left = l->right;
+    l->right = r;
+    region_tree_fix(r);
+    region_tree_fix(l);
+    return l;
+}
+
+static vmm_region_t *region_tree_rotate_left(vmm_region_t *r)
+{
+    vmm_region_t *rr = r->right;
+
+    r->right = rr->left;
+    rr->left = r;
+    region_tree_fix(r);
+    region_tree_fix(rr);
+    return rr;
+}
+
+static vmm_region_t *region_tree_balance(vmm_region_t *r)
+{
+    region_tree_fix(r);
+
+    int balance = (int)region_height(r->left) - (int)region_height(r->right);
+    if (balance > 1) {
+        if (region_height(r->left->left) < region_height(r->left->right))
+            r->left = region_tree_rotate_left(r->left);
+        return region_tree_rotate_right(r);
+    } else if (balance < -1) {
+        if (region_height(r->right->right) < region_height(r->right->left))
+            r->right = region_tree_rotate_right(r->right);
+        return region_tree_rotate_left(r);
+    }
+
+    return r;
+}
+
+static vmm_region_t *region_tree_insert(vmm_region_t *root, vmm_region_t *r)
+{
+    if (!root) {
+        r->left = r->right = NULL;
+        region_tree_fix(r);
+        return r;
+    }
+
+    if (r->base < root->base)
+        root->left = region_tree_insert(root->left, r);
+    else
+        root->right = region_tree_insert(root->right, r);
+
+    return region_tree_balance(root);
+}
+
+static vmm_region_t *region_tree_remove_min(vmm_region_t *root, vmm_region_t **min)
+{
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+
+    root->left = region_tree_remove_min(root->left, min);
+    return region_tree_balance(root);
+}
+
+static vmm_region_t *region_tree_remove(vmm_region_t *root, vmm_region_t *r)
+{
+    DEBUG_ASSERT(root);
+
+    if (r->base < root->base) {
+        root->left = region_tree_remove(root->left, r);
+    } else if (r->base > root->base) {
+        root->right = region_tree_remove(root->right, r);
+    } else {
+        DEBUG_ASSERT(root == r);
+
+        if (!r->left)
+            return r->right;
+        if (!r->right)
+            return r->left;
+
+        /* replace it with the next region up */
+        vmm_region_t *min;
+        vmm_region_t *right = region_tree_remove_min(r->right, &min);
+        min->left = r->left;
+        min->right = right;
+        root = min;
+    }
+
+    return region_tree_balance(root);
+}
+
+/* recompute the augmented values on the path down to r after its gap changed */
+static void region_tree_update(vmm_region_t *root, vmm_region_t *r)
+{
+    DEBUG_ASSERT(root);
+
+    if (r->base < root->base)
+        region_tree_update(root->left, r);
+    else if (r->base > root->base)
+        region_tree_update(root->right, r);
+
+    region_tree_fix(root);
+}
+
+/* free space between a region and the one in front of it */
+static size_t region_gap(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *prev = list_prev_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    vaddr_t start = prev ? prev->base + prev->size : aspace->base;
+
+    return r->base - start;
+}
+
+/* add a region that's already been put in the sorted list to the tree */
+static void insert_region_in_tree(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    r->gap = region_gap(aspace, r);
+    aspace->region_tree = region_tree_insert(aspace->region_tree, r);
+
+    /* the region after it just lost some of its gap */
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    if (next) {
+        next->gap = region_gap(aspace, next);
+        region_tree_update(aspace->region_tree, next);
+    }
+}
+
+/* take a region out of both the list and the tree */
+static void remove_region_from_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+
+    aspace->region_tree = region_tree_remove(aspace->region_tree, r);
+    list_delete(&r->node);
+
+    if (next) {
+        next->gap = region_gap(aspace, next);
+        region_tree_update(aspace->region_tree, next);
+    }
+}
+
 /* add a region to the appropriate spot in the address space list,
  * testing to see if there's a space */
 static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
@@ -144,31 +311,35 @@ static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
 
     vaddr_t r_end = r->base + r->size - 1;
 
-    /* does it fit in front */
-    vmm_region_t *last;
-    last = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
-    if (!last || r_end < last->base) {
-        /* empty list or not empty and fits before the first element */
-        list_add_head(&aspace->region_list, &r->node);
-        return NO_ERROR;
+    /* find the last region starting below it and the one after that */
+    vmm_region_t *prev = NULL;
+    vmm_region_t *n = aspace->region_tree;
+    while (n) {
+        if (n->base < r->base) {
+            prev = n;
+            n = n->right;
+        } else {
+            n = n->left;
+        }
     }
 
-    /* walk the list, finding the right spot to put it */
-    list_for_every_entry(&aspace->region_list, last, vmm_region_t, node) {
-        /* does it go after last? */
-        if (r->base > last->base + last->size - 1) {
-            /* get the next element in the list */
-            vmm_region_t *next = list_next_type(&aspace->region_list, &last->node, vmm_region_t, node);
-            if (!next || (r_end < next->base)) {
-                /* end of the list or next exists and it goes between them */
-                list_add_after(&last->node, &r->node);
-                return NO_ERROR;
-            }
-        }
+    vmm_region_t *next;
+    if (prev)
+        next = list_next_type(&aspace->region_list, &prev->node, vmm_region_t, node);
+    else
+        next = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
+
+    /* does it go between them */
+    if ((prev && r->base <= prev->base + prev->size - 1) ||
+            (next && r_end >= next->base)) {
+        LTRACEF("couldn't find spot\n");
+        return ERR_NO_MEMORY;
     }
 
-    LTRACEF("couldn't find spot\n");
-    return ERR_NO_MEMORY;
+    list_add_after(prev ? &prev->node : &aspace->region_list, &r->node);
+    insert_region_in_tree(aspace, r);
+
+    return NO_ERROR;
 }
 
 /*
@@ -184,6 +355,18 @@ __WEAK vaddr_t arch_mmu_pick_spot(arch_aspace_t *aspace, vaddr_t base, uint prev
     return ALIGN(base, align);
 }
 
+/*
+ *  Batching unmaps is optional, by default every unmap does its own
+ *  TLB maintenance.
+ */
+__WEAK void arch_mmu_unmap_begin(arch_aspace_t *aspace)
+{
+}
+
+__WEAK void arch_mmu_unmap_end(arch_aspace_t *aspace)
+{
+}
+
 /*
  *  Returns true if the caller has to stop search
  */
@@ -231,6 +414,28 @@ not_found:
     return true; /* not_found: stop search */
 }
 
+/* walk the gaps in front of the regions in address order, skipping subtrees
+ * with no gap big enough, until check_gap() says to stop */
+static bool alloc_spot_in_tree(vmm_aspace_t *aspace, vmm_region_t *r,
+                               vaddr_t *pva, vaddr_t align, size_t size,
+                               uint arch_mmu_flags, vmm_region_t **next)
+{
+    if (!r || r->max_gap < size)
+        return false;
+
+    if (alloc_spot_in_tree(aspace, r->left, pva, align, size, arch_mmu_flags, next))
+        return true;
+
+    if (r->gap >= size &&
+            check_gap(aspace, list_prev_type(&aspace->region_list, &r->node, vmm_region_t, node), r,
+                      pva, align, size, arch_mmu_flags)) {
+        *next = r;
+        return true;
+    }
+
+    return alloc_spot_in_tree(aspace, r->right, pva, align, size, arch_mmu_flags, next);
+}
+
 static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2,
                           uint arch_mmu_flags, struct list_node **before)
 {
@@ -244,28 +449,29 @@ static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2,
     vaddr_t align = 1UL << align_pow2;
 
     vaddr_t spot;
-    vmm_region_t *r = NULL;
-
-    /* try to pick spot at the beginning of address space */
-    if (check_gap(aspace, NULL,
-                  list_peek_head_type(&aspace->region_list, vmm_region_t, node),
-                  &spot, align, size, arch_mmu_flags))
+    vmm_region_t *prev;
+    vmm_region_t *next = NULL;
+
+    /* try the gaps in front of each region, lowest first */
+    if (alloc_spot_in_tree(aspace, aspace->region_tree, &spot, align, size, arch_mmu_flags, &next)) {
+        if (spot == (vaddr_t)-1)
+            return -1;
+        prev = list_prev_type(&aspace->region_list, &next->node, vmm_region_t, node);
         goto done;
-
-    /* search the middle of the list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if (check_gap(aspace, r,
-                      list_next_type(&aspace->region_list, &r->node, vmm_region_t, node),
-                      &spot, align, size, arch_mmu_flags))
-            goto done;
     }
 
+    /* then the space after the last one */
+    prev = list_peek_tail_type(&aspace->region_list, vmm_region_t, node);
+    if (check_gap(aspace, prev, NULL, &spot, align, size, arch_mmu_flags) &&
+            spot != (vaddr_t)-1)
+        goto done;
+
     /* couldn't find anything */
     return -1;
 
 done:
     if (before)
-        *before = r ? &r->node : &aspace->region_list;
+        *before = prev ? &prev->node : &aspace->region_list;
     return spot;
 }
 
@@ -304,8 +510,9 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
 
         r->base = (vaddr_t)vaddr;
 
-        /* add it to the region list */
+        /* add it to the region list and tree */
         list_add_after(before, &r->node);
+        insert_region_in_tree(aspace, r);
     }
 
     return r;
@@ -349,6 +556,24 @@ status_t vmm_reserve_space(vmm_aspace_t *aspace, const char *name, size_t size,
     return r ? NO_ERROR : ERR_NO_MEMORY;
 }
 
+/* the largest alignment VMM_FLAG_LARGE_PAGES will ask for */
+#ifndef VMM_LARGE_PAGE_MAX_SHIFT
+#define VMM_LARGE_PAGE_MAX_SHIFT 30
+#endif
+
+/* alignment that lets a mapping of the given size use the largest pages it
+ * can, limited by how the physical address is aligned if it is known */
+static uint8_t large_page_align(size_t size, paddr_t paddr, uint8_t align_pow2)
+{
+    uint shift = (sizeof(size) * 8 - 1) - __builtin_clzl(size);
+
+    shift = MIN(shift, VMM_LARGE_PAGE_MAX_SHIFT);
+    if (paddr)
+        shift = MIN(shift, (uint)__builtin_ctzl(paddr));
+
+    return MAX(align_pow2, shift);
+}
+
 status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size,
                             void **ptr, uint8_t align_log2, paddr_t paddr, uint vmm_flags, uint arch_mmu_flags)
 {
@@ -385,8 +610,15 @@ status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size,
     mutex_acquire(&vmm_lock);
 
     /* allocate a region and put it in the aspace list */
-    vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_log2, vmm_flags,
-                                   VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    vmm_region_t *r = NULL;
+    if (vmm_flags & VMM_FLAG_LARGE_PAGES) {
+        r = alloc_region(aspace, name, size, vaddr, large_page_align(size, paddr, align_log2),
+                         vmm_flags, VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    }
+    if (!r) {
+        r = alloc_region(aspace, name, size, vaddr, align_log2, vmm_flags,
+                         VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    }
     if (!r) {
         ret = ERR_NO_MEMORY;
         goto err_alloc_region;
@@ -441,8 +673,12 @@ status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t siz
     list_initialize(&page_list);
 
     paddr_t pa = 0;
-    /* allocate a run of physical pages */
-    size_t count = pmm_alloc_contiguous(size / PAGE_SIZE, align_pow2, &pa, &page_list);
+    size_t count = 0;
+    /* allocate a run of physical pages, aligned for large pages if asked */
+    if (vmm_flags & VMM_FLAG_LARGE_PAGES)
+        count = pmm_alloc_contiguous(size / PAGE_SIZE, large_page_align(size, 0, align_pow2), &pa, &page_list);
+    if (count == 0)
+        count = pmm_alloc_contiguous(size / PAGE_SIZE, align_pow2, &pa, &page_list);
     if (count < size / PAGE_SIZE) {
         DEBUG_ASSERT(count == 0); /* check that the pmm didn't allocate a partial run */
         err = ERR_NO_MEMORY;
@@ -452,8 +688,15 @@ status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t siz
     mutex_acquire(&vmm_lock);
 
     /* allocate a region and put it in the aspace list */
-    vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
-                                   VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    vmm_region_t *r = NULL;
+    if (vmm_flags & VMM_FLAG_LARGE_PAGES) {
+        r = alloc_region(aspace, name, size, vaddr, large_page_align(size, pa, align_pow2),
+                         vmm_flags, VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    }
+    if (!r) {
+        r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
+                         VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    }
     if (!r) {
         err = ERR_NO_MEMORY;
         goto err1;
@@ -578,9 +821,14 @@ static vmm_region_t *vmm_find_region(const vmm_aspace_t *aspace, vaddr_t vaddr)
     if (!aspace)
         return NULL;
 
-    /* search the region list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if ((vaddr >= r->base) && (vaddr <= r->base + r->size - 1))
+    /* search the region tree */
+    r = aspace->region_tree;
+    while (r) {
+        if (vaddr < r->base)
+            r = r->left;
+        else if (vaddr > r->base + r->size - 1)
+            r = r->right;
+        else
             return r;
     }
 
@@ -598,7 +846,7 @@ status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr)
     }
 
     /* remove it from aspace */
-    list_delete(&r->node);
+    remove_region_from_aspace(aspace, r);
 
     /* unmap it */
     arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
@@ -614,6 +862,42 @@ status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr)
     return NO_ERROR;
 }
 
+status_t vmm_free_regions(vmm_aspace_t *aspace, const vaddr_t *vaddrs, uint count)
+{
+    struct list_node region_list = LIST_INITIAL_VALUE(region_list);
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&vmm_lock);
+
+    /* let the arch flush the tlb once for the lot */
+    arch_mmu_unmap_begin(&aspace->arch_aspace);
+    for (uint i = 0; i < count; i++) {
+        vmm_region_t *r = vmm_find_region(aspace, vaddrs[i]);
+        if (!r) {
+            err = ERR_NOT_FOUND;
+            continue;
+        }
+
+        remove_region_from_aspace(aspace, r);
+        arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
+        list_add_tail(&region_list, &r->node);
+    }
+    arch_mmu_unmap_end(&aspace->arch_aspace);
+
+    mutex_release(&vmm_lock);
+
+    vmm_region_t *r;
+    while ((r = list_remove_head_type(&region_list, vmm_region_t, node))) {
+        /* return physical pages if any */
+        pmm_free(&r->page_list);
+
+        /* free it */
+        free(r);
+    }
+
+    return err;
+}
+
 status_t vmm_create_aspace(vmm_aspace_t **_aspace, const char *name, uint flags)
 {
     status_t err;
@@ -671,6 +955,7 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
     struct list_node region_list = LIST_INITIAL_VALUE(region_list);
 
     vmm_region_t *r;
+    arch_mmu_unmap_begin(&aspace->arch_aspace);
     while ((r = list_remove_head_type(&aspace->region_list, vmm_region_t, node))) {
         /* add it to our tempoary list */
         list_add_tail(&region_list, &r->node);
@@ -678,6 +963,8 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
         /* unmap it */
         arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
     }
+    arch_mmu_unmap_end(&aspace->arch_aspace);
+    aspace->region_tree = NULL;
     mutex_release(&vmm_lock);
 
     /* without the vmm lock held, free all of the pmm pages and the structure */
@@ -26,26 +26,86 @@
 #include <string.h>
 #include <sys/types.h>
 #include <debug.h>
+#include <err.h>
 #include <trace.h>
+#include <pow2.h>
+#include <platform.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
 #include <lib/bcache.h>
 #include <lib/bio.h>
 
 #define LOCAL_TRACE 0
 
+/*
+ * Blocks are found through a hash table on the block number and replaced
+ * with the 2Q policy: a block read for the first time goes on a short fifo
+ * (a1in) and is evicted from there without disturbing the main lru (am).
+ * The numbers of blocks evicted from the fifo are remembered for a while
+ * on a ghost list (a1out), and only a block that is asked for again while
+ * its ghost is still there gets into the lru. A long sequential read only
+ * ever cycles through the fifo, so it can't push hot blocks out of the lru.
+ *
+ * Dirty blocks are written back by a flusher thread once they have been
+ * dirty for a while, or as soon as enough of the cache is dirty. Runs of
+ * adjacent dirty blocks go out in one write. Likewise, a miss that continues
+ * a sequential run of accesses reads the following blocks along with it.
+ *
+ * The flusher copies a run out and holds a reference to its blocks while it
+ * writes, so it can drop the cache lock for the write without the blocks
+ * being evicted. It sleeps until something is dirtied while the cache is
+ * clean.
+ */
+
+/* how long a block may stay dirty before the flusher writes it back */
+#ifndef BCACHE_DIRTY_AGE
+#define BCACHE_DIRTY_AGE 1000
+#endif
+
+/* the longest run of blocks read or written in one go */
+#ifndef BCACHE_RUN_MAX
+#define BCACHE_RUN_MAX 8
+#endif
+
+/* sequential accesses in a row before starting to read ahead */
+#define BCACHE_SEQ_MIN 2
+
+enum bcache_queue {
+    BCACHE_FREE,
+    BCACHE_A1IN,
+    BCACHE_AM,
+};
+
 struct bcache_block {
     struct list_node node;
+    struct bcache_block *hash_next;
     bnum_t blocknum;
     int ref_count;
     bool is_dirty;
+    enum bcache_queue queue;
+    lk_time_t dirty_time;
     void *ptr;
 };
 
+/* number of a block recently evicted from the fifo */
+struct bcache_ghost {
+    struct list_node node;
+    struct bcache_ghost *hash_next;
+    bnum_t blocknum;
+};
+
 struct bcache_stats {
     uint32_t hits;
     uint32_t depth;
     uint32_t misses;
+    uint32_t ghost_hits;
+    uint32_t evictions;
     uint32_t reads;
+    uint32_t read_ops;
+    uint32_t prefetches;
     uint32_t writes;
+    uint32_t write_ops;
 };
 
 struct bcache {
@@ -54,54 +114,174 @@ struct bcache {
     int count;
     struct bcache_stats stats;
 
+    mutex_t lock;
+
+    /* write back. flush_lock orders the flusher's unlocked writes against
+     * bcache_flush(), and is taken before lock */
+    mutex_t flush_lock;
+    thread_t *flusher;
+    event_t flush_event;
+    uint8_t *flush_buf;
+    bool exiting;
+    int dirty_count;
+    int dirty_limit;
+
+    /* read ahead */
+    bnum_t next_seq;
+    uint seq_count;
+    bnum_t dev_blocks;
+
+    /* staging for multi block reads and writes */
+    uint run_max;
+    uint8_t *run_buf;
+
     struct list_node free_list;
-    struct list_node lru_list;
+    struct list_node a1in_list;
+    struct list_node am_list;
+    int a1in_count;
+    int a1in_max;
+
+    /* ghosts, oldest first, and the unused ones */
+    struct list_node a1out_list;
+    struct list_node ghost_free_list;
+
+    uint hash_shift;
+    struct bcache_block **hash;
+    struct bcache_ghost **ghost_hash;
 
     struct bcache_block *blocks;
+    struct bcache_ghost *ghosts;
 };
 
+static inline uint bcache_hash(struct bcache *cache, bnum_t blocknum)
+{
+    return (blocknum * 2654435761U) >> (32 - cache->hash_shift);
+}
+
+static int bcache_flusher(void *arg);
+
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count)
 {
     struct bcache *cache;
 
-    cache = malloc(sizeof(struct bcache));
+    cache = calloc(1, sizeof(struct bcache));
+    if (!cache)
+        return NULL;
 
     cache->dev = dev;
     cache->block_size = block_size;
     cache->count = block_count;
-    memset(&cache->stats, 0, sizeof(cache->stats));
+
+    mutex_init(&cache->lock);
+    mutex_init(&cache->flush_lock);
+    event_init(&cache->flush_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    cache->dirty_limit = MAX(block_count / 2, 1);
+    cache->dev_blocks = dev->total_size / block_size;
+
+    /* don't let a single run take over the cache */
+    cache->run_max = MIN(BCACHE_RUN_MAX, MAX(block_count / 2, 1));
 
     list_initialize(&cache->free_list);
-    list_initialize(&cache->lru_list);
+    list_initialize(&cache->a1in_list);
+    list_initialize(&cache->am_list);
+    list_initialize(&cache->a1out_list);
+    list_initialize(&cache->ghost_free_list);
+
+    /*
+     * a quarter of the blocks for the fifo. ghosts are only a block number,
+     * so remember plenty of them; with the small caches the filesystems use
+     * anything less forgets a block before it's asked for again.
+     */
+    cache->a1in_max = MAX(block_count / 4, 1);
+    int ghost_count = MAX(block_count * 2, 8);
+
+    /* a bucket for every block or so */
+    cache->hash_shift = MAX(log2_uint(round_up_pow2_u32(block_count)), 4U);
+
+    cache->hash = calloc(1U << cache->hash_shift, sizeof(*cache->hash));
+    cache->ghost_hash = calloc(1U << cache->hash_shift, sizeof(*cache->ghost_hash));
+    cache->blocks = calloc(block_count, sizeof(struct bcache_block));
+    cache->ghosts = calloc(ghost_count, sizeof(struct bcache_ghost));
+    cache->run_buf = malloc(cache->run_max * block_size);
+    cache->flush_buf = malloc(cache->run_max * block_size);
+    if (!cache->hash || !cache->ghost_hash || !cache->blocks || !cache->ghosts ||
+            !cache->run_buf || !cache->flush_buf)
+        goto err;
 
-    cache->blocks = malloc(sizeof(struct bcache_block) * block_count);
     int i;
     for (i=0; i < block_count; i++) {
-        cache->blocks[i].ref_count = 0;
-        cache->blocks[i].is_dirty = false;
         cache->blocks[i].ptr = malloc(block_size);
+        if (!cache->blocks[i].ptr)
+            goto err;
         // add to the free list
         list_add_head(&cache->free_list, &cache->blocks[i].node);
     }
 
+    for (i=0; i < ghost_count; i++)
+        list_add_tail(&cache->ghost_free_list, &cache->ghosts[i].node);
+
+    cache->flusher = thread_create("bcache flusher", &bcache_flusher, cache,
+                                   LOW_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!cache->flusher)
+        goto err;
+    thread_resume(cache->flusher);
+
     return (bcache_t)cache;
+
+err:
+    if (cache->blocks) {
+        for (i=0; i < block_count; i++)
+            free(cache->blocks[i].ptr);
+    }
+    free(cache->flush_buf);
+    free(cache->run_buf);
+    free(cache->ghosts);
+    free(cache->blocks);
+    free(cache->ghost_hash);
+    free(cache->hash);
+    event_destroy(&cache->flush_event);
+    mutex_destroy(&cache->flush_lock);
+    mutex_destroy(&cache->lock);
+    free(cache);
+    return NULL;
 }
 
-static int flush_block(struct bcache *cache, struct bcache_block *block)
+/* read or write count blocks, a block at a time if the device's are a different size */
+static int dev_read(struct bcache *cache, void *buf, bnum_t blocknum, uint count)
 {
-    int rc;
+    size_t len = count * cache->block_size;
+    ssize_t rc;
 
-    rc = bio_write(cache->dev, block->ptr,
-                   (off_t)block->blocknum * cache->block_size,
-                   cache->block_size);
+    if (cache->block_size == cache->dev->block_size)
+        rc = bio_read_block(cache->dev, buf, blocknum, count);
+    else
+        rc = bio_read(cache->dev, buf, (off_t)blocknum * cache->block_size, len);
     if (rc < 0)
-        goto exit;
+        return rc;
+    if ((size_t)rc != len)
+        return ERR_IO;
 
-    block->is_dirty = false;
-    cache->stats.writes++;
-    rc = 0;
-exit:
-    return (rc);
+    cache->stats.reads += count;
+    cache->stats.read_ops++;
+    return 0;
+}
+
+/* may be called without the cache lock, see flush_run() */
+static int dev_write(struct bcache *cache, const void *buf, bnum_t blocknum, uint count)
+{
+    size_t len = count * cache->block_size;
+    ssize_t rc;
+
+    if (cache->block_size == cache->dev->block_size)
+        rc = bio_write_block(cache->dev, buf, blocknum, count);
+    else
+        rc = bio_write(cache->dev, buf, (off_t)blocknum * cache->block_size, len);
+    if (rc < 0)
+        return rc;
+    if ((size_t)rc != len)
+        return ERR_IO;
+
+    return 0;
 }
 
 void bcache_destroy(bcache_t _cache)
@@ -109,6 +289,13 @@ void bcache_destroy(bcache_t _cache)
     struct bcache *cache = _cache;
     int i;
 
+    mutex_acquire(&cache->lock);
+    cache->exiting = true;
+    mutex_release(&cache->lock);
+
+    event_signal(&cache->flush_event, true);
+    thread_join(cache->flusher, NULL, INFINITE_TIME);
+
     for (i=0; i < cache->count; i++) {
         DEBUG_ASSERT(cache->blocks[i].ref_count == 0);
 
@@ -119,9 +306,80 @@ void bcache_destroy(bcache_t _cache)
         free(cache->blocks[i].ptr);
     }
 
+    free(cache->flush_buf);
+    free(cache->run_buf);
+    free(cache->ghosts);
+    free(cache->blocks);
+    free(cache->ghost_hash);
+    free(cache->hash);
+    event_destroy(&cache->flush_event);
+    mutex_destroy(&cache->flush_lock);
+    mutex_destroy(&cache->lock);
     free(cache);
 }
 
+static void hash_insert(struct bcache *cache, struct bcache_block *block)
+{
+    uint bucket = bcache_hash(cache, block->blocknum);
+
+    block->hash_next = cache->hash[bucket];
+    cache->hash[bucket] = block;
+}
+
+static void hash_remove(struct bcache *cache, struct bcache_block *block)
+{
+    struct bcache_block **prev = &cache->hash[bcache_hash(cache, block->blocknum)];
+
+    while (*prev != block) {
+        DEBUG_ASSERT(*prev);
+        prev = &(*prev)->hash_next;
+    }
+    *prev = block->hash_next;
+}
+
+/* remember the number of a block evicted from the fifo */
+static void ghost_add(struct bcache *cache, bnum_t blocknum)
+{
+    struct bcache_ghost *ghost, **prev;
+
+    /* recycle the oldest one if they're all in use */
+    ghost = list_remove_head_type(&cache->ghost_free_list, struct bcache_ghost, node);
+    if (!ghost) {
+        ghost = list_remove_head_type(&cache->a1out_list, struct bcache_ghost, node);
+        DEBUG_ASSERT(ghost);
+
+        prev = &cache->ghost_hash[bcache_hash(cache, ghost->blocknum)];
+        while (*prev != ghost)
+            prev = &(*prev)->hash_next;
+        *prev = ghost->hash_next;
+    }
+
+    uint bucket = bcache_hash(cache, blocknum);
+    ghost->blocknum = blocknum;
+    ghost->hash_next = cache->ghost_hash[bucket];
+    cache->ghost_hash[bucket] = ghost;
+    list_add_tail(&cache->a1out_list, &ghost->node);
+}
+
+/* forget a block's ghost, returns true if it had one */
+static bool ghost_remove(struct bcache *cache, bnum_t blocknum)
+{
+    struct bcache_ghost **prev = &cache->ghost_hash[bcache_hash(cache, blocknum)];
+
+    for (; *prev; prev = &(*prev)->hash_next) {
+        struct bcache_ghost *ghost = *prev;
+
+        if (ghost->blocknum == blocknum) {
+            *prev = ghost->hash_next;
+            list_delete(&ghost->node);
+            list_add_tail(&cache->ghost_free_list, &ghost->node);
+            return true;
+        }
+    }
+
+    return false;
+}
+
 /* find a block if it's already present */
 static struct bcache_block *find_block(struct bcache *cache, uint blocknum)
 {
@@ -130,14 +388,16 @@ static struct bcache_block *find_block(struct bcache *cache, uint blocknum)
 
     LTRACEF("num %u\n", blocknum);
 
-    block = NULL;
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
+    for (block = cache->hash[bcache_hash(cache, blocknum)]; block; block = block->hash_next) {
         LTRACEF("looking at entry %p, num %u\n", block, block->blocknum);
         depth++;
 
         if (block->blocknum == blocknum) {
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
+            /* blocks in the fifo stay where they are */
+            if (block->queue == BCACHE_AM) {
+                list_delete(&block->node);
+                list_add_tail(&cache->am_list, &block->node);
+            }
             cache->stats.hits++;
             cache->stats.depth += depth;
             return block;
@@ -148,7 +408,195 @@ static struct bcache_block *find_block(struct bcache *cache, uint blocknum)
     return NULL;
 }
 
-/* allocate a new block */
+/* find a block without counting it as a use */
+static struct bcache_block *lookup_block(struct bcache *cache, bnum_t blocknum)
+{
+    struct bcache_block *block;
+
+    for (block = cache->hash[bcache_hash(cache, blocknum)]; block; block = block->hash_next) {
+        if (block->blocknum == blocknum)
+            return block;
+    }
+
+    return NULL;
+}
+
+static void mark_dirty(struct bcache *cache, struct bcache_block *block)
+{
+    if (block->is_dirty)
+        return;
+
+    block->is_dirty = true;
+    block->dirty_time = current_time();
+
+    /* start the flusher aging the first dirty block, and get it going early
+     * if the cache is filling up with dirty blocks */
+    ++cache->dirty_count;
+    if (cache->dirty_count == 1 || cache->dirty_count == cache->dirty_limit)
+        event_signal(&cache->flush_event, false);
+}
+
+/* blocks in use are left alone unless the caller is explicitly flushing */
+static bool can_flush(struct bcache_block *block, bool busy_ok)
+{
+    return block && block->is_dirty && (busy_ok || block->ref_count == 0);
+}
+
+/* write a dirty block back along with any dirty blocks that follow it.
+ * With unlocked, the cache lock is dropped for the write: the run is copied
+ * out and marked clean first, and its blocks are held so they can't be
+ * evicted and read back from the device before the write lands. A block
+ * dirtied again in the meantime is simply written again later. Callers
+ * passing unlocked hold flush_lock. */
+static int flush_run(struct bcache *cache, struct bcache_block *block, bool busy_ok, bool unlocked)
+{
+    struct bcache_block *run[BCACHE_RUN_MAX];
+    lk_time_t dirty_time[BCACHE_RUN_MAX];
+    bnum_t blocknum = block->blocknum;
+    uint count = 0;
+    int err;
+
+    DEBUG_ASSERT(block->is_dirty);
+
+    run[count++] = block;
+    while (count < cache->run_max) {
+        struct bcache_block *next = lookup_block(cache, blocknum + count);
+        if (!can_flush(next, busy_ok))
+            break;
+        run[count++] = next;
+    }
+
+    LTRACEF("num %u, count %u, unlocked %d\n", blocknum, count, unlocked);
+
+    if (unlocked) {
+        for (uint i = 0; i < count; i++) {
+            memcpy(cache->flush_buf + i * cache->block_size, run[i]->ptr, cache->block_size);
+            run[i]->ref_count++;
+            run[i]->is_dirty = false;
+            dirty_time[i] = run[i]->dirty_time;
+        }
+        cache->dirty_count -= count;
+
+        mutex_release(&cache->lock);
+        err = dev_write(cache, cache->flush_buf, blocknum, count);
+        mutex_acquire(&cache->lock);
+
+        for (uint i = 0; i < count; i++) {
+            run[i]->ref_count--;
+            /* put back what didn't make it out, unless dirtied again */
+            if (err < 0 && !run[i]->is_dirty) {
+                run[i]->is_dirty = true;
+                run[i]->dirty_time = dirty_time[i];
+                cache->dirty_count++;
+            }
+        }
+    } else {
+        if (count == 1) {
+            err = dev_write(cache, block->ptr, blocknum, 1);
+        } else {
+            for (uint i = 0; i < count; i++)
+                memcpy(cache->run_buf + i * cache->block_size, run[i]->ptr, cache->block_size);
+            err = dev_write(cache, cache->run_buf, blocknum, count);
+        }
+
+        if (err == 0) {
+            for (uint i = 0; i < count; i++) {
+                run[i]->is_dirty = false;
+                cache->dirty_count--;
+            }
+        }
+    }
+    if (err < 0)
+        return err;
+
+    cache->stats.writes += count;
+    cache->stats.write_ops++;
+    return 0;
+}
+
+/* write back every block dirty for at least age ms, along with its dirty neighbours */
+static int flush_blocks(struct bcache *cache, lk_time_t age, bool busy_ok, bool unlocked)
+{
+    lk_time_t now = current_time();
+    bool progress;
+    int err;
+
+    do {
+        progress = false;
+        for (int i = 0; i < cache->count && cache->dirty_count > 0; i++) {
+            struct bcache_block *block = &cache->blocks[i];
+
+            /* blocks dirtied while the lock was dropped are newer than now */
+            if (!can_flush(block, busy_ok) || !TIME_GTE(now, block->dirty_time + age))
+                continue;
+
+            /* start from the beginning of the run it's in */
+            for (uint n = 1; n < cache->run_max && block->blocknum > 0; n++) {
+                struct bcache_block *prev = lookup_block(cache, block->blocknum - 1);
+                if (!can_flush(prev, busy_ok))
+                    break;
+                block = prev;
+            }
+
+            err = flush_run(cache, block, busy_ok, unlocked);
+            if (err < 0)
+                return err;
+            progress = true;
+        }
+    } while (progress);
+
+    return 0;
+}
+
+static int bcache_flusher(void *arg)
+{
+    struct bcache *cache = arg;
+    lk_time_t timeout = INFINITE_TIME;
+
+    for (;;) {
+        event_wait_timeout(&cache->flush_event, timeout);
+
+        mutex_acquire(&cache->flush_lock);
+        mutex_acquire(&cache->lock);
+        if (cache->exiting) {
+            mutex_release(&cache->lock);
+            mutex_release(&cache->flush_lock);
+            break;
+        }
+
+        if (cache->dirty_count > 0) {
+            /* everything goes if too much of the cache is dirty */
+            lk_time_t age = cache->dirty_count >= cache->dirty_limit ? 0 : BCACHE_DIRTY_AGE;
+            int err = flush_blocks(cache, age, false, true);
+            if (err < 0)
+                TRACEF("error %d writing back blocks\n", err);
+        }
+
+        /* only poll while there are dirty blocks to age, mark_dirty() wakes
+         * us up once the cache gets dirtied again */
+        timeout = cache->dirty_count > 0 ? BCACHE_DIRTY_AGE / 2 : INFINITE_TIME;
+
+        mutex_release(&cache->lock);
+        mutex_release(&cache->flush_lock);
+    }
+
+    return 0;
+}
+
+/* oldest unreferenced block on a queue */
+static struct bcache_block *find_victim(struct list_node *list)
+{
+    struct bcache_block *block;
+
+    list_for_every_entry(list, block, struct bcache_block, node) {
+        if (block->ref_count == 0)
+            return block;
+    }
+
+    return NULL;
+}
+
+/* allocate a new block, not yet on any queue */
 static struct bcache_block *alloc_block(struct bcache *cache)
 {
     int err;
@@ -157,58 +605,135 @@ static struct bcache_block *alloc_block(struct bcache *cache)
     /* pop one off the free list if it's present */
     block = list_remove_head_type(&cache->free_list, struct bcache_block, node);
     if (block) {
-        block->ref_count = 0;
-        list_add_tail(&cache->lru_list, &block->node);
         LTRACEF("found block %p on free list\n", block);
         return block;
     }
 
-    /* walk the lru, looking for a free block */
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        LTRACEF("looking at %p, num %u\n", block, block->blocknum);
-        if (block->ref_count == 0) {
-            if (block->is_dirty) {
-                err = flush_block(cache, block);
-                if (err)
-                    return NULL;
-            }
+    /* take from the fifo once it's over its share, otherwise from the lru */
+    block = NULL;
+    if (cache->a1in_count > cache->a1in_max)
+        block = find_victim(&cache->a1in_list);
+    if (!block)
+        block = find_victim(&cache->am_list);
+    if (!block)
+        block = find_victim(&cache->a1in_list);
+    if (!block)
+        return NULL;
+
+    LTRACEF("evicting %p, num %u\n", block, block->blocknum);
+
+    if (block->is_dirty) {
+        err = flush_run(cache, block, false, false);
+        if (err)
+            return NULL;
+    }
 
-            // add it to the tail of the lru
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
-            return block;
-        }
+    if (block->queue == BCACHE_A1IN) {
+        cache->a1in_count--;
+        ghost_add(cache, block->blocknum);
     }
 
-    return NULL;
+    list_delete(&block->node);
+    hash_remove(cache, block);
+    block->queue = BCACHE_FREE;
+    cache->stats.evictions++;
+
+    return block;
 }
 
-static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blocknum)
+/* give a freshly allocated block its number and put it on a queue */
+static void insert_block(struct bcache *cache, struct bcache_block *block, uint blocknum)
+{
+    block->blocknum = blocknum;
+    block->ref_count = 0;
+    block->is_dirty = false;
+    hash_insert(cache, block);
+
+    /* seen recently enough to have a ghost, it goes straight into the lru */
+    if (ghost_remove(cache, blocknum)) {
+        block->queue = BCACHE_AM;
+        list_add_tail(&cache->am_list, &block->node);
+        cache->stats.ghost_hits++;
+    } else {
+        block->queue = BCACHE_A1IN;
+        list_add_tail(&cache->a1in_list, &block->node);
+        cache->a1in_count++;
+    }
+}
+
+/* read a block, and if there's room, the ones after it that aren't cached yet */
+static struct bcache_block *fill_blocks(struct bcache *cache, uint blocknum, uint count)
 {
+    struct bcache_block *run[BCACHE_RUN_MAX];
+    uint n;
     int err;
 
+    count = MIN(count, cache->run_max);
+    if (blocknum < cache->dev_blocks)
+        count = MIN(count, cache->dev_blocks - blocknum);
+
+    for (n = 0; n < count; n++) {
+        if (n > 0 && lookup_block(cache, blocknum + n))
+            break;
+        run[n] = alloc_block(cache);
+        if (!run[n])
+            break;
+    }
+    if (n == 0)
+        return NULL;
+
+    LTRACEF("num %u, count %u\n", blocknum, n);
+
+    if (n == 1) {
+        err = dev_read(cache, run[0]->ptr, blocknum, 1);
+    } else {
+        err = dev_read(cache, cache->run_buf, blocknum, n);
+    }
+    if (err < 0) {
+        /* free the blocks, return an error */
+        for (uint i = 0; i < n; i++)
+            list_add_tail(&cache->free_list, &run[i]->node);
+        return NULL;
+    }
+
+    for (uint i = 0; i < n; i++) {
+        if (n > 1)
+            memcpy(run[i]->ptr, cache->run_buf + i * cache->block_size, cache->block_size);
+        insert_block(cache, run[i], blocknum + i);
+    }
+    cache->stats.prefetches += n - 1;
+
+    return run[0];
+}
+
+static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blocknum)
+{
+    uint count = 1;
+
     LTRACEF("block %u\n", blocknum);
 
+    /* keep track of how long the current sequential run is, rereading a block doesn't break it */
+    if (blocknum == cache->next_seq) {
+        cache->seq_count++;
+    } else if (blocknum + 1 != cache->next_seq) {
+        cache->seq_count = 0;
+    }
+    cache->next_seq = blocknum + 1;
+
     /* see if it's already in the cache */
     struct bcache_block *block = find_block(cache, blocknum);
     if (block == NULL) {
         LTRACEF("wasn't allocated\n");
 
-        /* allocate a new block and fill it */
-        block = alloc_block(cache);
-        DEBUG_ASSERT(block);
-
-        LTRACEF("wasn't allocated, new block %p\n", block);
+        if (cache->seq_count >= BCACHE_SEQ_MIN)
+            count = cache->run_max;
 
-        block->blocknum = blocknum;
-        err = bio_read(cache->dev, block->ptr, (off_t)blocknum * cache->block_size, cache->block_size);
-        if (err < 0) {
-            /* free the block, return an error */
-            list_add_tail(&cache->free_list, &block->node);
+        /* allocate new blocks and fill them */
+        block = fill_blocks(cache, blocknum, count);
+        if (!block)
             return NULL;
-        }
 
-        cache->stats.reads++;
+        LTRACEF("wasn't allocated, new block %p\n", block);
     }
 
     DEBUG_ASSERT(block->blocknum == blocknum);
@@ -222,14 +747,16 @@ int bcache_read_block(bcache_t _cache, void *buf, uint blocknum)
 
     LTRACEF("buf %p, blocknum %u\n", buf, blocknum);
 
+    mutex_acquire(&cache->lock);
+
     struct bcache_block *block = find_or_fill_block(cache, blocknum);
-    if (block == NULL) {
-        /* error */
-        return -1;
-    }
+    if (block)
+        memcpy(buf, block->ptr, cache->block_size);
 
-    memcpy(buf, block->ptr, cache->block_size);
-    return 0;
+    mutex_release(&cache->lock);
+
+    /* -1 on error */
+    return block ? 0 : -1;
 }
 
 int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum)
@@ -240,17 +767,19 @@ int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum)
 
     DEBUG_ASSERT(ptr);
 
+    mutex_acquire(&cache->lock);
+
     struct bcache_block *block = find_or_fill_block(cache, blocknum);
-    if (block == NULL) {
-        /* error */
-        return -1;
+    if (block) {
+        /* increment the ref count to keep it from being freed */
+        block->ref_count++;
+        *ptr = block->ptr;
     }
 
-    /* increment the ref count to keep it from being freed */
-    block->ref_count++;
-    *ptr = block->ptr;
+    mutex_release(&cache->lock);
 
-    return 0;
+    /* -1 on error */
+    return block ? 0 : -1;
 }
 
 int bcache_put_block(bcache_t _cache, uint blocknum)
@@ -259,6 +788,8 @@ int bcache_put_block(bcache_t _cache, uint blocknum)
 
     LTRACEF("blocknum %u\n", blocknum);
 
+    mutex_acquire(&cache->lock);
+
     struct bcache_block *block = find_block(cache, blocknum);
 
     /* be pretty hard on the caller for now */
@@ -267,6 +798,8 @@ int bcache_put_block(bcache_t _cache, uint blocknum)
 
     block->ref_count--;
 
+    mutex_release(&cache->lock);
+
     return 0;
 }
 
@@ -276,15 +809,18 @@ int bcache_mark_block_dirty(bcache_t priv, uint blocknum)
     struct bcache *cache = priv;
     struct bcache_block *block;
 
+    mutex_acquire(&cache->lock);
+
     block = find_block(cache, blocknum);
     if (!block) {
         err = -1;
         goto exit;
     }
 
-    block->is_dirty = true;
+    mark_dirty(cache, block);
     err = 0;
 exit:
+    mutex_release(&cache->lock);
     return (err);
 }
 
@@ -294,6 +830,8 @@ int bcache_zero_block(bcache_t priv, uint blocknum)
     struct bcache *cache = priv;
     struct bcache_block *block;
 
+    mutex_acquire(&cache->lock);
+
     block = find_block(cache, blocknum);
     if (!block) {
         block = alloc_block(cache);
@@ -302,13 +840,14 @@ int bcache_zero_block(bcache_t priv, uint blocknum)
             goto exit;
         }
 
-        block->blocknum = blocknum;
+        insert_block(cache, block, blocknum);
     }
 
     memset(block->ptr, 0, cache->block_size);
-    block->is_dirty = true;
+    mark_dirty(cache, block);
     err = 0;
 exit:
+    mutex_release(&cache->lock);
     return (err);
 }
 
@@ -316,18 +855,17 @@ int bcache_flush(bcache_t priv)
 {
     int err;
     struct bcache *cache = priv;
-    struct bcache_block *block;
 
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        if (block->is_dirty) {
-            err = flush_block(cache, block);
-            if (err)
-                goto exit;
-        }
-    }
+    mutex_acquire(&cache->flush_lock);
+    mutex_acquire(&cache->lock);
+    err = flush_blocks(cache, 0, true, false);
+    mutex_release(&cache->lock);
+    mutex_release(&cache->flush_lock);
+
+    /* and get them out of the device's write cache */
+    if (err == 0)
+        err = bio_flush(cache->dev);
 
-    err = 0;
-exit:
     return (err);
 }
 
@@ -338,13 +876,24 @@ void bcache_dump(bcache_t priv, const char *name)
 
     finds = cache->stats.hits + cache->stats.misses;
 
-    printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u writes=%u\n",
+    mutex_acquire(&cache->lock);
+
+    printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) ghost hits=%u evictions=%u\n",
            name,
            cache->stats.hits,
            finds ? (cache->stats.hits * 100) / finds : 0,
            cache->stats.hits ? cache->stats.depth / cache->stats.hits : 0,
            cache->stats.misses,
            finds ? (cache->stats.misses * 100) / finds : 0,
-           cache->stats.reads,
-           cache->stats.writes);
+           cache->stats.ghost_hits,
+           cache->stats.evictions);
+    printf("%s: reads=%u in %u ops (%u read ahead) writes=%u in %u ops, %d dirty\n",
+           name,
+           cache->stats.reads, cache->stats.read_ops, cache->stats.prefetches,
+           cache->stats.writes, cache->stats.write_ops, cache->dirty_count);
+    printf("%s: %d blocks, %d in fifo (max %d), %zu in lru, %zu ghosts\n",
+           name, cache->count, cache->a1in_count, cache->a1in_max,
+           list_length(&cache->am_list), list_length(&cache->a1out_list));
+
+    mutex_release(&cache->lock);
 }
@@ -35,3 +35,12 @@ int bcache_read_block(bcache_t, void *, uint block);
 int bcache_get_block(bcache_t, void **, uint block);
 int bcache_put_block(bcache_t, uint block);
 
+int bcache_mark_block_dirty(bcache_t, uint block);
+int bcache_zero_block(bcache_t, uint block);
+
+// write back every dirty block
+int bcache_flush(bcache_t);
+
+// print hit, miss and eviction counters
+void bcache_dump(bcache_t, const char *name);
+
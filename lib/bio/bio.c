@@ -29,19 +29,155 @@
 #include <list.h>
 #include <pow2.h>
 #include <lib/bio.h>
+#include <arch/defines.h>
 #include <kernel/mutex.h>
+#include <kernel/rwlock.h>
 #include <lk/init.h>
 
 #define LOCAL_TRACE 0
 
 static struct {
     struct list_node list;
-    mutex_t lock;
+    rwlock_t lock;
 } bdevs = {
     .list = LIST_INITIAL_VALUE(bdevs.list),
-    .lock = MUTEX_INITIAL_VALUE(bdevs.lock),
+    .lock = RWLOCK_INITIAL_VALUE(bdevs.lock),
+};
+
+/* bounce buffers for the middle of transfers to and from buffers the device can't use directly */
+#ifndef BIO_BOUNCE_SIZE
+#define BIO_BOUNCE_SIZE (64 * 1024)
+#endif
+#ifndef BIO_BOUNCE_COUNT
+#define BIO_BOUNCE_COUNT 4
+#endif
+
+struct bio_bounce_buf {
+    struct list_node node;
+    void *ptr;
 };
 
+static struct {
+    mutex_t lock;
+    struct list_node free;
+    uint count;
+} bio_bounce = {
+    .lock = MUTEX_INITIAL_VALUE(bio_bounce.lock),
+    .free = LIST_INITIAL_VALUE(bio_bounce.free),
+};
+
+/* grab a bounce buffer, allocating it the first time. returns NULL if they're all busy */
+static struct bio_bounce_buf *bio_bounce_get(void)
+{
+    struct bio_bounce_buf *bounce;
+
+    mutex_acquire(&bio_bounce.lock);
+
+    bounce = list_remove_head_type(&bio_bounce.free, struct bio_bounce_buf, node);
+    if (!bounce && bio_bounce.count < BIO_BOUNCE_COUNT) {
+        bounce = malloc(sizeof(*bounce));
+        if (bounce) {
+            bounce->ptr = memalign(CACHE_LINE, BIO_BOUNCE_SIZE);
+            if (bounce->ptr) {
+                bio_bounce.count++;
+            } else {
+                free(bounce);
+                bounce = NULL;
+            }
+        }
+    }
+
+    mutex_release(&bio_bounce.lock);
+
+    return bounce;
+}
+
+static void bio_bounce_put(struct bio_bounce_buf *bounce)
+{
+    mutex_acquire(&bio_bounce.lock);
+    list_add_head(&bio_bounce.free, &bounce->node);
+    mutex_release(&bio_bounce.lock);
+}
+
+/* read whole blocks into an unaligned buffer through a bounce buffer, or temp a block at a time if none are free */
+static ssize_t bio_read_bounced(struct bdev *dev, uint8_t *buf, bnum_t block, uint count, uint8_t *temp)
+{
+    struct bio_bounce_buf *bounce = NULL;
+    uint chunk = 1;
+    ssize_t bytes_read = 0;
+    ssize_t err = 0;
+
+    if (dev->block_size < BIO_BOUNCE_SIZE && count > 1)
+        bounce = bio_bounce_get();
+    if (bounce) {
+        temp = bounce->ptr;
+        chunk = BIO_BOUNCE_SIZE >> dev->block_shift;
+    }
+
+    while (count > 0) {
+        uint n = MIN(count, chunk);
+        size_t len = (size_t)n << dev->block_shift;
+
+        err = bio_read_block(dev, temp, block, n);
+        if (err < 0) {
+            break;
+        } else if ((size_t)err != len) {
+            err = ERR_IO;
+            break;
+        }
+        memcpy(buf, temp, len);
+
+        buf += len;
+        bytes_read += len;
+        block += n;
+        count -= n;
+    }
+
+    if (bounce)
+        bio_bounce_put(bounce);
+
+    return (err >= 0) ? bytes_read : err;
+}
+
+static ssize_t bio_write_bounced(struct bdev *dev, const uint8_t *buf, bnum_t block, uint count, uint8_t *temp)
+{
+    struct bio_bounce_buf *bounce = NULL;
+    uint chunk = 1;
+    ssize_t bytes_written = 0;
+    ssize_t err = 0;
+
+    if (dev->block_size < BIO_BOUNCE_SIZE && count > 1)
+        bounce = bio_bounce_get();
+    if (bounce) {
+        temp = bounce->ptr;
+        chunk = BIO_BOUNCE_SIZE >> dev->block_shift;
+    }
+
+    while (count > 0) {
+        uint n = MIN(count, chunk);
+        size_t len = (size_t)n << dev->block_shift;
+
+        memcpy(temp, buf, len);
+        err = bio_write_block(dev, temp, block, n);
+        if (err < 0) {
+            break;
+        } else if ((size_t)err != len) {
+            err = ERR_IO;
+            break;
+        }
+
+        buf += len;
+        bytes_written += len;
+        block += n;
+        count -= n;
+    }
+
+    if (bounce)
+        bio_bounce_put(bounce);
+
+    return (err >= 0) ? bytes_written : err;
+}
+
 /* default implementation is to use the read_block hook to 'deblock' the device */
 static ssize_t bio_default_read(struct bdev *dev, void *_buf, off_t offset, size_t len)
 {
@@ -86,22 +222,14 @@ static ssize_t bio_default_read(struct bdev *dev, void *_buf, off_t offset, size
         (IS_ALIGNED((size_t)buf, CACHE_LINE) == false);
     /* handle middle blocks */
     if (requires_alignment) {
-        while (len >= dev->block_size) {
-            /* do the middle reads */
-            err = bio_read_block(dev, temp, block, 1);
-            if (err < 0) {
-                goto err;
-            } else if ((size_t)err != dev->block_size) {
-                err = ERR_IO;
-                goto err;
-            }
-            memcpy(buf, temp, dev->block_size);
-
-            buf += dev->block_size;
-            len -= dev->block_size;
-            bytes_read += dev->block_size;
-            block++;
-        }
+        uint32_t num_blocks = divpow2(len, dev->block_shift);
+        err = bio_read_bounced(dev, buf, block, num_blocks, temp);
+        if (err < 0)
+            goto err;
+        buf += err;
+        len -= err;
+        bytes_read += err;
+        block += num_blocks;
     } else {
         uint32_t num_blocks = divpow2(len, dev->block_shift);
         err = bio_read_block(dev, buf, block, num_blocks);
@@ -193,22 +321,14 @@ static ssize_t bio_default_write(struct bdev *dev, const void *_buf, off_t offse
 
     /* handle middle blocks */
     if (requires_alignment) {
-        while (len >= dev->block_size) {
-            /* do the middle reads */
-            memcpy(temp, buf, dev->block_size);
-            err = bio_write_block(dev, temp, block, 1);
-            if (err < 0) {
-                goto err;
-            } else if ((size_t)err != dev->block_size) {
-                err = ERR_IO;
-                goto err;
-            }
-
-            buf += dev->block_size;
-            len -= dev->block_size;
-            bytes_written += dev->block_size;
-            block++;
-        }
+        uint32_t block_count = divpow2(len, dev->block_shift);
+        err = bio_write_bounced(dev, buf, block, block_count, temp);
+        if (err < 0)
+            goto err;
+        buf += err;
+        len -= err;
+        bytes_written += err;
+        block += block_count;
     } else {
         uint32_t block_count = divpow2(len, dev->block_shift);
         err = bio_write_block(dev, buf, block, block_count);
@@ -297,6 +417,64 @@ static ssize_t bio_default_write_block(struct bdev *dev, const void *buf, bnum_t
     return ERR_NOT_SUPPORTED;
 }
 
+/* one contiguous piece of a request for the synchronous hooks */
+static ssize_t bio_default_xfer(struct bdev *dev, enum bio_op op, void *buf, bnum_t block, size_t len)
+{
+    uint count = len >> dev->block_shift;
+    ssize_t err;
+
+    if (op == BIO_OP_WRITE)
+        err = dev->write_block(dev, buf, block, count);
+    else
+        err = dev->read_block(dev, buf, block, count);
+    if (err < 0)
+        return err;
+    if ((size_t)err != len)
+        return ERR_IO;
+
+    return count;
+}
+
+/* default implementation does the transfer right away with the block hooks,
+ * a piece at a time where the buffers are contiguous in memory */
+static void bio_default_submit(struct bdev *dev, bio_request_t *req)
+{
+    bnum_t block = req->block;
+    uint8_t *run = NULL;
+    size_t run_len = 0;
+    ssize_t err = 0;
+
+    /* writes went straight to the device, and discards are only a hint */
+    if (req->op == BIO_OP_FLUSH || req->op == BIO_OP_DISCARD)
+        goto done;
+
+    for (bio_request_t *r = req; r; r = r->next) {
+        for (uint i = 0; i < r->iov_count; i++) {
+            const bio_iovec_t *iov = &r->iov[i];
+
+            if (run && run + run_len == iov->base) {
+                run_len += iov->len;
+                continue;
+            }
+
+            if (run_len) {
+                err = bio_default_xfer(dev, req->op, run, block, run_len);
+                if (err < 0)
+                    goto done;
+                block += err;
+            }
+            run = iov->base;
+            run_len = iov->len;
+        }
+    }
+
+    if (run_len)
+        err = bio_default_xfer(dev, req->op, run, block, run_len);
+
+done:
+    bio_request_complete(dev, req, err < 0 ? err : NO_ERROR);
+}
+
 static void bdev_inc_ref(bdev_t *dev)
 {
     LTRACEF("Add ref \"%s\" %d -> %d\n", dev->name, dev->ref, dev->ref + 1);
@@ -315,11 +493,12 @@ static void bdev_dec_ref(bdev_t *dev)
 
         TRACEF("last ref, removing (%s)\n", dev->name);
 
-        // call the close hook if it exists
+        // call the close hook if it exists, it may free the device
+        char *name = dev->name;
         if (dev->close)
             dev->close(dev);
 
-        free(dev->name);
+        free(name);
     }
 }
 
@@ -358,7 +537,7 @@ bdev_t *bio_open(const char *name)
 
     /* see if it's in our list */
     bdev_t *entry;
-    mutex_acquire(&bdevs.lock);
+    rwlock_read_acquire(&bdevs.lock);
     list_for_every_entry(&bdevs.list, entry, bdev_t, node) {
         DEBUG_ASSERT(entry->ref > 0);
         if (!strcmp(entry->name, name)) {
@@ -367,7 +546,7 @@ bdev_t *bio_open(const char *name)
             break;
         }
     }
-    mutex_release(&bdevs.lock);
+    rwlock_read_release(&bdevs.lock);
 
     return bdev;
 }
@@ -453,6 +632,227 @@ ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len)
     return dev->erase(dev, offset, len);
 }
 
+/* hand queued requests to the driver until it has as many as it can take */
+static void bio_dispatch(bdev_t *dev)
+{
+    spin_lock_saved_state_t state;
+    bio_request_t *req;
+
+    spin_lock_irqsave(&dev->queue_lock, state);
+
+    /* whoever is already dispatching will pick up the new requests */
+    if (dev->dispatching) {
+        spin_unlock_irqrestore(&dev->queue_lock, state);
+        return;
+    }
+    dev->dispatching = true;
+
+    while (dev->inflight < dev->queue_depth &&
+            (req = list_remove_head_type(&dev->queue, bio_request_t, node))) {
+        dev->inflight++;
+        dev->queue_stats.dispatched++;
+        if (dev->inflight > dev->queue_stats.max_inflight)
+            dev->queue_stats.max_inflight = dev->inflight;
+        spin_unlock_irqrestore(&dev->queue_lock, state);
+
+        LTRACEF("dev '%s', block %u, total %u, merged %u\n", dev->name, req->block, req->total, req->merged);
+        dev->submit(dev, req);
+
+        spin_lock_irqsave(&dev->queue_lock, state);
+    }
+
+    dev->dispatching = false;
+    spin_unlock_irqrestore(&dev->queue_lock, state);
+}
+
+/* worst case number of segments a driver needs for a buffer */
+static uint bio_iov_segments(const bio_iovec_t *iov)
+{
+    if (iov->len == 0)
+        return 0;
+#if WITH_KERNEL_VM
+    /* pages needn't be physically contiguous */
+    vaddr_t start = ROUNDDOWN((vaddr_t)iov->base, PAGE_SIZE);
+    vaddr_t end = ROUNDUP((vaddr_t)iov->base + iov->len, PAGE_SIZE);
+    return (end - start) / PAGE_SIZE;
+#else
+    return 1;
+#endif
+}
+
+/* tack a request onto a queued one it's contiguous with, called with the queue lock held */
+static bool bio_queue_merge(bdev_t *dev, bio_request_t *req)
+{
+    struct list_node *node;
+
+    if (req->op == BIO_OP_FLUSH)
+        return false;
+
+    /* newest first, and never move a request ahead of one it overlaps or a flush */
+    for (node = list_peek_tail(&dev->queue); node; node = list_prev(&dev->queue, node)) {
+        bio_request_t *q = containerof(node, bio_request_t, node);
+
+        if (q->op == BIO_OP_FLUSH)
+            break;
+
+        if (q->op == req->op && q->merged + req->merged <= BIO_MERGE_MAX &&
+                (!dev->max_segments || q->segs + req->segs <= dev->max_segments)) {
+            if (q->block + q->total == req->block) {
+                q->last->next = req;
+                q->last = req;
+                q->total += req->count;
+                q->merged += req->merged;
+                q->segs += req->segs;
+                return true;
+            }
+            if (req->block + req->count == q->block) {
+                /* req takes the other one's place on the queue */
+                req->next = q;
+                req->last = q->last;
+                req->total += q->total;
+                req->merged += q->merged;
+                req->segs += q->segs;
+                list_add_head(&q->node, &req->node);
+                list_delete(&q->node);
+                return true;
+            }
+        }
+
+        if (bio_does_overlap(q->block, q->total, req->block, req->count))
+            break;
+    }
+
+    return false;
+}
+
+status_t bio_submit(bdev_t *dev, bio_request_t *req)
+{
+    LTRACEF("dev '%s', req %p, op %d, block %u, count %u\n", dev->name, req, req->op, req->block, req->count);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(req);
+
+    req->segs = 0;
+
+    switch (req->op) {
+        case BIO_OP_READ:
+        case BIO_OP_WRITE:
+            break;
+        case BIO_OP_FLUSH:
+            if (req->count || req->iov_count)
+                return ERR_INVALID_ARGS;
+            goto queue;
+        case BIO_OP_DISCARD:
+            if (req->iov_count)
+                return ERR_INVALID_ARGS;
+            break;
+        default:
+            return ERR_INVALID_ARGS;
+    }
+
+    /* range check, no partial requests */
+    if (req->count == 0 || bio_trim_block_range(dev, req->block, req->count) != req->count)
+        return ERR_OUT_OF_RANGE;
+
+    if (req->op == BIO_OP_DISCARD)
+        goto queue;
+
+    /* devices that dma straight into the buffers may need them cache aligned */
+    uint32_t align_flag = (req->op == BIO_OP_READ) ? BIO_FLAG_CACHE_ALIGNED_READS
+                                                    : BIO_FLAG_CACHE_ALIGNED_WRITES;
+    bool requires_alignment = dev->flags & align_flag;
+
+    size_t len = 0;
+    uint segs = 0;
+    for (uint i = 0; i < req->iov_count; i++) {
+        DEBUG_ASSERT(req->iov[i].base);
+        if (req->iov[i].len & (dev->block_size - 1))
+            return ERR_INVALID_ARGS;
+        if (requires_alignment && !IS_ALIGNED((uintptr_t)req->iov[i].base, CACHE_LINE))
+            return ERR_INVALID_ARGS;
+        len += req->iov[i].len;
+        segs += bio_iov_segments(&req->iov[i]);
+    }
+    if (len != (size_t)req->count << dev->block_shift)
+        return ERR_INVALID_ARGS;
+    if (dev->max_segments && segs > dev->max_segments)
+        return ERR_TOO_BIG;
+    req->segs = segs;
+
+queue:
+    req->result = 0;
+    req->next = NULL;
+    req->last = req;
+    req->total = req->count;
+    req->merged = 1;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&dev->queue_lock, state);
+
+    dev->queue_stats.submitted++;
+    if (bio_queue_merge(dev, req))
+        dev->queue_stats.merged++;
+    else
+        list_add_tail(&dev->queue, &req->node);
+
+    spin_unlock_irqrestore(&dev->queue_lock, state);
+
+    bio_dispatch(dev);
+
+    return NO_ERROR;
+}
+
+status_t bio_flush(bdev_t *dev)
+{
+    event_t event;
+    bio_request_t req = {
+        .op = BIO_OP_FLUSH,
+        .event = &event,
+    };
+
+    LTRACEF("dev '%s'\n", dev->name);
+
+    event_init(&event, false, 0);
+
+    status_t err = bio_submit(dev, &req);
+    if (err == NO_ERROR) {
+        event_wait(&event);
+        err = req.result;
+    }
+
+    event_destroy(&event);
+
+    return err;
+}
+
+void bio_request_complete(bdev_t *dev, bio_request_t *req, status_t err)
+{
+    spin_lock_saved_state_t state;
+
+    LTRACEF("dev '%s', req %p, err %d\n", dev->name, req, err);
+
+    spin_lock_irqsave(&dev->queue_lock, state);
+    DEBUG_ASSERT(dev->inflight > 0);
+    dev->inflight--;
+    spin_unlock_irqrestore(&dev->queue_lock, state);
+
+    /* finish every request in the chain, they may be freed or reused once their callback runs */
+    while (req) {
+        bio_request_t *next = req->next;
+        event_t *event = req->event;
+
+        req->result = (err < 0) ? err : (ssize_t)req->count << dev->block_shift;
+        if (req->callback)
+            req->callback(req);
+        if (event)
+            event_signal(event, false);
+
+        req = next;
+    }
+
+    bio_dispatch(dev);
+}
+
 int bio_ioctl(bdev_t *dev, int request, void *argp)
 {
     LTRACEF("dev '%s', request %08x, argp %p\n", dev->name, request, argp);
@@ -538,6 +938,16 @@ void bio_initialize_bdev(bdev_t *dev,
     dev->write_block = bio_default_write_block;
     dev->erase = bio_default_erase;
     dev->close = NULL;
+
+    /* requests go one at a time through the block hooks unless the driver says otherwise */
+    dev->submit = bio_default_submit;
+    spin_lock_init(&dev->queue_lock);
+    list_initialize(&dev->queue);
+    dev->queue_depth = 1;
+    dev->max_segments = 0;
+    dev->inflight = 0;
+    dev->dispatching = false;
+    memset(&dev->queue_stats, 0, sizeof(dev->queue_stats));
 }
 
 void bio_register_device(bdev_t *dev)
@@ -548,9 +958,9 @@ void bio_register_device(bdev_t *dev)
 
     bdev_inc_ref(dev);
 
-    mutex_acquire(&bdevs.lock);
+    rwlock_write_acquire(&bdevs.lock);
     list_add_tail(&bdevs.list, &dev->node);
-    mutex_release(&bdevs.lock);
+    rwlock_write_release(&bdevs.lock);
 }
 
 void bio_unregister_device(bdev_t *dev)
@@ -560,9 +970,9 @@ void bio_unregister_device(bdev_t *dev)
     LTRACEF(" '%s'\n", dev->name);
 
     // remove it from the list
-    mutex_acquire(&bdevs.lock);
+    rwlock_write_acquire(&bdevs.lock);
     list_delete(&dev->node);
-    mutex_release(&bdevs.lock);
+    rwlock_write_release(&bdevs.lock);
 
     bdev_dec_ref(dev); // remove the ref the list used to have
 }
@@ -571,7 +981,7 @@ void bio_dump_devices(void)
 {
     printf("block devices:\n");
     bdev_t *entry;
-    mutex_acquire(&bdevs.lock);
+    rwlock_read_acquire(&bdevs.lock);
     list_for_every_entry(&bdevs.list, entry, bdev_t, node) {
 
         printf("\t%s, size %lld, bsize %zd, ref %d",
@@ -589,6 +999,11 @@ void bio_dump_devices(void)
         }
 
         printf("\n");
+
+        printf("\t\tqueue depth %u, inflight %u, submitted %u, merged %u, dispatched %u, max inflight %u\n",
+               entry->queue_depth, entry->inflight, entry->queue_stats.submitted,
+               entry->queue_stats.merged, entry->queue_stats.dispatched,
+               entry->queue_stats.max_inflight);
     }
-    mutex_release(&bdevs.lock);
+    rwlock_read_release(&bdevs.lock);
 }
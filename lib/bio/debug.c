@@ -40,11 +40,17 @@
 #define THREE_BYTE_ADDR_BOUNDARY (16777216)
 #define SUB_ERASE_TEST_SAMPLES (32)
 
+#define BIO_BENCH_SIZE (8 * 1024 * 1024)
+#define BIO_BENCH_MEM_SIZE (4 * 1024 * 1024)
+#define BIO_BENCH_MAX_DEPTH (32)
+
 #if defined(WITH_LIB_CONSOLE)
 
 #if LK_DEBUGLEVEL > 0
 static int cmd_bio(int argc, const cmd_args *argv);
 static int bio_test_device(bdev_t *device);
+static int bio_bench(const char *name, size_t req_size, bool write);
+static int bio_align_bench(const char *name, size_t len);
 
 STATIC_COMMAND_START
 STATIC_COMMAND("bio", "block io debug commands", &cmd_bio)
@@ -66,6 +72,8 @@ usage:
         printf("%s ioctl <device> <request> <arg>\n", argv[0].str);
         printf("%s remove <device>\n", argv[0].str);
         printf("%s test <device>\n", argv[0].str);
+        printf("%s bench <device|mem> [request size] [read|write]\n", argv[0].str);
+        printf("%s alignbench <device|mem> [len]\n", argv[0].str);
 #if WITH_LIB_PARTITION
         printf("%s partscan <device> [offset]\n", argv[0].str);
 #endif
@@ -223,6 +231,19 @@ usage:
         bio_close(dev);
 
         rc = err;
+    } else if (!strcmp(argv[1].str, "bench")) {
+        if (argc < 3) goto notenoughargs;
+
+        size_t req_size = (argc > 3) ? argv[3].u : 4096;
+        bool write = (argc > 4) && !strcmp(argv[4].str, "write");
+
+        rc = bio_bench(argv[2].str, req_size, write);
+    } else if (!strcmp(argv[1].str, "alignbench")) {
+        if (argc < 3) goto notenoughargs;
+
+        size_t len = (argc > 3) ? argv[3].u : 65536;
+
+        rc = bio_align_bench(argv[2].str, len);
 #if WITH_LIB_PARTITION
     } else if (!strcmp(argv[1].str, "partscan")) {
         if (argc < 3) goto notenoughargs;
@@ -562,3 +583,246 @@ static int bio_test_device(bdev_t *device)
 
     return 0;
 }
+
+struct bio_bench_slot {
+    bio_request_t req;
+    bio_iovec_t iov;
+    volatile bool busy;
+};
+
+struct bio_bench_state {
+    event_t event;
+    volatile int completed;
+    volatile int errors;
+};
+
+static void bio_bench_callback(bio_request_t *req)
+{
+    struct bio_bench_slot *slot = containerof(req, struct bio_bench_slot, req);
+    struct bio_bench_state *state = req->callback_arg;
+
+    if (req->result < 0)
+        atomic_add(&state->errors, 1);
+    slot->busy = false;
+    atomic_add(&state->completed, 1);
+    event_signal(&state->event, false);
+}
+
+// Opens the device to benchmark, or for "mem" creates a scratch memory device
+// whose backing memory is returned in mem, for bio_bench_close() to clean up.
+static bdev_t *bio_bench_open(const char **name, void **mem)
+{
+    bdev_t *dev;
+
+    *mem = NULL;
+    if (!strcmp(*name, "mem")) {
+        *name = "membench";
+        dev = bio_open(*name);
+        if (dev) {
+            printf("%s is in use\n", *name);
+            bio_close(dev);
+            return NULL;
+        }
+
+        *mem = malloc(BIO_BENCH_MEM_SIZE);
+        if (!*mem) {
+            printf("error allocating memory device\n");
+            return NULL;
+        }
+        create_membdev(*name, *mem, BIO_BENCH_MEM_SIZE);
+        dev = bio_open(*name);
+
+        // behave like a device doing dma, so unaligned buffers take the bounce path
+        if (dev)
+            dev->flags |= BIO_FLAG_CACHE_ALIGNED_READS | BIO_FLAG_CACHE_ALIGNED_WRITES;
+    } else {
+        dev = bio_open(*name);
+    }
+    if (!dev)
+        printf("error opening block device\n");
+
+    return dev;
+}
+
+static void bio_bench_close(bdev_t *dev, void *mem)
+{
+    if (mem)
+        bio_unregister_device(dev);
+    bio_close(dev);
+    free(mem);
+}
+
+// Streams through the start of the device with bio_submit(), keeping up to
+// depth requests outstanding, for a range of depths.
+static int bio_bench(const char *name, size_t req_size, bool write)
+{
+    void *mem;
+    bdev_t *dev = bio_bench_open(&name, &mem);
+    if (!dev) {
+        free(mem);
+        return -1;
+    }
+
+    int rc = 0;
+    struct bio_bench_slot *slots = NULL;
+    uint8_t *buf = NULL;
+
+    req_size = ROUNDUP(MAX(req_size, dev->block_size), dev->block_size);
+    uint req_blocks = req_size >> dev->block_shift;
+    int nreqs = MIN((off_t)BIO_BENCH_SIZE, dev->total_size) / req_size;
+    if (nreqs == 0) {
+        printf("device too small\n");
+        rc = ERR_INVALID_ARGS;
+        goto out;
+    }
+
+    // adjacent slots have adjacent buffers, so merged requests are contiguous in memory too
+    slots = calloc(BIO_BENCH_MAX_DEPTH, sizeof(*slots));
+    buf = memalign(DMA_ALIGNMENT, BIO_BENCH_MAX_DEPTH * req_size);
+    if (!slots || !buf) {
+        printf("error allocating buffers\n");
+        rc = ERR_NO_MEMORY;
+        goto out;
+    }
+    memset(buf, 0x99, BIO_BENCH_MAX_DEPTH * req_size);
+
+    struct bio_bench_state state;
+    event_init(&state.event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    printf("bio_bench,device,op,depth,request size,requests,usecs,MB/s,IOPS,dispatched,merged\n");
+
+    for (uint depth = 1; depth <= BIO_BENCH_MAX_DEPTH; depth *= 2) {
+        int submitted = 0;
+
+        state.completed = 0;
+        state.errors = 0;
+        uint32_t dispatched = dev->queue_stats.dispatched;
+        uint32_t merged = dev->queue_stats.merged;
+
+        lk_bigtime_t t = current_time_hires();
+        while (state.completed < nreqs && state.errors == 0) {
+            for (uint i = 0; i < depth && submitted < nreqs; i++) {
+                struct bio_bench_slot *slot = &slots[i];
+                if (slot->busy)
+                    continue;
+
+                slot->iov.base = buf + i * req_size;
+                slot->iov.len = req_size;
+                slot->req.op = write ? BIO_OP_WRITE : BIO_OP_READ;
+                slot->req.block = submitted * req_blocks;
+                slot->req.count = req_blocks;
+                slot->req.iov = &slot->iov;
+                slot->req.iov_count = 1;
+                slot->req.callback = bio_bench_callback;
+                slot->req.callback_arg = &state;
+                slot->req.event = NULL;
+                slot->busy = true;
+
+                status_t err = bio_submit(dev, &slot->req);
+                if (err < 0) {
+                    printf("error %d submitting request\n", err);
+                    slot->busy = false;
+                    rc = err;
+                    break;
+                }
+                submitted++;
+            }
+            if (rc < 0)
+                break;
+
+            if (state.completed < submitted)
+                event_wait(&state.event);
+        }
+
+        // let anything still outstanding finish before reusing the slots
+        while (state.completed < submitted)
+            event_wait(&state.event);
+
+        t = current_time_hires() - t;
+
+        if (rc < 0)
+            break;
+        if (state.errors) {
+            printf("%d requests failed\n", state.errors);
+            rc = ERR_IO;
+            break;
+        }
+
+        uint64_t bytes = (uint64_t)nreqs * req_size;
+        if (t == 0)
+            t = 1;
+        printf("bio_bench,%s,%s,%u,%zu,%d,%llu,%llu,%llu,%u,%u\n",
+               name, write ? "write" : "read", depth, req_size, nreqs, t,
+               bytes / t, (uint64_t)nreqs * 1000000 / t,
+               dev->queue_stats.dispatched - dispatched, dev->queue_stats.merged - merged);
+    }
+
+    event_destroy(&state.event);
+
+out:
+    free(buf);
+    free(slots);
+    bio_bench_close(dev, mem);
+
+    return rc;
+}
+
+// Reads the start of the device with bio_read() into a cache aligned buffer and
+// then misaligned ones, to compare the direct and bounced paths.
+static int bio_align_bench(const char *name, size_t len)
+{
+    void *mem;
+    bdev_t *dev = bio_bench_open(&name, &mem);
+    if (!dev) {
+        free(mem);
+        return -1;
+    }
+
+    int rc = 0;
+    len = MIN((off_t)len, dev->total_size);
+    if (len == 0) {
+        printf("nothing to read\n");
+        rc = ERR_INVALID_ARGS;
+        goto out;
+    }
+    int reps = MAX(BIO_BENCH_SIZE / len, 1U);
+
+    uint8_t *buf = memalign(DMA_ALIGNMENT, len + DMA_ALIGNMENT);
+    if (!buf) {
+        printf("error allocating buffer\n");
+        rc = ERR_NO_MEMORY;
+        goto out;
+    }
+
+    printf("bio_alignbench,device,buffer offset,len,reads,usecs,MB/s\n");
+
+    static const size_t offsets[] = { 0, 4, DMA_ALIGNMENT / 2 };
+    for (uint i = 0; i < countof(offsets); i++) {
+        lk_bigtime_t t = current_time_hires();
+        for (int r = 0; r < reps; r++) {
+            ssize_t err = bio_read(dev, buf + offsets[i], 0, len);
+            if (err < 0 || (size_t)err != len) {
+                printf("error %ld reading device\n", (long)err);
+                rc = (err < 0) ? (int)err : ERR_IO;
+                break;
+            }
+        }
+        t = current_time_hires() - t;
+
+        if (rc < 0)
+            break;
+
+        uint64_t bytes = (uint64_t)reps * len;
+        if (t == 0)
+            t = 1;
+        printf("bio_alignbench,%s,%zu,%zu,%d,%llu,%llu\n",
+               name, offsets[i], len, reps, t, bytes / t);
+    }
+
+    free(buf);
+
+out:
+    bio_bench_close(dev, mem);
+
+    return rc;
+}
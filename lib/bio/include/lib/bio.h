@@ -25,6 +25,8 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <list.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
 
 __BEGIN_CDECLS;
 
@@ -41,6 +43,8 @@ typedef struct bio_erase_geometry_info {
     size_t erase_shift;
 } bio_erase_geometry_info_t;
 
+struct bio_request;
+
 typedef struct bdev {
     struct list_node node;
     volatile int ref;
@@ -68,8 +72,99 @@ typedef struct bdev {
     ssize_t (*erase)(struct bdev *, off_t offset, size_t len);
     int (*ioctl)(struct bdev *, int request, void *argp);
     void (*close)(struct bdev *);
+
+    /* start an async request, see bio_submit() */
+    void (*submit)(struct bdev *, struct bio_request *req);
+
+    /* async request queue */
+    spin_lock_t queue_lock;
+    struct list_node queue;
+    uint queue_depth;   /* most requests handed to the driver at once */
+    uint max_segments;  /* most buffer segments in one driver transfer, 0 for no limit */
+    uint inflight;
+    bool dispatching;
+    struct {
+        uint32_t submitted;
+        uint32_t merged;
+        uint32_t dispatched;
+        uint32_t max_inflight;
+    } queue_stats;
 } bdev_t;
 
+/*
+ * Async block requests.
+ *
+ * A request reads or writes count blocks starting at block, scattered
+ * across the buffers in iov. Every buffer must be a multiple of the block
+ * size, and together they must cover the whole request. On devices with
+ * BIO_FLAG_CACHE_ALIGNED_READS or _WRITES set, the buffers must also be
+ * cache line aligned for that direction. When the request
+ * finishes, result holds the number of bytes transferred or an error. Then
+ * the callback is called and the event is signaled, if they are set. This
+ * may happen in interrupt context, and before bio_submit() returns.
+ *
+ * A flush request has no blocks or buffers. It finishes once every write
+ * that completed before it was submitted is on stable storage. A discard
+ * request has blocks but no buffers, and tells the device their contents
+ * are no longer needed. Discards are only a hint: a device may leave the
+ * data as it was, or return anything when the blocks are read back.
+ *
+ * Requests wait on a queue in the device until fewer than queue_depth are
+ * with the driver. While they wait, a request that is contiguous with one
+ * already queued is merged into it, so the driver sees one bigger transfer.
+ *
+ * Drivers that can have several transfers in flight set the submit hook and
+ * queue_depth. A driver that can only take so many separate buffers in one
+ * transfer sets max_segments. Each buffer counts as one segment, or one per
+ * page it touches when the kernel has a vm. Chains are never merged past
+ * the limit, and a single request over it is refused. The hook is given the
+ * first of a chain of merged requests, linked through next, covering
+ * req->total blocks from req->block. It must not block, since it may be
+ * called from a completion. The driver then calls bio_request_complete()
+ * once for the whole chain. Drivers that don't set the hook get one that
+ * does the transfer with the synchronous block hooks, in the context of
+ * whoever submitted or completed the request, so such a device must only be
+ * given requests from a thread.
+ */
+typedef struct bio_iovec {
+    void *base;
+    size_t len;
+} bio_iovec_t;
+
+enum bio_op {
+    BIO_OP_READ,
+    BIO_OP_WRITE,
+    BIO_OP_FLUSH,
+    BIO_OP_DISCARD,
+};
+
+typedef void (*bio_callback_t)(struct bio_request *req);
+
+typedef struct bio_request {
+    enum bio_op op;
+    bnum_t block;
+    uint count;
+    const bio_iovec_t *iov;
+    uint iov_count;
+
+    bio_callback_t callback;
+    void *callback_arg;
+    event_t *event;
+
+    ssize_t result;
+
+    /* private to lib/bio and the driver */
+    struct list_node node;
+    struct bio_request *next;
+    struct bio_request *last;
+    uint total;
+    uint merged;
+    uint segs;
+} bio_request_t;
+
+/* most requests merged into one driver transfer */
+#define BIO_MERGE_MAX 16
+
 /* user api */
 bdev_t *bio_open(const char *name);
 void bio_close(bdev_t *dev);
@@ -78,8 +173,13 @@ ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count);
 ssize_t bio_write(bdev_t *dev, const void *buf, off_t offset, size_t len);
 ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count);
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len);
+status_t bio_submit(bdev_t *dev, bio_request_t *req);
+status_t bio_flush(bdev_t *dev);
 int bio_ioctl(bdev_t *dev, int request, void *argp);
 
+/* used by drivers to finish a chain of requests passed to the submit hook */
+void bio_request_complete(bdev_t *dev, bio_request_t *req, status_t err);
+
 /* register a block device */
 void bio_register_device(bdev_t *dev);
 void bio_unregister_device(bdev_t *dev);
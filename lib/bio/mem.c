@@ -80,6 +80,14 @@ static ssize_t mem_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t b
     return count * BLOCKSIZE;
 }
 
+static void mem_bdev_close(struct bdev *bdev)
+{
+    mem_bdev_t *mem = (mem_bdev_t *)bdev;
+
+    /* the memory itself belongs to whoever created the device */
+    free(mem);
+}
+
 int create_membdev(const char *name, void *ptr, size_t len)
 {
     mem_bdev_t *mem = malloc(sizeof(mem_bdev_t));
@@ -94,6 +102,7 @@ int create_membdev(const char *name, void *ptr, size_t len)
     mem->dev.read_block = mem_bdev_read_block;
     mem->dev.write = mem_bdev_write;
     mem->dev.write_block = mem_bdev_write_block;
+    mem->dev.close = mem_bdev_close;
 
     /* register it */
     bio_register_device(&mem->dev);
@@ -22,127 +22,279 @@
  */
 #include <debug.h>
 #include <stddef.h>
-#include <list.h>
-#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
 #include <err.h>
 #include <lib/dpc.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
-#include <kernel/spinlock.h>
+#include <kernel/mp.h>
+#include <arch/ops.h>
 #include <lk/init.h>
 
-struct dpc {
-    struct list_node node;
+/* entries in each cpu's queue, must be a power of two */
+#ifndef LK_DPC_QUEUE_SIZE
+#define LK_DPC_QUEUE_SIZE 128
+#endif
+STATIC_ASSERT((LK_DPC_QUEUE_SIZE & (LK_DPC_QUEUE_SIZE - 1)) == 0);
 
+/* callbacks a worker runs before letting other threads of its priority in */
+#ifndef LK_DPC_BATCH
+#define LK_DPC_BATCH 16
+#endif
+
+#ifndef LK_DPC_PRIORITY
+#define LK_DPC_PRIORITY DPC_PRIORITY
+#endif
+
+struct dpc {
+    uint seq;
     dpc_callback cb;
     void *arg;
 };
 
-static spin_lock_t dpc_lock = SPIN_LOCK_INITIAL_VALUE;
-static struct list_node dpc_list = LIST_INITIAL_VALUE(dpc_list);
-static struct list_node dpc_list_free = LIST_INITIAL_VALUE(dpc_list_free);
-static event_t dpc_event;
+/*
+ * Every cpu has its own bounded multiple producer, single consumer queue,
+ * drained by a worker thread pinned to that cpu. dpc_queue() pushes on the
+ * queue of the cpu it runs on without taking any lock, so interrupt handlers
+ * on different cpus never contend. Producers are usually local but a thread
+ * can migrate in the middle of a push, hence multiple producers.
+ *
+ * Isolated cpus get no worker, a dpc queued on one goes to the queue of the
+ * lowest housekeeping cpu instead so the callback runs there.
+ *
+ * The slot sequence numbers say who owns a slot: a slot is free for the
+ * producer claiming position pos when seq == pos, and holds a dpc for the
+ * worker once seq == pos + 1.
+ */
+struct dpc_queue {
+    struct dpc slots[LK_DPC_QUEUE_SIZE];
+    uint head; /* next position to claim, shared by the producers */
+    uint tail; /* next position to run, owned by the worker */
+    int idle; /* the worker found the queue empty and waits for a signal */
+    int priority;
+    event_t event;
+    thread_t *worker;
+
+    /* statistics */
+    uint queued;
+    uint overflows;
+    uint executed;
+    uint batches;
+    uint max_depth;
+} __CPU_ALIGN;
+
+static struct dpc_queue dpc_queues[SMP_MAX_CPUS];
+
+static bool dpc_push(struct dpc_queue *q, dpc_callback cb, void *arg)
+{
+    uint pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    struct dpc *dpc;
 
-#ifndef LK_DPC_NR_PREALLOCATED
-#define LK_DPC_NR_PREALLOCATED  128
-#endif
+    for (;;) {
+        dpc = &q->slots[pos & (LK_DPC_QUEUE_SIZE - 1)];
+        int diff = (int)(__atomic_load_n(&dpc->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (diff == 0) {
+            /* on failure pos is reloaded with the current head */
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            /* the worker has not run the previous occupant yet, queue full */
+            return false;
+        } else {
+            /* another producer claimed it */
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
 
-#if defined  LK_DPC_NR_PREALLOCATED  && (LK_DPC_NR_PREALLOCATED > 0)
-#define LK_DPC_NO_MALLOC 1
+    dpc->cb = cb;
+    dpc->arg = arg;
+    __atomic_store_n(&dpc->seq, pos + 1, __ATOMIC_RELEASE);
 
-static struct dpc dpc_irqs[LK_DPC_NR_PREALLOCATED];
-#else
-#undef LK_DPC_NO_MALLOC
+    return true;
+}
 
-#endif
+static bool dpc_pending(struct dpc_queue *q)
+{
+    struct dpc *dpc = &q->slots[q->tail & (LK_DPC_QUEUE_SIZE - 1)];
 
-static int dpc_thread_routine(void *arg);
+    return __atomic_load_n(&dpc->seq, __ATOMIC_ACQUIRE) == q->tail + 1;
+}
 
+static bool dpc_pop(struct dpc_queue *q, dpc_callback *cb, void **arg)
+{
+    uint pos = q->tail;
+    struct dpc *dpc = &q->slots[pos & (LK_DPC_QUEUE_SIZE - 1)];
 
-status_t dpc_queue(dpc_callback cb, void *arg, uint flags)
+    /* claimed but not filled in yet counts as empty, its producer will
+     * signal the worker once done */
+    if (__atomic_load_n(&dpc->seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return false;
+
+    *cb = dpc->cb;
+    *arg = dpc->arg;
+
+    /* hand the slot back to the producers for the next lap */
+    __atomic_store_n(&dpc->seq, pos + LK_DPC_QUEUE_SIZE, __ATOMIC_RELEASE);
+    q->tail = pos + 1;
+
+    return true;
+}
+
+/* the queue of the calling cpu, or of a housekeeping cpu if it has no worker */
+static struct dpc_queue *dpc_local_queue(void)
 {
-    struct dpc *dpc;
-#ifndef LK_DPC_NO_MALLOC
-    dpc = malloc(sizeof(struct dpc));
+    uint cpu = arch_curr_cpu_num();
 
-    if (dpc == NULL)
-        return ERR_NO_MEMORY;
-#endif
+    if (mp_is_cpu_isolated(cpu) || !dpc_queues[cpu].worker)
+        cpu = lowest_cpu_set(mp_get_default_affinity());
 
-    // disable interrupts before finding lock
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&dpc_lock, state);
+    return &dpc_queues[cpu];
+}
 
-#ifdef LK_DPC_NO_MALLOC
-    dpc = list_remove_head_type(&dpc_list_free, struct dpc, node);
-    if (dpc == NULL) {
-        printf("No more DPC preallocated buffer available\n");
-        spin_unlock_irqrestore(&dpc_lock, state);
+status_t dpc_queue(dpc_callback cb, void *arg, uint flags)
+{
+    struct dpc_queue *q = dpc_local_queue();
+
+    if (!dpc_push(q, cb, arg)) {
+        __atomic_fetch_add(&q->overflows, 1, __ATOMIC_RELAXED);
         return ERR_NO_MEMORY;
     }
-#endif
+    __atomic_fetch_add(&q->queued, 1, __ATOMIC_RELAXED);
 
-    list_add_tail(&dpc_list, &dpc->node);
+    /* only kick the worker if it went idle, pairs with dpc_thread_routine() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&q->idle, 0, __ATOMIC_SEQ_CST))
+        event_signal(&q->event, (flags & DPC_FLAG_NORESCHED) ? false : true);
 
-    spin_unlock_irqrestore(&dpc_lock, state);
+    return NO_ERROR;
+}
 
-    dpc->cb = cb;
-    dpc->arg = arg;
+status_t dpc_set_priority(uint cpu, int priority)
+{
+    if (cpu >= SMP_MAX_CPUS || priority <= IDLE_PRIORITY || priority > HIGHEST_PRIORITY)
+        return ERR_INVALID_ARGS;
+
+    struct dpc_queue *q = &dpc_queues[cpu];
 
-    event_signal(&dpc_event, (flags & DPC_FLAG_NORESCHED) ? false : true);
+    /* the worker picks it up the next time it wakes up */
+    q->priority = priority;
+    if (__atomic_exchange_n(&q->idle, 0, __ATOMIC_SEQ_CST))
+        event_signal(&q->event, false);
 
     return NO_ERROR;
 }
 
 static int dpc_thread_routine(void *arg)
 {
+    struct dpc_queue *q = (struct dpc_queue *)arg;
+    dpc_callback cb;
+    void *cb_arg;
 
-    spin_lock_saved_state_t state;
     for (;;) {
-        event_wait(&dpc_event);
-
-        spin_lock_irqsave(&dpc_lock, state);
-        struct dpc *dpc = list_remove_head_type(&dpc_list, struct dpc, node);
-        if (!dpc)
-            event_unsignal(&dpc_event);
-        spin_unlock_irqrestore(&dpc_lock, state);
-
-        if (dpc) {
-//            dprintf("dpc calling %p, arg %p\n", dpc->cb, dpc->arg);
-            dpc->cb(dpc->arg);
+        uint depth = __atomic_load_n(&q->head, __ATOMIC_RELAXED) - q->tail;
+        if (depth > q->max_depth)
+            q->max_depth = depth;
+
+        uint n = 0;
+        while (n < LK_DPC_BATCH && dpc_pop(q, &cb, &cb_arg)) {
+            cb(cb_arg);
+            n++;
+        }
+        if (n) {
+            q->executed += n;
+            q->batches++;
+        }
 
-#ifndef LK_DPC_NO_MALLOC
-            free(dpc);
-#else
-            spin_lock_saved_state_t state;
-            spin_lock_irqsave(&dpc_lock, state);
+        if (q->priority != get_current_thread()->priority)
+            thread_set_priority(q->priority);
 
-            list_add_tail(&dpc_list_free, &dpc->node);
+        if (n == LK_DPC_BATCH) {
+            /* there may be more, give threads of the same priority a turn */
+            thread_yield();
+            continue;
+        }
 
-            spin_unlock_irqrestore(&dpc_lock, state);
-#endif
+        /* announce we are going to sleep, then look again so a push racing
+         * with us either sees idle set or is seen here */
+        __atomic_store_n(&q->idle, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (dpc_pending(q)) {
+            __atomic_store_n(&q->idle, 0, __ATOMIC_SEQ_CST);
+            continue;
         }
+
+        event_wait(&q->event);
     }
 
     return 0;
 }
 
+/* start the worker of the calling cpu, isolated cpus don't get one */
+static void dpc_init_cpu(uint level)
+{
+    uint cpu = arch_curr_cpu_num();
+    struct dpc_queue *q = &dpc_queues[cpu];
+    char name[32];
+
+    if (mp_is_cpu_isolated(cpu))
+        return;
+
+    snprintf(name, sizeof(name), "dpc %u", cpu);
+    q->worker = thread_create(name, &dpc_thread_routine, q, q->priority, DEFAULT_STACK_SIZE);
+    if (!q->worker) {
+        dprintf(CRITICAL, "dpc: failed to create the worker of cpu %u\n", cpu);
+        return;
+    }
+
+    thread_set_pinned_cpu(q->worker, cpu);
+    thread_detach_and_resume(q->worker);
+}
 
 static void dpc_init(uint level)
 {
-    event_init(&dpc_event, false, 0);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct dpc_queue *q = &dpc_queues[cpu];
 
-#ifdef LK_DPC_NO_MALLOC
-    unsigned i;
-    for (i = 0; i < LK_DPC_NR_PREALLOCATED; i++) {
-        struct dpc *dpc = &dpc_irqs[i];
-        list_add_tail(&dpc_list_free, &dpc->node);
+        for (uint i = 0; i < LK_DPC_QUEUE_SIZE; i++)
+            q->slots[i].seq = i;
+        q->priority = LK_DPC_PRIORITY;
+        event_init(&q->event, false, EVENT_FLAG_AUTOUNSIGNAL);
     }
-#endif
 
-    thread_detach_and_resume(thread_create("dpc", &dpc_thread_routine, NULL, DPC_PRIORITY, DEFAULT_STACK_SIZE));
+    dpc_init_cpu(level);
 }
 
 LK_INIT_HOOK(libdpc, &dpc_init, LK_INIT_LEVEL_THREADING);
+#if WITH_SMP
+LK_INIT_HOOK_FLAGS(libdpc_secondary, &dpc_init_cpu, LK_INIT_LEVEL_THREADING, LK_INIT_FLAG_SECONDARY_CPUS);
+#endif
+
+#if WITH_LIB_CONSOLE
 
+#include <lib/console.h>
+
+static int cmd_dpcstats(int argc, const cmd_args *argv)
+{
+    printf("dpc queues, %u entries per cpu:\n", LK_DPC_QUEUE_SIZE);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct dpc_queue *q = &dpc_queues[cpu];
 
+        if (!q->worker)
+            continue;
+
+        printf("cpu %u: priority %d, depth %u, max depth %u, queued %u, executed %u, batches %u, overflows %u\n",
+               cpu, q->priority, __atomic_load_n(&q->head, __ATOMIC_RELAXED) - q->tail, q->max_depth,
+               q->queued, q->executed, q->batches, q->overflows);
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("dpcstats", "deferred procedure call queue statistics", &cmd_dpcstats)
+STATIC_COMMAND_END(dpc);
+
+#endif
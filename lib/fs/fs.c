@@ -29,7 +29,8 @@
 #include <lib/fs.h>
 #include <lib/bio.h>
 #include <lk/init.h>
-#include <kernel/mutex.h>
+#include <kernel/rwlock.h>
+#include <arch/ops.h>
 
 #define LOCAL_TRACE 0
 
@@ -53,7 +54,9 @@ struct dirhandle {
     struct fs_mount *mount;
 };
 
-static mutex_t mount_lock = MUTEX_INITIAL_VALUE(mount_lock);
+// lookups take the lock for reading, mount list changes and the final put for writing;
+// other puts just drop the reference atomically
+static rwlock_t mount_lock = RWLOCK_INITIAL_VALUE(mount_lock);
 static struct list_node mounts = LIST_INITIAL_VALUE(mounts);
 static struct list_node fses = LIST_INITIAL_VALUE(fses);
 
@@ -78,7 +81,7 @@ static struct fs_mount *find_mount(const char *path, const char **trimmed_path)
     struct fs_mount *mount;
     size_t pathlen = strlen(path);
 
-    mutex_acquire(&mount_lock);
+    rwlock_read_acquire(&mount_lock);
     list_for_every_entry(&mounts, mount, struct fs_mount, node) {
         size_t mountpathlen = strlen(mount->path);
         if (pathlen < mountpathlen)
@@ -90,14 +93,15 @@ static struct fs_mount *find_mount(const char *path, const char **trimmed_path)
             if (trimmed_path)
                 *trimmed_path = &path[mountpathlen];
 
-            mount->ref++;
+            // other readers may be bumping it concurrently
+            atomic_add(&mount->ref, 1);
 
-            mutex_release(&mount_lock);
+            rwlock_read_release(&mount_lock);
             return mount;
         }
     }
 
-    mutex_release(&mount_lock);
+    rwlock_read_release(&mount_lock);
     return NULL;
 }
 
@@ -105,16 +109,36 @@ static struct fs_mount *find_mount(const char *path, const char **trimmed_path)
 // cause an unmount operation
 static void put_mount(struct fs_mount *mount)
 {
-    mutex_acquire(&mount_lock);
-    if ((--mount->ref) == 0) {
-        list_delete(&mount->node);
-        mount->api->unmount(mount->cookie);
-        free(mount->path);
-        if (mount->dev)
-            bio_close(mount->dev);
-        free(mount);
+    // only the last reference needs the mount list
+    if (atomic_add(&mount->ref, -1) != 1)
+        return;
+
+    rwlock_write_acquire(&mount_lock);
+
+    // find_mount may have picked it up again before we got the lock, and
+    // whoever dropped that reference may have freed it already, so only tear
+    // it down if it is still on the list with no references
+    struct fs_mount *m;
+    bool found = false;
+    list_for_every_entry(&mounts, m, struct fs_mount, node) {
+        if (m == mount) {
+            found = true;
+            break;
+        }
+    }
+    if (!found || mount->ref != 0) {
+        rwlock_write_release(&mount_lock);
+        return;
     }
-    mutex_release(&mount_lock);
+
+    list_delete(&mount->node);
+    rwlock_write_release(&mount_lock);
+
+    mount->api->unmount(mount->cookie);
+    free(mount->path);
+    if (mount->dev)
+        bio_close(mount->dev);
+    free(mount);
 }
 
 static status_t mount(const char *path, const char *device, const struct fs_api *api)
@@ -159,7 +183,9 @@ static status_t mount(const char *path, const char *device, const struct fs_api
     mount->ref = 1;
     mount->api = api;
 
+    rwlock_write_acquire(&mount_lock);
     list_add_head(&mounts, &mount->node);
+    rwlock_write_release(&mount_lock);
 
     return 0;
 
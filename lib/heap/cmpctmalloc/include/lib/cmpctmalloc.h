@@ -31,6 +31,13 @@ void *cmpct_realloc(void *, size_t);
 void cmpct_free(void *);
 void *cmpct_memalign(size_t size, size_t alignment);
 
+/* allocate or free several objects under a single acquisition of the heap lock */
+size_t cmpct_alloc_batch(size_t size, void **ptrs, size_t count);
+void cmpct_free_batch(void **ptrs, size_t count);
+
+/* number of bytes usable in an allocation, at least the size asked for */
+size_t cmpct_usable_size(void *);
+
 void cmpct_init(void);
 void cmpct_dump(void);
 void cmpct_test(void);
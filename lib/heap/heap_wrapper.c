@@ -30,8 +30,10 @@
 #include <err.h>
 #include <list.h>
 #include <kernel/spinlock.h>
+#include <arch/ops.h>
 #include <lib/console.h>
 #include <lib/page_alloc.h>
+#include <platform.h>
 
 #define LOCAL_TRACE 0
 
@@ -42,9 +44,21 @@ static bool heap_trace = false;
 #define heap_trace (false)
 #endif
 
-/* delayed free list */
-struct list_node delayed_free_list = LIST_INITIAL_VALUE(delayed_free_list);
-spin_lock_t delayed_free_lock = SPIN_LOCK_INITIAL_VALUE;
+/* delayed free stack, pushed onto from any context and taken whole to be
+ * freed the next time the heap is called from a thread */
+struct delayed_free_node {
+    struct delayed_free_node *next;
+};
+
+static struct delayed_free_node *delayed_free_head;
+#if __GCC_ATOMIC_POINTER_LOCK_FREE != 2
+/* no pointer sized atomics on this cpu, fall back to a lock */
+static spin_lock_t delayed_free_lock = SPIN_LOCK_INITIAL_VALUE;
+#endif
+
+/* statistics */
+static volatile int delayed_free_count;
+static volatile int delayed_free_batches;
 
 #if WITH_LIB_HEAP_MINIHEAP
 /* miniheap implementation */
@@ -72,6 +86,7 @@ static inline void HEAP_INIT(void)
 }
 #define HEAP_DUMP miniheap_dump
 #define HEAP_TRIM miniheap_trim
+#define HEAP_USABLE_SIZE miniheap_usable_size
 
 /* end miniheap implementation */
 #elif WITH_LIB_HEAP_CMPCTMALLOC
@@ -85,6 +100,9 @@ static inline void HEAP_INIT(void)
 #define HEAP_INIT cmpct_init
 #define HEAP_DUMP cmpct_dump
 #define HEAP_TRIM cmpct_trim
+#define HEAP_USABLE_SIZE cmpct_usable_size
+#define HEAP_ALLOC_BATCH cmpct_alloc_batch
+#define HEAP_FREE_BATCH cmpct_free_batch
 static inline void *HEAP_CALLOC(size_t n, size_t s)
 {
     size_t realsize = n * s;
@@ -105,6 +123,8 @@ static inline void *HEAP_CALLOC(size_t n, size_t s)
 #define HEAP_MEMALIGN(b, s) dlmemalign(b, s)
 #define HEAP_REALLOC(p, s) dlrealloc(p, s)
 #define HEAP_FREE(p) dlfree(p)
+#define HEAP_USABLE_SIZE(p) dlmalloc_usable_size(p)
+#define HEAP_FREE_BATCH(p, n) dlbulk_free(p, n)
 static inline void HEAP_INIT(void) {}
 
 static inline void HEAP_DUMP(void)
@@ -135,38 +155,706 @@ static inline void HEAP_TRIM(void) { dlmalloc_trim(0); }
 #error need to select valid heap implementation or provide wrapper
 #endif
 
-static void heap_free_delayed_list(void)
+#ifndef HEAP_ALLOC_BATCH
+static inline size_t HEAP_ALLOC_BATCH(size_t size, void **ptrs, size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; i++) {
+        ptrs[i] = HEAP_MALLOC(size);
+        if (!ptrs[i])
+            break;
+    }
+    return i;
+}
+#endif
+
+#ifndef HEAP_FREE_BATCH
+static inline void HEAP_FREE_BATCH(void **ptrs, size_t count)
 {
-    struct list_node list;
+    for (size_t i = 0; i < count; i++)
+        HEAP_FREE(ptrs[i]);
+}
+#endif
+
+#ifndef HEAP_USABLE_SIZE
+#error need the heap implementation to provide HEAP_USABLE_SIZE
+#endif
+
+#if LK_HEAP_CACHE
+/* Per cpu cache of small objects in front of the heap.
+ *
+ * Objects up to HEAP_CACHE_MAX_SIZE bytes are sorted into bins by size class
+ * and handed back out to the same cpu without touching the heap lock. Bins
+ * are refilled from and drained to the heap HEAP_CACHE_BATCH objects at a
+ * time. Freed objects are binned by their usable size, so anything in a bin
+ * is at least as large as the bin's size class.
+ */
+#define HEAP_CACHE_GRANULE 16
+#define HEAP_CACHE_MAX_SIZE 256
+#define HEAP_CACHE_BINS (HEAP_CACHE_MAX_SIZE / HEAP_CACHE_GRANULE)
+#ifndef HEAP_CACHE_BIN_SIZE
+#define HEAP_CACHE_BIN_SIZE 16
+#endif
+#define HEAP_CACHE_BATCH (HEAP_CACHE_BIN_SIZE / 2)
+
+struct heap_cache_bin {
+    uint count;
+    void *objs[HEAP_CACHE_BIN_SIZE];
+};
+
+struct heap_cache {
+    struct heap_cache_bin bins[HEAP_CACHE_BINS];
+
+    /* statistics */
+    ulong hits;
+    ulong misses;
+    ulong drains;
+} __CPU_ALIGN;
 
-    list_initialize(&list);
+static struct heap_cache heap_cache[SMP_MAX_CPUS];
 
+static void *heap_cache_alloc(size_t size)
+{
+    void *objs[HEAP_CACHE_BATCH];
+    void *ptr = NULL;
+    uint bin = (size - 1) / HEAP_CACHE_GRANULE;
     spin_lock_saved_state_t state;
-    spin_lock_irqsave(&delayed_free_lock, state);
 
-    struct list_node *node;
-    while ((node = list_remove_head(&delayed_free_list))) {
-        list_add_head(&list, node);
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct heap_cache *c = &heap_cache[arch_curr_cpu_num()];
+    struct heap_cache_bin *b = &c->bins[bin];
+    if (b->count > 0) {
+        ptr = b->objs[--b->count];
+        c->hits++;
+    } else {
+        c->misses++;
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (ptr)
+        return ptr;
+
+    /* refill with a batch of objects of the full size class */
+    size_t count = HEAP_ALLOC_BATCH((bin + 1) * HEAP_CACHE_GRANULE, objs, HEAP_CACHE_BATCH);
+    if (count == 0)
+        return NULL;
+
+    /* we may have moved cpus while refilling, stash the rest on this one */
+    size_t i = 1;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    b = &heap_cache[arch_curr_cpu_num()].bins[bin];
+    while (i < count && b->count < HEAP_CACHE_BIN_SIZE)
+        b->objs[b->count++] = objs[i++];
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (i < count)
+        HEAP_FREE_BATCH(&objs[i], count - i);
+
+    return objs[0];
+}
+
+/* returns false if the object is not cached and should go to the heap */
+static bool heap_cache_free(void *ptr)
+{
+    void *drain[HEAP_CACHE_BATCH];
+    bool drained = false;
+
+    size_t usable = HEAP_USABLE_SIZE(ptr);
+    if (usable < HEAP_CACHE_GRANULE || usable >= HEAP_CACHE_MAX_SIZE + HEAP_CACHE_GRANULE)
+        return false;
+
+    uint bin = usable / HEAP_CACHE_GRANULE - 1;
+    spin_lock_saved_state_t state;
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct heap_cache *c = &heap_cache[arch_curr_cpu_num()];
+    struct heap_cache_bin *b = &c->bins[bin];
+    if (b->count == HEAP_CACHE_BIN_SIZE) {
+        /* full, send the least recently freed half back to the heap */
+        memcpy(drain, b->objs, sizeof(drain));
+        memmove(b->objs, b->objs + HEAP_CACHE_BATCH,
+                (HEAP_CACHE_BIN_SIZE - HEAP_CACHE_BATCH) * sizeof(b->objs[0]));
+        b->count -= HEAP_CACHE_BATCH;
+        c->drains++;
+        drained = true;
+    }
+    b->objs[b->count++] = ptr;
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (drained)
+        HEAP_FREE_BATCH(drain, HEAP_CACHE_BATCH);
+
+    return true;
+}
+
+/* give everything cached on the local cpu back to the heap */
+static void heap_cache_drain(void)
+{
+    for (uint bin = 0; bin < HEAP_CACHE_BINS; bin++) {
+        void *drain[HEAP_CACHE_BIN_SIZE];
+        uint count;
+        spin_lock_saved_state_t state;
+
+        arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+        struct heap_cache_bin *b = &heap_cache[arch_curr_cpu_num()].bins[bin];
+        count = b->count;
+        memcpy(drain, b->objs, count * sizeof(b->objs[0]));
+        b->count = 0;
+
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+        if (count > 0)
+            HEAP_FREE_BATCH(drain, count);
+    }
+}
+
+static void heap_cache_dump(void)
+{
+    printf("\tsmall object cache:\n");
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct heap_cache *c = &heap_cache[i];
+        uint cached = 0;
+
+        for (uint bin = 0; bin < HEAP_CACHE_BINS; bin++)
+            cached += c->bins[bin].count;
+
+        printf("\t\tcpu %u: %u objects, %lu hits, %lu misses, %lu drains\n",
+               i, cached, c->hits, c->misses, c->drains);
+    }
+}
+#endif // LK_HEAP_CACHE
+
+#if LK_HEAP_PROFILE
+/* Heap profiling.
+ *
+ * Every live allocation made through the public api is recorded with its
+ * size, the caller and when it was made, in an open addressed hash table
+ * keyed on the pointer. Allocations made while the table is three quarters
+ * full aren't recorded and are only counted.
+ */
+#ifndef HEAP_PROFILE_RECORDS
+#define HEAP_PROFILE_RECORDS 4096
+#endif
+STATIC_ASSERT((HEAP_PROFILE_RECORDS & (HEAP_PROFILE_RECORDS - 1)) == 0);
+
+struct heap_profile_record {
+    void *ptr;
+    void *caller;
+    uint32_t size;
+    lk_time_t time;
+};
+
+static struct heap_profile_record heap_profile_table[HEAP_PROFILE_RECORDS];
+static spin_lock_t heap_profile_lock = SPIN_LOCK_INITIAL_VALUE;
+
+/* statistics */
+static size_t heap_profile_live;
+static size_t heap_profile_bytes;
+static ulong heap_profile_dropped;
+
+static inline uint heap_profile_hash(const void *ptr)
+{
+    return ((uint)((uintptr_t)ptr >> 3) * 2654435761U) & (HEAP_PROFILE_RECORDS - 1);
+}
+
+static void heap_profile_add(void *ptr, size_t size, void *caller)
+{
+    if (!ptr)
+        return;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&heap_profile_lock, state);
+
+    if (heap_profile_live >= HEAP_PROFILE_RECORDS / 4 * 3) {
+        heap_profile_dropped++;
+    } else {
+        uint i = heap_profile_hash(ptr);
+        while (heap_profile_table[i].ptr)
+            i = (i + 1) & (HEAP_PROFILE_RECORDS - 1);
+
+        heap_profile_table[i].ptr = ptr;
+        heap_profile_table[i].caller = caller;
+        heap_profile_table[i].size = size;
+        heap_profile_table[i].time = current_time();
+        heap_profile_live++;
+        heap_profile_bytes += size;
+    }
+
+    spin_unlock_irqrestore(&heap_profile_lock, state);
+}
+
+static void heap_profile_remove(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&heap_profile_lock, state);
+
+    uint i = heap_profile_hash(ptr);
+    while (heap_profile_table[i].ptr && heap_profile_table[i].ptr != ptr)
+        i = (i + 1) & (HEAP_PROFILE_RECORDS - 1);
+
+    /* not there if it was allocated while the table was full */
+    if (heap_profile_table[i].ptr) {
+        heap_profile_live--;
+        heap_profile_bytes -= heap_profile_table[i].size;
+
+        /* shift back any later entries in the run that probed past this slot */
+        uint j = i;
+        for (;;) {
+            j = (j + 1) & (HEAP_PROFILE_RECORDS - 1);
+            if (!heap_profile_table[j].ptr)
+                break;
+
+            uint home = heap_profile_hash(heap_profile_table[j].ptr);
+            if (((j - home) & (HEAP_PROFILE_RECORDS - 1)) >= ((j - i) & (HEAP_PROFILE_RECORDS - 1))) {
+                heap_profile_table[i] = heap_profile_table[j];
+                i = j;
+            }
+        }
+        heap_profile_table[i].ptr = NULL;
+    }
+
+    spin_unlock_irqrestore(&heap_profile_lock, state);
+}
+
+/* binary dump format, fields are in the cpu's byte order which tools can
+ * work out from the version field */
+#define HEAP_PROFILE_MAGIC "LKHP"
+#define HEAP_PROFILE_VERSION 1
+
+struct heap_profile_dump_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t count;
+    uint32_t dropped;
+    uint32_t now;
+    uint32_t reserved;
+    uint64_t bytes;
+};
+
+struct heap_profile_dump_record {
+    uint64_t caller;
+    uint64_t ptr;
+    uint32_t size;
+    uint32_t time;
+};
+
+ssize_t heap_profile_dump(void *buf, size_t len)
+{
+    struct heap_profile_dump_header *h = buf;
+    struct heap_profile_dump_record *r = (void *)(h + 1);
+
+    if (len < sizeof(*h))
+        return ERR_NOT_ENOUGH_BUFFER;
+
+    size_t max = (len - sizeof(*h)) / sizeof(*r);
+    size_t count = 0;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&heap_profile_lock, state);
+
+    if (max < heap_profile_live) {
+        spin_unlock_irqrestore(&heap_profile_lock, state);
+        return ERR_NOT_ENOUGH_BUFFER;
+    }
+
+    for (uint i = 0; i < HEAP_PROFILE_RECORDS; i++) {
+        if (!heap_profile_table[i].ptr)
+            continue;
+
+        r[count].caller = (uintptr_t)heap_profile_table[i].caller;
+        r[count].ptr = (uintptr_t)heap_profile_table[i].ptr;
+        r[count].size = heap_profile_table[i].size;
+        r[count].time = heap_profile_table[i].time;
+        count++;
+    }
+
+    memcpy(h->magic, HEAP_PROFILE_MAGIC, sizeof(h->magic));
+    h->version = HEAP_PROFILE_VERSION;
+    h->record_size = sizeof(*r);
+    h->count = count;
+    h->dropped = heap_profile_dropped;
+    h->now = current_time();
+    h->reserved = 0;
+    h->bytes = heap_profile_bytes;
+
+    spin_unlock_irqrestore(&heap_profile_lock, state);
+
+    return sizeof(*h) + count * sizeof(*r);
+}
+
+static void heap_profile_dump_info(void)
+{
+    printf("\tprofile: %zu live allocations, %zu bytes, %lu not recorded\n",
+           heap_profile_live, heap_profile_bytes, heap_profile_dropped);
+}
+
+#if LK_DEBUGLEVEL >= 0 && WITH_LIB_CONSOLE
+struct heap_profile_site {
+    uint64_t caller;
+    uint64_t bytes;
+    uint count;
+};
+
+static int heap_profile_cmp_caller(const void *a, const void *b)
+{
+    const struct heap_profile_dump_record *ra = a, *rb = b;
+    return (ra->caller > rb->caller) - (ra->caller < rb->caller);
+}
+
+static int heap_profile_cmp_bytes(const void *a, const void *b)
+{
+    const struct heap_profile_site *sa = a, *sb = b;
+    return (sa->bytes < sb->bytes) - (sa->bytes > sb->bytes);
+}
+
+static int heap_profile_cmp_count(const void *a, const void *b)
+{
+    const struct heap_profile_site *sa = a, *sb = b;
+    return (sa->count < sb->count) - (sa->count > sb->count);
+}
+
+/* take a snapshot of the table, returns the size of the dump or an error */
+static ssize_t heap_profile_snapshot(void **buf)
+{
+    size_t len = sizeof(struct heap_profile_dump_header) +
+                 HEAP_PROFILE_RECORDS * sizeof(struct heap_profile_dump_record);
+
+    *buf = malloc(len);
+    if (!*buf)
+        return ERR_NO_MEMORY;
+
+    ssize_t ret = heap_profile_dump(*buf, len);
+    if (ret < 0)
+        free(*buf);
+    return ret;
+}
+
+/* print the call sites holding the most memory and the most allocations */
+static void heap_profile_top(uint n)
+{
+    void *buf;
+    if (heap_profile_snapshot(&buf) < 0) {
+        printf("failed to take heap profile snapshot\n");
+        return;
+    }
+
+    struct heap_profile_dump_header *h = buf;
+    struct heap_profile_dump_record *r = (void *)(h + 1);
+    struct heap_profile_site *sites = malloc(MAX(h->count, 1U) * sizeof(*sites));
+    if (!sites) {
+        printf("failed to allocate call site table\n");
+        free(buf);
+        return;
+    }
+
+    /* gather records from the same caller together and sum them up */
+    qsort(r, h->count, sizeof(*r), heap_profile_cmp_caller);
+
+    uint nsites = 0;
+    for (uint i = 0; i < h->count; i++) {
+        if (nsites == 0 || sites[nsites - 1].caller != r[i].caller) {
+            sites[nsites].caller = r[i].caller;
+            sites[nsites].bytes = 0;
+            sites[nsites].count = 0;
+            nsites++;
+        }
+        sites[nsites - 1].bytes += r[i].size;
+        sites[nsites - 1].count++;
+    }
+
+    printf("%u live allocations, %llu bytes from %u call sites, %u not recorded\n",
+           h->count, h->bytes, nsites, h->dropped);
+
+    qsort(sites, nsites, sizeof(*sites), heap_profile_cmp_bytes);
+    printf("top call sites by bytes:\n");
+    for (uint i = 0; i < MIN(n, nsites); i++)
+        printf("\t%#18llx %10llu bytes %8u allocs\n", sites[i].caller, sites[i].bytes, sites[i].count);
+
+    qsort(sites, nsites, sizeof(*sites), heap_profile_cmp_count);
+    printf("top call sites by allocations:\n");
+    for (uint i = 0; i < MIN(n, nsites); i++)
+        printf("\t%#18llx %10llu bytes %8u allocs\n", sites[i].caller, sites[i].bytes, sites[i].count);
+
+    free(sites);
+    free(buf);
+}
+
+/* print the binary dump as hex lines for tools/heap_profile.py to pick out
+ * of a console log */
+static void heap_profile_hexdump(void)
+{
+    void *buf;
+    ssize_t len = heap_profile_snapshot(&buf);
+    if (len < 0) {
+        printf("failed to take heap profile snapshot\n");
+        return;
+    }
+
+    printf("HEAPPROF BEGIN %zu\n", (size_t)len);
+    for (ssize_t off = 0; off < len; off += 32) {
+        printf("HEAPPROF ");
+        for (ssize_t i = off; i < MIN(off + 32, len); i++)
+            printf("%02x", ((uint8_t *)buf)[i]);
+        printf("\n");
+    }
+    printf("HEAPPROF END\n");
+
+    free(buf);
+}
+#endif
+#else
+static inline void heap_profile_add(void *ptr, size_t size, void *caller) {}
+static inline void heap_profile_remove(void *ptr) {}
+
+ssize_t heap_profile_dump(void *buf, size_t len)
+{
+    return ERR_NOT_SUPPORTED;
+}
+#endif // LK_HEAP_PROFILE
+
+/* Per cpu reserves of small objects for heap_alloc_irq().
+ *
+ * Each cpu keeps a few objects of every size class that interrupt handlers
+ * can take without going near the heap lock. A reserve that runs low marks
+ * itself and is topped up from the heap by the next thread to call into it.
+ */
+#define HEAP_IRQ_MIN_SHIFT 5
+#define HEAP_IRQ_CLASSES 4
+#define HEAP_IRQ_MAX_SIZE (1U << (HEAP_IRQ_MIN_SHIFT + HEAP_IRQ_CLASSES - 1))
+#ifndef HEAP_IRQ_RESERVE_SIZE
+#define HEAP_IRQ_RESERVE_SIZE 4
+#endif
+
+struct heap_irq_reserve {
+    spin_lock_t lock;
+    uint count[HEAP_IRQ_CLASSES];
+    void *objs[HEAP_IRQ_CLASSES][HEAP_IRQ_RESERVE_SIZE];
+    bool low; /* needs topping up */
+
+    /* statistics */
+    ulong allocs;
+    ulong misses;
+    ulong refills;
+} __CPU_ALIGN;
+
+static struct heap_irq_reserve heap_irq_reserve[SMP_MAX_CPUS];
+
+/* set once any cpu's reserve is low, the cpus are found by their low flag */
+static volatile int heap_irq_reserve_low;
+
+static void heap_irq_reserve_refill(void)
+{
+    atomic_and(&heap_irq_reserve_low, 0);
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct heap_irq_reserve *r = &heap_irq_reserve[cpu];
+        spin_lock_saved_state_t state;
+
+        spin_lock_irqsave(&r->lock, state);
+        bool low = r->low;
+        r->low = false;
+        spin_unlock_irqrestore(&r->lock, state);
+
+        if (!low)
+            continue;
+
+        for (uint class = 0; class < HEAP_IRQ_CLASSES; class++) {
+            void *objs[HEAP_IRQ_RESERVE_SIZE];
+
+            spin_lock_irqsave(&r->lock, state);
+            size_t want = HEAP_IRQ_RESERVE_SIZE - r->count[class];
+            spin_unlock_irqrestore(&r->lock, state);
+
+            if (want == 0)
+                continue;
+
+            size_t count = HEAP_ALLOC_BATCH(1U << (HEAP_IRQ_MIN_SHIFT + class), objs, want);
+
+            /* it may have been used or refilled in the meantime */
+            size_t i = 0;
+            spin_lock_irqsave(&r->lock, state);
+            while (i < count && r->count[class] < HEAP_IRQ_RESERVE_SIZE)
+                r->objs[class][r->count[class]++] = objs[i++];
+            r->refills++;
+            spin_unlock_irqrestore(&r->lock, state);
+
+            if (i < count)
+                HEAP_FREE_BATCH(&objs[i], count - i);
+        }
+    }
+}
+
+static void heap_irq_reserve_init(void)
+{
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        spin_lock_init(&heap_irq_reserve[cpu].lock);
+        heap_irq_reserve[cpu].low = true;
+    }
+
+    heap_irq_reserve_refill();
+}
+
+void *heap_alloc_irq(size_t size)
+{
+    LTRACEF("size %zd\n", size);
+
+    if (size == 0 || size > HEAP_IRQ_MAX_SIZE)
+        return NULL;
+
+    uint class = 0;
+    while ((1U << (HEAP_IRQ_MIN_SHIFT + class)) < size)
+        class++;
+
+    void *ptr = NULL;
+    spin_lock_saved_state_t state;
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    uint cpu = arch_curr_cpu_num();
+    struct heap_irq_reserve *r = &heap_irq_reserve[cpu];
+    spin_lock(&r->lock);
+    if (r->count[class] > 0) {
+        ptr = r->objs[class][--r->count[class]];
+        r->allocs++;
+    } else {
+        r->misses++;
+    }
+    bool low = r->count[class] <= HEAP_IRQ_RESERVE_SIZE / 2;
+    if (low)
+        r->low = true;
+    spin_unlock(&r->lock);
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (low)
+        atomic_or(&heap_irq_reserve_low, 1);
+
+    heap_profile_add(ptr, size, __GET_CALLER());
+    return ptr;
+}
+
+void heap_free_irq(void *ptr)
+{
+    LTRACEF("ptr %p\n", ptr);
+
+    if (!ptr)
+        return;
+
+    heap_profile_remove(ptr);
+
+    /* put it back in the largest class it can serve if there's room */
+    size_t usable = HEAP_USABLE_SIZE(ptr);
+    if (usable >= (1U << HEAP_IRQ_MIN_SHIFT)) {
+        uint class = 0;
+        while (class < HEAP_IRQ_CLASSES - 1 && (1U << (HEAP_IRQ_MIN_SHIFT + class + 1)) <= usable)
+            class++;
+
+        bool stashed = false;
+        spin_lock_saved_state_t state;
+
+        arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+        struct heap_irq_reserve *r = &heap_irq_reserve[arch_curr_cpu_num()];
+        spin_lock(&r->lock);
+        if (r->count[class] < HEAP_IRQ_RESERVE_SIZE) {
+            r->objs[class][r->count[class]++] = ptr;
+            stashed = true;
+        }
+        spin_unlock(&r->lock);
+
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+        if (stashed)
+            return;
     }
+
+    heap_delayed_free(ptr);
+}
+
+static void heap_irq_reserve_dump(void)
+{
+    printf("\tirq reserves:\n");
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct heap_irq_reserve *r = &heap_irq_reserve[i];
+        uint reserved = 0;
+
+        for (uint class = 0; class < HEAP_IRQ_CLASSES; class++)
+            reserved += r->count[class];
+
+        printf("\t\tcpu %u: %u objects, %lu allocs, %lu misses, %lu refills\n",
+               i, reserved, r->allocs, r->misses, r->refills);
+    }
+}
+
+static struct delayed_free_node *heap_delayed_list_take(void)
+{
+#if __GCC_ATOMIC_POINTER_LOCK_FREE == 2
+    return __atomic_exchange_n(&delayed_free_head, NULL, __ATOMIC_ACQUIRE);
+#else
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&delayed_free_lock, state);
+    struct delayed_free_node *node = delayed_free_head;
+    delayed_free_head = NULL;
     spin_unlock_irqrestore(&delayed_free_lock, state);
+    return node;
+#endif
+}
+
+#define DELAYED_FREE_BATCH 16
 
-    while ((node = list_remove_head(&list))) {
+static void heap_free_delayed_list(void)
+{
+    struct delayed_free_node *node = heap_delayed_list_take();
+    void *batch[DELAYED_FREE_BATCH];
+    size_t count = 0;
+
+    while (node) {
         LTRACEF("freeing node %p\n", node);
-        HEAP_FREE(node);
+        batch[count++] = node;
+        node = node->next;
+
+        if (count == DELAYED_FREE_BATCH || !node) {
+            HEAP_FREE_BATCH(batch, count);
+            atomic_add(&delayed_free_batches, 1);
+            count = 0;
+        }
     }
 }
 
+/* deal with the pending free list and any irq reserves running low */
+static inline void heap_deferred_work(void)
+{
+    if (unlikely(delayed_free_head != NULL))
+        heap_free_delayed_list();
+    if (unlikely(heap_irq_reserve_low))
+        heap_irq_reserve_refill();
+}
+
 void heap_init(void)
 {
     HEAP_INIT();
+    heap_irq_reserve_init();
 }
 
 void heap_trim(void)
 {
+#if LK_HEAP_CACHE
+    heap_cache_drain();
+#endif
+
     // deal with the pending free list
-    if (unlikely(!list_is_empty(&delayed_free_list))) {
-        heap_free_delayed_list();
-    }
+    heap_deferred_work();
 
     HEAP_TRIM();
 }
@@ -176,11 +864,16 @@ void *malloc(size_t size)
     LTRACEF("size %zd\n", size);
 
     // deal with the pending free list
-    if (unlikely(!list_is_empty(&delayed_free_list))) {
-        heap_free_delayed_list();
-    }
+    heap_deferred_work();
 
-    void *ptr = HEAP_MALLOC(size);
+    void *ptr;
+#if LK_HEAP_CACHE
+    if (size > 0 && size <= HEAP_CACHE_MAX_SIZE)
+        ptr = heap_cache_alloc(size);
+    else
+#endif
+        ptr = HEAP_MALLOC(size);
+    heap_profile_add(ptr, size, __GET_CALLER());
     if (heap_trace)
         printf("caller %p malloc %zu -> %p\n", __GET_CALLER(), size, ptr);
     return ptr;
@@ -191,11 +884,10 @@ void *memalign(size_t boundary, size_t size)
     LTRACEF("boundary %zu, size %zd\n", boundary, size);
 
     // deal with the pending free list
-    if (unlikely(!list_is_empty(&delayed_free_list))) {
-        heap_free_delayed_list();
-    }
+    heap_deferred_work();
 
     void *ptr = HEAP_MEMALIGN(boundary, size);
+    heap_profile_add(ptr, size, __GET_CALLER());
     if (heap_trace)
         printf("caller %p memalign %zu, %zu -> %p\n", __GET_CALLER(), boundary, size, ptr);
     return ptr;
@@ -206,11 +898,22 @@ void *calloc(size_t count, size_t size)
     LTRACEF("count %zu, size %zd\n", count, size);
 
     // deal with the pending free list
-    if (unlikely(!list_is_empty(&delayed_free_list))) {
-        heap_free_delayed_list();
-    }
-
-    void *ptr = HEAP_CALLOC(count, size);
+    heap_deferred_work();
+
+    void *ptr;
+#if LK_HEAP_CACHE
+    /* both bounded first so the product can't overflow */
+    size_t realsize = count * size;
+    if (count <= HEAP_CACHE_MAX_SIZE && size <= HEAP_CACHE_MAX_SIZE &&
+            realsize > 0 && realsize <= HEAP_CACHE_MAX_SIZE) {
+        ptr = heap_cache_alloc(realsize);
+        if (likely(ptr))
+            memset(ptr, 0, realsize);
+    } else
+#endif
+        ptr = HEAP_CALLOC(count, size);
+    if (ptr)
+        heap_profile_add(ptr, count * size, __GET_CALLER());
     if (heap_trace)
         printf("caller %p calloc %zu, %zu -> %p\n", __GET_CALLER(), count, size, ptr);
     return ptr;
@@ -221,11 +924,12 @@ void *realloc(void *ptr, size_t size)
     LTRACEF("ptr %p, size %zd\n", ptr, size);
 
     // deal with the pending free list
-    if (unlikely(!list_is_empty(&delayed_free_list))) {
-        heap_free_delayed_list();
-    }
+    heap_deferred_work();
 
     void *ptr2 = HEAP_REALLOC(ptr, size);
+    if (ptr2 || size == 0)
+        heap_profile_remove(ptr);
+    heap_profile_add(ptr2, size, __GET_CALLER());
     if (heap_trace)
         printf("caller %p realloc %p, %zu -> %p\n", __GET_CALLER(), ptr, size, ptr2);
     return ptr2;
@@ -236,6 +940,12 @@ void free(void *ptr)
     LTRACEF("ptr %p\n", ptr);
     if (heap_trace)
         printf("caller %p free %p\n", __GET_CALLER(), ptr);
+    heap_profile_remove(ptr);
+
+#if LK_HEAP_CACHE
+    if (ptr && heap_cache_free(ptr))
+        return;
+#endif
 
     HEAP_FREE(ptr);
 }
@@ -245,28 +955,42 @@ void heap_delayed_free(void *ptr)
 {
     LTRACEF("ptr %p\n", ptr);
 
-    /* throw down a structure on the free block */
-    /* XXX assumes the free block is large enough to hold a list node */
-    struct list_node *node = (struct list_node *)ptr;
+    heap_profile_remove(ptr);
 
+    /* throw down a structure on the free block */
+    /* XXX assumes the free block is large enough to hold a pointer */
+    struct delayed_free_node *node = (struct delayed_free_node *)ptr;
+
+#if __GCC_ATOMIC_POINTER_LOCK_FREE == 2
+    node->next = __atomic_load_n(&delayed_free_head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&delayed_free_head, &node->next, node, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+#else
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&delayed_free_lock, state);
-    list_add_head(&delayed_free_list, node);
+    node->next = delayed_free_head;
+    delayed_free_head = node;
     spin_unlock_irqrestore(&delayed_free_lock, state);
+#endif
+
+    atomic_add(&delayed_free_count, 1);
 }
 
 static void heap_dump(void)
 {
     HEAP_DUMP();
 
-    printf("\tdelayed free list:\n");
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&delayed_free_lock, state);
-    struct list_node *node;
-    list_for_every(&delayed_free_list, node) {
-        printf("\t\tnode %p\n", node);
-    }
-    spin_unlock_irqrestore(&delayed_free_lock, state);
+#if LK_HEAP_CACHE
+    heap_cache_dump();
+#endif
+    heap_irq_reserve_dump();
+#if LK_HEAP_PROFILE
+    heap_profile_dump_info();
+#endif
+
+    printf("\tdelayed free: %d frees in %d batches, %spending\n",
+           delayed_free_count, delayed_free_batches, delayed_free_head ? "" : "none ");
 }
 
 static void heap_test(void)
@@ -349,6 +1073,10 @@ usage:
         printf("\t%s alloc <size> [alignment]\n", argv[0].str);
         printf("\t%s realloc <ptr> <size>\n", argv[0].str);
         printf("\t%s free <address>\n", argv[0].str);
+#if LK_HEAP_PROFILE
+        printf("\t%s profile [count]\n", argv[0].str);
+        printf("\t%s profile dump\n", argv[0].str);
+#endif
         return -1;
     }
 
@@ -375,6 +1103,13 @@ usage:
         if (argc < 2) goto notenoughargs;
 
         free(argv[2].p);
+#if LK_HEAP_PROFILE
+    } else if (strcmp(argv[1].str, "profile") == 0) {
+        if (argc >= 3 && strcmp(argv[2].str, "dump") == 0)
+            heap_profile_hexdump();
+        else
+            heap_profile_top((argc >= 3) ? argv[2].u : 10);
+#endif
     } else {
         printf("unrecognized command\n");
         goto usage;
@@ -40,7 +40,23 @@ void heap_init(void);
 /* critical section time delayed free */
 void heap_delayed_free(void *);
 
+/* Allocate and free small objects from interrupt context or with interrupts
+ * disabled. Allocations come from per cpu reserves of up to 256 byte objects
+ * that are topped up the next time a thread calls into the heap, and return
+ * NULL if the reserve is empty. Objects from either side can be freed with
+ * either free() or heap_free_irq().
+ */
+void *heap_alloc_irq(size_t size) __MALLOC;
+void heap_free_irq(void *ptr);
+
 /* tell the heap to return any free pages it can find */
 void heap_trim(void);
 
+/* Write a binary snapshot of the live allocations recorded by heap profiling
+ * (LK_HEAP_PROFILE=1) to buf, in the format read by tools/heap_profile.py.
+ * Returns the length written, ERR_NOT_ENOUGH_BUFFER if it doesn't fit or
+ * ERR_NOT_SUPPORTED if profiling isn't built in.
+ */
+ssize_t heap_profile_dump(void *buf, size_t len);
+
 __END_CDECLS;
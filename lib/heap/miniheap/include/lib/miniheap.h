@@ -39,6 +39,7 @@ void miniheap_get_stats(struct miniheap_stats *ptr);
 void *miniheap_alloc(size_t, unsigned int alignment);
 void *miniheap_realloc(void *, size_t);
 void miniheap_free(void *);
+size_t miniheap_usable_size(void *);
 
 void miniheap_init(void *ptr, size_t len);
 void miniheap_dump(void);
@@ -340,6 +340,21 @@ void *miniheap_realloc(void *ptr, size_t size)
     return p;
 }
 
+size_t miniheap_usable_size(void *ptr)
+{
+    struct alloc_struct_begin *as = (struct alloc_struct_begin *)ptr;
+    as--;
+
+    DEBUG_ASSERT(as->magic == HEAP_MAGIC);
+
+#if DEBUG_HEAP
+    // don't hand out the guard padding
+    return (addr_t)as->padding_start - (addr_t)ptr;
+#else
+    return ((addr_t)as->ptr + as->size) - (addr_t)ptr;
+#endif
+}
+
 void miniheap_free(void *ptr)
 {
     if (!ptr)
@@ -29,4 +29,14 @@ endif
 
 GLOBAL_DEFINES += LK_HEAP_IMPLEMENTATION=$(LK_HEAP_IMPLEMENTATION)
 
+# optional per cpu cache of small objects in front of the heap
+ifeq ($(LK_HEAP_CACHE),1)
+GLOBAL_DEFINES += LK_HEAP_CACHE=1
+endif
+
+# optional tracking of every live allocation's size and caller
+ifeq ($(LK_HEAP_PROFILE),1)
+GLOBAL_DEFINES += LK_HEAP_PROFILE=1
+endif
+
 include make/module.mk
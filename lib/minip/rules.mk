@@ -5,7 +5,7 @@ MODULE := $(LOCAL_DIR)
 MODULE_DEPS := \
 	lib/cbuf \
 	lib/iovec \
-	lib/pool
+	lib/slab
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/arp.c \
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2026 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <compiler.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Slab allocator for fixed size objects.
+ *
+ * A slab cache hands out objects of one size carved from runs of pages
+ * taken from the page allocator. Each cpu keeps a magazine of recently freed
+ * objects that it can allocate from and free to with only interrupts
+ * disabled; the magazines are refilled from and drained to the slabs in
+ * batches under the cache lock.
+ *
+ * If a constructor is given it is run once on every object when its slab is
+ * created, and objects are expected to be handed back to slab_free() in
+ * their constructed state. The allocator never writes to a free object.
+ *
+ * slab_free() may be called from interrupt context. slab_alloc() may need to
+ * allocate pages to grow the cache, so it must be called from a thread unless
+ * the cache has enough objects reserved with slab_cache_reserve(). Empty
+ * slabs are only given back to the page allocator by slab_cache_reap().
+ */
+
+typedef struct slab_cache slab_cache_t;
+
+typedef void (*slab_ctor_t)(void *obj, void *arg);
+
+/* Create a cache of objects of the given size and alignment (0 for the
+ * natural alignment of a pointer). Returns NULL on failure.
+ */
+slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align,
+                                slab_ctor_t ctor, void *ctor_arg);
+
+/* Destroy a cache. All objects must have been freed. */
+void slab_cache_destroy(slab_cache_t *cache);
+
+void *slab_alloc(slab_cache_t *cache);
+void slab_free(slab_cache_t *cache, void *obj);
+
+/* Grow the cache until it holds at least count objects and keep that many
+ * around when reaping.
+ */
+status_t slab_cache_reserve(slab_cache_t *cache, size_t count);
+
+/* Return empty slabs beyond the reserve to the page allocator. Returns the
+ * number of pages freed.
+ */
+size_t slab_cache_reap(slab_cache_t *cache);
+
+__END_CDECLS
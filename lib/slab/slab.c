@@ -0,0 +1,536 @@
+/*
+ * Copyright (c) 2026 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <lib/slab.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <list.h>
+#include <malloc.h>
+#include <pow2.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <lib/page_alloc.h>
+
+#define LOCAL_TRACE 0
+
+#ifndef SLAB_MAGAZINE_SIZE
+#define SLAB_MAGAZINE_SIZE 16
+#endif
+#define SLAB_MAGAZINE_BATCH (SLAB_MAGAZINE_SIZE / 2)
+
+/* largest run of pages a slab is carved from */
+#define SLAB_MAX_PAGES 8
+
+/* objects up to this size always live in single page slabs */
+#define SLAB_SMALL_SIZE (PAGE_SIZE / 8)
+
+/* Slab header, kept at the end of the slab's pages. Objects in a single page
+ * slab find it by rounding down to the page; in larger slabs every object
+ * carries a pointer back to it just past the object. Free objects are
+ * tracked by index so the objects themselves are never written to.
+ */
+struct slab {
+    struct list_node node;
+    uint8_t *base;          // first object, after the color offset
+    uint16_t free_count;
+    uint16_t free[];        // stack of free object indices
+};
+
+struct slab_magazine {
+    uint count;
+    void *objs[SLAB_MAGAZINE_SIZE];
+
+    /* statistics */
+    ulong hits;
+    ulong misses;
+} __CPU_ALIGN;
+
+struct slab_cache {
+    struct slab_magazine mags[SMP_MAX_CPUS];
+
+    struct list_node node;
+    char name[32];
+
+    size_t size;
+    size_t stride;
+    size_t trailer;         // offset of the slab pointer in multi page slabs
+    uint slab_pages;
+    uint slab_objs;
+    size_t header_offset;   // of the struct slab from the start of the pages
+    size_t color_step;
+    size_t color_max;
+    size_t next_color;
+
+    slab_ctor_t ctor;
+    void *ctor_arg;
+
+    spin_lock_t lock;
+    struct list_node partial;
+    struct list_node full;
+    struct list_node empty;
+    size_t slabs;
+    size_t free_objs;       // free in the slabs, not counting the magazines
+    size_t reserve;
+
+    /* statistics */
+    ulong grows;
+    ulong reaps;
+};
+
+static struct list_node cache_list = LIST_INITIAL_VALUE(cache_list);
+static mutex_t cache_list_lock = MUTEX_INITIAL_VALUE(cache_list_lock);
+
+static size_t slab_header_size(uint objs)
+{
+    return ROUNDUP(sizeof(struct slab) + objs * sizeof(uint16_t), sizeof(void *));
+}
+
+/* how many objects of the given stride fit in a slab, and the bytes left over */
+static uint slab_layout(size_t total, size_t stride, size_t *waste)
+{
+    uint objs = (total - sizeof(struct slab)) / (stride + sizeof(uint16_t));
+
+    while (objs > 0 && objs * stride + slab_header_size(objs) > total)
+        objs--;
+
+    *waste = total - objs * stride - slab_header_size(objs);
+    return objs;
+}
+
+static struct slab *obj_to_slab(slab_cache_t *cache, void *obj)
+{
+    if (cache->slab_pages == 1)
+        return (struct slab *)(ROUNDDOWN((uintptr_t)obj, PAGE_SIZE) + cache->header_offset);
+
+    return *(struct slab **)((uint8_t *)obj + cache->trailer);
+}
+
+static void *slab_to_pages(slab_cache_t *cache, struct slab *slab)
+{
+    return (uint8_t *)slab - cache->header_offset;
+}
+
+/* pull up to count objects out of the slabs. cache lock held. */
+static uint slab_take_locked(slab_cache_t *cache, void **objs, uint count)
+{
+    uint n = 0;
+
+    while (n < count) {
+        struct slab *slab = list_peek_head_type(&cache->partial, struct slab, node);
+        if (!slab) {
+            slab = list_remove_head_type(&cache->empty, struct slab, node);
+            if (!slab)
+                break;
+            list_add_head(&cache->partial, &slab->node);
+        }
+
+        while (n < count && slab->free_count > 0)
+            objs[n++] = slab->base + slab->free[--slab->free_count] * cache->stride;
+
+        if (slab->free_count == 0) {
+            list_delete(&slab->node);
+            list_add_head(&cache->full, &slab->node);
+        }
+    }
+
+    cache->free_objs -= n;
+    return n;
+}
+
+/* return objects to their slabs. cache lock held. */
+static void slab_put_locked(slab_cache_t *cache, void **objs, uint count)
+{
+    for (uint i = 0; i < count; i++) {
+        struct slab *slab = obj_to_slab(cache, objs[i]);
+        uint index = ((uint8_t *)objs[i] - slab->base) / cache->stride;
+
+        DEBUG_ASSERT(index < cache->slab_objs);
+        DEBUG_ASSERT(slab->base + index * cache->stride == objs[i]);
+        DEBUG_ASSERT(slab->free_count < cache->slab_objs);
+
+        if (slab->free_count == 0) {
+            list_delete(&slab->node);
+            list_add_head(&cache->partial, &slab->node);
+        }
+
+        slab->free[slab->free_count++] = index;
+
+        if (slab->free_count == cache->slab_objs) {
+            list_delete(&slab->node);
+            list_add_head(&cache->empty, &slab->node);
+        }
+    }
+
+    cache->free_objs += count;
+}
+
+static status_t slab_grow(slab_cache_t *cache)
+{
+    uint8_t *pages = page_alloc(cache->slab_pages, PAGE_ALLOC_ANY_ARENA);
+    if (!pages)
+        return ERR_NO_MEMORY;
+
+    LTRACEF("cache %s, %u pages at %p\n", cache->name, cache->slab_pages, pages);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cache->lock, state);
+
+    /* stagger the start of each slab so the objects at the same index in
+     * different slabs don't all land on the same cache lines */
+    size_t color = cache->next_color;
+    cache->next_color += cache->color_step;
+    if (cache->next_color > cache->color_max)
+        cache->next_color = 0;
+
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    struct slab *slab = (struct slab *)(pages + cache->header_offset);
+    slab->base = pages + color;
+    slab->free_count = cache->slab_objs;
+
+    for (uint i = 0; i < cache->slab_objs; i++) {
+        uint8_t *obj = slab->base + i * cache->stride;
+
+        /* hand out the lowest addresses first */
+        slab->free[i] = cache->slab_objs - 1 - i;
+
+        if (cache->slab_pages > 1)
+            *(struct slab **)(obj + cache->trailer) = slab;
+        if (cache->ctor)
+            cache->ctor(obj, cache->ctor_arg);
+    }
+
+    spin_lock_irqsave(&cache->lock, state);
+    list_add_head(&cache->empty, &slab->node);
+    cache->slabs++;
+    cache->free_objs += cache->slab_objs;
+    cache->grows++;
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    return NO_ERROR;
+}
+
+slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align,
+                                slab_ctor_t ctor, void *ctor_arg)
+{
+    LTRACEF("name %s, size %zu, align %zu\n", name, size, align);
+
+    if (align == 0)
+        align = sizeof(void *);
+    if (size == 0 || !ispow2(align) || align > PAGE_SIZE)
+        return NULL;
+
+    /* small objects, or ones that pack well enough into a page, get single
+     * page slabs. otherwise try runs of pages, with room for the pointer
+     * back to the slab, and pick the first that wastes at most an eighth */
+    size_t trailer = 0;
+    size_t stride = ROUNDUP(size, align);
+    size_t waste;
+    uint pages = 1;
+    uint objs = slab_layout(PAGE_SIZE, stride, &waste);
+
+    if (objs == 0 || (size > SLAB_SMALL_SIZE && waste * 8 > PAGE_SIZE)) {
+        size_t big_trailer = ROUNDUP(size, sizeof(void *));
+        size_t big_stride = ROUNDUP(big_trailer + sizeof(void *), align);
+
+        for (uint p = 2; p <= SLAB_MAX_PAGES; p++) {
+            size_t w;
+            uint n = slab_layout(p * PAGE_SIZE, big_stride, &w);
+            if (n == 0)
+                continue;
+
+            if (objs == 0 || w * pages < waste * p) {
+                trailer = big_trailer;
+                stride = big_stride;
+                waste = w;
+                pages = p;
+                objs = n;
+            }
+            if (w * 8 <= p * PAGE_SIZE)
+                break;
+        }
+    }
+
+    if (objs == 0)
+        return NULL;
+
+    slab_cache_t *cache = memalign(CACHE_LINE, sizeof(slab_cache_t));
+    if (!cache)
+        return NULL;
+
+    memset(cache, 0, sizeof(*cache));
+    strlcpy(cache->name, name, sizeof(cache->name));
+    cache->size = size;
+    cache->stride = stride;
+    cache->trailer = trailer;
+    cache->slab_pages = pages;
+    cache->slab_objs = objs;
+    cache->header_offset = pages * PAGE_SIZE - slab_header_size(objs);
+    cache->color_step = ROUNDUP(CACHE_LINE, align);
+    cache->color_max = waste;
+    cache->ctor = ctor;
+    cache->ctor_arg = ctor_arg;
+    spin_lock_init(&cache->lock);
+    list_initialize(&cache->partial);
+    list_initialize(&cache->full);
+    list_initialize(&cache->empty);
+
+    LTRACEF("cache %s: stride %zu, %u pages per slab, %u objects, %zu bytes wasted\n",
+            name, stride, pages, objs, waste);
+
+    mutex_acquire(&cache_list_lock);
+    list_add_tail(&cache_list, &cache->node);
+    mutex_release(&cache_list_lock);
+
+    return cache;
+}
+
+void slab_cache_destroy(slab_cache_t *cache)
+{
+    DEBUG_ASSERT(cache);
+
+    mutex_acquire(&cache_list_lock);
+    list_delete(&cache->node);
+    mutex_release(&cache_list_lock);
+
+    /* nobody else may be using the cache now, so empty every magazine */
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cache->lock, state);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        slab_put_locked(cache, cache->mags[i].objs, cache->mags[i].count);
+        cache->mags[i].count = 0;
+    }
+    cache->reserve = 0;
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    DEBUG_ASSERT(list_is_empty(&cache->partial));
+    DEBUG_ASSERT(list_is_empty(&cache->full));
+
+    slab_cache_reap(cache);
+    free(cache);
+}
+
+void *slab_alloc(slab_cache_t *cache)
+{
+    DEBUG_ASSERT(cache);
+
+    void *obj = NULL;
+    spin_lock_saved_state_t state;
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct slab_magazine *mag = &cache->mags[arch_curr_cpu_num()];
+    if (mag->count > 0) {
+        obj = mag->objs[--mag->count];
+        mag->hits++;
+    } else {
+        mag->misses++;
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    while (!obj) {
+        /* reload the magazine with a batch from the slabs */
+        spin_lock_irqsave(&cache->lock, state);
+
+        mag = &cache->mags[arch_curr_cpu_num()];
+        uint room = MIN(SLAB_MAGAZINE_BATCH, SLAB_MAGAZINE_SIZE - mag->count);
+        mag->count += slab_take_locked(cache, &mag->objs[mag->count], room);
+        if (mag->count > 0)
+            obj = mag->objs[--mag->count];
+
+        spin_unlock_irqrestore(&cache->lock, state);
+
+        if (!obj && slab_grow(cache) < 0)
+            return NULL;
+    }
+
+    return obj;
+}
+
+void slab_free(slab_cache_t *cache, void *obj)
+{
+    DEBUG_ASSERT(cache);
+    DEBUG_ASSERT(obj);
+
+    spin_lock_saved_state_t state;
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct slab_magazine *mag = &cache->mags[arch_curr_cpu_num()];
+    if (mag->count < SLAB_MAGAZINE_SIZE) {
+        mag->objs[mag->count++] = obj;
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+        return;
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    /* full, send the least recently freed half back to the slabs */
+    spin_lock_irqsave(&cache->lock, state);
+
+    mag = &cache->mags[arch_curr_cpu_num()];
+    if (mag->count == SLAB_MAGAZINE_SIZE) {
+        slab_put_locked(cache, mag->objs, SLAB_MAGAZINE_BATCH);
+        memmove(mag->objs, mag->objs + SLAB_MAGAZINE_BATCH,
+                (SLAB_MAGAZINE_SIZE - SLAB_MAGAZINE_BATCH) * sizeof(mag->objs[0]));
+        mag->count -= SLAB_MAGAZINE_BATCH;
+    }
+    mag->objs[mag->count++] = obj;
+
+    spin_unlock_irqrestore(&cache->lock, state);
+}
+
+status_t slab_cache_reserve(slab_cache_t *cache, size_t count)
+{
+    DEBUG_ASSERT(cache);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cache->lock, state);
+    cache->reserve = count;
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    for (;;) {
+        spin_lock_irqsave(&cache->lock, state);
+        size_t total = cache->slabs * cache->slab_objs;
+        spin_unlock_irqrestore(&cache->lock, state);
+
+        if (total >= count)
+            return NO_ERROR;
+
+        if (slab_grow(cache) < 0)
+            return ERR_NO_MEMORY;
+    }
+}
+
+size_t slab_cache_reap(slab_cache_t *cache)
+{
+    DEBUG_ASSERT(cache);
+
+    size_t pages = 0;
+    spin_lock_saved_state_t state;
+
+    for (;;) {
+        struct slab *slab = NULL;
+
+        spin_lock_irqsave(&cache->lock, state);
+        if (cache->slabs * cache->slab_objs >= cache->reserve + cache->slab_objs) {
+            slab = list_remove_head_type(&cache->empty, struct slab, node);
+            if (slab) {
+                cache->slabs--;
+                cache->free_objs -= cache->slab_objs;
+                cache->reaps++;
+            }
+        }
+        spin_unlock_irqrestore(&cache->lock, state);
+
+        if (!slab)
+            break;
+
+        page_free(slab_to_pages(cache, slab), cache->slab_pages);
+        pages += cache->slab_pages;
+    }
+
+    LTRACEF("cache %s: freed %zu pages\n", cache->name, pages);
+
+    return pages;
+}
+
+#if LK_DEBUGLEVEL > 1
+#if WITH_LIB_CONSOLE
+
+#include <lib/console.h>
+
+static int cmd_slab(int argc, const cmd_args *argv);
+
+STATIC_COMMAND_START
+STATIC_COMMAND("slab", "slab allocator debug commands", &cmd_slab)
+STATIC_COMMAND_END(slab);
+
+static void slab_cache_dump(slab_cache_t *cache)
+{
+    ulong hits = 0, misses = 0;
+    size_t cached = 0;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        hits += cache->mags[i].hits;
+        misses += cache->mags[i].misses;
+        cached += cache->mags[i].count;
+    }
+
+    size_t total = cache->slabs * cache->slab_objs;
+    ulong allocs = hits + misses;
+
+    printf("%-16s %6zu %6zu %5u %5u %6zu %7zu %7zu %7zu %9lu %3lu%% %6lu %6lu\n",
+           cache->name, cache->size, cache->stride, cache->slab_pages, cache->slab_objs,
+           cache->slabs, total, total - cache->free_objs - cached, cached,
+           allocs, allocs ? hits * 100 / allocs : 0, cache->grows, cache->reaps);
+}
+
+static int cmd_slab(int argc, const cmd_args *argv)
+{
+    if (argc < 2) {
+        printf("not enough arguments\n");
+usage:
+        printf("usage:\n");
+        printf("\t%s info\n", argv[0].str);
+        printf("\t%s reap\n", argv[0].str);
+        return -1;
+    }
+
+    slab_cache_t *cache;
+    if (strcmp(argv[1].str, "info") == 0) {
+        printf("%-16s %6s %6s %5s %5s %6s %7s %7s %7s %9s %4s %6s %6s\n",
+               "name", "size", "stride", "pages", "objs", "slabs", "total", "in use",
+               "cached", "allocs", "hit", "grows", "reaps");
+
+        mutex_acquire(&cache_list_lock);
+        list_for_every_entry(&cache_list, cache, slab_cache_t, node) {
+            slab_cache_dump(cache);
+        }
+        mutex_release(&cache_list_lock);
+    } else if (strcmp(argv[1].str, "reap") == 0) {
+        size_t pages = 0;
+
+        mutex_acquire(&cache_list_lock);
+        list_for_every_entry(&cache_list, cache, slab_cache_t, node) {
+            pages += slab_cache_reap(cache);
+        }
+        mutex_release(&cache_list_lock);
+
+        printf("freed %zu pages\n", pages);
+    } else {
+        printf("unrecognized command\n");
+        goto usage;
+    }
+
+    return 0;
+}
+
+#endif
+#endif
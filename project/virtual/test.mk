@@ -8,8 +8,11 @@ MODULES += \
   lib/aes/test \
   lib/cksum \
   lib/debugcommands \
+  lib/dpc \
   lib/libm \
   lib/version \
 
 WITH_CPP_SUPPORT=true
 
+# build the edf scheduling class so app/tests exercises it
+WITH_KERNEL_EDF=1
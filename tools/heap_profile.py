@@ -0,0 +1,166 @@
+#!/usr/bin/env python3
+# vim: set expandtab ts=4 sw=4 tw=100:
+#
+# Summarize heap profile dumps from a target built with LK_HEAP_PROFILE=1.
+#
+# The input is either the raw binary from heap_profile_dump() or a console
+# log containing the output of 'heap profile dump'. Call sites can be turned
+# into function names and lines with addr2line given the kernel's elf file,
+# and a second, earlier dump can be given to see which call sites grew.
+#
+# usage: heap_profile.py [-e lk.elf] [-n 20] [-b earlier.log] dump.log
+
+import argparse
+import os
+import struct
+import subprocess
+import sys
+
+MAGIC = b"LKHP"
+VERSION = 1
+HEADER = "4sHHIIIIQ"
+RECORD = "QQII"
+
+
+def read_dump(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    if data.startswith(MAGIC):
+        return data
+
+    # pick the hex lines out of a console log, the last dump wins
+    dump = None
+    result = None
+    for line in data.decode("utf-8", "replace").splitlines():
+        line = line.strip()
+        if line.startswith("HEAPPROF BEGIN"):
+            dump = bytearray()
+        elif line.startswith("HEAPPROF END"):
+            if dump is not None:
+                result = bytes(dump)
+        elif line.startswith("HEAPPROF ") and dump is not None:
+            dump += bytes.fromhex(line.split(None, 1)[1])
+
+    if result is None:
+        sys.exit("%s: no heap profile dump found" % path)
+    return result
+
+
+def parse_dump(data):
+    # the dump is in the target's byte order, work it out from the version
+    for order in "<>":
+        header = struct.unpack_from(order + HEADER, data)
+        if header[1] == VERSION:
+            break
+    else:
+        sys.exit("unsupported heap profile version")
+
+    magic, version, record_size, count, dropped, now, _, total = header
+    if magic != MAGIC or record_size != struct.calcsize(RECORD):
+        sys.exit("bad heap profile header")
+
+    records = []
+    offset = struct.calcsize(HEADER)
+    for _ in range(count):
+        caller, ptr, size, time = struct.unpack_from(order + RECORD, data, offset)
+        records.append((caller, ptr, size, time))
+        offset += record_size
+
+    return {"now": now, "dropped": dropped, "bytes": total, "records": records}
+
+
+def call_sites(dump):
+    sites = {}
+    for caller, _, size, _ in dump["records"]:
+        site = sites.setdefault(caller, [0, 0])
+        site[0] += size
+        site[1] += 1
+    return sites
+
+
+class Symbolizer:
+    def __init__(self, elf, addr2line):
+        self.elf = elf
+        self.addr2line = addr2line
+        self.cache = {}
+
+    def lookup(self, addrs):
+        addrs = [a for a in addrs if a not in self.cache]
+        if not self.elf or not addrs:
+            return
+        # the caller is a return address, look up the call instruction before it
+        args = [self.addr2line, "-f", "-C", "-s", "-e", self.elf] + ["%#x" % (a - 1) for a in addrs]
+        try:
+            out = subprocess.check_output(args, universal_newlines=True).splitlines()
+        except (OSError, subprocess.CalledProcessError) as e:
+            sys.stderr.write("addr2line failed: %s\n" % e)
+            self.elf = None
+            return
+        for i, addr in enumerate(addrs):
+            self.cache[addr] = "%s (%s)" % (out[2 * i], out[2 * i + 1])
+
+    def __call__(self, addr):
+        return self.cache.get(addr, "")
+
+
+def print_sites(title, rows, symbolize):
+    print(title)
+    print("  %18s %12s %8s" % ("caller", "bytes", "allocs"))
+    for caller, (size, count) in rows:
+        print("  %#18x %12d %8d  %s" % (caller, size, count, symbolize(caller)))
+    print()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="summarize lk heap profile dumps")
+    parser.add_argument("dump", help="binary dump or console log with 'heap profile dump' output")
+    parser.add_argument("-n", "--top", type=int, default=20, help="number of call sites to show")
+    parser.add_argument("-e", "--elf", help="kernel elf file to look up call sites in")
+    parser.add_argument("-b", "--base", help="earlier dump to show growth against")
+    parser.add_argument("-o", "--oldest", type=int, default=0,
+                        help="also list this many of the oldest live allocations")
+    parser.add_argument("--addr2line",
+                        default=os.environ.get("CROSS_COMPILE", "") + "addr2line",
+                        help="addr2line to use (default ${CROSS_COMPILE}addr2line)")
+    args = parser.parse_args()
+
+    dump = parse_dump(read_dump(args.dump))
+    sites = call_sites(dump)
+    symbolize = Symbolizer(args.elf, args.addr2line)
+
+    print("%d live allocations, %d bytes from %d call sites, %d not recorded, at %d ms" %
+          (len(dump["records"]), dump["bytes"], len(sites), dump["dropped"], dump["now"]))
+    print()
+
+    by_bytes = sorted(sites.items(), key=lambda s: s[1][0], reverse=True)[:args.top]
+    by_count = sorted(sites.items(), key=lambda s: s[1][1], reverse=True)[:args.top]
+
+    growth = []
+    if args.base:
+        base = call_sites(parse_dump(read_dump(args.base)))
+        for caller in set(sites) | set(base):
+            new = sites.get(caller, [0, 0])
+            old = base.get(caller, [0, 0])
+            growth.append((caller, (new[0] - old[0], new[1] - old[1])))
+        growth = sorted(growth, key=lambda s: s[1][0], reverse=True)[:args.top]
+
+    oldest = sorted(dump["records"], key=lambda r: r[3])[:args.oldest]
+
+    symbolize.lookup({c for c, _ in by_bytes + by_count + growth} | {r[0] for r in oldest})
+
+    print_sites("top call sites by bytes:", by_bytes, symbolize)
+    print_sites("top call sites by allocations:", by_count, symbolize)
+    if args.base:
+        print_sites("top call sites by growth since %s:" % args.base, growth, symbolize)
+
+    if oldest:
+        print("oldest live allocations:")
+        print("  %18s %18s %10s %10s" % ("ptr", "caller", "size", "age ms"))
+        for caller, ptr, size, time in oldest:
+            print("  %#18x %#18x %10d %10d  %s" %
+                  (ptr, caller, size, (dump["now"] - time) & 0xffffffff, symbolize(caller)))
+
+
+if __name__ == "__main__":
+    main()